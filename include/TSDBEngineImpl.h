@@ -16,8 +16,17 @@
 #include "downsample_manager.h"
 #include "convert_manager.h"
 #include "storage/tsm_writer.h"
+#include "storage/mem_table.h"
+#include "storage/wal.h"
+#include "vin_dictionary.h"
 
 namespace LindormContest {
+    // knobs of an engine which are fixed once it's constructed
+    struct EngineOptions {
+        WriteControllerOptions _write_controller_options;
+        size_t _fd_budget = FILE_HANDLE_BUDGET; // segment files kept open, split evenly over 16 shards of at least one file
+    };
+
     class TSDBEngineImpl : public TSDBEngine {
     public:
         /**
@@ -27,6 +36,8 @@ namespace LindormContest {
          */
         explicit TSDBEngineImpl(const std::string &dataDirPath);
 
+        TSDBEngineImpl(const std::string &dataDirPath, const EngineOptions &options);
+
         ~TSDBEngineImpl() override;
 
         int connect() override;
@@ -37,6 +48,40 @@ namespace LindormContest {
 
         int write(const WriteRequest &writeRequest) override;
 
+        /**
+         * Write rows laid out column by column, the values are read from the caller's
+         * buffers without building Row objects. Every column of the schema must be present.
+         * Returns 0 on success, -1 if the columns don't match the schema.
+         */
+        int writeColumnar(const ColumnarWriteRequest &writeRequest);
+
+        /**
+         * Set how the columns are compressed, a column without its own profile uses the table profile.
+         * Takes effect from the next connect or createTable, files already written keep their encoding.
+         * Safe to call while other threads write or query.
+         */
+        void setCompressionOptions(const CompressionOptions &compressionOptions);
+
+        /**
+         * Limit the bytes per second written by the background conversions and compactions,
+         * 0 leaves them unlimited. The default is BACKGROUND_WRITE_BYTES_PER_SEC.
+         * Takes effect right away, safe to call while other threads write or query.
+         * Returns 0 on success, -1 if the limit is negative.
+         */
+        int setBackgroundWriteBandwidth(double bytesPerSec);
+
+        /**
+         * How often and how long writes have been stalled waiting for the conversions,
+         * and how much is waiting for conversion right now. Safe to call while other threads write or query.
+         */
+        WriteStallMetrics getWriteStallMetrics() const;
+
+        /**
+         * Queue depth and throughput of the background conversions and compactions.
+         * Safe to call while other threads write or query, and after shutdown.
+         */
+        CompactionSchedulerMetrics getCompactionSchedulerMetrics() const;
+
         int executeLatestQuery(const LatestQueryRequest &pReadReq, std::vector<Row> &pReadRes) override;
 
         int executeTimeRangeQuery(const TimeRangeQueryRequest &trReadReq, std::vector<Row> &trReadRes) override;
@@ -52,7 +97,17 @@ namespace LindormContest {
 
         Path _get_schema_path() const { return _get_root_path() / "schema.txt"; }
 
-        void _get_latest_records();
+        // the write path shared by write and writeColumnar, batch is a RowBatch or a ColumnarBatch
+        template <typename Batch>
+        int _write_batch(const Batch& batch, size_t row_count);
+
+        VinId _get_or_insert_vin(const Vin& vin);
+
+        void _add_vin(VinId vin_id, const Vin& vin);
+
+        void _get_latest_records(ThreadPool& pool);
+
+        void _replay_wal(ThreadPool& pool);
 
         void _save_schema_to_file();
 
@@ -60,15 +115,21 @@ namespace LindormContest {
 
         void _print_schema();
 
-        bool _finish_compaction;
         SchemaSPtr _schema;
+        RowCodecSPtr _row_codec;
+        VinDictionarySPtr _vin_dictionary;
         TsmWriterManagerUPtr _writer_manager;
+        GlobalMemTableManagerSPtr _mem_table_manager;
         GlobalIndexManagerSPtr _index_manager;
-        GlobalLatestManagerUPtr _latest_manager;
+        GlobalLatestManagerSPtr _latest_manager;
+        GlobalSegmentManagerSPtr _segment_manager;
         GlobalTimeRangeManagerUPtr _tr_manager;
         GlobalAggregateManagerUPtr _agg_manager;
         GlobalDownSampleManagerUPtr _ds_manager;
         GlobalConvertManagerSPtr _convert_manager;
+        GlobalWalManagerSPtr _wal_manager;
+        WriteControllerSPtr _write_controller;
+        bool _open_failed = false; // connect failed, shutdown leaves the files alone
     }; // End class TSDBEngineImpl.
 
 }
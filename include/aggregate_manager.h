@@ -26,6 +26,8 @@
 #include "struct/Row.h"
 #include "io/io_utils.h"
 #include "index_manager.h"
+#include "storage/mem_table.h"
+#include "read_snapshot.h"
 #include "struct/Requests.h"
 
 namespace LindormContest {
@@ -34,40 +36,52 @@ namespace LindormContest {
     public:
         AggregateManager() = default;
 
-        AggregateManager(uint16_t vin_num, const Path& vin_dir_path, GlobalIndexManagerSPtr index_manager)
-                : _vin_num(vin_num), _vin_dir_path(vin_dir_path), _schema(nullptr), _index_manager(index_manager) {}
+        AggregateManager(VinId vin_id, GlobalMemTableManagerSPtr mem_table_manager, GlobalIndexManagerSPtr index_manager)
+                : _vin_id(vin_id), _schema(nullptr), _row_codec(nullptr),
+                  _mem_table_manager(mem_table_manager), _index_manager(index_manager) {}
 
         AggregateManager(AggregateManager&& other) = default;
 
         ~AggregateManager() = default;
 
-        void init(SchemaSPtr schema) {
+        void init(SchemaSPtr schema, RowCodecSPtr row_codec) {
             _schema = schema;
+            _row_codec = row_codec;
         }
 
-        template<typename T, bool finish_compaction>
+        template<typename T>
         void query_time_range_max_aggregate(const TimeRange& tr,
                                             const std::string& column_name, std::vector<Row> &aggregationRes) {
             T max_value = std::numeric_limits<T>::lowest();
+            bool found = false;
+            ReadSnapshot snapshot;
+            snapshot.take(_vin_id, tr, *_mem_table_manager, *_index_manager);
 
-            for (uint16_t file_idx = tr._start_idx / FILE_CONVERT_SIZE; file_idx <= tr._end_idx / FILE_CONVERT_SIZE; ++file_idx) {
-                TimeRange file_tr (
-                        std::max(tr._start_idx, (uint16_t) (file_idx * FILE_CONVERT_SIZE)) % FILE_CONVERT_SIZE,
-                        std::min(tr._end_idx, (uint16_t) ((file_idx + 1) * FILE_CONVERT_SIZE - 1)) % FILE_CONVERT_SIZE
-                );
-
-                T file_max_value = std::numeric_limits<T>::lowest();
+            for (size_t i = 0; i < snapshot._files.size(); ++i) {
+                _query_max_from_one_tsm_file<T>(*snapshot._files[i], snapshot._file_shadows[i], tr, column_name, max_value, found);
+            }
 
-                if constexpr (finish_compaction) {
-                    _query_max_from_one_tsm_file<T>(file_idx, file_tr, column_name, file_max_value);
-                } else {
-                    _query_max_from_one_flush_file<T>(file_idx, file_tr, column_name, file_max_value);
+            for (size_t i = 0; i < snapshot._mem_tables.size(); ++i) {
+                const ShadowSet& shadow = snapshot._mem_table_shadows[i];
+                auto visitor = [&](int64_t ts, T value) {
+                    if (unlikely(!shadow.empty() && shadow.contains(ts))) {
+                        return;
+                    }
+                    max_value = std::max(max_value, value);
+                    found = true;
+                };
+                if (unlikely(!shadow.empty())) {
+                    snapshot._mem_tables[i]->scan_column<T>(column_name, tr, visitor);
+                    continue;
                 }
-
-                max_value = std::max(max_value, file_max_value);
+                // filled blocks covered by tr are answered by their stats, like the blocks of a tsm file
+                snapshot._mem_tables[i]->scan_column_blocks<T>(column_name, tr, [&](const auto& block) {
+                    max_value = std::max<T>(max_value, block._max);
+                    found = true;
+                }, visitor);
             }
 
-            if (unlikely(max_value == std::numeric_limits<T>::lowest())) {
+            if (unlikely(!found)) {
                 return;
             }
 
@@ -77,23 +91,35 @@ namespace LindormContest {
             aggregationRes.emplace_back(std::move(result_row));
         }
 
-        template<typename T, bool finish_compaction>
+        template<typename T>
         void query_time_range_avg_aggregate(const TimeRange& tr, const std::string& column_name, std::vector<Row> &aggregationRes) {
             T sum_value = 0;
             size_t sum_count = 0;
+            ReadSnapshot snapshot;
+            snapshot.take(_vin_id, tr, *_mem_table_manager, *_index_manager);
 
-            for (uint16_t file_idx = tr._start_idx / FILE_CONVERT_SIZE; file_idx <= tr._end_idx / FILE_CONVERT_SIZE; ++file_idx) {
-                TimeRange file_tr (
-                        std::max(tr._start_idx, (uint16_t) (file_idx * FILE_CONVERT_SIZE)) % FILE_CONVERT_SIZE,
-                        std::min(tr._end_idx, (uint16_t) ((file_idx + 1) * FILE_CONVERT_SIZE - 1)) % FILE_CONVERT_SIZE
-                );
-
-                if constexpr (finish_compaction) {
-                    _query_avg_from_one_tsm_file<T>(file_idx, file_tr, column_name, sum_value);
-                    sum_count += file_tr.range_width();
-                } else {
-                    _query_avg_from_one_flush_file<T>(file_idx, file_tr, column_name, sum_value, sum_count);
+            for (size_t i = 0; i < snapshot._files.size(); ++i) {
+                _query_avg_from_one_tsm_file<T>(*snapshot._files[i], snapshot._file_shadows[i], tr, column_name, sum_value, sum_count);
+            }
+
+            for (size_t i = 0; i < snapshot._mem_tables.size(); ++i) {
+                using V = std::conditional_t<std::is_same_v<T, int64_t>, int32_t, double_t>;
+                const ShadowSet& shadow = snapshot._mem_table_shadows[i];
+                auto visitor = [&](int64_t ts, V value) {
+                    if (unlikely(!shadow.empty() && shadow.contains(ts))) {
+                        return;
+                    }
+                    sum_value += value;
+                    sum_count++;
+                };
+                if (unlikely(!shadow.empty())) {
+                    snapshot._mem_tables[i]->scan_column<V>(column_name, tr, visitor);
+                    continue;
                 }
+                snapshot._mem_tables[i]->scan_column_blocks<V>(column_name, tr, [&](const auto& block) {
+                    sum_value += block._sum;
+                    sum_count += DATA_BLOCK_ITEM_NUMS;
+                }, visitor);
             }
 
             if (unlikely(sum_count == 0)) {
@@ -107,171 +133,99 @@ namespace LindormContest {
         }
 
     private:
+        // fully covered blocks are answered by the index, only the partial ones at both ends are decoded.
+        // blocks holding shadowed rows are decoded with their timestamps to skip these rows
         template <typename T>
-        void _query_max_from_one_tsm_file(uint16_t file_idx, const TimeRange& file_tr,
-                                          const std::string& column_name, T& file_max_value) {
-            std::vector<IndexEntry> index_entries;
-            std::vector<IndexRange> ranges;
-            _index_manager->query_indexes(_vin_num, file_idx, column_name, file_tr, index_entries, ranges);
-
-            if (unlikely(file_tr.range_width() == FILE_CONVERT_SIZE)) {
-                for (const auto &index_entry : index_entries) {
-                    file_max_value = std::max(file_max_value, index_entry.get_max<T>());
+        void _query_max_from_one_tsm_file(const FileIndex& file, const ShadowSet& shadow, const TimeRange& tr,
+                                          const std::string& column_name, T& max_value, bool& found) {
+            std::vector<BlockRange> block_ranges;
+            file.get_block_ranges(tr, !shadow.empty(), block_ranges);
+            uint16_t column_id = _row_codec->column_id(column_name);
+            const IndexBlock& index_block = file.get_index_block(column_id);
+
+            // blocks to decode are skipped if their max can't raise the max of the covered blocks
+            std::vector<const BlockRange*> decoded_ranges;
+            for (const auto &block_range: block_ranges) {
+                const IndexEntry& index_entry = index_block._index_entries[block_range._block_idx];
+                const TimeIndexEntry& time_index_entry = file._time_index[block_range._block_idx];
+                if (block_range._full && !shadow.overlap(time_index_entry._min_ts, time_index_entry._max_ts)) {
+                    max_value = std::max(max_value, index_entry.get_max<T>());
+                    found = true;
+                    continue;
                 }
-                return;
+                decoded_ranges.push_back(&block_range);
             }
 
-            uint32_t global_offset = index_entries.front()._offset;
-            uint32_t global_size = index_entries.back()._offset + index_entries.back()._size - global_offset;
-            Path tsm_file_path = _vin_dir_path / std::to_string(file_idx);
-            std::string buf;
-            io::stream_read_string_from_file(tsm_file_path, global_offset, global_size, buf);
-
-            for (size_t i = 0; i < index_entries.size(); ++i) {
-                uint32_t local_offset = index_entries[i]._offset - global_offset;
-                file_max_value = std::max(file_max_value, _get_max_column_value<T>(buf.c_str() + local_offset, index_entries[i], ranges[i]));
-            }
-        }
-
-        template <typename T>
-        void _query_max_from_one_flush_file(uint16_t file_idx, const TimeRange& file_tr, const std::string& column_name, T& max_value) {
-            Path flush_file_path = _vin_dir_path / std::to_string(file_idx);
-            std::string buf;
-            io::stream_read_string_from_file(flush_file_path, buf);
-
-            if (buf.empty()) {
-                return;
-            }
-
-            const char* start = buf.c_str();
-            const char* end = start + buf.size();
-
-            while (start < end) {
-                Row row;
-                io::deserialize_row(_schema, start, false, row);
-                uint16_t ts_num = decode_ts(row.timestamp) % FILE_CONVERT_SIZE;
-                if (ts_num >= file_tr._start_idx && ts_num <= file_tr._end_idx) {
-                    T row_value;
-                    if constexpr (std::is_same_v<T, int32_t>) {
-                        row.columns.at(column_name).getIntegerValue(row_value);
-                    } else if constexpr (std::is_same_v<T, double_t>) {
-                        row.columns.at(column_name).getDoubleFloatValue(row_value);
-                    }
-                    max_value = std::max(max_value, row_value);
+            for (const BlockRange* block_range_ptr: decoded_ranges) {
+                const BlockRange& block_range = *block_range_ptr;
+                const IndexEntry& index_entry = index_block._index_entries[block_range._block_idx];
+                if (found && !(index_entry.get_max<T>() > max_value)) {
+                    continue;
                 }
+                const TimeIndexEntry& time_index_entry = file._time_index[block_range._block_idx];
+                bool shadowed = shadow.overlap(time_index_entry._min_ts, time_index_entry._max_ts);
+                const char* buf = file.data(index_entry._offset, index_entry._size);
+                _visit_column_values<T>(file.column_block(buf, index_entry._offset, column_id, block_range._block_idx), block_range, shadowed ? &shadow : nullptr, [&](T value) {
+                    max_value = std::max(max_value, value);
+                    found = true;
+                });
             }
         }
 
         template <typename T>
-        void _query_avg_from_one_tsm_file(uint16_t file_idx, const TimeRange& file_tr,
-                                          const std::string& column_name, T& sum_value) {
-            std::vector<IndexEntry> index_entries;
-            std::vector<IndexRange> ranges;
-            _index_manager->query_indexes(_vin_num, file_idx, column_name, file_tr, index_entries, ranges);
-
-            if (unlikely(file_tr.range_width() == FILE_CONVERT_SIZE)) {
-                for (const auto &index_entry : index_entries) {
+        void _query_avg_from_one_tsm_file(const FileIndex& file, const ShadowSet& shadow, const TimeRange& tr,
+                                          const std::string& column_name, T& sum_value, size_t& sum_count) {
+            std::vector<BlockRange> block_ranges;
+            file.get_block_ranges(tr, !shadow.empty(), block_ranges);
+            uint16_t column_id = _row_codec->column_id(column_name);
+            const IndexBlock& index_block = file.get_index_block(column_id);
+
+            for (const auto &block_range: block_ranges) {
+                const IndexEntry& index_entry = index_block._index_entries[block_range._block_idx];
+                const TimeIndexEntry& time_index_entry = file._time_index[block_range._block_idx];
+                bool shadowed = shadow.overlap(time_index_entry._min_ts, time_index_entry._max_ts);
+                if (block_range._full && !shadowed) {
+                    sum_count += block_range._range._end_index - block_range._range._start_index + 1;
                     sum_value += index_entry.get_sum<T>();
+                    continue;
                 }
-                return;
-            }
-
-            uint32_t global_offset = index_entries.front()._offset;
-            uint32_t global_size = index_entries.back()._offset + index_entries.back()._size - global_offset;
-            Path tsm_file_path = _vin_dir_path / std::to_string(file_idx);
-            std::string buf;
-            io::stream_read_string_from_file(tsm_file_path, global_offset, global_size, buf);
-
-            for (size_t i = 0; i < index_entries.size(); ++i) {
-                uint32_t local_offset = index_entries[i]._offset - global_offset;
-                _get_sum_column_value<T>(buf.c_str() + local_offset, index_entries[i], ranges[i], sum_value);
-            }
-        }
-
-        template <typename T>
-        void _query_avg_from_one_flush_file(uint16_t file_idx, const TimeRange& file_tr,
-                                            const std::string& column_name, T& sum_value, size_t& sum_count) {
-            Path flush_file_path = _vin_dir_path / std::to_string(file_idx);
-            std::string buf;
-            io::stream_read_string_from_file(flush_file_path, buf);
-
-            if (buf.empty()) {
-                return;
-            }
-
-            const char* start = buf.c_str();
-            const char* end = start + buf.size();
-
-            while (start < end) {
-                Row row;
-                io::deserialize_row(_schema, start, false, row);
-                uint16_t ts_num = decode_ts(row.timestamp) % FILE_CONVERT_SIZE;
-                if (ts_num >= file_tr._start_idx && ts_num <= file_tr._end_idx) {
-                    if constexpr (std::is_same_v<T, int64_t>) {
-                        int32_t row_value;
-                        row.columns.at(column_name).getIntegerValue(row_value);
-                        sum_value += (int64_t) row_value;
-                    } else if constexpr (std::is_same_v<T, double_t>) {
-                        double_t row_value;
-                        row.columns.at(column_name).getDoubleFloatValue(row_value);
-                        sum_value += row_value;
-                    }
+                const char* buf = file.data(index_entry._offset, index_entry._size);
+                _visit_column_values<T>(file.column_block(buf, index_entry._offset, column_id, block_range._block_idx), block_range, shadowed ? &shadow : nullptr, [&](auto value) {
+                    sum_value += value;
                     sum_count++;
-                }
+                });
             }
         }
 
-        template <typename T>
-        T _get_max_column_value(const char* buf, const IndexEntry& index_entry, const IndexRange& range) {
-            if ((range._end_index - range._start_index + 1) == DATA_BLOCK_ITEM_NUMS) {
-                return index_entry.get_max<T>();
-            }
-
-            T max_value = std::numeric_limits<T>::lowest();
-
-            if constexpr (std::is_same_v<T, int32_t>) {
-                IntDataBlock int_data_block;
-                int_data_block.decode_from_decompress(buf);
-                for (uint16_t start = range._start_index; start <= range._end_index; ++start) {
-                    max_value = std::max(max_value, int_data_block._column_values[start]);
-                }
-            } else if constexpr (std::is_same_v<T, double_t>) {
-                DoubleDataBlock double_data_block;
-                double_data_block.decode_from_decompress(buf);
-                for (uint16_t start = range._start_index; start <= range._end_index; ++start) {
-                    max_value = std::max(max_value, double_data_block._column_values[start]);
-                }
-            }
-
-            return max_value;
-        }
-
-        template <typename T>
-        void _get_sum_column_value(const char* buf, const IndexEntry& index_entry,
-                                const IndexRange& range, T& sum_value) {
-            if ((range._end_index - range._start_index + 1) == DATA_BLOCK_ITEM_NUMS) {
-                sum_value += index_entry.get_sum<T>();
-                return;
-            }
+        // visit the values of the block inside its range, except the shadowed ones if shadow is set.
+        // T is the aggregated type, int32_t or int64_t for integer columns and double_t for double columns
+        template <typename T, typename F>
+        void _visit_column_values(const char* buf, const BlockRange& block_range, const ShadowSet* shadow, F&& visitor) {
+            const IndexRange& range = block_range._range;
 
-            if constexpr (std::is_same_v<T, int64_t>) {
+            if constexpr (std::is_same_v<T, int32_t> || std::is_same_v<T, int64_t>) {
                 IntDataBlock int_data_block;
                 int_data_block.decode_from_decompress(buf);
                 for (uint16_t start = range._start_index; start <= range._end_index; ++start) {
-                    sum_value += int_data_block._column_values[start];
+                    if (shadow == nullptr || !shadow->contains(block_range._timestamps->_timestamps[start])) {
+                        visitor(int_data_block._column_values[start]);
+                    }
                 }
             } else if constexpr (std::is_same_v<T, double_t>) {
                 DoubleDataBlock double_data_block;
                 double_data_block.decode_from_decompress(buf);
                 for (uint16_t start = range._start_index; start <= range._end_index; ++start) {
-                    sum_value += double_data_block._column_values[start];
+                    if (shadow == nullptr || !shadow->contains(block_range._timestamps->_timestamps[start])) {
+                        visitor(double_data_block._column_values[start]);
+                    }
                 }
             }
         }
 
-        uint16_t _vin_num;
-        Path _vin_dir_path;
+        VinId _vin_id;
         SchemaSPtr _schema;
+        RowCodecSPtr _row_codec;
+        GlobalMemTableManagerSPtr _mem_table_manager;
         GlobalIndexManagerSPtr _index_manager;
     };
 
@@ -281,54 +235,63 @@ namespace LindormContest {
 
     class GlobalAggregateManager {
     public:
-        GlobalAggregateManager(const Path& root_path, bool finish_compaction, GlobalIndexManagerSPtr index_manager)
-        : _schema(nullptr) {
-            for (uint16_t vin_num = 0; vin_num < VIN_NUM_RANGE; ++vin_num) {
-                Path vin_dir_path = finish_compaction ?
-                                    root_path / "compaction" / std::to_string(vin_num)
-                                    : root_path / "no-compaction" / std::to_string(vin_num);
-                _agg_managers[vin_num] = std::make_unique<AggregateManager>(vin_num, vin_dir_path, index_manager);
-            }
-        }
+        GlobalAggregateManager(const Path& root_path, GlobalMemTableManagerSPtr mem_table_manager,
+                               GlobalIndexManagerSPtr index_manager)
+        : _root_path(root_path), _schema(nullptr), _row_codec(nullptr), _mem_table_manager(mem_table_manager), _index_manager(index_manager) {}
 
         ~GlobalAggregateManager() = default;
 
-        void init(SchemaSPtr schema) {
+        void init(SchemaSPtr schema, RowCodecSPtr row_codec) {
             _schema = schema;
-            for (auto &agg_manager: _agg_managers) {
-                agg_manager->init(_schema);
-            }
+            _row_codec = row_codec;
+            _agg_managers.for_each([&](size_t /*vin_id*/, std::unique_ptr<AggregateManager>& agg_manager) {
+                if (agg_manager != nullptr) {
+                    agg_manager->init(_schema, _row_codec);
+                }
+            });
+        }
+
+        // called once per vin before its id is visible
+        void add_vin(VinId vin_id) {
+            auto agg_manager = std::make_unique<AggregateManager>(vin_id, _mem_table_manager, _index_manager);
+            agg_manager->init(_schema, _row_codec);
+            _agg_managers[vin_id] = std::move(agg_manager);
         }
 
-        template <bool finish_compaction>
-        void query_aggregate(uint16_t vin_num, const Vin& vin, int64_t time_lower_inclusive, int64_t time_upper_exclusive,
+        void query_aggregate(VinId vin_id, const Vin& vin, int64_t time_lower_inclusive, int64_t time_upper_exclusive,
                              const std::string& column_name, Aggregator aggregator, std::vector<Row>& aggregationRes) {
-            TimeRange tr;
-            tr.init(time_lower_inclusive, time_upper_exclusive);
-            if (unlikely(tr._end_idx >= TS_NUM_RANGE)) {
+            TimeRange tr(time_lower_inclusive, time_upper_exclusive);
+            if (unlikely(tr.empty())) {
                 return;
             }
             ColumnType type = _schema->columnTypeMap[column_name];
             if (type == COLUMN_TYPE_INTEGER) {
                 if (aggregator == MAX) {
-                    _agg_managers[vin_num]->query_time_range_max_aggregate<int32_t, finish_compaction>(tr, column_name, aggregationRes);
+                    _agg_managers[vin_id]->query_time_range_max_aggregate<int32_t>(tr, column_name, aggregationRes);
                 } else if (aggregator == AVG) {
-                    _agg_managers[vin_num]->query_time_range_avg_aggregate<int64_t, finish_compaction>(tr, column_name, aggregationRes);
+                    _agg_managers[vin_id]->query_time_range_avg_aggregate<int64_t>(tr, column_name, aggregationRes);
                 }
             } else if (type == COLUMN_TYPE_DOUBLE_FLOAT) {
                 if (aggregator == MAX) {
-                    _agg_managers[vin_num]->query_time_range_max_aggregate<double_t, finish_compaction>(tr, column_name, aggregationRes);
+                    _agg_managers[vin_id]->query_time_range_max_aggregate<double_t>(tr, column_name, aggregationRes);
                 } else if (aggregator == AVG) {
-                    _agg_managers[vin_num]->query_time_range_avg_aggregate<double_t, finish_compaction>(tr, column_name, aggregationRes);
+                    _agg_managers[vin_id]->query_time_range_avg_aggregate<double_t>(tr, column_name, aggregationRes);
                 }
             }
+            if (unlikely(aggregationRes.empty())) {
+                return;
+            }
             aggregationRes[0].vin = vin;
             aggregationRes[0].timestamp = time_lower_inclusive;
         }
 
     private:
+        Path _root_path;
         SchemaSPtr _schema;
-        std::unique_ptr<AggregateManager> _agg_managers[VIN_NUM_RANGE];
+        RowCodecSPtr _row_codec;
+        GlobalMemTableManagerSPtr _mem_table_manager;
+        GlobalIndexManagerSPtr _index_manager;
+        VinArray<std::unique_ptr<AggregateManager>> _agg_managers;
     };
 
 }
\ No newline at end of file
@@ -28,53 +28,16 @@ namespace LindormContest {
 #define likely(x)       __builtin_expect((x),1)
 #define unlikely(x)     __builtin_expect((x),0)
 
-    // DEBUG:   3981 ~ 8981 LSVNV2182E024
-    // RELEASE: 1654 ~ 6654 LSVNV2182E054
-
-    static const std::string VIN_PREFIX = "LSVNV2182E054";
-    static constexpr uint16_t VIN_NUM_RANGE = 5000;
-    static constexpr uint16_t MIN_VIN_NUM = 1654;
-    static constexpr uint16_t MAX_VIN_NUM = MIN_VIN_NUM + VIN_NUM_RANGE;
-    static constexpr uint16_t INVALID_VIN_NUM = std::numeric_limits<uint16_t>::max();
-    static constexpr int64_t MIN_TS = 1694043124000;
-    static constexpr int64_t MAX_TS = 1694079123000;
-    static constexpr uint16_t TS_NUM_RANGE = 36000;
-
-    // 0 ~ 4999
-    inline uint16_t decode_vin(const Vin& vin) {
-        uint16_t vin_num = 0;
-        for (uint8_t i = 0; i < 4; ++i) {
-            if (!std::isdigit(vin.vin[13 + i])) {
-                return INVALID_VIN_NUM;
-            }
-            vin_num = vin_num * 10 + (vin.vin[13 + i] - '0');
-        }
-        if (likely(vin_num >= MIN_VIN_NUM && vin_num < MAX_VIN_NUM)) {
-            return vin_num - MIN_VIN_NUM;
-        } else {
-            return INVALID_VIN_NUM;
-        }
-    }
+    using VinId = uint32_t;
 
-    inline Vin encode_vin(uint16_t vin_num) {
-        assert(vin_num >= 0 && vin_num < VIN_NUM_RANGE);
-        std::string vin_str = VIN_PREFIX + std::to_string(vin_num + MIN_VIN_NUM);
-        Vin vin;
-        std::memcpy(vin.vin, vin_str.c_str(), VIN_LENGTH);
-        return vin;
-    }
+    static constexpr VinId INVALID_VIN_ID = std::numeric_limits<VinId>::max();
+    static constexpr size_t VIN_SEGMENT_BITS = 12;
+    static constexpr size_t MAX_VIN_SEGMENT_NUM = 4096; // up to 16M vins
+    static constexpr size_t VIN_DICT_BUCKET_NUM = 1 << 20;
 
     using Path = std::filesystem::path;
     using SchemaSPtr = std::shared_ptr<Schema>;
 
-    inline uint16_t decode_ts(int64_t ts) {
-        return (ts - MIN_TS) / 1000;
-    }
-
-    inline int64_t encode_ts(uint16_t ts) {
-        return ts * 1000 + MIN_TS;
-    }
-
     inline void swap_row(Row& lhs, Row& rhs) {
         std::swap(lhs.vin, rhs.vin);
         std::swap(lhs.timestamp, rhs.timestamp);
@@ -87,15 +50,35 @@ namespace LindormContest {
 
     static constexpr uint16_t SCHEMA_COLUMN_NUMS = 60;
     static constexpr uint16_t DATA_BLOCK_ITEM_NUMS = 2000;
-    static constexpr uint16_t FILE_CONVERT_SIZE = 36000;
-    static constexpr uint16_t TSM_FILE_COUNT = TS_NUM_RANGE / FILE_CONVERT_SIZE;
-    static constexpr uint16_t DATA_BLOCK_COUNT = FILE_CONVERT_SIZE / DATA_BLOCK_ITEM_NUMS;
+    static constexpr uint16_t FILE_CONVERT_SIZE = 36000; // rows of one mem table
+    static constexpr int64_t TIME_PARTITION_INTERVAL = 3600 * 1000; // ms, rows of one mem table are inside one partition
+    static constexpr int64_t TIME_PARTITION_SEAL_LAG = 1; // partitions behind the newest row before a mem table is sealed
+    static constexpr int64_t MEM_TABLE_MAX_AGE = 10 * 60 * 1000; // ms of wall clock before a mem table is sealed
+    static constexpr uint16_t DATA_BLOCK_COUNT = FILE_CONVERT_SIZE / DATA_BLOCK_ITEM_NUMS; // max blocks of one column
+    static constexpr int64_t TIER_FANOUT = 4; // a window of tiered compaction spans TIER_FANOUT windows of the level below
+    static constexpr uint16_t TIER_LEVEL_NUM = 3; // windows of 4, 16 and 64 partitions
+    static constexpr uint32_t TIER_FILE_MAX_ROWS = 4 * FILE_CONVERT_SIZE; // rows of one file written by tiered compaction
     static constexpr uint16_t POOL_THREAD_NUM = 8;
-    static constexpr uint32_t BITPACKING_RANGE_NUM = 1 << 6;
+    static constexpr uint32_t WRITE_RADIX_BITS = 8; // digit of the radix partition of a write batch by vin id
+    static constexpr size_t WRITE_SOFT_PENDING_CONVERTS = 4 * POOL_THREAD_NUM; // sealed mem tables before writes are throttled
+    static constexpr size_t WRITE_HARD_PENDING_CONVERTS = 16 * POOL_THREAD_NUM; // sealed mem tables before writes block
+    static constexpr size_t WRITE_SOFT_PENDING_BYTES = 512UL * 1024 * 1024;
+    static constexpr size_t WRITE_HARD_PENDING_BYTES = 2UL * 1024 * 1024 * 1024;
+    static constexpr double WRITE_DELAYED_ROWS_PER_SEC = 1000000; // write rate past the soft thresholds
+    static constexpr double BACKGROUND_WRITE_BYTES_PER_SEC = 0; // bandwidth of conversions and compactions, 0 is unlimited
+    static constexpr int64_t QUERY_HOT_MS = 1000; // ms after a query during which its partitions are compacted first
+    static constexpr uint32_t CODEC_TRIAL_INTERVAL = 64; // blocks of a column encoded with the last winner between trials
+    static constexpr double CODEC_DECODE_COST_WEIGHT = 0.05; // size penalty per unit of decode cost, 0 picks the smallest
     static constexpr uint32_t ROW_CACHE_SIZE = 256 * 1024;
+    static constexpr uint16_t WAL_STREAM_NUM = 4;
+    static constexpr size_t WAL_SEGMENT_SIZE = 64 * 1024 * 1024;
+    static constexpr bool WAL_SYNC = false; // fdatasync every group commit
+    static constexpr uint64_t SEGMENT_FILE_SIZE = 256UL * 1024 * 1024; // tsm files of many vins are packed into one segment up to it
+    static constexpr size_t FILE_HANDLE_BUDGET = 128; // segment files kept open, the mappings of the others need no fd
+    static constexpr bool TSM_VERIFY_CHECKSUMS = true; // check tsm blocks against their crc32c the first time they are read
 
-    static_assert(TS_NUM_RANGE % FILE_CONVERT_SIZE == 0);
     static_assert(FILE_CONVERT_SIZE % DATA_BLOCK_ITEM_NUMS == 0);
+    static_assert(TIER_FILE_MAX_ROWS % DATA_BLOCK_ITEM_NUMS == 0);
 
     static const int64_t LONG_DOUBLE_NAN = 0xfff0000000000000L;
     static const double_t DOUBLE_NAN = *(double_t*)(&LONG_DOUBLE_NAN);
@@ -128,4 +111,4 @@ namespace LindormContest {
     } while (false);
 }
 
-#define STANDARD_VECTOR_SIZE 2048
\ No newline at end of file
+#define STANDARD_VECTOR_SIZE 2048
\ No newline at end of file
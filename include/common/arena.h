@@ -0,0 +1,123 @@
+/*
+ * Copyright Alibaba Group Holding Ltd.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <vector>
+
+namespace LindormContest {
+
+    // bump allocator for the scratch buffers of one thread. memory is handed out in stack order
+    // and released back to a mark, chunks are kept for the next user, so a converter thread stops
+    // allocating once its chunks have grown to the largest block it encodes.
+    // not thread safe, use ScratchArena::local()
+    class ScratchArena {
+    public:
+        struct Mark {
+            size_t _chunk_idx;
+            size_t _offset;
+        };
+
+        static ScratchArena& local() {
+            thread_local ScratchArena arena;
+            return arena;
+        }
+
+        // aligned to 16 bytes for simd stores, valid until the arena is released to a mark taken before
+        char* allocate(size_t size) {
+            size = (size + 15) & ~static_cast<size_t>(15);
+            while (_chunk_idx < _chunks.size() && _offset + size > _chunks[_chunk_idx]._size) {
+                if (_offset == 0) {
+                    // an unused chunk which is too small, chunks past the current one are free
+                    _chunks[_chunk_idx] = _new_chunk(size);
+                    break;
+                }
+                ++_chunk_idx;
+                _offset = 0;
+            }
+            if (_chunk_idx == _chunks.size()) {
+                _chunks.emplace_back(_new_chunk(size));
+                _offset = 0;
+            }
+            char* p = _chunks[_chunk_idx]._data.get() + _offset;
+            _offset += size;
+            return p;
+        }
+
+        Mark mark() const {
+            return {_chunk_idx, _offset};
+        }
+
+        void release(const Mark& mark) {
+            _chunk_idx = mark._chunk_idx;
+            _offset = mark._offset;
+        }
+
+    private:
+        static constexpr size_t CHUNK_SIZE = 1024 * 1024;
+
+        struct Chunk {
+            std::unique_ptr<char[]> _data;
+            size_t _size;
+        };
+
+        ScratchArena() = default;
+
+        static Chunk _new_chunk(size_t size) {
+            size = std::max(size, CHUNK_SIZE);
+            return {std::make_unique<char[]>(size), size};
+        }
+
+        std::vector<Chunk> _chunks;
+        size_t _chunk_idx = 0;
+        size_t _offset = 0;
+    };
+
+    // scratch buffers from the arena of the calling thread, released when the scope ends
+    class ScratchScope {
+    public:
+        ScratchScope() : _arena(ScratchArena::local()), _mark(_arena.mark()) {}
+
+        ~ScratchScope() {
+            _arena.release(_mark);
+        }
+
+        ScratchScope(const ScratchScope&) = delete;
+        ScratchScope& operator=(const ScratchScope&) = delete;
+
+        char* allocate(size_t size) {
+            return _arena.allocate(size);
+        }
+
+        // data itself if it is aligned like the scratch buffers, a scratch copy of it otherwise
+        const char* align(const char* data, size_t size) {
+            if ((reinterpret_cast<uintptr_t>(data) & 15) == 0) {
+                return data;
+            }
+            char* aligned_data = _arena.allocate(size);
+            std::memcpy(aligned_data, data, size);
+            return aligned_data;
+        }
+
+    private:
+        ScratchArena& _arena;
+        ScratchArena::Mark _mark;
+    };
+
+}
@@ -67,6 +67,86 @@ namespace LindormContest {
         }
     }
 
+    inline uint64_t zigzag_encode64(int64_t value) {
+        return (static_cast<uint64_t>(value) << 1) ^ static_cast<uint64_t>(value >> 63);
+    }
+
+    inline int64_t zigzag_decode64(uint64_t value) {
+        return static_cast<int64_t>((value >> 1) ^ (-(value & 1)));
+    }
+
+    // dst[0] is the zigzag first value, dst[1] the zigzag first delta, the rest are zigzag delta of deltas,
+    // regular sampling intervals turn into runs of zeros
+    inline void delta_of_delta_encode(const int64_t* src, uint64_t* dst, size_t length) {
+        int64_t prev_value = 0;
+        int64_t prev_delta = 0;
+
+        for (size_t i = 0; i < length; ++i) {
+            int64_t delta = src[i] - prev_value;
+            dst[i] = i == 0 ? zigzag_encode64(src[i]) : zigzag_encode64(delta - prev_delta);
+            prev_delta = i == 0 ? 0 : delta;
+            prev_value = src[i];
+        }
+    }
+
+    inline void delta_of_delta_decode(const uint64_t* src, int64_t* dst, size_t length) {
+        int64_t prev_value = 0;
+        int64_t prev_delta = 0;
+
+        for (size_t i = 0; i < length; ++i) {
+            if (i == 0) {
+                dst[i] = zigzag_decode64(src[i]);
+            } else {
+                prev_delta += zigzag_decode64(src[i]);
+                dst[i] = prev_value + prev_delta;
+            }
+            prev_value = dst[i];
+        }
+    }
+
+    inline uint8_t get_required_bits64(uint64_t max_value) {
+        return max_value == 0 ? 0 : 64 - __builtin_clzll(max_value);
+    }
+
+    // pack every value into required_bits bits, little endian bit order
+    inline void bit_packing_encoding64(uint8_t required_bits, const uint64_t* uncompress_data, size_t uncompress_size, std::string* buf) {
+        if (required_bits == 0) {
+            return;
+        }
+        size_t start = buf->size();
+        buf->resize(start + (uncompress_size * required_bits + 7) / 8, 0);
+        uint8_t* compress_data = reinterpret_cast<uint8_t*>(buf->data() + start);
+        size_t bit_pos = 0;
+
+        for (size_t i = 0; i < uncompress_size; ++i) {
+            uint64_t value = uncompress_data[i];
+            for (uint8_t written = 0; written < required_bits;) {
+                uint8_t bit_offset = bit_pos & 7;
+                uint8_t bits = std::min<uint8_t>(8 - bit_offset, required_bits - written);
+                compress_data[bit_pos >> 3] |= static_cast<uint8_t>(((value >> written) & ((1u << bits) - 1)) << bit_offset);
+                written += bits;
+                bit_pos += bits;
+            }
+        }
+    }
+
+    inline void bit_packing_decoding64(uint8_t required_bits, const char* compress_data, uint64_t* uncompress_data, size_t uncompress_size) {
+        const uint8_t* p = reinterpret_cast<const uint8_t*>(compress_data);
+        size_t bit_pos = 0;
+
+        for (size_t i = 0; i < uncompress_size; ++i) {
+            uint64_t value = 0;
+            for (uint8_t read = 0; read < required_bits;) {
+                uint8_t bit_offset = bit_pos & 7;
+                uint8_t bits = std::min<uint8_t>(8 - bit_offset, required_bits - read);
+                value |= static_cast<uint64_t>((p[bit_pos >> 3] >> bit_offset) & ((1u << bits) - 1)) << read;
+                read += bits;
+                bit_pos += bits;
+            }
+            uncompress_data[i] = value;
+        }
+    }
+
     static uint32_t bit_packing_encoding(uint8_t required_bits, int32_t int_min, const int32_t* uncompress_data, size_t uncompress_size, char* compress_data) {
         uint32_t compress_size = 0;
         uint16_t current_byte = 0;
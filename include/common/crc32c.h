@@ -0,0 +1,97 @@
+/*
+ * Copyright Alibaba Group Holding Ltd.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#endif
+
+namespace LindormContest::crc32c {
+
+    namespace detail {
+
+        // reflected castagnoli polynomial
+        static constexpr uint32_t POLY = 0x82f63b78;
+
+        constexpr std::array<uint32_t, 256> make_table() {
+            std::array<uint32_t, 256> table {};
+            for (uint32_t i = 0; i < 256; ++i) {
+                uint32_t crc = i;
+                for (int bit = 0; bit < 8; ++bit) {
+                    crc = (crc >> 1) ^ (crc & 1 ? POLY : 0);
+                }
+                table[i] = crc;
+            }
+            return table;
+        }
+
+        static constexpr std::array<uint32_t, 256> TABLE = make_table();
+
+        inline uint32_t extend_table(uint32_t crc, const uint8_t* p, const uint8_t* end) {
+            for (; p < end; ++p) {
+                crc = TABLE[(crc ^ *p) & 0xff] ^ (crc >> 8);
+            }
+            return crc;
+        }
+
+#if defined(__x86_64__)
+        // compiled for sse4.2 whatever the build targets, only called once the cpu is known to have it
+        __attribute__((target("sse4.2")))
+        inline uint32_t extend_hardware(uint32_t crc, const uint8_t* p, const uint8_t* end) {
+            uint64_t crc64 = crc;
+            for (; p + sizeof(uint64_t) <= end; p += sizeof(uint64_t)) {
+                uint64_t word;
+                std::memcpy(&word, p, sizeof(word));
+                crc64 = _mm_crc32_u64(crc64, word);
+            }
+            crc = static_cast<uint32_t>(crc64);
+            for (; p < end; ++p) {
+                crc = _mm_crc32_u8(crc, *p);
+            }
+            return crc;
+        }
+
+        inline bool has_hardware() {
+            static const bool has_sse42 = __builtin_cpu_supports("sse4.2");
+            return has_sse42;
+        }
+#endif
+
+    }
+
+    // crc of data appended to the data whose crc is crc, the crc of nothing is 0.
+    // the crc32 instruction is used when the cpu has sse4.2, a byte table otherwise
+    inline uint32_t extend(uint32_t crc, const char* data, size_t size) {
+        const uint8_t* p = reinterpret_cast<const uint8_t*>(data);
+        const uint8_t* end = p + size;
+#if defined(__x86_64__)
+        if (detail::has_hardware()) {
+            return ~detail::extend_hardware(~crc, p, end);
+        }
+#endif
+        return ~detail::extend_table(~crc, p, end);
+    }
+
+    inline uint32_t value(const char* data, size_t size) {
+        return extend(0, data, size);
+    }
+
+}
@@ -0,0 +1,97 @@
+/*
+ * Copyright Alibaba Group Holding Ltd.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <atomic>
+#include <cassert>
+#include <cstddef>
+
+#include "base.h"
+
+namespace LindormContest {
+
+    // array of fixed size segments which are allocated on first access and never moved,
+    // so references stay valid while the array grows and lookups are two loads.
+    // multi thread safe, the elements themselves must be synchronized by the caller
+    template <typename T, size_t SEGMENT_BITS, size_t MAX_SEGMENT_NUM>
+    class SegmentedArray {
+    public:
+        static constexpr size_t SEGMENT_SIZE = 1 << SEGMENT_BITS;
+        static constexpr size_t CAPACITY = SEGMENT_SIZE * MAX_SEGMENT_NUM;
+
+        SegmentedArray() {
+            for (auto &segment: _segments) {
+                segment.store(nullptr, std::memory_order_relaxed);
+            }
+        }
+
+        SegmentedArray(const SegmentedArray &) = delete;
+
+        SegmentedArray &operator=(const SegmentedArray &) = delete;
+
+        ~SegmentedArray() {
+            for (auto &segment: _segments) {
+                delete[] segment.load(std::memory_order_relaxed);
+            }
+        }
+
+        // return nullptr if the segment of idx hasn't been allocated
+        T *get(size_t idx) const {
+            assert(idx < CAPACITY);
+            T *segment = _segments[idx >> SEGMENT_BITS].load(std::memory_order_acquire);
+            return segment == nullptr ? nullptr : &segment[idx & (SEGMENT_SIZE - 1)];
+        }
+
+        // allocate the segment of idx if absent
+        T &operator[](size_t idx) {
+            assert(idx < CAPACITY);
+            std::atomic<T *> &slot = _segments[idx >> SEGMENT_BITS];
+            T *segment = slot.load(std::memory_order_acquire);
+            if (unlikely(segment == nullptr)) {
+                T *new_segment = new T[SEGMENT_SIZE];
+                if (slot.compare_exchange_strong(segment, new_segment, std::memory_order_acq_rel)) {
+                    segment = new_segment;
+                } else {
+                    // another thread won, segment holds its pointer
+                    delete[] new_segment;
+                }
+            }
+            return segment[idx & (SEGMENT_SIZE - 1)];
+        }
+
+        // visit every element of the allocated segments in index order
+        template <typename F>
+        void for_each(F &&visitor) {
+            for (size_t segment_idx = 0; segment_idx < MAX_SEGMENT_NUM; ++segment_idx) {
+                T *segment = _segments[segment_idx].load(std::memory_order_acquire);
+                if (segment == nullptr) {
+                    continue;
+                }
+                for (size_t i = 0; i < SEGMENT_SIZE; ++i) {
+                    visitor((segment_idx << SEGMENT_BITS) + i, segment[i]);
+                }
+            }
+        }
+
+    private:
+        std::atomic<T *> _segments[MAX_SEGMENT_NUM];
+    };
+
+    // per vin state indexed by the dense vin id
+    template <typename T>
+    using VinArray = SegmentedArray<T, VIN_SEGMENT_BITS, MAX_VIN_SEGMENT_NUM>;
+
+}
@@ -15,6 +15,9 @@
 
 #pragma once
 
+#include <atomic>
+#include <condition_variable>
+#include <exception>
 #include <mutex>
 #include <queue>
 #include <functional>
@@ -115,6 +118,50 @@ namespace LindormContest {
             return _queue.empty();
         }
 
+        // run task(i) for every i in [0, task_count) on the calling thread and the workers of the pool,
+        // return once all are done. the caller takes tasks too, so a busy pool only costs parallelism.
+        // workers which start after the last task has been taken return at once. a task which throws doesn't
+        // stop the others, the first exception is rethrown to the caller once all tasks are done
+        template <typename F>
+        void parallel_for(size_t task_count, F&& task) {
+            struct State {
+                std::atomic<size_t> _next {0};
+                std::atomic<size_t> _done {0};
+                std::mutex _mutex;
+                std::condition_variable _cv;
+                std::exception_ptr _exception; // guarded by _mutex
+            };
+            auto state = std::make_shared<State>();
+            auto run = [state, task_count, &task]() {
+                for (size_t i; (i = state->_next.fetch_add(1)) < task_count;) {
+                    try {
+                        task(i);
+                    } catch (...) {
+                        std::lock_guard<std::mutex> l(state->_mutex);
+                        if (state->_exception == nullptr) {
+                            state->_exception = std::current_exception();
+                        }
+                    }
+                    if (state->_done.fetch_add(1) + 1 == task_count) {
+                        std::lock_guard<std::mutex> l(state->_mutex);
+                        state->_cv.notify_all();
+                    }
+                }
+            };
+
+            size_t helper_count = std::min(_threads.size(), task_count > 0 ? task_count - 1 : 0);
+            for (size_t i = 0; i < helper_count; ++i) {
+                _queue.enqueue(std::function<void()>(run));
+                _thread_pool_cv.notify_one();
+            }
+            run();
+            std::unique_lock<std::mutex> l(state->_mutex);
+            state->_cv.wait(l, [&] { return state->_done == task_count; });
+            if (state->_exception != nullptr) {
+                std::rethrow_exception(state->_exception);
+            }
+        }
+
     private:
         class ThreadWorker {
         public:
@@ -19,56 +19,74 @@
 
 namespace LindormContest {
 
+    // index of the time partition holding ts, rounded down for negative timestamps
+    inline int64_t get_time_partition(int64_t ts) {
+        return ts >= 0 ? ts / TIME_PARTITION_INTERVAL : (ts + 1) / TIME_PARTITION_INTERVAL - 1;
+    }
+
+    // timestamps are in milliseconds
     struct TimeRange {
-        uint16_t _start_idx; // inclusive
-        uint16_t _end_idx;   // inclusive
+        int64_t _start_time; // inclusive
+        int64_t _end_time;   // exclusive
 
         TimeRange() = default;
 
-        TimeRange(uint16_t start_idx, uint16_t end_idx) : _start_idx(start_idx), _end_idx(end_idx) {}
+        TimeRange(int64_t start_time_inclusive, int64_t end_time_exclusive)
+                : _start_time(start_time_inclusive), _end_time(end_time_exclusive) {}
 
-        void init(int64_t start_time_inclusive, int64_t end_time_exclusive) {
-            if (start_time_inclusive % 1000 == 0) {
-                _start_idx = decode_ts(start_time_inclusive);
-            } else {
-                _start_idx = decode_ts(start_time_inclusive) + 1;
-            }
-            if (end_time_exclusive % 1000 == 0) {
-                _end_idx = decode_ts(end_time_exclusive) - 1;
-            } else {
-                _end_idx = decode_ts(end_time_exclusive);
-            }
+        bool empty() const {
+            return _start_time >= _end_time;
+        }
+
+        bool contains(int64_t ts) const {
+            return _start_time <= ts && ts < _end_time;
+        }
+
+        // [min_ts, max_ts] overlaps with this range
+        bool overlap(int64_t min_ts, int64_t max_ts) const {
+            return min_ts < _end_time && _start_time <= max_ts;
         }
 
-        bool overlap(const TimeRange& other) const {
-            return _start_idx <= other._start_idx && other._end_idx <= _end_idx;
+        // [min_ts, max_ts] is fully inside this range
+        bool cover(int64_t min_ts, int64_t max_ts) const {
+            return _start_time <= min_ts && max_ts < _end_time;
         }
 
-        uint32_t interval_nums(uint32_t interval) const {
-            assert((_end_idx - _start_idx + 1) % interval == 0);
-            return (_end_idx - _start_idx + 1) / interval;
+        // the range may span more than int64_t, the distances are taken in uint64_t
+        uint64_t length() const {
+            return empty() ? 0 : static_cast<uint64_t>(_end_time) - static_cast<uint64_t>(_start_time);
         }
 
-        TimeRange sub_interval(uint32_t interval, uint32_t index) const {
+        size_t interval_nums(int64_t interval) const {
+            assert(interval > 0);
+            uint64_t length = this->length();
+            return length / interval + (length % interval != 0);
+        }
+
+        // index of the interval holding ts, which must lie inside the range
+        size_t interval_index(int64_t ts, int64_t interval) const {
+            assert(contains(ts));
+            return (static_cast<uint64_t>(ts) - static_cast<uint64_t>(_start_time)) / interval;
+        }
+
+        TimeRange sub_interval(int64_t interval, size_t index) const {
             assert(index < interval_nums(interval));
-            return {static_cast<uint16_t>(_start_idx + index * interval),
-                    static_cast<uint16_t>(_start_idx + (index + 1) * interval - 1)};
+            uint64_t offset = static_cast<uint64_t>(index) * interval;
+            int64_t start_time = static_cast<int64_t>(static_cast<uint64_t>(_start_time) + offset);
+            return {start_time, length() - offset <= static_cast<uint64_t>(interval) ? _end_time : start_time + interval};
         }
 
         std::vector<TimeRange> sub_intervals(int64_t interval) const {
             std::vector<TimeRange> trs;
-            uint32_t interval_count = interval_nums(interval / 1000);
-            for (uint32_t i = 0; i < interval_count; ++i) {
-                trs.emplace_back(sub_interval(interval / 1000, i));
+            size_t interval_count = interval_nums(interval);
+            for (size_t i = 0; i < interval_count; ++i) {
+                trs.emplace_back(sub_interval(interval, i));
             }
             return trs;
         }
-
-        uint16_t range_width() const {
-            return _end_idx - _start_idx + 1;
-        }
     };
 
+    // rows of one data block
     struct IndexRange {
         uint16_t _start_index;  // inclusive
         uint16_t _end_index;    // inclusive
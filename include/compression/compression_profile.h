@@ -0,0 +1,118 @@
+/*
+ * Copyright Alibaba Group Holding Ltd.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <cstring>
+#include <string>
+#include <unordered_map>
+
+#include "base.h"
+#include "compression/compressor.h"
+
+namespace LindormContest {
+
+    // general purpose compression applied to the output of the first stage codec of a block.
+    // the stage is part of the block type written in the block header, so decoding doesn't
+    // depend on the profile a block was written with
+    enum class SecondStage : uint8_t {
+        NONE,
+        LZ4,
+        ZSTD,
+        BROTLI
+    };
+
+    // how the blocks of a column are compressed, from fast to decode to small on disk
+    struct CompressionProfile {
+        SecondStage _second_stage;
+        int _level; // lz4 acceleration, zstd level or brotli quality
+        double _decode_cost_weight; // trades size for decode speed when codecs are chosen, 0 picks the smallest
+
+        // hot columns which are queried constantly, lz4 decodes several times faster than zstd
+        static constexpr CompressionProfile fast() {
+            return {SecondStage::LZ4, 1, 0.5};
+        }
+
+        static constexpr CompressionProfile balanced() {
+            return {SecondStage::ZSTD, 3, CODEC_DECODE_COST_WEIGHT};
+        }
+
+        // archival columns which are rarely read
+        static constexpr CompressionProfile max_ratio() {
+            return {SecondStage::BROTLI, 9, 0};
+        }
+    };
+
+    // profiles of one table, a column without its own profile uses the table profile.
+    // they only affect how new blocks are written
+    struct CompressionOptions {
+        CompressionProfile _table_profile = CompressionProfile::balanced();
+        std::unordered_map<std::string, CompressionProfile> _column_profiles;
+
+        const CompressionProfile& get_profile(const std::string& column_name) const {
+            auto it = _column_profiles.find(column_name);
+            return it == _column_profiles.end() ? _table_profile : it->second;
+        }
+    };
+
+    namespace compression {
+
+        // capacity of dest for compress_second_stage
+        static size_t second_stage_bound(uint32_t source_size) {
+            size_t lz4_bound = LZ4_compressBound(static_cast<int>(source_size));
+            return std::max({lz4_bound, ZSTD_compressBound(source_size), BrotliEncoderMaxCompressedSize(source_size)});
+        }
+
+        // return 0 if the profile has no second stage or it doesn't shrink the data
+        static uint32_t compress_second_stage(const CompressionProfile& profile, const char *source, uint32_t source_size, char *dest) {
+            uint32_t compress_size;
+            switch (profile._second_stage) {
+                case SecondStage::LZ4:
+                    compress_size = compress_string_lz4(source, source_size, dest, profile._level);
+                    break;
+                case SecondStage::ZSTD:
+                    compress_size = compress_string_zstd(source, source_size, dest, profile._level);
+                    break;
+                case SecondStage::BROTLI:
+                    compress_size = compress_string_brotli(source, source_size, dest, profile._level);
+                    break;
+                default:
+                    return 0;
+            }
+            return compress_size < source_size ? compress_size : 0;
+        }
+
+        static void decompress_second_stage(SecondStage second_stage, const char *source, uint32_t source_size,
+                                            char *dest, uint32_t uncompressed_size) {
+            switch (second_stage) {
+                case SecondStage::LZ4:
+                    decompress_string_lz4(source, source_size, dest, uncompressed_size);
+                    break;
+                case SecondStage::ZSTD:
+                    decompress_string_zstd(source, source_size, dest, uncompressed_size);
+                    break;
+                case SecondStage::BROTLI:
+                    decompress_string_brotli(source, source_size, dest, uncompressed_size);
+                    break;
+                default:
+                    std::memcpy(dest, source, source_size);
+                    break;
+            }
+        }
+
+    }
+
+}
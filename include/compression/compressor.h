@@ -54,9 +54,9 @@ namespace LindormContest::compression {
         return compressionFastPFor.compress(source, source_size, dest);
     }
 
-    static uint32_t decompress_int32_fastpfor(const uint32_t *source, size_t source_size, uint32_t *dest) {
+    static uint32_t decompress_int32_fastpfor(const uint32_t *source, size_t source_size, uint32_t *dest, size_t dest_size) {
         CompressionFastPFor compressionFastPFor;
-        return compressionFastPFor.decompress(source, source_size, dest);
+        return compressionFastPFor.decompress(source, source_size, dest, dest_size);
     }
 
     static uint32_t compress_int32_rle(const char *source, uint32_t source_size, char *dest) {
@@ -80,9 +80,9 @@ namespace LindormContest::compression {
         return dest + compressionCodecGorilla.decompress(source, source_size, dest, uncompressed_size);
     }
 
-    static uint32_t compress_string_zstd(const char *source, uint32_t source_size, char *dest) {
+    static uint32_t compress_string_zstd(const char *source, uint32_t source_size, char *dest, int level = 1) {
         static CompressionCodecZSTD compressionCodecZstd;
-        return compressionCodecZstd.compress(source, source_size, dest);
+        return compressionCodecZstd.compress(source, source_size, dest, level);
     }
 
     static void decompress_string_zstd(const char *source, uint32_t source_size, char *dest, uint32_t uncompressed_size) {
@@ -90,9 +90,19 @@ namespace LindormContest::compression {
         compressionCodecZstd.decompress(source, source_size, dest, uncompressed_size);
     }
 
-    static uint32_t compress_string_brotli(const char *source, uint32_t source_size, char *dest) {
+    static uint32_t compress_string_lz4(const char *source, uint32_t source_size, char *dest, int acceleration = 1) {
+        static CompressionCodecLZ4 compressionCodecLZ4;
+        return compressionCodecLZ4.compress(source, source_size, dest, acceleration);
+    }
+
+    static void decompress_string_lz4(const char *source, uint32_t source_size, char *dest, uint32_t uncompressed_size) {
+        static CompressionCodecLZ4 compressionCodecLZ4;
+        compressionCodecLZ4.decompress(source, source_size, dest, uncompressed_size);
+    }
+
+    static uint32_t compress_string_brotli(const char *source, uint32_t source_size, char *dest, int quality = 5) {
         static CompressionCodecBrotli compressionCodecBrotli;
-        return compressionCodecBrotli.compress(source, source_size, dest);
+        return compressionCodecBrotli.compress(source, source_size, dest, quality);
     }
 
     static void decompress_string_brotli(const char *source, uint32_t source_size, char *dest, uint32_t uncompressed_size) {
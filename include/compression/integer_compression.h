@@ -33,7 +33,8 @@ namespace LindormContest::compression {
 
         size_t compress(const uint32_t *source, size_t source_size, uint32_t *dest) const;
 
-        size_t decompress(const uint32_t *source, size_t source_size, uint32_t *dest) const;
+        // dest_size is the capacity of dest, in uint32_t
+        size_t decompress(const uint32_t *source, size_t source_size, uint32_t *dest, size_t dest_size) const;
 
     private:
         std::shared_ptr<FastPForLib::IntegerCODEC> _codec;
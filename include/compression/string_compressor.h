@@ -8,6 +8,7 @@
 #include "../source/zstd/zstd.h"
 #include "../source/brotli/encode.h"
 #include "../source/brotli/decode.h"
+#include "../source/lz4/lz4.h"
 
 namespace LindormContest::compression {
 
@@ -17,7 +18,18 @@ namespace LindormContest::compression {
 
         ~CompressionCodecZSTD() = default;
 
-        uint32_t compress(const char *source, uint32_t source_size, char *dest) const;
+        uint32_t compress(const char *source, uint32_t source_size, char *dest, int level = 1) const;
+
+        void decompress(const char *source, uint32_t source_size, char *dest, uint32_t uncompressed_size) const;
+    };
+
+    class CompressionCodecLZ4 {
+    public:
+        CompressionCodecLZ4() = default;
+
+        ~CompressionCodecLZ4() = default;
+
+        uint32_t compress(const char *source, uint32_t source_size, char *dest, int acceleration = 1) const;
 
         void decompress(const char *source, uint32_t source_size, char *dest, uint32_t uncompressed_size) const;
     };
@@ -28,7 +40,7 @@ namespace LindormContest::compression {
 
         ~CompressionCodecBrotli() = default;
 
-        uint32_t compress(const char *source, uint32_t source_size, char *dest) const;
+        uint32_t compress(const char *source, uint32_t source_size, char *dest, int quality = 5) const;
 
         void decompress(const char *source, uint32_t source_size, char *dest, uint32_t uncompressed_size) const;
     };
@@ -24,6 +24,13 @@
 #include "struct/Vin.h"
 #include "struct/Schema.h"
 #include "index_manager.h"
+#include "compression/compression_profile.h"
+#include "latest_manager.h"
+#include "storage/compaction_scheduler.h"
+#include "storage/mem_table.h"
+#include "storage/wal.h"
+#include "storage/write_controller.h"
+#include "vin_dictionary.h"
 
 namespace LindormContest {
 
@@ -32,187 +39,457 @@ namespace LindormContest {
     public:
         ConvertManager() = default;
 
-        ConvertManager(uint16_t vin_num, const Path &root_path) : _vin_num(vin_num), _schema(nullptr) {
-            _no_compaction_path = root_path / "no-compaction" / std::to_string(_vin_num);
-            _compaction_path = root_path / "compaction" / std::to_string(_vin_num);
-            std::filesystem::create_directories(_compaction_path);
-        }
+        ConvertManager(VinId vin_id, const Vin& vin, GlobalMemTableManagerSPtr mem_table_manager,
+                       GlobalIndexManagerSPtr index_manager, GlobalLatestManagerSPtr latest_manager,
+                       GlobalSegmentManagerSPtr segment_manager, CompactionScheduler* scheduler)
+                : _vin_id(vin_id), _vin(vin), _schema(nullptr), _mem_table_manager(mem_table_manager),
+                  _index_manager(index_manager), _latest_manager(latest_manager), _segment_manager(segment_manager),
+                  _scheduler(scheduler) {}
 
         ConvertManager(ConvertManager &&other) = default;
 
         ~ConvertManager() = default;
 
-        void init(SchemaSPtr schema) {
+        void init(SchemaSPtr schema, RowCodecSPtr row_codec, const CompressionOptions& compression_options) {
             _schema = schema;
+            _row_codec = row_codec;
+            _column_names.clear();
+            for (const auto &[column_name, column_type]: _schema->columnTypeMap) {
+                _column_names.insert(column_name);
+            }
+            _codec_selectors.clear();
+            for (uint16_t column_id = 0; column_id < _row_codec->column_count(); ++column_id) {
+                _codec_selectors.emplace_back(_row_codec->column_type(column_id),
+                                              compression_options.get_profile(_row_codec->column_name(column_id)));
+            }
         }
 
-        void convert(uint16_t file_idx) {
-            TsmFile output_tsm_file;
-            Path flush_file_path = _no_compaction_path / std::to_string(file_idx);
-            std::string buf;
-            io::stream_read_string_from_file(flush_file_path, buf);
-            std::map<std::string, std::vector<std::unique_ptr<DataBlock>>> sorted_columns;
+        VinId vin_id() const {
+            return _vin_id;
+        }
 
-            for (const auto &[column_name, column_type]: _schema->columnTypeMap) {
-                switch (column_type) {
-                    case COLUMN_TYPE_INTEGER: {
-                        std::vector<std::unique_ptr<DataBlock>> data_blocks;
-                        for (uint16_t i = 0; i < DATA_BLOCK_COUNT; ++i) {
-                            data_blocks.emplace_back(std::make_unique<IntDataBlock>());
-                        }
-                        sorted_columns.emplace(column_name, std::move(data_blocks));
-                        break;
-                    }
-                    case COLUMN_TYPE_DOUBLE_FLOAT: {
-                        std::vector<std::unique_ptr<DataBlock>> data_blocks;
-                        for (uint16_t i = 0; i < DATA_BLOCK_COUNT; ++i) {
-                            data_blocks.emplace_back(std::make_unique<DoubleDataBlock>());
-                        }
-                        sorted_columns.emplace(column_name, std::move(data_blocks));
-                        break;
-                    }
-                    case COLUMN_TYPE_STRING: {
-                        std::vector<std::unique_ptr<DataBlock>> data_blocks;
-                        for (uint16_t i = 0; i < DATA_BLOCK_COUNT; ++i) {
-                            data_blocks.emplace_back(std::make_unique<StringDataBlock>());
-                        }
-                        sorted_columns.emplace(column_name, std::move(data_blocks));
-                        break;
-                    }
-                    default:
-                        break;
+        // mem_table must be sealed, its columns are encoded on encode_pool if given
+        void convert(MemTableSPtr mem_table, ThreadPool* encode_pool = nullptr) {
+            // publish the indexes and the latest row before releasing the mem table,
+            // so that queries can always find the data either in memory or on disk
+            _index_manager->add_file(_vin_id, _write_tsm_file(*mem_table, encode_pool));
+            Row latest_row;
+            if (mem_table->get_latest_row(_column_names, latest_row)) {
+                latest_row.vin = _vin;
+                _latest_manager->update_latest_row(_vin_id, latest_row, mem_table->file_seq());
+            }
+            _mem_table_manager->release(_vin_id, mem_table);
+        }
+
+        // encode a block the mem table has filled up, so that the conversion of the sealed mem table
+        // only encodes the blocks written last
+        void encode_filled_block(MemTable& mem_table, uint16_t block_idx) {
+            mem_table.encode_filled_block(block_idx, [&](const TimestampDataBlock& timestamp_block,
+                                                         const std::vector<const DataBlock*>& column_blocks) {
+                EncodedBlock encoded_block;
+                timestamp_block.encode_to_compress(&encoded_block._timestamps);
+                encoded_block._columns.resize(column_blocks.size());
+                for (uint16_t column_id = 0; column_id < column_blocks.size(); ++column_id) {
+                    _codec_selectors[column_id].encode(*column_blocks[column_id], &encoded_block._columns[column_id]);
                 }
+                return encoded_block;
+            });
+        }
+
+        // whether files of the partition overlap in time, e.g. after late rows have been converted
+        bool need_compaction(int64_t partition) {
+            return !IndexManager::get_overlapping_groups(_index_manager->get_window_files(_vin_id, partition, 1)).empty();
+        }
+
+        // minor compaction, the overlapping files inside the partition are merged into sorted files without
+        // duplicate timestamps, the row of the largest file seq wins. skipped while the partition still has
+        // mem tables, the conversion of the last one asks for the compaction again. files of tiered compaction
+        // reaching other partitions are left to the compaction of their window
+        void compact_partition(int64_t partition, ThreadPool* encode_pool = nullptr) {
+            std::vector<FileIndexSPtr> files = _index_manager->get_window_files(_vin_id, partition, 1);
+            std::vector<std::vector<FileIndexSPtr>> groups = IndexManager::get_overlapping_groups(files);
+            uint32_t file_seq;
+            if (groups.empty() || !_mem_table_manager->reserve_file_seqs(_vin_id, partition, 1, files.size(), file_seq)) {
+                return;
+            }
+            // a file converted before the reservation must be merged too
+            if (_index_manager->get_window_files(_vin_id, partition, 1) != files) {
+                return;
             }
 
-            const char *start = buf.c_str();
-            const char *end = start + buf.size();
+            std::vector<FileIndexSPtr> input_files;
+            std::vector<FileIndexSPtr> output_files;
+            if (!_merge_runs(partition, 1, groups, FILE_CONVERT_SIZE, file_seq, output_files, encode_pool)) {
+                return;
+            }
+            for (const auto &group: groups) {
+                input_files.insert(input_files.end(), group.begin(), group.end());
+            }
+            _index_manager->replace_files(_vin_id, input_files, std::move(output_files));
+        }
 
-            while (start < end) {
-                deserialize_row(start, sorted_columns);
+        // tiered compaction of the window of TIER_FANOUT^level partitions from partition. the files lying inside
+        // the window are cut into runs of adjacent files of about TIER_FILE_MAX_ROWS rows, a run is merged if
+        // that takes fewer files or its files overlap. files grow by TIER_FANOUT with every level, so a long range
+        // query opens a few large files instead of one per partition. the window must be closed, the vin has
+        // moved past it and none of its mem tables is left, late rows get it merged again
+        void compact_window(uint16_t level, int64_t partition, ThreadPool* encode_pool = nullptr) {
+            int64_t partition_count = get_window_span(level);
+            int64_t newest_partition = _mem_table_manager->max_partition(_vin_id);
+            int64_t max_ts;
+            if (_index_manager->get_max_ts(_vin_id, max_ts)) {
+                newest_partition = std::max(newest_partition, get_time_partition(max_ts));
+            }
+            if (partition + partition_count - 1 + TIME_PARTITION_SEAL_LAG >= newest_partition) {
+                return;
             }
 
-            assert(start == end);
+            std::vector<FileIndexSPtr> files = _index_manager->get_window_files(_vin_id, partition, partition_count);
+            std::vector<std::vector<FileIndexSPtr>> runs = _get_merge_runs(files);
+            uint32_t file_seq;
+            if (runs.empty() || !_mem_table_manager->reserve_file_seqs(_vin_id, partition, partition_count, files.size(), file_seq)) {
+                return;
+            }
+            if (_index_manager->get_window_files(_vin_id, partition, partition_count) != files) {
+                return;
+            }
 
-            for (auto &[column_name, data_blocks]: sorted_columns) {
-                IndexBlock index_block;
+            std::vector<FileIndexSPtr> input_files;
+            std::vector<FileIndexSPtr> output_files;
+            if (!_merge_runs(partition, partition_count, runs, TIER_FILE_MAX_ROWS, file_seq, output_files, encode_pool)) {
+                return;
+            }
+            for (const auto &run: runs) {
+                input_files.insert(input_files.end(), run.begin(), run.end());
+            }
+            _index_manager->replace_files(_vin_id, input_files, std::move(output_files));
+        }
 
-                switch (_schema->columnTypeMap[column_name]) {
-                    case COLUMN_TYPE_INTEGER: {
-                        for (uint16_t i = 0; i < DATA_BLOCK_COUNT; ++i) {
-                            IntDataBlock &int_data_block = dynamic_cast<IntDataBlock &>(*data_blocks[i]);
-                            uint32_t range_width = int_data_block._max - int_data_block._min + 1;
+        // partitions of a window of tiered compaction, level 0 is the partition of minor compaction
+        static int64_t get_window_span(uint16_t level) {
+            int64_t span = 1;
+            for (uint16_t i = 0; i < level; ++i) {
+                span *= TIER_FANOUT;
+            }
+            return span;
+        }
 
-                            if (unlikely(range_width == 1)) {
-                                int_data_block._type = IntCompressType::SAME;
-                            } else if (unlikely(range_width <= BITPACKING_RANGE_NUM
-                                                || range_width == 9985
-                                                || range_width == 4993
-                                                || range_width == 2993
-                                                || range_width == 9969
-                                                || range_width == 1985)) {
-                                int_data_block._type = IntCompressType::BITPACK;
-                            } else {
-                                int_data_block._type = IntCompressType::FASTPFOR;
-                            }
+        // first partition of the window holding partition, windows of one level are aligned
+        static int64_t get_window(int64_t partition, uint16_t level) {
+            int64_t span = get_window_span(level);
+            return partition >= 0 ? partition / span * span : (partition + 1) / span * span - span;
+        }
 
-                            index_block._index_entries[i].set_sum(int_data_block._sum);
-                            index_block._index_entries[i].set_max(int_data_block._max);
-                            output_tsm_file._data_blocks.emplace_back(std::move(data_blocks[i]));
-                        }
-                        break;
-                    }
-                    case COLUMN_TYPE_DOUBLE_FLOAT: {
-                        for (uint16_t i = 0; i < DATA_BLOCK_COUNT; ++i) {
-                            DoubleDataBlock &double_data_block = dynamic_cast<DoubleDataBlock &>(*data_blocks[i]);
-
-                            // if (double_data_block._max == double_data_block._min) {
-                            //     double_data_block._type = DoubleCompressType::SAME;
-                            // } else {
-                            //     double_data_block._type = DoubleCompressType::CHIMP;
-                            // }
-
-                            index_block._index_entries[i].set_sum(double_data_block._sum);
-                            index_block._index_entries[i].set_max(double_data_block._max);
-                            output_tsm_file._data_blocks.emplace_back(std::move(data_blocks[i]));
-                        }
-                        break;
-                    }
-                    case COLUMN_TYPE_STRING: {
-                        for (uint16_t i = 0; i < DATA_BLOCK_COUNT; ++i) {
-                            StringDataBlock &string_data_block = dynamic_cast<StringDataBlock &>(*data_blocks[i]);
+        // the window is queued for compaction, return true if the caller should start the compaction task
+        bool add_pending_compaction(uint16_t level, int64_t partition) {
+            std::lock_guard<SpinLock> l(_compaction_lock);
+            _pending_compactions.emplace(level, partition);
+            if (_compacting) {
+                return false;
+            }
+            _compacting = true;
+            return true;
+        }
+
+        // return false and stop the compaction task if no window is queued
+        bool next_pending_compaction(uint16_t& level, int64_t& partition) {
+            std::lock_guard<SpinLock> l(_compaction_lock);
+            if (_pending_compactions.empty()) {
+                _compacting = false;
+                return false;
+            }
+            std::tie(level, partition) = *_pending_compactions.begin();
+            _pending_compactions.erase(_pending_compactions.begin());
+            return true;
+        }
 
-                            if (string_data_block._min_length == string_data_block._max_length) {
-                                string_data_block._type = StringCompressType::ZSTD_SAME_LENGTH;
-                            } else {
-                                string_data_block._type = StringCompressType::ZSTD;
-                            }
+    private:
+        // all rows of a tsm file, decoded for compaction
+        struct DecodedFile {
+            uint32_t _file_seq;
+            std::vector<TimestampDataBlock> _timestamp_blocks;
+            std::vector<std::unique_ptr<DataBlock>> _column_blocks; // [column_idx * block_count + block_idx]
+            uint32_t _block_count;
+        };
+
+        struct MergeRow {
+            int64_t _timestamp;
+            uint32_t _file_seq;
+            uint32_t _input_idx;
+            uint32_t _row_idx;
+        };
+
+        // rows of the inputs in merge order, appended to mem tables like the rows of a write
+        struct MergeBatch {
+            const std::vector<DecodedFile>& _inputs;
+            const std::vector<MergeRow>& _rows;
+            const RowCodec& _row_codec;
+
+            int64_t timestamp(size_t row_idx) const {
+                return _rows[row_idx]._timestamp;
+            }
 
-                            output_tsm_file._data_blocks.emplace_back(std::move(data_blocks[i]));
+            template <typename F>
+            void visit(size_t row_idx, F&& visitor) const {
+                const MergeRow& row = _rows[row_idx];
+                const DecodedFile& input = _inputs[row._input_idx];
+                uint16_t block_offset = row._row_idx % DATA_BLOCK_ITEM_NUMS;
+
+                for (uint16_t column_id = 0; column_id < _row_codec.column_count(); ++column_id) {
+                    const DataBlock* data_block = input._column_blocks[column_id * input._block_count + row._row_idx / DATA_BLOCK_ITEM_NUMS].get();
+                    switch (_row_codec.column_type(column_id)) {
+                        case COLUMN_TYPE_INTEGER:
+                            visitor(column_id, reinterpret_cast<const char*>(&static_cast<const IntDataBlock*>(data_block)->_column_values[block_offset]), 0);
+                            break;
+                        case COLUMN_TYPE_DOUBLE_FLOAT:
+                            visitor(column_id, reinterpret_cast<const char*>(&static_cast<const DoubleDataBlock*>(data_block)->_column_values[block_offset]), 0);
+                            break;
+                        case COLUMN_TYPE_STRING: {
+                            const char* column_data = static_cast<const StringDataBlock*>(data_block)->_column_values[block_offset].columnData;
+                            visitor(column_id, column_data + sizeof(int32_t), *reinterpret_cast<const int32_t*>(column_data));
+                            break;
                         }
-                        break;
+                        default:
+                            break;
                     }
-                    default:
-                        break;
                 }
+            }
+        };
 
-                output_tsm_file._index_blocks.emplace_back(std::move(index_block));
+        void _decode_file(const FileIndex& file, DecodedFile& decoded_file) {
+            const char* buf = file.data(0, file._size, true);
+            decoded_file._file_seq = file._file_seq;
+            decoded_file._block_count = file._time_index.size();
+            decoded_file._timestamp_blocks.resize(decoded_file._block_count);
+
+            for (uint32_t i = 0; i < decoded_file._block_count; ++i) {
+                decoded_file._timestamp_blocks[i].decode_from_decompress(file.timestamp_block(buf, 0, i));
             }
 
-            Path output_tsm_file_path = _compaction_path / std::to_string(file_idx);
-            output_tsm_file.write_to_file(output_tsm_file_path);
+            for (uint16_t column_id = 0; column_id < _row_codec->column_count(); ++column_id) {
+                const ColumnOps& column_ops = _column_ops(_row_codec->column_type(column_id));
+                for (uint32_t i = 0; i < decoded_file._block_count; ++i) {
+                    std::unique_ptr<DataBlock> data_block = column_ops._new_block();
+                    data_block->decode_from_decompress(file.column_block(buf, 0, column_id, i));
+                    decoded_file._column_blocks.emplace_back(std::move(data_block));
+                }
+            }
         }
 
-        inline void deserialize_row(const char *&p,
-                                    std::map<std::string, std::vector<std::unique_ptr<DataBlock>>> &sorted_columns) {
-            uint16_t ts_num = decode_ts(*reinterpret_cast<const int64_t *>(p)) % FILE_CONVERT_SIZE;
-            p += sizeof(int64_t);
-            uint16_t block_index = ts_num / DATA_BLOCK_ITEM_NUMS;
-            uint16_t block_offset = ts_num % DATA_BLOCK_ITEM_NUMS;
-
-            for (auto &[column_name, column_blocks]: sorted_columns) {
-                switch (_schema->columnTypeMap[column_name]) {
-                    case COLUMN_TYPE_INTEGER: {
-                        IntDataBlock &int_data_block = dynamic_cast<IntDataBlock &>(*column_blocks[block_index]);
-                        int32_t int_value = *reinterpret_cast<const int32_t *>(p);
-                        p += sizeof(int32_t);
-                        int_data_block._column_values[block_offset] = int_value;
-                        int_data_block._sum += int_value;
-                        int_data_block._min = std::min(int_data_block._min, int_value);
-                        int_data_block._max = std::max(int_data_block._max, int_value);
-                        break;
+        // groups of overlapping files in time order are cut into runs, a run is closed once it holds
+        // TIER_FILE_MAX_ROWS rows. runs which would be written into fewer files or overlap are returned
+        static std::vector<std::vector<FileIndexSPtr>> _get_merge_runs(std::vector<FileIndexSPtr> files) {
+            std::sort(files.begin(), files.end(), [](const FileIndexSPtr& lhs, const FileIndexSPtr& rhs) {
+                return lhs->min_ts() < rhs->min_ts();
+            });
+            std::vector<std::vector<FileIndexSPtr>> runs;
+            std::vector<FileIndexSPtr> run;
+            size_t run_rows = 0;
+            bool run_overlapped = false;
+            int64_t run_max_ts = 0;
+
+            for (size_t i = 0; i < files.size(); ++i) {
+                bool overlapped = !run.empty() && files[i]->min_ts() <= run_max_ts;
+                // an overlapping file always joins the run, the rows of one timestamp must be merged together
+                if (!run.empty() && !overlapped && run_rows >= TIER_FILE_MAX_ROWS) {
+                    if (run_overlapped || run.size() > (run_rows + TIER_FILE_MAX_ROWS - 1) / TIER_FILE_MAX_ROWS) {
+                        runs.emplace_back(std::move(run));
                     }
-                    case COLUMN_TYPE_DOUBLE_FLOAT: {
-                        DoubleDataBlock &double_data_block = dynamic_cast<DoubleDataBlock &>(*column_blocks[block_index]);
-                        double_t double_value = *reinterpret_cast<const double_t *>(p);
-                        p += sizeof(double_t);
-                        double_data_block._column_values[block_offset] = double_value;
-                        double_data_block._sum += double_value;
-                        double_data_block._min = std::min(double_data_block._min, double_value);
-                        double_data_block._max = std::max(double_data_block._max, double_value);
+                    run.clear();
+                    run_rows = 0;
+                    run_overlapped = false;
+                }
+                run_overlapped |= overlapped;
+                run_max_ts = run.empty() ? files[i]->max_ts() : std::max(run_max_ts, files[i]->max_ts());
+                run_rows += files[i]->row_count();
+                run.emplace_back(files[i]);
+            }
+
+            if (run_overlapped || run.size() > (run_rows + TIER_FILE_MAX_ROWS - 1) / TIER_FILE_MAX_ROWS) {
+                runs.emplace_back(std::move(run));
+            }
+            return runs;
+        }
+
+        // merge every run, return false if one of them fails, e.g. on a corrupted block. the files written
+        // so far are dropped then and the inputs stay in place, the queries of the corrupted block report it
+        bool _merge_runs(int64_t partition, int64_t partition_count, const std::vector<std::vector<FileIndexSPtr>>& runs,
+                         uint32_t max_row_count, uint32_t& file_seq, std::vector<FileIndexSPtr>& output_files,
+                         ThreadPool* encode_pool) {
+            bool merged = true;
+            try {
+                for (const auto &run: runs) {
+                    if (!_merge_files(partition, partition_count, run, max_row_count, file_seq, output_files, encode_pool)) {
+                        merged = false;
                         break;
                     }
-                    case COLUMN_TYPE_STRING: {
-                        StringDataBlock &string_data_block = dynamic_cast<StringDataBlock &>(*column_blocks[block_index]);
-                        int32_t str_length = *reinterpret_cast<const int32_t *>(p);
-                        p += sizeof(int32_t);
-                        ColumnValue column_value(p, str_length);
-                        p += str_length;
-                        string_data_block._column_values[block_offset] = column_value;
-                        string_data_block._min_length = std::min(string_data_block._min_length, str_length);
-                        string_data_block._max_length = std::max(string_data_block._max_length, str_length);
-                        break;
+                }
+            } catch (const std::exception& e) {
+                ERR_LOG("compaction of vin %u from partition %ld failed: %s", _vin_id, partition, e.what())
+                merged = false;
+            }
+            if (unlikely(!merged)) {
+                for (const auto &output_file: output_files) {
+                    output_file->_obsolete = true;
+                }
+                output_files.clear();
+            }
+            return merged;
+        }
+
+        // merge the files inside partition_count partitions from partition into files of at most
+        // max_row_count rows, numbered from file_seq on. false if a file can't take all of its rows
+        bool _merge_files(int64_t partition, int64_t partition_count, const std::vector<FileIndexSPtr>& files,
+                          uint32_t max_row_count, uint32_t& file_seq, std::vector<FileIndexSPtr>& output_files,
+                          ThreadPool* encode_pool) {
+            std::vector<DecodedFile> inputs(files.size());
+            std::vector<MergeRow> rows;
+
+            for (uint32_t input_idx = 0; input_idx < files.size(); ++input_idx) {
+                _decode_file(*files[input_idx], inputs[input_idx]);
+                const std::vector<TimeIndexEntry>& time_index = files[input_idx]->_time_index;
+                for (uint32_t block_idx = 0; block_idx < time_index.size(); ++block_idx) {
+                    for (uint16_t i = 0; i < time_index[block_idx]._count; ++i) {
+                        rows.push_back({inputs[input_idx]._timestamp_blocks[block_idx]._timestamps[i], files[input_idx]->_file_seq,
+                                        input_idx, static_cast<uint32_t>(block_idx * DATA_BLOCK_ITEM_NUMS + i)});
                     }
-                    default:
-                        break;
                 }
             }
+
+            // the largest file seq comes first among the rows of one timestamp and is kept
+            std::sort(rows.begin(), rows.end(), [](const MergeRow& lhs, const MergeRow& rhs) {
+                return lhs._timestamp < rhs._timestamp || (lhs._timestamp == rhs._timestamp && lhs._file_seq > rhs._file_seq);
+            });
+            rows.erase(std::unique(rows.begin(), rows.end(), [](const MergeRow& lhs, const MergeRow& rhs) {
+                return lhs._timestamp == rhs._timestamp;
+            }), rows.end());
+
+            MergeBatch batch {inputs, rows, *_row_codec};
+            std::vector<uint32_t> row_indices(rows.size());
+            std::iota(row_indices.begin(), row_indices.end(), 0);
+
+            for (size_t begin = 0; begin < rows.size(); begin += max_row_count) {
+                size_t count = std::min<size_t>(max_row_count, rows.size() - begin);
+                MemTable mem_table(file_seq++, partition, _row_codec, nullptr, false, partition_count, max_row_count);
+                size_t appended;
+                mem_table.append_batch(batch, row_indices.data() + begin, count, 0, appended);
+                if (unlikely(appended != count)) {
+                    ERR_LOG("compaction of vin %u from partition %ld kept %zu of %zu rows", _vin_id, partition, appended, count)
+                    return false;
+                }
+                mem_table.seal();
+                output_files.emplace_back(_write_tsm_file(mem_table, encode_pool));
+            }
+            return true;
         }
 
-    private:
-        uint16_t _vin_num;
-        Path _no_compaction_path;
-        Path _compaction_path;
+        // steps of the conversion which depend on the column type. they are looked up once per column
+        // in a table built at compile time, the blocks of the column are then handled without switching
+        struct ColumnOps {
+            std::unique_ptr<DataBlock> (*_new_block)();
+            // fill the index entry of a sealed block
+            void (*_index_block)(DataBlock& data_block, uint16_t count, IndexEntry& index_entry);
+        };
+
+        template <typename Block>
+        static std::unique_ptr<DataBlock> _new_block() {
+            return std::make_unique<Block>();
+        }
+
+        // count is the rows of the block, the values past it are padding
+        template <typename Block>
+        static void _index_block(DataBlock& data_block, uint16_t count, IndexEntry& index_entry) {
+            if constexpr (!std::is_same_v<Block, StringDataBlock>) {
+                Block& block = static_cast<Block&>(data_block);
+                index_entry.set_sum(block._sum);
+                index_entry.set_max(block._max);
+                index_entry.set_min(block._min);
+                index_entry.set_first(block._column_values[0]);
+                index_entry.set_last(block._column_values[count - 1]);
+                index_entry._count = count;
+                if constexpr (std::is_same_v<Block, DoubleDataBlock>) {
+                    index_entry._nan_count = std::count_if(block._column_values.begin(), block._column_values.begin() + count,
+                                                           [](double_t value) { return std::isnan(value); });
+                    index_entry._count -= index_entry._nan_count;
+                }
+            } else {
+                index_entry._count = count;
+            }
+        }
+
+        static const ColumnOps& _column_ops(ColumnType column_type) {
+            // indexed by ColumnType
+            static constexpr ColumnOps COLUMN_OPS[] = {
+                    {nullptr, nullptr},
+                    {_new_block<StringDataBlock>, _index_block<StringDataBlock>},
+                    {_new_block<IntDataBlock>, _index_block<IntDataBlock>},
+                    {_new_block<DoubleDataBlock>, _index_block<DoubleDataBlock>},
+            };
+            if (unlikely(column_type < COLUMN_TYPE_STRING || column_type > COLUMN_TYPE_DOUBLE_FLOAT)) {
+                throw std::runtime_error("Undefined column type, this is not expected");
+            }
+            return COLUMN_OPS[column_type];
+        }
+
+        // mem_table must be sealed
+        FileIndexSPtr _write_tsm_file(MemTable& mem_table, ThreadPool* encode_pool) {
+            TsmFile output_tsm_file;
+            output_tsm_file._codec_selectors = _codec_selectors.data();
+            mem_table.get_sealed_blocks(output_tsm_file._timestamp_blocks, output_tsm_file._data_blocks);
+            mem_table.take_encoded_blocks(output_tsm_file._encoded_blocks);
+            size_t block_count = output_tsm_file._timestamp_blocks.size();
+            size_t block_idx = 0;
+
+            for (const auto &timestamp_block: output_tsm_file._timestamp_blocks) {
+                TimeIndexEntry time_index_entry;
+                time_index_entry._min_ts = timestamp_block->_timestamps[0];
+                time_index_entry._max_ts = timestamp_block->_timestamps[timestamp_block->_count - 1];
+                time_index_entry._count = timestamp_block->_count;
+                output_tsm_file._time_index.emplace_back(time_index_entry);
+            }
+
+            // data blocks are grouped by column id
+            for (uint16_t column_id = 0; column_id < _row_codec->column_count(); ++column_id) {
+                const ColumnOps& column_ops = _column_ops(_row_codec->column_type(column_id));
+                IndexBlock index_block(block_count);
+                for (uint16_t i = 0; i < block_count; ++i) {
+                    column_ops._index_block(*output_tsm_file._data_blocks[block_idx++], output_tsm_file._time_index[i]._count,
+                                            index_block._index_entries[i]);
+                }
+                output_tsm_file._index_blocks.emplace_back(std::move(index_block));
+            }
+
+            // reused by the files the thread writes next, only its capacity is kept
+            thread_local std::string buf;
+            buf.clear();
+            output_tsm_file.encode_to(&buf, encode_pool);
+
+            _scheduler->throttle_write(buf.size());
+            auto file_index = std::make_shared<FileIndex>();
+            file_index->_file_seq = mem_table.file_seq();
+            file_index->_segment = _segment_manager->append(_vin_id, mem_table.file_seq(), buf, output_tsm_file._index_offset,
+                                                            file_index->_offset);
+            file_index->_size = buf.size();
+            file_index->_time_index = std::move(output_tsm_file._time_index);
+            file_index->_index_blocks = std::move(output_tsm_file._index_blocks);
+            file_index->enable_checksums();
+            return file_index;
+        }
+
+        VinId _vin_id;
+        Vin _vin;
         SchemaSPtr _schema;
+        RowCodecSPtr _row_codec;
+        std::set<std::string> _column_names;
+        std::vector<CodecSelector> _codec_selectors; // by column id
+        GlobalMemTableManagerSPtr _mem_table_manager;
+        GlobalIndexManagerSPtr _index_manager;
+        GlobalLatestManagerSPtr _latest_manager;
+        GlobalSegmentManagerSPtr _segment_manager;
+        CompactionScheduler* _scheduler; // owned by the global convert manager
+        SpinLock _compaction_lock;
+        std::set<std::pair<uint16_t, int64_t>> _pending_compactions; // level and first partition of the windows
+        bool _compacting = false; // a compaction task of the vin is running
     };
 
     class GlobalConvertManager;
@@ -221,50 +498,213 @@ namespace LindormContest {
 
     class GlobalConvertManager {
     public:
-        GlobalConvertManager(const Path &root_path) {
-            _thread_pool = std::make_unique<ThreadPool>(POOL_THREAD_NUM);
-            for (uint16_t vin_num = 0; vin_num < VIN_NUM_RANGE; ++vin_num) {
-                _convert_managers[vin_num] = std::make_unique<ConvertManager>(vin_num, root_path);
+        GlobalConvertManager(GlobalMemTableManagerSPtr mem_table_manager, GlobalIndexManagerSPtr index_manager,
+                             GlobalLatestManagerSPtr latest_manager, GlobalSegmentManagerSPtr segment_manager,
+                             GlobalWalManagerSPtr wal_manager, WriteControllerSPtr write_controller,
+                             VinDictionarySPtr vin_dictionary,
+                             const CompactionSchedulerOptions& scheduler_options = CompactionSchedulerOptions())
+                : _schema(nullptr), _mem_table_manager(mem_table_manager), _index_manager(index_manager),
+                  _latest_manager(latest_manager), _segment_manager(segment_manager), _wal_manager(wal_manager),
+                  _write_controller(write_controller), _vin_dictionary(vin_dictionary) {
+            _scheduler = std::make_unique<CompactionScheduler>(scheduler_options);
+            _encode_pool = std::make_unique<ThreadPool>(POOL_THREAD_NUM);
+        }
+
+        // called by connect and createTable before any write, the compression options set so far are taken
+        void init(SchemaSPtr schema, RowCodecSPtr row_codec) {
+            _schema = schema;
+            _row_codec = row_codec;
+            {
+                std::lock_guard<std::mutex> l(_compression_options_mutex);
+                _compression_options = _pending_compression_options;
             }
+            _convert_managers.for_each([&](size_t /*vin_id*/, std::unique_ptr<ConvertManager>& convert_manager) {
+                if (convert_manager != nullptr) {
+                    convert_manager->init(_schema, _row_codec, _compression_options);
+                }
+            });
+        }
+
+        // applied by the next init, files already written keep their encoding. may be called while
+        // writing, the vins added meanwhile keep using the options taken by the last init
+        void set_compression_options(const CompressionOptions& compression_options) {
+            std::lock_guard<std::mutex> l(_compression_options_mutex);
+            _pending_compression_options = compression_options;
+        }
+
+        // limit the bytes per second the conversions and compactions write, 0 leaves them unlimited.
+        // applied right away, may be called while writing
+        void set_background_write_bandwidth(double write_bytes_per_sec) {
+            _scheduler->set_write_bytes_per_sec(write_bytes_per_sec);
         }
 
-        void init(SchemaSPtr schema) {
-            for (auto &convert_manager: _convert_managers) {
-                convert_manager->init(schema);
+        // called once per vin before its id is visible
+        void add_vin(VinId vin_id, const Vin& vin) {
+            auto convert_manager = std::make_unique<ConvertManager>(vin_id, vin, _mem_table_manager, _index_manager,
+                                                                    _latest_manager, _segment_manager, _scheduler.get());
+            convert_manager->init(_schema, _row_codec, _compression_options);
+            _convert_managers[vin_id] = std::move(convert_manager);
+        }
+
+        // the mem table counts against the write thresholds until it is converted, the larger
+        // mem tables pin more bytes of wal and are converted first
+        void convert_async(VinId vin_id, MemTableSPtr mem_table) {
+            size_t bytes = mem_table->memory_usage();
+            _write_controller->add_pending(bytes);
+            TaskPriority priority {_index_manager->is_queried(vin_id, mem_table->partition(), 1), TaskPriority::CONVERT, bytes};
+            _scheduler->submit(priority, [this, convert_manager = _convert_managers[vin_id].get(), mem_table, bytes]() mutable {
+                do_convert(this, convert_manager, std::move(mem_table), bytes);
+            });
+        }
+
+        // filled blocks are encoded by the converters, the ones still queued when their mem table
+        // is converted are skipped
+        void encode_block_async(VinId vin_id, FilledBlock filled_block) {
+            TaskPriority priority {_index_manager->is_queried(vin_id, filled_block._mem_table->partition(), 1), TaskPriority::ENCODE};
+            _scheduler->submit(priority, [convert_manager = _convert_managers[vin_id].get(), filled_block]() {
+                do_encode_block(convert_manager, filled_block);
+            });
+        }
+
+        // a block failing to encode is encoded again by the conversion of its mem table
+        static void do_encode_block(ConvertManager *convert_manager, FilledBlock filled_block) {
+            try {
+                convert_manager->encode_filled_block(*filled_block._mem_table, filled_block._block_idx);
+            } catch (const std::exception& e) {
+                ERR_LOG("encoding block %u of vin %u failed: %s", filled_block._block_idx, convert_manager->vin_id(), e.what())
             }
         }
 
-        void convert_async(uint16_t vin_num, uint16_t file_idx) {
-            _thread_pool->submit(do_convert, _convert_managers[vin_num].get(), file_idx);
+        // a failed conversion keeps the mem table in place, its rows are still queried from memory
+        // and replayed from the wal it pins by the next connect
+        static void do_convert(GlobalConvertManager *global_manager, ConvertManager *convert_manager, MemTableSPtr mem_table, size_t bytes) {
+            int64_t partition = mem_table->partition();
+            bool converted = true;
+            try {
+                convert_manager->convert(std::move(mem_table), global_manager->_get_encode_pool());
+            } catch (const std::exception& e) {
+                ERR_LOG("conversion of vin %u from partition %ld failed: %s", convert_manager->vin_id(), partition, e.what())
+                converted = false;
+            }
+            global_manager->_write_controller->remove_pending(bytes);
+            if (unlikely(!converted)) {
+                return;
+            }
+            try {
+                global_manager->_checkpoint();
+            } catch (const std::exception& e) {
+                ERR_LOG("checkpoint after converting vin %u failed: %s", convert_manager->vin_id(), e.what())
+            }
+            if (convert_manager->need_compaction(partition)) {
+                global_manager->_compact_async(convert_manager, 0, partition);
+            }
+            global_manager->_compact_windows_async(convert_manager, partition);
         }
 
-        static void do_convert(ConvertManager *convert_manager, uint16_t file_idx) {
-            convert_manager->convert(file_idx);
+        // compact the partitions left overlapping by the last run
+        void compact_overlapping_partitions(VinId vin_count) {
+            for (VinId vin_id = 0; vin_id < vin_count; ++vin_id) {
+                for (int64_t partition: _index_manager->get_overlapping_partitions(vin_id)) {
+                    _compact_async(_convert_managers[vin_id].get(), 0, partition);
+                    _compact_windows_async(_convert_managers[vin_id].get(), partition);
+                }
+            }
         }
 
+        // pending compactions are dropped, they are picked up again by the next connect.
+        // the segments are sealed once nothing is written anymore
         void finalize_convert() {
-            _thread_pool->shutdown();
-            assert(_thread_pool->empty());
-        }
-
-        // void save_latest_records_to_file(const Path& latest_records_path) const {
-        //     std::ofstream output_file(latest_records_path, std::ios::out | std::ios::binary);
-        //     if (!output_file.is_open()) {
-        //         throw std::runtime_error("Failed to open file for writing.");
-        //     }
-        //     std::string buf;
-        //
-        //     for (uint16_t i = 0; i < VIN_NUM_RANGE; ++i) {
-        //         io::serialize_row(_convert_managers[i]->get_latest_row(), true, buf);
-        //     }
-        //
-        //     output_file.write(buf.c_str(), buf.size());
-        //     output_file.close();
-        // }
+            _shutdown = true;
+            _scheduler->shutdown();
+            assert(_scheduler->empty());
+            _encode_pool->shutdown();
+            _segment_manager->seal_all();
+        }
+
+        CompactionSchedulerMetrics get_scheduler_metrics() {
+            return _scheduler->get_metrics();
+        }
+
+        // save the tsm files to the manifest and remove the wal segments obsolete by it. the vins of
+        // the files are synced first, recovery drops the files of vins missing from the dictionary
+        void checkpoint(uint32_t wal_checkpoint) {
+            _segment_manager->checkpoint(wal_checkpoint, [this] { _vin_dictionary->sync(); });
+            _wal_manager->remove_obsolete(wal_checkpoint);
+        }
 
     private:
-        ThreadPoolUPtr _thread_pool;
-        std::unique_ptr<ConvertManager> _convert_managers[VIN_NUM_RANGE];
+        // a checkpoint is taken whenever a conversion frees the oldest live wal segment
+        void _checkpoint() {
+            std::lock_guard<std::mutex> l(_checkpoint_mutex);
+            uint32_t wal_checkpoint = _wal_manager->min_live_seq();
+            if (wal_checkpoint > _wal_checkpoint) {
+                checkpoint(wal_checkpoint);
+                _wal_checkpoint = wal_checkpoint;
+            }
+        }
+
+        // files are encoded by one thread while the converters are saturated. once fewer files are queued
+        // than there are converters, e.g. towards shutdown, the idle cores help encoding the columns
+        ThreadPool* _get_encode_pool() const {
+            return _write_controller->get_metrics()._pending_converts < POOL_THREAD_NUM ? _encode_pool.get() : nullptr;
+        }
+
+        // one compaction task per vin at a time works through the queued windows of the vin,
+        // the partitions of minor compaction first and then the windows from the smallest level up.
+        // the task goes first while the window it is queued for is being queried
+        void _compact_async(ConvertManager *convert_manager, uint16_t level, int64_t partition) {
+            if (convert_manager->add_pending_compaction(level, partition)) {
+                int64_t partition_count = level == 0 ? 1 : ConvertManager::get_window_span(level);
+                TaskPriority priority {_index_manager->is_queried(convert_manager->vin_id(), partition, partition_count)};
+                _scheduler->submit(priority, [this, convert_manager]() {
+                    do_compact(this, convert_manager);
+                });
+            }
+        }
+
+        // the windows holding the partition and the ones before them, which a vin skipping
+        // partitions leaves behind without converting anything inside them anymore
+        void _compact_windows_async(ConvertManager *convert_manager, int64_t partition) {
+            for (uint16_t level = 1; level <= TIER_LEVEL_NUM; ++level) {
+                int64_t window = ConvertManager::get_window(partition, level);
+                _compact_async(convert_manager, level, window);
+                _compact_async(convert_manager, level, window - ConvertManager::get_window_span(level));
+            }
+        }
+
+        static void do_compact(GlobalConvertManager *global_manager, ConvertManager *convert_manager) {
+            uint16_t level;
+            int64_t partition;
+            while (convert_manager->next_pending_compaction(level, partition)) {
+                if (unlikely(global_manager->_shutdown)) {
+                    continue;
+                }
+                if (level == 0) {
+                    convert_manager->compact_partition(partition, global_manager->_get_encode_pool());
+                } else {
+                    convert_manager->compact_window(level, partition, global_manager->_get_encode_pool());
+                }
+            }
+        }
+
+        SchemaSPtr _schema;
+        RowCodecSPtr _row_codec;
+        CompressionOptions _compression_options; // taken by the last init, only read afterwards
+        CompressionOptions _pending_compression_options;
+        std::mutex _compression_options_mutex;
+        GlobalMemTableManagerSPtr _mem_table_manager;
+        GlobalIndexManagerSPtr _index_manager;
+        GlobalLatestManagerSPtr _latest_manager;
+        GlobalSegmentManagerSPtr _segment_manager;
+        GlobalWalManagerSPtr _wal_manager;
+        WriteControllerSPtr _write_controller;
+        VinDictionarySPtr _vin_dictionary;
+        CompactionSchedulerUPtr _scheduler; // runs conversions, block encodes and compactions
+        ThreadPoolUPtr _encode_pool; // helps the converters encode the columns of one file
+        std::atomic<bool> _shutdown {false};
+        std::mutex _checkpoint_mutex;
+        uint32_t _wal_checkpoint = 0; // of the last checkpoint taken by a conversion
+        VinArray<std::unique_ptr<ConvertManager>> _convert_managers;
     };
 
 }
@@ -23,66 +23,108 @@
 #include "struct/Schema.h"
 #include "struct/CompareExpression.h"
 #include "index_manager.h"
+#include "storage/mem_table.h"
+#include "read_snapshot.h"
 #include "struct/Row.h"
 #include "struct/Requests.h"
 
 namespace LindormContest {
 
+    // the column filter of a downsample typed like the column, so values are compared without a ColumnValue.
+    // a block can be decided as a whole from the min and max of its values, NaN values never pass but EQUAL NaN
+    struct BlockMatch {
+        enum Kind : uint8_t {
+            NONE, // no value of the block passes
+            SOME,
+            ALL,
+        };
+    };
+
+    template <typename V>
+    struct ValueFilter {
+        CompareOp _op;
+        bool _typed; // the filter value has the type of the column, no value passes otherwise
+        V _value;
+
+        explicit ValueFilter(const CompareExpression& column_filter) : _op(column_filter.compareOp) {
+            if constexpr (std::is_same_v<V, int32_t>) {
+                _typed = column_filter.value.getIntegerValue(_value) == 0;
+            } else {
+                _typed = column_filter.value.getDoubleFloatValue(_value) == 0;
+            }
+        }
+
+        // same as CompareExpression::doCompare, EQUAL compares the bits like ColumnValue does
+        bool match(V value) const {
+            if (_op == GREATER) {
+                return _typed && value > _value;
+            }
+            return _typed && std::memcmp(&value, &_value, sizeof(V)) == 0;
+        }
+
+        // min and max leave out the NaN values, nan_free tells whether the block has any
+        BlockMatch::Kind match_block(V min, V max, bool nan_free) const {
+            if (!_typed) {
+                return BlockMatch::NONE;
+            }
+            if constexpr (std::is_same_v<V, double_t>) {
+                if (std::isnan(_value)) {
+                    return _op == EQUAL && !nan_free ? BlockMatch::SOME : BlockMatch::NONE;
+                }
+            }
+            if (_op == GREATER) {
+                if (!(max > _value)) {
+                    return BlockMatch::NONE;
+                }
+                return nan_free && min > _value ? BlockMatch::ALL : BlockMatch::SOME;
+            }
+            if (_value < min || _value > max) {
+                return BlockMatch::NONE;
+            }
+            // doubles equal to the value may still differ in their bits, e.g. -0.0
+            if constexpr (std::is_same_v<V, int32_t>) {
+                if (min == max) {
+                    return BlockMatch::ALL;
+                }
+            }
+            return BlockMatch::SOME;
+        }
+    };
+
     class DownSampleManager {
     public:
         DownSampleManager() = default;
 
-        DownSampleManager(uint16_t vin_num, const Path& vin_dir_path, GlobalIndexManagerSPtr index_manager)
-                : _vin_num(vin_num), _vin_dir_path(vin_dir_path), _schema(nullptr), _index_manager(index_manager) {}
+        DownSampleManager(VinId vin_id, GlobalMemTableManagerSPtr mem_table_manager, GlobalIndexManagerSPtr index_manager)
+                : _vin_id(vin_id), _schema(nullptr), _row_codec(nullptr),
+                  _mem_table_manager(mem_table_manager), _index_manager(index_manager) {}
 
         DownSampleManager(DownSampleManager&& other) = default;
 
         ~DownSampleManager() = default;
 
-        void init(SchemaSPtr schema) {
+        void init(SchemaSPtr schema, RowCodecSPtr row_codec) {
             _schema = schema;
+            _row_codec = row_codec;
         }
 
-        template<typename T, bool finish_compaction>
+        template<typename T>
         void query_time_range_max_down_sample(int64_t interval, const TimeRange& tr, const std::string& column_name,
                                               const CompareExpression& column_filter, std::vector<Row> &downsampleRes) {
-            for (const auto &sub_tr: tr.sub_intervals(interval)) {
-                DownSampleState state = DownSampleState::NO_DATA;
-                T max_value = std::numeric_limits<T>::lowest();
-
-                // once one tsm has data, the state is HAVE_DATA
-                // if all tsms have no data, the state is NO_DATA
-                // if some tsms have filtered all data, but the rest tsms have no data, the state is FILTER_ALL_DATA
-                for (uint16_t file_idx = sub_tr._start_idx / FILE_CONVERT_SIZE; file_idx <= sub_tr._end_idx / FILE_CONVERT_SIZE; ++file_idx) {
-                    TimeRange file_tr (
-                            std::max(sub_tr._start_idx, (uint16_t) (file_idx * FILE_CONVERT_SIZE)) % FILE_CONVERT_SIZE,
-                            std::min(sub_tr._end_idx, (uint16_t) ((file_idx + 1) * FILE_CONVERT_SIZE - 1)) % FILE_CONVERT_SIZE
-                    );
-
-                    T file_max_value = std::numeric_limits<T>::lowest();
-                    DownSampleState file_state;
-
-                    if constexpr (finish_compaction) {
-                        file_state = _query_max_from_one_tsm_file<T>(file_idx, file_tr, column_name,
-                                                                     column_filter, file_max_value);
-                    } else {
-                        file_state = _query_max_from_one_flush_file<T>(file_idx, file_tr, column_name,
-                                                                       column_filter, file_max_value);
-                    }
-
-                    if (file_state == DownSampleState::HAVE_DATA) {
-                        state = DownSampleState::HAVE_DATA;
-                        max_value = std::max(max_value, file_max_value);
-                    } else if (state == DownSampleState::NO_DATA && file_state == DownSampleState::FILTER_ALL_DATA) {
-                        state = DownSampleState::FILTER_ALL_DATA;
-                    }
+            ReadSnapshot snapshot;
+            TimeRange bucket_tr = _take_snapshot(interval, tr, snapshot);
+            std::vector<DownSampleBucket<T>> buckets(bucket_tr.interval_nums(interval), {std::numeric_limits<T>::lowest(), 0, 0});
+            _scan_column<MAX, T, T>(snapshot, interval, bucket_tr, column_name, ValueFilter<T>(column_filter), buckets);
+
+            for (size_t i = 0; i < buckets.size(); ++i) {
+                // the interval has no data at all
+                if (buckets[i]._row_count == 0) {
+                    continue;
                 }
 
-                if (state == DownSampleState::NO_DATA) {
-                    return;
-                }
-
-                if (state == DownSampleState::FILTER_ALL_DATA) {
+                T max_value = buckets[i]._value;
+                // all data of the interval has been filtered
+                if (buckets[i]._filtered_count == 0) {
                     if constexpr (std::is_same_v<T, int32_t>) {
                         max_value = INT_NAN;
                     } else if constexpr (std::is_same_v<T, double_t>) {
@@ -92,302 +134,185 @@ namespace LindormContest {
 
                 ColumnValue max_column_value(max_value);
                 Row result_row;
+                result_row.timestamp = bucket_tr.sub_interval(interval, i)._start_time;
                 result_row.columns.emplace(column_name, std::move(max_column_value));
                 downsampleRes.emplace_back(std::move(result_row));
             }
         }
 
-        template<typename T, bool finish_compaction>
+        template<typename T>
         void query_time_range_avg_down_sample(int64_t interval, const TimeRange& tr, const std::string& column_name,
                                               const CompareExpression& column_filter, std::vector<Row> &downsampleRes) {
-            for (const auto &sub_tr: tr.sub_intervals(interval)) {
-                DownSampleState state = DownSampleState::NO_DATA;
-                double_t avg_value;
-                T sum_value = 0;
-                size_t sum_count = 0;
-
-                // once one tsm has data, the state is HAVE_DATA
-                // if all tsms have no data, the state is NO_DATA
-                // if some tsms have filtered all data, but the rest tsms have no data, the state is FILTER_ALL_DATA
-                for (uint16_t file_idx = sub_tr._start_idx / FILE_CONVERT_SIZE; file_idx <= sub_tr._end_idx / FILE_CONVERT_SIZE; ++file_idx) {
-                    TimeRange file_tr (
-                            std::max(sub_tr._start_idx, (uint16_t) (file_idx * FILE_CONVERT_SIZE)) % FILE_CONVERT_SIZE,
-                            std::min(sub_tr._end_idx, (uint16_t) ((file_idx + 1) * FILE_CONVERT_SIZE - 1)) % FILE_CONVERT_SIZE
-                    );
-
-                    T file_sum_value = 0;
-                    size_t file_sum_count = 0;
-                    DownSampleState file_state;
-
-                    if constexpr (finish_compaction) {
-                        file_state = _query_avg_from_one_tsm_file<T>(file_idx, file_tr, column_name,
-                                                                     column_filter, file_sum_value, file_sum_count);
-                    } else {
-                        file_state = _query_avg_from_one_flush_file<T>(file_idx, file_tr, column_name,
-                                                                       column_filter, file_sum_value, file_sum_count);
-                    }
-
-                    if (file_state == DownSampleState::HAVE_DATA) {
-                        state = DownSampleState::HAVE_DATA;
-                        sum_value += file_sum_value;
-                        sum_count += file_sum_count;
-                    } else if (state == DownSampleState::NO_DATA && file_state == DownSampleState::FILTER_ALL_DATA) {
-                        state = DownSampleState::FILTER_ALL_DATA;
-                    }
-                }
-
-                if (state == DownSampleState::NO_DATA) {
-                    return;
-                }
-
-                if (state == DownSampleState::FILTER_ALL_DATA) {
-                    avg_value = DOUBLE_NAN;
-                } else {
-                    avg_value = sum_value * 1.0 / sum_count;
+            using V = std::conditional_t<std::is_same_v<T, int64_t>, int32_t, double_t>;
+            ReadSnapshot snapshot;
+            TimeRange bucket_tr = _take_snapshot(interval, tr, snapshot);
+            std::vector<DownSampleBucket<T>> buckets(bucket_tr.interval_nums(interval), {0, 0, 0});
+            _scan_column<AVG, T, V>(snapshot, interval, bucket_tr, column_name, ValueFilter<V>(column_filter), buckets);
+
+            for (size_t i = 0; i < buckets.size(); ++i) {
+                if (buckets[i]._row_count == 0) {
+                    continue;
                 }
 
-                ColumnValue max_column_value(avg_value);
+                double_t avg_value = buckets[i]._filtered_count == 0
+                                     ? DOUBLE_NAN : buckets[i]._value * 1.0 / buckets[i]._filtered_count;
+                ColumnValue avg_column_value(avg_value);
                 Row result_row;
-                result_row.columns.emplace(column_name, std::move(max_column_value));
+                result_row.timestamp = bucket_tr.sub_interval(interval, i)._start_time;
+                result_row.columns.emplace(column_name, std::move(avg_column_value));
                 downsampleRes.emplace_back(std::move(result_row));
             }
         }
 
     private:
-        enum class DownSampleState {
-            HAVE_DATA,
-            NO_DATA,
-            FILTER_ALL_DATA
+        template <typename T>
+        struct DownSampleBucket {
+            T _value;               // max or sum of the rows passing the filter
+            size_t _row_count;      // rows inside the interval
+            size_t _filtered_count; // rows passing the filter
         };
 
-        template <typename T>
-        DownSampleState _query_max_from_one_tsm_file(uint16_t file_idx, const TimeRange& file_tr, const std::string& column_name,
-                                                     const CompareExpression& column_filter, T& max_value) {
-            std::vector<IndexEntry> index_entries;
-            std::vector<IndexRange> ranges;
-            _index_manager->query_indexes(_vin_num, file_idx, column_name, file_tr, index_entries, ranges);
-            DownSampleState file_state = DownSampleState::NO_DATA;
-            uint32_t global_offset = index_entries.front()._offset;
-            uint32_t global_size = index_entries.back()._offset + index_entries.back()._size - global_offset;
-            Path tsm_file_path = _vin_dir_path / std::to_string(file_idx);
-            std::string buf;
-            io::stream_read_string_from_file(tsm_file_path, global_offset, global_size, buf);
-
-            for (size_t i = 0; i < index_entries.size(); ++i) {
-                DownSampleState entry_state;
-                T entry_max_value = std::numeric_limits<T>::lowest();
-                uint32_t local_offset = index_entries[i]._offset - global_offset;
-                entry_state = _get_max_column_value<T>(buf.c_str() + local_offset,
-                                                       index_entries[i], column_filter,
-                                                       ranges[i], entry_max_value);
-                if (entry_state == DownSampleState::HAVE_DATA) {
-                    file_state = DownSampleState::HAVE_DATA;
-                    max_value = std::max(max_value, entry_max_value);
-                } else if (file_state == DownSampleState::NO_DATA && entry_state == DownSampleState::FILTER_ALL_DATA) {
-                    file_state = DownSampleState::FILTER_ALL_DATA;
-                }
+        // the intervals of tr from the one of the first row inside it to the one of the last row, so a long range
+        // with a short interval only gets buckets for the intervals its rows span. rows written to the mem tables
+        // outside of them after the snapshot is taken are left out like the ones written to other intervals
+        TimeRange _take_snapshot(int64_t interval, const TimeRange& tr, ReadSnapshot& snapshot) {
+            snapshot.take(_vin_id, tr, *_mem_table_manager, *_index_manager);
+            if (snapshot._ts_range.empty()) {
+                return {tr._start_time, tr._start_time};
             }
-
-            return file_state;
+            TimeRange first = tr.sub_interval(interval, tr.interval_index(snapshot._ts_range._start_time, interval));
+            TimeRange last = tr.sub_interval(interval, tr.interval_index(snapshot._ts_range._end_time - 1, interval));
+            return {first._start_time, last._end_time};
         }
 
-        template <typename T>
-        DownSampleState _query_max_from_one_flush_file(uint16_t file_idx, const TimeRange& file_tr, const std::string& column_name,
-                                                       const CompareExpression& column_filter, T& max_value) {
-            Path flush_file_path = _vin_dir_path / std::to_string(file_idx);
-            std::string buf;
-            io::stream_read_string_from_file(flush_file_path, buf);
-
-            if (buf.empty()) {
-                return DownSampleState::NO_DATA;
-            }
-
-            const char* start = buf.c_str();
-            const char* end = start + buf.size();
-            size_t tr_count = 0;
-            size_t non_filter_count = 0;
-
-            while (start < end) {
-                Row row;
-                io::deserialize_row(_schema, start, false, row);
-                uint16_t ts_num = decode_ts(row.timestamp) % FILE_CONVERT_SIZE;
-                if (ts_num >= file_tr._start_idx && ts_num <= file_tr._end_idx) {
-                    tr_count++;
-                    if (!column_filter.doCompare(row.columns.at(column_name))) {
-                        continue;
-                    }
-                    non_filter_count++;
-                    T row_value;
-                    if constexpr (std::is_same_v<T, int32_t>) {
-                        row.columns.at(column_name).getIntegerValue(row_value);
-                    } else if constexpr (std::is_same_v<T, double_t>) {
-                        row.columns.at(column_name).getDoubleFloatValue(row_value);
-                    }
-                    max_value = std::max(max_value, row_value);
-                }
-            }
+        // aggregate the rows of the column inside tr into the buckets of their intervals,
+        // the tsm files and mem tables are scanned once for all intervals
+        template <Aggregator AGG, typename T, typename V>
+        void _scan_column(const ReadSnapshot& snapshot, int64_t interval, const TimeRange& tr, const std::string& column_name,
+                          const ValueFilter<V>& filter, std::vector<DownSampleBucket<T>>& buckets) {
+            uint16_t column_id = _row_codec->column_id(column_name);
 
-            if (tr_count == 0) {
-                return DownSampleState::NO_DATA;
-            } else if (non_filter_count == 0) {
-                return DownSampleState::FILTER_ALL_DATA;
-            } else {
-                return DownSampleState::HAVE_DATA;
+            for (size_t i = 0; i < snapshot._files.size(); ++i) {
+                _scan_one_tsm_file<AGG>(*snapshot._files[i], snapshot._file_shadows[i], interval, tr, column_id, filter, buckets);
             }
-        }
 
-        template <typename T>
-        DownSampleState _query_avg_from_one_tsm_file(uint16_t file_idx, const TimeRange& file_tr,
-                                            const std::string& column_name, const CompareExpression& column_filter,
-                                            T& sum_value, size_t& sum_count) {
-            std::vector<IndexEntry> index_entries;
-            std::vector<IndexRange> ranges;
-            _index_manager->query_indexes(_vin_num, file_idx, column_name, file_tr, index_entries, ranges);
-            DownSampleState file_state = DownSampleState::NO_DATA;
-            uint32_t global_offset = index_entries.front()._offset;
-            uint32_t global_size = index_entries.back()._offset + index_entries.back()._size - global_offset;
-            Path tsm_file_path = _vin_dir_path / std::to_string(file_idx);
-            std::string buf;
-            io::stream_read_string_from_file(tsm_file_path, global_offset, global_size, buf);
-
-            for (size_t i = 0; i < index_entries.size(); ++i) {
-                DownSampleState entry_state;
-                T entry_sum_value = 0;
-                size_t entry_sum_count = 0;
-                uint32_t local_offset = index_entries[i]._offset - global_offset;
-                entry_state = _get_sum_column_value<T>(buf.c_str() + local_offset,
-                                                       index_entries[i], column_filter,
-                                                       ranges[i], entry_sum_value, entry_sum_count);
-                if (entry_state == DownSampleState::HAVE_DATA) {
-                    file_state = DownSampleState::HAVE_DATA;
-                    sum_value += entry_sum_value;
-                    sum_count += entry_sum_count;
-                } else if (file_state == DownSampleState::NO_DATA && entry_state == DownSampleState::FILTER_ALL_DATA) {
-                    file_state = DownSampleState::FILTER_ALL_DATA;
-                }
+            for (size_t i = 0; i < snapshot._mem_tables.size(); ++i) {
+                const ShadowSet& shadow = snapshot._mem_table_shadows[i];
+                snapshot._mem_tables[i]->scan_column<V>(column_name, tr, [&](int64_t ts, V value) {
+                    if (unlikely(!shadow.empty() && shadow.contains(ts))) {
+                        return;
+                    }
+                    _add_value<AGG>(buckets[tr.interval_index(ts, interval)], filter, value);
+                });
             }
-
-            return file_state;
         }
 
-        template <typename T>
-        DownSampleState _query_avg_from_one_flush_file(uint16_t file_idx, const TimeRange& file_tr, const std::string& column_name,
-                                                     const CompareExpression& column_filter, T& sum_value, size_t& sum_count) {
-            Path flush_file_path = _vin_dir_path / std::to_string(file_idx);
-            std::string buf;
-            io::stream_read_string_from_file(flush_file_path, buf);
-
-            if (buf.empty()) {
-                return DownSampleState::NO_DATA;
+        template <Aggregator AGG, typename T, typename V>
+        static void _add_value(DownSampleBucket<T>& bucket, const ValueFilter<V>& filter, V value) {
+            bucket._row_count++;
+            if (!filter.match(value)) {
+                return;
             }
-
-            const char* start = buf.c_str();
-            const char* end = start + buf.size();
-            size_t tr_count = 0;
-            size_t non_filter_count = 0;
-
-            while (start < end) {
-                Row row;
-                io::deserialize_row(_schema, start, false, row);
-                uint16_t ts_num = decode_ts(row.timestamp) % FILE_CONVERT_SIZE;
-                if (ts_num >= file_tr._start_idx && ts_num <= file_tr._end_idx) {
-                    tr_count++;
-                    if (!column_filter.doCompare(row.columns.at(column_name))) {
-                        continue;
-                    }
-                    non_filter_count++;
-                    if constexpr (std::is_same_v<T, int64_t>) {
-                        int32_t row_value;
-                        row.columns.at(column_name).getIntegerValue(row_value);
-                        sum_value += (int64_t) row_value;
-                    } else if constexpr (std::is_same_v<T, double_t>) {
-                        double_t row_value;
-                        row.columns.at(column_name).getDoubleFloatValue(row_value);
-                        sum_value += row_value;
-                    }
-                    sum_count++;
-                }
+            bucket._filtered_count++;
+            if constexpr (AGG == MAX) {
+                bucket._value = std::max<T>(bucket._value, value);
+            } else {
+                bucket._value += value;
             }
+        }
 
-            if (tr_count == 0) {
-                return DownSampleState::NO_DATA;
-            } else if (non_filter_count == 0) {
-                return DownSampleState::FILTER_ALL_DATA;
+        // the block stats of a tsm file stand in for the block whose rows all pass the filter
+        template <Aggregator AGG, typename T>
+        static void _add_block(DownSampleBucket<T>& bucket, size_t row_count, const IndexEntry& index_entry) {
+            bucket._row_count += row_count;
+            bucket._filtered_count += row_count;
+            if constexpr (AGG == MAX) {
+                bucket._value = std::max<T>(bucket._value, index_entry.get_max<T>());
             } else {
-                return DownSampleState::HAVE_DATA;
+                bucket._value += index_entry.get_sum<T>();
             }
         }
 
-        template <typename T>
-        DownSampleState _get_max_column_value(const char* buf, const IndexEntry& index_entry,
-                                const CompareExpression& column_filter, const IndexRange& range, T& max_value) {
-            if constexpr (std::is_same_v<T, int32_t>) {
-                IntDataBlock int_data_block;
-                int_data_block.decode_from_decompress(buf);
-                for (uint16_t start = range._start_index; start <= range._end_index; ++start) {
-                    ColumnValue cv(int_data_block._column_values[start]);
-                    if (!column_filter.doCompare(cv)) {
+        // blocks are decided by their min and max before they are decoded. a block without a passing row
+        // only adds its rows to the counts, a block inside one interval whose rows all pass is answered by
+        // its stats, both without decoding its values. blocks holding shadowed rows are always decoded
+        template <Aggregator AGG, typename T, typename V>
+        void _scan_one_tsm_file(const FileIndex& file, const ShadowSet& shadow, int64_t interval, const TimeRange& tr,
+                                uint16_t column_id, const ValueFilter<V>& filter, std::vector<DownSampleBucket<T>>& buckets) {
+            std::vector<BlockRange> block_ranges;
+            file.get_block_ranges(tr, false, block_ranges);
+            const IndexBlock& index_block = file.get_index_block(column_id);
+
+            for (auto &block_range: block_ranges) {
+                const IndexEntry& index_entry = index_block._index_entries[block_range._block_idx];
+                const TimeIndexEntry& time_index_entry = file._time_index[block_range._block_idx];
+                uint16_t start = block_range._range._start_index;
+                uint16_t end = block_range._range._end_index;
+                if (likely(!shadow.overlap(time_index_entry._min_ts, time_index_entry._max_ts))) {
+                    BlockMatch::Kind match = filter.match_block(_get_min<V>(file, index_entry), index_entry.get_max<V>(),
+                                                                _nan_free<V>(file, index_entry));
+                    // the timestamps of a partially covered block are decoded already
+                    int64_t first_ts = block_range._full ? time_index_entry._min_ts : block_range._timestamps->_timestamps[start];
+                    int64_t last_ts = block_range._full ? time_index_entry._max_ts : block_range._timestamps->_timestamps[end];
+                    size_t bucket_idx = tr.interval_index(first_ts, interval);
+                    bool one_interval = bucket_idx == tr.interval_index(last_ts, interval);
+                    if (match == BlockMatch::NONE) {
+                        if (one_interval) {
+                            buckets[bucket_idx]._row_count += end - start + 1;
+                            continue;
+                        }
+                        file.decode_timestamps(block_range);
+                        const int64_t* timestamps = block_range._timestamps->_timestamps.data();
+                        for (uint16_t i = start; i <= end; ++i) {
+                            buckets[tr.interval_index(timestamps[i], interval)]._row_count++;
+                        }
                         continue;
                     }
-                    max_value = std::max(max_value, int_data_block._column_values[start]);
-                }
-            } else if constexpr (std::is_same_v<T, double_t>) {
-                DoubleDataBlock double_data_block;
-                double_data_block.decode_from_decompress(buf);
-                for (uint16_t start = range._start_index; start <= range._end_index; ++start) {
-                    ColumnValue cv(double_data_block._column_values[start]);
-                    if (!column_filter.doCompare(cv)) {
+                    if (match == BlockMatch::ALL && one_interval && block_range._full) {
+                        _add_block<AGG>(buckets[bucket_idx], end - start + 1, index_entry);
                         continue;
                     }
-                    max_value = std::max(max_value, double_data_block._column_values[start]);
                 }
-            }
-
-            if (max_value == std::numeric_limits<T>::lowest()) {
-                return DownSampleState::FILTER_ALL_DATA;
-            }
-
-            return DownSampleState::HAVE_DATA;
-        }
 
-        template <typename T>
-        DownSampleState _get_sum_column_value(const char* buf, const IndexEntry& index_entry,
-                                              const CompareExpression& column_filter, const IndexRange& range,
-                                              T& sum_value, size_t& sum_count) {
-            if constexpr (std::is_same_v<T, int64_t>) {
-                IntDataBlock int_data_block;
-                int_data_block.decode_from_decompress(buf);
-                for (uint16_t start = range._start_index; start <= range._end_index; ++start) {
-                    ColumnValue cv(int_data_block._column_values[start]);
-                    if (!column_filter.doCompare(cv)) {
-                        continue;
-                    }
-                    sum_value += int_data_block._column_values[start];
-                    sum_count++;
-                }
-            } else if constexpr (std::is_same_v<T, double_t>) {
-                DoubleDataBlock double_data_block;
-                double_data_block.decode_from_decompress(buf);
-                for (uint16_t start = range._start_index; start <= range._end_index; ++start) {
-                    ColumnValue cv(double_data_block._column_values[start]);
-                    if (!column_filter.doCompare(cv)) {
-                        continue;
+                file.decode_timestamps(block_range);
+                const int64_t* timestamps = block_range._timestamps->_timestamps.data();
+                const char* block_buf = file.column_block(file.data(index_entry._offset, index_entry._size),
+                                                          index_entry._offset, column_id, block_range._block_idx);
+                std::conditional_t<std::is_same_v<V, int32_t>, IntDataBlock, DoubleDataBlock> data_block;
+                data_block.decode_from_decompress(block_buf);
+                for (uint16_t i = start; i <= end; ++i) {
+                    if (likely(shadow.empty() || !shadow.contains(timestamps[i]))) {
+                        _add_value<AGG>(buckets[tr.interval_index(timestamps[i], interval)], filter, data_block._column_values[i]);
                     }
-                    sum_value += double_data_block._column_values[start];
-                    sum_count++;
                 }
             }
+        }
 
-            if (sum_count == 0) {
-                return DownSampleState::FILTER_ALL_DATA;
+        // files written before the block stats have no min
+        template <typename V>
+        static V _get_min(const FileIndex& file, const IndexEntry& index_entry) {
+            if (likely(file.has_block_stats())) {
+                return index_entry.get_min<V>();
+            }
+            if constexpr (std::is_same_v<V, double_t>) {
+                return -std::numeric_limits<double_t>::infinity();
             }
+            return std::numeric_limits<V>::lowest();
+        }
 
-            return DownSampleState::HAVE_DATA;
+        template <typename V>
+        static bool _nan_free(const FileIndex& file, const IndexEntry& index_entry) {
+            if constexpr (std::is_same_v<V, double_t>) {
+                // the sum of a block holding a NaN is NaN
+                return file.has_block_stats() ? index_entry._nan_count == 0 : !std::isnan(index_entry.get_sum<double_t>());
+            }
+            return true;
         }
 
-        uint16_t _vin_num;
-        Path _vin_dir_path;
+        VinId _vin_id;
         SchemaSPtr _schema;
+        RowCodecSPtr _row_codec;
+        GlobalMemTableManagerSPtr _mem_table_manager;
         GlobalIndexManagerSPtr _index_manager;
     };
 
@@ -397,57 +322,63 @@ namespace LindormContest {
 
     class GlobalDownSampleManager {
     public:
-        GlobalDownSampleManager(const Path& root_path, bool finish_compaction, GlobalIndexManagerSPtr index_manager)
-        : _schema(nullptr) {
-            for (uint16_t vin_num = 0; vin_num < VIN_NUM_RANGE; ++vin_num) {
-                Path vin_dir_path = finish_compaction ?
-                                    root_path / "compaction" / std::to_string(vin_num)
-                                    : root_path / "no-compaction" / std::to_string(vin_num);
-                _ds_managers[vin_num] = std::make_unique<DownSampleManager>(vin_num, vin_dir_path, index_manager);
-            }
-        }
+        GlobalDownSampleManager(const Path& root_path, GlobalMemTableManagerSPtr mem_table_manager,
+                                GlobalIndexManagerSPtr index_manager)
+        : _root_path(root_path), _schema(nullptr), _row_codec(nullptr), _mem_table_manager(mem_table_manager), _index_manager(index_manager) {}
 
         ~GlobalDownSampleManager() = default;
 
-        void init(SchemaSPtr schema) {
+        void init(SchemaSPtr schema, RowCodecSPtr row_codec) {
             _schema = schema;
-            for (auto &ds_manager: _ds_managers) {
-                ds_manager->init(_schema);
-            }
+            _row_codec = row_codec;
+            _ds_managers.for_each([&](size_t /*vin_id*/, std::unique_ptr<DownSampleManager>& ds_manager) {
+                if (ds_manager != nullptr) {
+                    ds_manager->init(_schema, _row_codec);
+                }
+            });
         }
 
-        template <bool finish_compaction>
-        void query_down_sample(uint16_t vin_num, const Vin& vin, int64_t time_lower_inclusive, int64_t time_upper_exclusive,
+        // called once per vin before its id is visible
+        void add_vin(VinId vin_id) {
+            auto ds_manager = std::make_unique<DownSampleManager>(vin_id, _mem_table_manager, _index_manager);
+            ds_manager->init(_schema, _row_codec);
+            _ds_managers[vin_id] = std::move(ds_manager);
+        }
+
+        void query_down_sample(VinId vin_id, const Vin& vin, int64_t time_lower_inclusive, int64_t time_upper_exclusive,
                                int64_t interval, const std::string& column_name, Aggregator aggregator,
                                const CompareExpression& columnFilter, std::vector<Row>& downsampleRes) {
-            TimeRange tr;
-            tr.init(time_lower_inclusive, time_upper_exclusive);
-            if (unlikely(tr._end_idx >= TS_NUM_RANGE)) {
+            TimeRange tr(time_lower_inclusive, time_upper_exclusive);
+            if (unlikely(tr.empty() || interval <= 0)) {
                 return;
             }
             ColumnType type = _schema->columnTypeMap[column_name];
             if (type == COLUMN_TYPE_INTEGER) {
                 if (aggregator == MAX) {
-                    _ds_managers[vin_num]->query_time_range_max_down_sample<int32_t, finish_compaction>(interval, tr, column_name, columnFilter, downsampleRes);
+                    _ds_managers[vin_id]->query_time_range_max_down_sample<int32_t>(interval, tr, column_name, columnFilter, downsampleRes);
                 } else if (aggregator == AVG) {
-                    _ds_managers[vin_num]->query_time_range_avg_down_sample<int64_t, finish_compaction>(interval, tr, column_name, columnFilter, downsampleRes);
+                    _ds_managers[vin_id]->query_time_range_avg_down_sample<int64_t>(interval, tr, column_name, columnFilter, downsampleRes);
                 }
             } else if (type == COLUMN_TYPE_DOUBLE_FLOAT) {
                 if (aggregator == MAX) {
-                    _ds_managers[vin_num]->query_time_range_max_down_sample<double_t, finish_compaction>(interval, tr, column_name, columnFilter, downsampleRes);
+                    _ds_managers[vin_id]->query_time_range_max_down_sample<double_t>(interval, tr, column_name, columnFilter, downsampleRes);
                 } else if (aggregator == AVG) {
-                    _ds_managers[vin_num]->query_time_range_avg_down_sample<double_t, finish_compaction>(interval, tr, column_name, columnFilter, downsampleRes);
+                    _ds_managers[vin_id]->query_time_range_avg_down_sample<double_t>(interval, tr, column_name, columnFilter, downsampleRes);
                 }
             }
 
-            for (uint32_t i = 0; i < downsampleRes.size(); ++i) {
-                downsampleRes[i].vin = vin;
-                downsampleRes[i].timestamp = time_lower_inclusive + i * interval;
+            // intervals without data are skipped, the rows carry their own interval start
+            for (auto &result_row: downsampleRes) {
+                result_row.vin = vin;
             }
         }
 
     private:
+        Path _root_path;
         SchemaSPtr _schema;
-        std::unique_ptr<DownSampleManager> _ds_managers[VIN_NUM_RANGE];
+        RowCodecSPtr _row_codec;
+        GlobalMemTableManagerSPtr _mem_table_manager;
+        GlobalIndexManagerSPtr _index_manager;
+        VinArray<std::unique_ptr<DownSampleManager>> _ds_managers;
     };
 }
\ No newline at end of file
@@ -15,15 +15,245 @@
 
 #pragma once
 
+#include <atomic>
+#include <chrono>
 #include <unordered_map>
 #include <shared_mutex>
 
 #include "common/spinlock.h"
+#include "common/segmented_array.h"
 #include "common/time_range.h"
+#include "storage/segment.h"
 #include "storage/tsm_file.h"
 
 namespace LindormContest {
 
+    // rows of one data block inside a time range
+    struct BlockRange {
+        uint32_t _block_idx;
+        IndexRange _range;
+        bool _full;                                      // the whole block is inside the time range
+        std::unique_ptr<TimestampDataBlock> _timestamps; // nullptr if not decoded
+    };
+
+    struct FileIndex;
+
+    using FileIndexSPtr = std::shared_ptr<const FileIndex>;
+
+    // in-memory index of one tsm file, immutable once published. a file replaced by compaction is
+    // marked obsolete and dropped from its segment once the last query holding its index is done
+    struct FileIndex {
+        uint32_t _file_seq;
+        SegmentSPtr _segment;
+        uint64_t _offset; // of the tsm file inside the segment
+        uint32_t _size;
+        uint32_t _version = TSM_VERSION_3; // of the format the file was written in
+        std::vector<TimeIndexEntry> _time_index;
+        std::vector<IndexBlock> _index_blocks; // by column id
+        mutable std::atomic<bool> _obsolete {false};
+        // by block, the timestamp blocks then the blocks of each column. null for v1 files which have no checksums
+        mutable std::unique_ptr<std::atomic<bool>[]> _verified;
+
+        ~FileIndex() {
+            if (_obsolete) {
+                _segment->remove_entry(_offset);
+            }
+        }
+
+        // offset is relative to the tsm file, like the offsets of its index. the bytes live in the
+        // mapping of the segment and stay valid while the file index is held
+        const char* data(uint64_t offset, uint32_t size, bool sequential = false) const {
+            return _segment->data(_offset + offset, size, sequential);
+        }
+
+        // the timestamp block idx inside buf, the bytes of the file from buf_offset on.
+        // a block is checked against its crc32c the first time it is read, hot blocks aren't checked again
+        const char* timestamp_block(const char* buf, uint64_t buf_offset, size_t idx) const {
+            const TimeIndexEntry& entry = _time_index[idx];
+            const char* block = buf + (entry._offset - buf_offset);
+            _verify(idx, block, entry._size, entry._crc);
+            return block;
+        }
+
+        const char* column_block(const char* buf, uint64_t buf_offset, uint16_t column_id, size_t idx) const {
+            const IndexEntry& entry = _index_blocks[column_id]._index_entries[idx];
+            const char* block = buf + (entry._offset - buf_offset);
+            _verify((column_id + 1) * _time_index.size() + idx, block, entry._size, entry._crc);
+            return block;
+        }
+
+        // blocks are checked as they are read from now on
+        void enable_checksums() {
+            _verified = std::make_unique<std::atomic<bool>[]>((_index_blocks.size() + 1) * _time_index.size());
+        }
+
+        int64_t min_ts() const {
+            return _time_index.front()._min_ts;
+        }
+
+        int64_t max_ts() const {
+            return _time_index.back()._max_ts;
+        }
+
+        // whether the index entries hold the min, first, last and counts of their blocks
+        bool has_block_stats() const {
+            return _version >= TSM_VERSION_3;
+        }
+
+        size_t row_count() const {
+            size_t row_count = 0;
+            for (const auto &time_index_entry: _time_index) {
+                row_count += time_index_entry._count;
+            }
+            return row_count;
+        }
+
+        const IndexBlock& get_index_block(uint16_t column_id) const {
+            return _index_blocks[column_id];
+        }
+
+        // blocks are sorted by time, so the overlapping ones are found by binary search on their min/max ts.
+        // timestamps are decoded for partially covered blocks, or for all blocks if need_timestamps
+        void get_block_ranges(const TimeRange& tr, bool need_timestamps, std::vector<BlockRange>& block_ranges) const {
+            auto first = std::partition_point(_time_index.begin(), _time_index.end(),
+                                              [&](const TimeIndexEntry& entry) { return entry._max_ts < tr._start_time; });
+            auto last = std::partition_point(first, _time_index.end(),
+                                             [&](const TimeIndexEntry& entry) { return entry._min_ts < tr._end_time; });
+            if (first == last) {
+                return;
+            }
+
+            bool need_decode = need_timestamps || !tr.cover(first->_min_ts, first->_max_ts)
+                               || !tr.cover((last - 1)->_min_ts, (last - 1)->_max_ts);
+            uint64_t global_offset = first->_offset;
+            const char* buf = nullptr;
+            if (need_decode) {
+                uint32_t global_size = (last - 1)->_offset + (last - 1)->_size - global_offset;
+                buf = data(global_offset, global_size, true);
+            }
+
+            for (auto it = first; it != last; ++it) {
+                BlockRange block_range {static_cast<uint32_t>(it - _time_index.begin()),
+                                        IndexRange(0, it->_count - 1), tr.cover(it->_min_ts, it->_max_ts), nullptr};
+                if (need_timestamps || !block_range._full) {
+                    block_range._timestamps = std::make_unique<TimestampDataBlock>();
+                    block_range._timestamps->decode_from_decompress(timestamp_block(buf, global_offset, it - _time_index.begin()));
+                    if (!block_range._full && !block_range._timestamps->get_range(tr, block_range._range)) {
+                        continue;
+                    }
+                }
+                block_ranges.emplace_back(std::move(block_range));
+            }
+        }
+
+        // decode the timestamps of a block range found without them
+        void decode_timestamps(BlockRange& block_range) const {
+            if (block_range._timestamps != nullptr) {
+                return;
+            }
+            const TimeIndexEntry& entry = _time_index[block_range._block_idx];
+            block_range._timestamps = std::make_unique<TimestampDataBlock>();
+            block_range._timestamps->decode_from_decompress(
+                    timestamp_block(data(entry._offset, entry._size), entry._offset, block_range._block_idx));
+        }
+
+        // decode the index of a tsm file written by any version, index_offset is only used by v1 files.
+        // throw if the index is corrupted or doesn't fit the file
+        void decode_from_file(uint32_t index_offset, SchemaSPtr schema) {
+            TsmFooter footer;
+            if (_size >= TsmFooter::ENCODED_SIZE) {
+                footer.decode_from(reinterpret_cast<const uint8_t*>(data(_size - TsmFooter::ENCODED_SIZE, TsmFooter::ENCODED_SIZE)));
+            }
+            if (_size < TsmFooter::ENCODED_SIZE || !footer.valid(_size)) {
+                if (unlikely(static_cast<uint64_t>(index_offset) + sizeof(uint32_t) > _size)) {
+                    ERR_LOG("index of tsm file %u lies outside of the file", _file_seq)
+                    throw std::runtime_error("tsm index out of bounds");
+                }
+                // the index without the trailing index offset
+                uint32_t index_size = _size - index_offset - sizeof(uint32_t);
+                const char* buf = data(index_offset, index_size, true);
+                _version = TSM_VERSION_1;
+                _decode_from(reinterpret_cast<const uint8_t*>(buf), index_offset, index_size, schema->columnTypeMap.size());
+                return;
+            }
+            if (unlikely(footer._version < TSM_VERSION_2 || footer._version > TSM_VERSION_3)) {
+                ERR_LOG("tsm file %u has unsupported version %u", _file_seq, footer._version)
+                throw std::runtime_error("unsupported tsm file version");
+            }
+            const char* buf = data(footer._index_offset, footer._index_size, true);
+            if (TSM_VERIFY_CHECKSUMS && unlikely(crc32c::value(buf, footer._index_size) != footer._index_crc)) {
+                ERR_LOG("index of tsm file %u is corrupted", _file_seq)
+                throw std::runtime_error("tsm index checksum mismatch");
+            }
+            _version = footer._version;
+            _decode_from(reinterpret_cast<const uint8_t*>(buf), footer._index_offset, footer._index_size,
+                         schema->columnTypeMap.size());
+            enable_checksums();
+        }
+
+    private:
+        // the index must hold exactly the entries of its block count, their blocks lie before the index
+        void _decode_from(const uint8_t *p, uint64_t index_offset, uint32_t index_size, size_t column_count) {
+            uint32_t block_count = index_size >= sizeof(uint32_t) ? decode_fixed<uint32_t>(p) : 0;
+            size_t expected_size = sizeof(uint32_t) + block_count * TimeIndexEntry::encoded_size(_version)
+                                   + column_count * block_count * IndexEntry::encoded_size(_version);
+            if (_version >= TSM_VERSION_2) {
+                expected_size += sizeof(uint16_t) + column_count * 2 * sizeof(uint64_t);
+            }
+            if (unlikely(block_count == 0 || expected_size != index_size)) {
+                ERR_LOG("index of tsm file %u has %u blocks in %u bytes", _file_seq, block_count, index_size)
+                throw std::runtime_error("tsm index corrupted");
+            }
+
+            _time_index.resize(block_count);
+            for (auto &time_index_entry: _time_index) {
+                time_index_entry.decode_from(p, _version);
+                _check_block(time_index_entry._offset, time_index_entry._size, index_offset);
+            }
+
+            if (_version >= TSM_VERSION_2) {
+                const uint8_t* column_directory = p;
+                uint16_t file_column_count = decode_fixed<uint16_t>(column_directory);
+                if (unlikely(file_column_count != column_count)) {
+                    ERR_LOG("tsm file %u holds %u columns, the schema %zu", _file_seq, file_column_count, column_count)
+                    throw std::runtime_error("tsm file doesn't match the schema");
+                }
+                // skip the column directory, the index blocks locate every block
+                p += sizeof(uint16_t) + column_count * 2 * sizeof(uint64_t);
+            }
+
+            // index blocks are written in column id order
+            _index_blocks.resize(column_count);
+            for (auto &index_block: _index_blocks) {
+                index_block.decode_from(p, block_count, _version);
+                for (const auto &index_entry: index_block._index_entries) {
+                    _check_block(index_entry._offset, index_entry._size, index_offset);
+                }
+            }
+        }
+
+        void _check_block(uint64_t offset, uint32_t size, uint64_t index_offset) const {
+            if (unlikely(size == 0 || offset + size > index_offset)) {
+                ERR_LOG("block at %lu of tsm file %u lies outside of its data", offset, _file_seq)
+                throw std::runtime_error("tsm index corrupted");
+            }
+        }
+
+        void _verify(size_t block_id, const char* block, uint32_t size, uint32_t crc) const {
+            if (!TSM_VERIFY_CHECKSUMS || _verified == nullptr || _verified[block_id].load(std::memory_order_relaxed)) {
+                return;
+            }
+            if (unlikely(crc32c::value(block, size) != crc)) {
+                ERR_LOG("block %zu of tsm file %u is corrupted", block_id, _file_seq)
+                throw std::runtime_error("tsm block checksum mismatch");
+            }
+            _verified[block_id].store(true, std::memory_order_relaxed);
+        }
+    };
+
+    // tsm files of one vin grouped by the time partition of their min ts, so queries only look at the partitions
+    // overlapping their time range. partitions are created on demand as files are added. a file written by
+    // tiered compaction spans several partitions, queries start looking that many partitions earlier.
     // multi thread safe
     class IndexManager {
     public:
@@ -31,32 +261,180 @@ namespace LindormContest {
 
         ~IndexManager() = default;
 
-        void query_indexes(uint16_t file_idx, const std::string& column_name, const TimeRange& file_tr,
-                           std::vector<IndexEntry>& index_entries, std::vector<IndexRange>& ranges) {
-            _index_entries[file_idx][column_name].get_index_entries_and_ranges(file_tr, index_entries, ranges);
-        }
-
-        void decode_from_file(const Path& vin_dir_path, SchemaSPtr schema) {
-            for (const auto& entry: std::filesystem::directory_iterator(vin_dir_path)) {
-                uint32_t file_size, index_offset;
-                TsmFile::get_size_and_offset(entry.path(), &file_size, &index_offset);
-                std::string buf;
-                uint32_t index_size = file_size - index_offset - sizeof(uint32_t);
-                io::stream_read_string_from_file(entry.path(), index_offset, index_size, buf);
-                uint16_t file_idx = std::stoi(entry.path().filename().string());
-                std::unordered_map<std::string, IndexBlock>& index_blocks = _index_entries[file_idx];
-                const uint8_t* p = reinterpret_cast<const uint8_t*>(buf.c_str());
-
-                for (const auto &[column_name, column_type]: schema->columnTypeMap) {
-                    IndexBlock index_block;
-                    index_block.decode_from(p);
-                    index_blocks.emplace(column_name, std::move(index_block));
+        // files whose time range overlaps tr ordered by partition and file seq,
+        // except the ones still readable from their mem tables
+        std::vector<FileIndexSPtr> get_files(const TimeRange& tr, const std::vector<uint32_t>& excluded_file_seqs) {
+            std::shared_lock<std::shared_mutex> l(_mutex);
+            std::vector<FileIndexSPtr> files;
+            if (tr.empty()) {
+                return files;
+            }
+            int64_t last_partition = get_time_partition(tr._end_time - 1);
+            _mark_queried(get_time_partition(tr._start_time), last_partition);
+
+            for (auto it = _find_partition(get_time_partition(tr._start_time) - _max_file_span);
+                 it != _partitions.end() && it->_partition <= last_partition; ++it) {
+                for (const auto &file: it->_files) {
+                    if (tr.overlap(file->min_ts(), file->max_ts())
+                        && std::find(excluded_file_seqs.begin(), excluded_file_seqs.end(), file->_file_seq) == excluded_file_seqs.end()) {
+                        files.emplace_back(file);
+                    }
                 }
             }
+
+            return files;
+        }
+
+        // files lying entirely inside partition_count partitions from partition, ordered by partition and file seq
+        std::vector<FileIndexSPtr> get_window_files(int64_t partition, int64_t partition_count) {
+            std::shared_lock<std::shared_mutex> l(_mutex);
+            std::vector<FileIndexSPtr> files;
+            for (auto it = _find_partition(partition); it != _partitions.end() && it->_partition < partition + partition_count; ++it) {
+                for (const auto &file: it->_files) {
+                    if (get_time_partition(file->max_ts()) < partition + partition_count) {
+                        files.emplace_back(file);
+                    }
+                }
+            }
+            return files;
+        }
+
+        // partitions of the files whose time ranges overlap, their rows have to be deduplicated
+        std::vector<int64_t> get_overlapping_partitions() {
+            std::shared_lock<std::shared_mutex> l(_mutex);
+            std::vector<FileIndexSPtr> files;
+            for (const auto &partition: _partitions) {
+                files.insert(files.end(), partition._files.begin(), partition._files.end());
+            }
+            std::vector<int64_t> partitions;
+            for (const auto &group: get_overlapping_groups(std::move(files))) {
+                for (const auto &file: group) {
+                    partitions.emplace_back(get_time_partition(file->min_ts()));
+                }
+            }
+            std::sort(partitions.begin(), partitions.end());
+            partitions.erase(std::unique(partitions.begin(), partitions.end()), partitions.end());
+            return partitions;
+        }
+
+        // groups of files whose time ranges overlap transitively, files without overlap are left out
+        static std::vector<std::vector<FileIndexSPtr>> get_overlapping_groups(std::vector<FileIndexSPtr> files) {
+            std::vector<std::vector<FileIndexSPtr>> groups;
+            std::sort(files.begin(), files.end(), [](const FileIndexSPtr& lhs, const FileIndexSPtr& rhs) {
+                return lhs->min_ts() < rhs->min_ts();
+            });
+            int64_t group_max_ts = 0;
+
+            for (size_t i = 0; i < files.size(); ++i) {
+                if (i == 0 || files[i]->min_ts() > group_max_ts) {
+                    if (!groups.empty() && groups.back().size() == 1) {
+                        groups.pop_back();
+                    }
+                    groups.emplace_back();
+                    group_max_ts = files[i]->max_ts();
+                }
+                group_max_ts = std::max(group_max_ts, files[i]->max_ts());
+                groups.back().emplace_back(files[i]);
+            }
+
+            if (!groups.empty() && groups.back().size() == 1) {
+                groups.pop_back();
+            }
+            return groups;
+        }
+
+        // return false if there is no tsm file
+        bool get_max_ts(int64_t& max_ts) {
+            std::shared_lock<std::shared_mutex> l(_mutex);
+            if (_partitions.empty()) {
+                return false;
+            }
+            max_ts = std::numeric_limits<int64_t>::lowest();
+            for (auto it = _find_partition(_partitions.back()._partition - _max_file_span); it != _partitions.end(); ++it) {
+                for (const auto &file: it->_files) {
+                    max_ts = std::max(max_ts, file->max_ts());
+                }
+            }
+            return true;
+        }
+
+        uint32_t next_file_seq() {
+            std::shared_lock<std::shared_mutex> l(_mutex);
+            return _next_file_seq;
+        }
+
+        void add_file(FileIndexSPtr file) {
+            std::lock_guard<std::shared_mutex> l(_mutex);
+            _add_file(std::move(file));
+        }
+
+        // publish the compacted files and drop their inputs in one step, so that queries see either
+        void replace_files(const std::vector<FileIndexSPtr>& input_files, std::vector<FileIndexSPtr> output_files) {
+            std::lock_guard<std::shared_mutex> l(_mutex);
+            for (const auto &input_file: input_files) {
+                auto it = _find_partition(get_time_partition(input_file->min_ts()));
+                assert(it != _partitions.end());
+                it->_files.erase(std::find(it->_files.begin(), it->_files.end(), input_file));
+                if (it->_files.empty()) {
+                    _partitions.erase(it);
+                }
+                input_file->_obsolete = true;
+            }
+            for (auto &output_file: output_files) {
+                _add_file(std::move(output_file));
+            }
+        }
+
+        // whether a query read one of partition_count partitions from partition during the last QUERY_HOT_MS
+        bool is_queried(int64_t partition, int64_t partition_count) const {
+            int64_t now_ms = _now_ms();
+            return now_ms - _last_query_ms.load(std::memory_order_relaxed) < QUERY_HOT_MS
+                   && partition <= _last_queried_partitions[1].load(std::memory_order_relaxed)
+                   && partition + partition_count > _last_queried_partitions[0].load(std::memory_order_relaxed);
         }
 
     private:
-        std::unordered_map<std::string, IndexBlock> _index_entries[TSM_FILE_COUNT];
+        static int64_t _now_ms() {
+            return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+        }
+
+        // only the partitions of the last query are kept, concurrent queries may mix up their bounds
+        void _mark_queried(int64_t first_partition, int64_t last_partition) {
+            _last_queried_partitions[0].store(first_partition, std::memory_order_relaxed);
+            _last_queried_partitions[1].store(last_partition, std::memory_order_relaxed);
+            _last_query_ms.store(_now_ms(), std::memory_order_relaxed);
+        }
+
+        struct Partition {
+            int64_t _partition;
+            std::vector<FileIndexSPtr> _files; // ordered by file seq
+        };
+
+        // the first partition not before partition
+        std::vector<Partition>::iterator _find_partition(int64_t partition) {
+            return std::partition_point(_partitions.begin(), _partitions.end(),
+                                        [&](const Partition& p) { return p._partition < partition; });
+        }
+
+        void _add_file(FileIndexSPtr file) {
+            int64_t partition = get_time_partition(file->min_ts());
+            auto it = _find_partition(partition);
+            if (it == _partitions.end() || it->_partition != partition) {
+                it = _partitions.insert(it, Partition {partition, {}});
+            }
+            auto file_it = std::upper_bound(it->_files.begin(), it->_files.end(), file->_file_seq,
+                                            [](uint32_t file_seq, const FileIndexSPtr& other) { return file_seq < other->_file_seq; });
+            _next_file_seq = std::max(_next_file_seq, file->_file_seq + 1);
+            _max_file_span = std::max(_max_file_span, get_time_partition(file->max_ts()) - partition);
+            it->_files.insert(file_it, std::move(file));
+        }
+
+        std::vector<Partition> _partitions; // ordered by partition
+        uint32_t _next_file_seq = 0;
+        int64_t _max_file_span = 0; // partitions past the one of its min ts a file reaches, never shrinks
+        std::shared_mutex _mutex;
+        std::atomic<int64_t> _last_queried_partitions[2] {0, -1}; // first and last
+        std::atomic<int64_t> _last_query_ms {std::numeric_limits<int64_t>::lowest() / 2};
     };
 
     class GlobalIndexManager;
@@ -69,19 +447,82 @@ namespace LindormContest {
 
         ~GlobalIndexManager() = default;
 
-        void query_indexes(uint16_t vin_num, uint16_t file_idx, const std::string& column_name,
-                           const TimeRange& file_tr, std::vector<IndexEntry>& index_entries, std::vector<IndexRange>& ranges) {
-            _index_managers[vin_num].query_indexes(file_idx, column_name, file_tr, index_entries, ranges);
+        std::vector<FileIndexSPtr> get_files(VinId vin_id, const TimeRange& tr, const std::vector<uint32_t>& excluded_file_seqs) {
+            return _index_managers[vin_id].get_files(tr, excluded_file_seqs);
+        }
+
+        std::vector<FileIndexSPtr> get_window_files(VinId vin_id, int64_t partition, int64_t partition_count) {
+            return _index_managers[vin_id].get_window_files(partition, partition_count);
+        }
+
+        bool is_queried(VinId vin_id, int64_t partition, int64_t partition_count) {
+            return _index_managers[vin_id].is_queried(partition, partition_count);
+        }
+
+        std::vector<int64_t> get_overlapping_partitions(VinId vin_id) {
+            return _index_managers[vin_id].get_overlapping_partitions();
+        }
+
+        bool get_max_ts(VinId vin_id, int64_t& max_ts) {
+            return _index_managers[vin_id].get_max_ts(max_ts);
+        }
+
+        uint32_t next_file_seq(VinId vin_id) {
+            return _index_managers[vin_id].next_file_seq();
+        }
+
+        void add_file(VinId vin_id, FileIndexSPtr file) {
+            _index_managers[vin_id].add_file(std::move(file));
+        }
+
+        void replace_files(VinId vin_id, const std::vector<FileIndexSPtr>& input_files, std::vector<FileIndexSPtr> output_files) {
+            _index_managers[vin_id].replace_files(input_files, std::move(output_files));
         }
 
-        void decode_from_file(const Path& root_path, SchemaSPtr schema) {
-            for (uint16_t vin_num = 0; vin_num < VIN_NUM_RANGE; ++vin_num) {
-                Path vin_dir_path = root_path / "compaction" / std::to_string(vin_num);
-                _index_managers[vin_num].decode_from_file(vin_dir_path, schema);
+        // load the indexes of the tsm files in the segments, vins are numbered densely below vin_count.
+        // the indexes are decoded by the pool, return the wal checkpoint of the manifest. throw if the index
+        // of a file is corrupted, the file is left in its segment and nothing is loaded
+        uint32_t decode_from_segments(GlobalSegmentManager& segment_manager, SchemaSPtr schema, VinId vin_count, ThreadPool& pool) {
+            std::vector<std::pair<SegmentSPtr, SegmentEntry>> entries;
+            uint32_t wal_checkpoint = segment_manager.recover([&](const SegmentSPtr& segment, const SegmentEntry& entry) {
+                if (unlikely(entry._vin_id >= vin_count)) {
+                    ERR_LOG("segment %u holds a file of unknown vin %u", segment->segment_seq(), entry._vin_id)
+                    return;
+                }
+                entries.emplace_back(segment, entry);
+            });
+
+            std::vector<FileIndexSPtr> files(entries.size());
+            std::atomic<size_t> corrupted_count {0};
+            pool.parallel_for(entries.size(), [&](size_t i) {
+                const auto &[segment, entry] = entries[i];
+                auto file = std::make_shared<FileIndex>();
+                file->_file_seq = entry._file_seq;
+                file->_segment = segment;
+                file->_offset = entry._offset;
+                file->_size = entry._size;
+                try {
+                    file->decode_from_file(entry._index_offset, schema);
+                } catch (const std::exception& e) {
+                    ERR_LOG("tsm file %u of vin %u in segment %u can't be loaded: %s", entry._file_seq, entry._vin_id,
+                            segment->segment_seq(), e.what())
+                    corrupted_count.fetch_add(1, std::memory_order_relaxed);
+                    return;
+                }
+                files[i] = std::move(file);
+            });
+            if (unlikely(corrupted_count.load() > 0)) {
+                throw std::runtime_error(std::to_string(corrupted_count.load()) + " tsm files can't be loaded");
+            }
+            for (size_t i = 0; i < entries.size(); ++i) {
+                if (likely(files[i] != nullptr)) {
+                    _index_managers[entries[i].second._vin_id].add_file(std::move(files[i]));
+                }
             }
+            return wal_checkpoint;
         }
 
     private:
-        IndexManager _index_managers[VIN_NUM_RANGE];
+        VinArray<IndexManager> _index_managers;
     };
-}
\ No newline at end of file
+}
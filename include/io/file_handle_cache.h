@@ -0,0 +1,154 @@
+/*
+ * Copyright Alibaba Group Holding Ltd.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <list>
+#include <mutex>
+#include <unordered_map>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "base.h"
+#include "common/spinlock.h"
+
+namespace LindormContest {
+
+    class FileHandle;
+
+    using FileHandleSPtr = std::shared_ptr<FileHandle>;
+
+    // an open file, closed once the cache has evicted it and the last user is done.
+    // positional reads and writes, so any number of threads share it
+    class FileHandle {
+    public:
+        FileHandle(const Path& path, int flags) {
+            _fd = ::open(path.c_str(), flags, 0644);
+            if (_fd < 0) {
+                throw std::runtime_error("open file failed");
+            }
+        }
+
+        ~FileHandle() {
+            ::close(_fd);
+        }
+
+        FileHandle(const FileHandle&) = delete;
+        FileHandle& operator=(const FileHandle&) = delete;
+
+        int fd() const {
+            return _fd;
+        }
+
+        // read size bytes at offset, a read past the end of the file leaves buf shorter
+        void read(uint64_t offset, uint32_t size, std::string& buf) const {
+            buf.resize(size);
+            size_t done = 0;
+            while (done < size) {
+                ssize_t n = ::pread(_fd, buf.data() + done, size - done, static_cast<off_t>(offset + done));
+                if (n < 0) {
+                    if (errno == EINTR) {
+                        continue;
+                    }
+                    throw std::runtime_error("read file failed");
+                }
+                if (n == 0) {
+                    break;
+                }
+                done += n;
+            }
+            buf.resize(done);
+        }
+
+    private:
+        int _fd;
+    };
+
+    class FileHandleCache;
+
+    using FileHandleCacheSPtr = std::shared_ptr<FileHandleCache>;
+
+    // open files by id, at most fd_budget of them are kept open. the cache is split into shards
+    // by id, each shard evicts its least recently used file once it holds its share of the budget.
+    // a file in use when it is evicted is closed by its last user.
+    // multi thread safe
+    class FileHandleCache {
+    public:
+        explicit FileHandleCache(size_t fd_budget = FILE_HANDLE_BUDGET) {
+            // a shard keeps at least one file open
+            for (auto &shard: _shards) {
+                shard._capacity = std::max<size_t>(fd_budget / SHARD_NUM, 1);
+            }
+        }
+
+        ~FileHandleCache() = default;
+
+        // the cached file of id, opened from path with flags on a miss
+        FileHandleSPtr get(uint32_t id, const Path& path, int flags) {
+            Shard& shard = _shards[id % SHARD_NUM];
+            {
+                std::lock_guard<SpinLock> l(shard._lock);
+                auto it = shard._handles.find(id);
+                if (likely(it != shard._handles.end())) {
+                    shard._lru.splice(shard._lru.begin(), shard._lru, it->second);
+                    return it->second->second;
+                }
+            }
+
+            // open outside the lock, a racing open of the same id loses and is closed again
+            auto handle = std::make_shared<FileHandle>(path, flags);
+            FileHandleSPtr evicted; // closed after the lock is released
+            std::lock_guard<SpinLock> l(shard._lock);
+            auto it = shard._handles.find(id);
+            if (it != shard._handles.end()) {
+                return it->second->second;
+            }
+            shard._lru.emplace_front(id, handle);
+            shard._handles.emplace(id, shard._lru.begin());
+            if (shard._lru.size() > shard._capacity) {
+                evicted = std::move(shard._lru.back().second);
+                shard._handles.erase(shard._lru.back().first);
+                shard._lru.pop_back();
+            }
+            return handle;
+        }
+
+        // drop the file of id, e.g. before it is removed
+        void erase(uint32_t id) {
+            Shard& shard = _shards[id % SHARD_NUM];
+            FileHandleSPtr erased; // closed after the lock is released
+            std::lock_guard<SpinLock> l(shard._lock);
+            auto it = shard._handles.find(id);
+            if (it != shard._handles.end()) {
+                erased = std::move(it->second->second);
+                shard._lru.erase(it->second);
+                shard._handles.erase(it);
+            }
+        }
+
+    private:
+        static constexpr size_t SHARD_NUM = 16;
+
+        struct Shard {
+            SpinLock _lock;
+            size_t _capacity;
+            std::list<std::pair<uint32_t, FileHandleSPtr>> _lru; // most recently used first
+            std::unordered_map<uint32_t, std::list<std::pair<uint32_t, FileHandleSPtr>>::iterator> _handles;
+        };
+
+        Shard _shards[SHARD_NUM];
+    };
+
+}
@@ -15,6 +15,7 @@
 
 #pragma once
 
+#include <algorithm>
 #include <fstream>
 #include <cstring>
 #include <sys/mman.h>
@@ -26,7 +27,7 @@
 
 namespace LindormContest::io {
 
-    static void stream_write_string_to_file(const Path &file_path, const std::string &buf) {
+    inline void stream_write_string_to_file(const Path &file_path, const std::string &buf) {
         std::ofstream output_file(file_path, std::ios::out | std::ios::binary);
         if (!output_file.is_open() || !output_file.good()) {
             throw std::runtime_error("open file failed");
@@ -35,7 +36,7 @@ namespace LindormContest::io {
         output_file.close();
     }
 
-    static void stream_read_string_from_file(const Path &file_path, std::string &buf) {
+    inline void stream_read_string_from_file(const Path &file_path, std::string &buf) {
         std::ifstream input_file(file_path, std::ios::in | std::ios::binary);
         if (!input_file.is_open() || !input_file.good()) {
             throw std::runtime_error("open file failed");
@@ -48,7 +49,7 @@ namespace LindormContest::io {
         input_file.close();
     }
 
-    static void stream_read_string_from_file(const Path &file_path, uint32_t offset, uint32_t size, std::string &buf) {
+    inline void stream_read_string_from_file(const Path &file_path, uint64_t offset, uint32_t size, std::string &buf) {
         std::ifstream input_file(file_path, std::ios::in | std::ios::binary);
         if (!input_file.is_open() || !input_file.good()) {
             throw std::runtime_error("open file failed");
@@ -60,68 +61,32 @@ namespace LindormContest::io {
         input_file.close();
     }
 
-    static uint32_t serialize_row(const Row &row, char *buf) {
-        uint32_t row_length = 0;
-        *reinterpret_cast<int64_t *>(buf) = row.timestamp;
-        row_length += sizeof(int64_t);
-
-        for (const auto &item: row.columns) {
-            uint32_t raw_size = item.second.getRawDataSize();
-            std::memcpy(buf + row_length, item.second.columnData, raw_size);
-            row_length += raw_size;
-        }
-
-        return row_length;
-    }
-
-    static inline void serialize_row(const Row &row, bool vin_include, std::string &buf) {
-        if (vin_include) {
-            buf.append(row.vin.vin, VIN_LENGTH);
+    // the seq of a regular file named by its seq, like the wal and segment files. false for any other
+    // entry, e.g. an editor backup or a leftover tmp file
+    inline bool parse_seq_file_name(const std::filesystem::directory_entry &entry, uint32_t &seq) {
+        std::string file_name = entry.path().filename().string();
+        if (!entry.is_regular_file() || file_name.empty() || file_name.size() > 10
+            || !std::all_of(file_name.begin(), file_name.end(), [](char c) { return c >= '0' && c <= '9'; })) {
+            return false;
         }
-        buf.append((const char *) &row.timestamp, sizeof(int64_t));
-
-        for (const auto &item: row.columns) {
-            buf.append(item.second.columnData, item.second.getRawDataSize());
+        uint64_t value = std::stoull(file_name);
+        if (value > std::numeric_limits<uint32_t>::max()) {
+            return false;
         }
+        seq = static_cast<uint32_t>(value);
+        return true;
     }
 
-    static inline void deserialize_row(SchemaSPtr schema, const char *&p, bool vin_include, Row &row) {
-        if (vin_include) {
-            std::memcpy(row.vin.vin, p, VIN_LENGTH);
-            p += VIN_LENGTH;
+    // make the files created in the directory durable, fdatasync on a file doesn't persist its directory entry
+    inline void sync_dir(const Path &dir_path) {
+        int dir_fd = ::open(dir_path.c_str(), O_RDONLY | O_DIRECTORY);
+        if (dir_fd < 0) {
+            throw std::runtime_error("open dir failed");
         }
-
-        row.timestamp = *reinterpret_cast<const int64_t *>(p);
-        p += sizeof(int64_t);
-
-        for (const auto &[column_name, column_type]: schema->columnTypeMap) {
-            switch (column_type) {
-                case COLUMN_TYPE_INTEGER: {
-                    int32_t int_value = *reinterpret_cast<const int32_t *>(p);
-                    p += sizeof(int32_t);
-                    ColumnValue column_value(int_value);
-                    row.columns.emplace(column_name, std::move(column_value));
-                    break;
-                }
-                case COLUMN_TYPE_DOUBLE_FLOAT: {
-                    double_t double_value = *reinterpret_cast<const double_t *>(p);
-                    p += sizeof(double_t);
-                    ColumnValue column_value(double_value);
-                    row.columns.emplace(column_name, std::move(column_value));
-                    break;
-                }
-                case COLUMN_TYPE_STRING: {
-                    int32_t str_length = *reinterpret_cast<const int32_t *>(p);
-                    p += sizeof(int32_t);
-                    ColumnValue column_value(p, str_length);
-                    p += str_length;
-                    row.columns.emplace(column_name, std::move(column_value));
-                    break;
-                }
-                default: {
-                    throw std::runtime_error("Undefined column type, this is not expected");
-                }
-            }
+        bool ok = ::fsync(dir_fd) == 0;
+        ::close(dir_fd);
+        if (!ok) {
+            throw std::runtime_error("sync dir failed");
         }
     }
-}
\ No newline at end of file
+}
@@ -0,0 +1,243 @@
+/*
+ * Copyright Alibaba Group Holding Ltd.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <cassert>
+#include <algorithm>
+#include <cstring>
+#include <set>
+#include <unordered_map>
+
+#include "base.h"
+#include "struct/Row.h"
+#include "struct/Schema.h"
+#include "struct/Requests.h"
+
+namespace LindormContest {
+
+    class RowCodec;
+
+    using RowCodecSPtr = std::shared_ptr<RowCodec>;
+
+    // row codec compiled from the schema once. columns get dense ids in column name order,
+    // which is also the order of Row::columns, so rows are walked by position without name lookups.
+    // encoded row: [vin][timestamp][fixed section][string bytes], where the fixed section holds
+    // every integer, double and string length at an offset precomputed per column.
+    // multi thread safe
+    class RowCodec {
+    public:
+        RowCodec(SchemaSPtr schema) {
+            _row_width = VIN_LENGTH + sizeof(int64_t);
+
+            for (const auto &[column_name, column_type]: schema->columnTypeMap) {
+                _column_ids.emplace(column_name, _columns.size());
+                _columns.push_back({column_name, column_type, static_cast<uint32_t>(_row_width)});
+                // integers and the lengths of strings take 4 bytes
+                _row_width += column_type == COLUMN_TYPE_DOUBLE_FLOAT ? sizeof(double_t) : sizeof(int32_t);
+            }
+        }
+
+        ~RowCodec() = default;
+
+        // encoded size of one row without its string bytes
+        size_t row_width() const {
+            return _row_width;
+        }
+
+        uint16_t column_count() const {
+            return _columns.size();
+        }
+
+        uint16_t column_id(const std::string& column_name) const {
+            return _column_ids.at(column_name);
+        }
+
+        // return false if the schema has no such column
+        bool find_column(const std::string& column_name, uint16_t& column_id) const {
+            auto it = _column_ids.find(column_name);
+            if (it == _column_ids.end()) {
+                return false;
+            }
+            column_id = it->second;
+            return true;
+        }
+
+        // ids of the columns in ascending order, since requested_columns is sorted by name
+        std::vector<uint16_t> column_ids(const std::set<std::string>& requested_columns) const {
+            std::vector<uint16_t> ids;
+            ids.reserve(requested_columns.size());
+            for (const auto &column_name: requested_columns) {
+                ids.emplace_back(column_id(column_name));
+            }
+            return ids;
+        }
+
+        const std::string& column_name(uint16_t column_id) const {
+            return _columns[column_id]._name;
+        }
+
+        ColumnType column_type(uint16_t column_id) const {
+            return _columns[column_id]._type;
+        }
+
+        // the row must have a value for every column of the schema.
+        // Batch is RowBatch or ColumnarBatch
+        template <typename Batch>
+        void encode(const Batch& batch, size_t row_idx, std::string& buf) const {
+            size_t row_offset = buf.size();
+            buf.resize(row_offset + _row_width);
+            std::memcpy(buf.data() + row_offset, batch.vin(row_idx).vin, VIN_LENGTH);
+            int64_t timestamp = batch.timestamp(row_idx);
+            std::memcpy(buf.data() + row_offset + VIN_LENGTH, &timestamp, sizeof(int64_t));
+
+            batch.visit(row_idx, [&](uint16_t column_id, const char* value, int32_t str_length) {
+                const Column& column = _columns[column_id];
+                // appending strings may move the buffer
+                char* fixed = buf.data() + row_offset;
+                switch (column._type) {
+                    case COLUMN_TYPE_INTEGER:
+                        std::memcpy(fixed + column._offset, value, sizeof(int32_t));
+                        break;
+                    case COLUMN_TYPE_DOUBLE_FLOAT:
+                        std::memcpy(fixed + column._offset, value, sizeof(double_t));
+                        break;
+                    case COLUMN_TYPE_STRING:
+                        std::memcpy(fixed + column._offset, &str_length, sizeof(int32_t));
+                        buf.append(value, str_length);
+                        break;
+                    default:
+                        break;
+                }
+            });
+        }
+
+        void decode(const char*& p, Row& row) const {
+            const char* fixed = p;
+            const char* str = p + _row_width;
+            std::memcpy(row.vin.vin, fixed, VIN_LENGTH);
+            std::memcpy(&row.timestamp, fixed + VIN_LENGTH, sizeof(int64_t));
+
+            for (const auto &column: _columns) {
+                const char* value = fixed + column._offset;
+                switch (column._type) {
+                    case COLUMN_TYPE_INTEGER:
+                        row.columns.emplace_hint(row.columns.end(), column._name, *reinterpret_cast<const int32_t*>(value));
+                        break;
+                    case COLUMN_TYPE_DOUBLE_FLOAT:
+                        row.columns.emplace_hint(row.columns.end(), column._name, *reinterpret_cast<const double_t*>(value));
+                        break;
+                    case COLUMN_TYPE_STRING: {
+                        int32_t str_length = *reinterpret_cast<const int32_t*>(value);
+                        row.columns.emplace_hint(row.columns.end(), column._name, ColumnValue(str, str_length));
+                        str += str_length;
+                        break;
+                    }
+                    default:
+                        throw std::runtime_error("Undefined column type, this is not expected");
+                }
+            }
+
+            p = str;
+        }
+
+    private:
+        struct Column {
+            std::string _name;
+            ColumnType _type;
+            uint32_t _offset; // of the value or the string length inside the encoded row
+        };
+
+        std::vector<Column> _columns;
+        std::unordered_map<std::string, uint16_t> _column_ids;
+        size_t _row_width;
+    };
+
+    // rows of a WriteRequest, visited by position in column id order
+    struct RowBatch {
+        const Row* _rows;
+
+        const Vin& vin(size_t row_idx) const {
+            return _rows[row_idx].vin;
+        }
+
+        int64_t timestamp(size_t row_idx) const {
+            return _rows[row_idx].timestamp;
+        }
+
+        // visitor(column_id, value, str_length), value points to the string bytes for strings
+        template <typename F>
+        void visit(size_t row_idx, F&& visitor) const {
+            uint16_t column_id = 0;
+            for (const auto &[column_name, column_value]: _rows[row_idx].columns) {
+                const char* column_data = column_value.columnData;
+                if (column_value.columnType == COLUMN_TYPE_STRING) {
+                    visitor(column_id++, column_data + sizeof(int32_t), *reinterpret_cast<const int32_t*>(column_data));
+                } else {
+                    visitor(column_id++, column_data, 0);
+                }
+            }
+        }
+    };
+
+    // rows of a ColumnarWriteRequest, the values are read from the caller's buffers in place
+    struct ColumnarBatch {
+        const ColumnarWriteRequest& _request;
+        std::vector<const ColumnarColumn*> _columns; // by column id
+
+        // return false if the request doesn't carry every column of the schema
+        bool init(const RowCodec& row_codec) {
+            _columns.assign(row_codec.column_count(), nullptr);
+            for (const auto &column: _request.columns) {
+                uint16_t column_id;
+                if (!row_codec.find_column(column.columnName, column_id) || row_codec.column_type(column_id) != column.columnType) {
+                    return false;
+                }
+                _columns[column_id] = &column;
+            }
+            return std::find(_columns.begin(), _columns.end(), nullptr) == _columns.end();
+        }
+
+        const Vin& vin(size_t row_idx) const {
+            return _request.vins[row_idx];
+        }
+
+        int64_t timestamp(size_t row_idx) const {
+            return _request.timestamps[row_idx];
+        }
+
+        template <typename F>
+        void visit(size_t row_idx, F&& visitor) const {
+            for (uint16_t column_id = 0; column_id < _columns.size(); ++column_id) {
+                const ColumnarColumn& column = *_columns[column_id];
+                switch (column.columnType) {
+                    case COLUMN_TYPE_INTEGER:
+                        visitor(column_id, reinterpret_cast<const char*>(column.intValues + row_idx), 0);
+                        break;
+                    case COLUMN_TYPE_DOUBLE_FLOAT:
+                        visitor(column_id, reinterpret_cast<const char*>(column.doubleValues + row_idx), 0);
+                        break;
+                    case COLUMN_TYPE_STRING:
+                        visitor(column_id, column.stringData + column.stringOffsets[row_idx],
+                                column.stringOffsets[row_idx + 1] - column.stringOffsets[row_idx]);
+                        break;
+                    default:
+                        break;
+                }
+            }
+        }
+    };
+
+}
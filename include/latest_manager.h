@@ -26,17 +26,20 @@
 #include "struct/ColumnValue.h"
 #include "common/coding.h"
 #include "common/spinlock.h"
+#include "common/segmented_array.h"
 #include "io/io_utils.h"
+#include "storage/mem_table.h"
 
 namespace LindormContest {
 
     class GlobalLatestManager;
 
-    using GlobalLatestManagerUPtr = std::unique_ptr<GlobalLatestManager>;
+    using GlobalLatestManagerSPtr = std::shared_ptr<GlobalLatestManager>;
 
+    // multi thread safe
     class GlobalLatestManager {
     public:
-        GlobalLatestManager(const Path& root_path, bool finish_compaction) : _root_path(root_path) {}
+        GlobalLatestManager(GlobalMemTableManagerSPtr mem_table_manager) : _mem_table_manager(mem_table_manager) {}
 
         ~GlobalLatestManager() = default;
 
@@ -44,85 +47,64 @@ namespace LindormContest {
             _schema = schema;
         }
 
-        template <bool finish_compaction>
-        void query_latest(uint16_t vin_num, const std::set<std::string>& requested_columns, Row &result_row) {
-            if constexpr (finish_compaction) {
-                result_row.timestamp = _latest_records[vin_num].timestamp;
+        // return false if the vin has no data
+        bool query_latest(VinId vin_id, const std::set<std::string>& requested_columns, Row &result_row) {
+            bool found = false;
+            uint32_t file_seq = 0;
 
-                for (const auto& requested_column : requested_columns) {
-                    result_row.columns[requested_column] = _latest_records[vin_num].columns.at(requested_column);
-                }
-            } else {
+            // the larger file seq holds the later write and wins on the same timestamp
+            for (const auto &mem_table: _mem_table_manager->get_mem_tables(vin_id)) {
                 Row latest_row;
-
-                for (uint16_t file_idx = 0; file_idx < TSM_FILE_COUNT; ++file_idx) {
-                    Path flush_file_path = _root_path / "no-compaction" / std::to_string(vin_num) / std::to_string(file_idx);
-                    query_from_one_flush_file(flush_file_path, latest_row);
+                if (mem_table->get_latest_row(requested_columns, latest_row)
+                    && (!found || _is_newer(latest_row.timestamp, mem_table->file_seq(), result_row.timestamp, file_seq))) {
+                    found = true;
+                    file_seq = mem_table->file_seq();
+                    result_row.timestamp = latest_row.timestamp;
+                    result_row.columns = std::move(latest_row.columns);
                 }
+            }
 
-                result_row.timestamp = latest_row.timestamp;
+            LatestRecord& record = _latest_records[vin_id];
+            std::lock_guard<SpinLock> l(record._lock);
+            const Row& latest_record = record._row;
 
+            if (record._exists && (!found || _is_newer(latest_record.timestamp, record._file_seq, result_row.timestamp, file_seq))) {
+                found = true;
+                result_row.timestamp = latest_record.timestamp;
+                result_row.columns.clear();
                 for (const auto& requested_column : requested_columns) {
-                    result_row.columns.emplace(requested_column, latest_row.columns.at(requested_column));
+                    result_row.columns.emplace(requested_column, latest_record.columns.at(requested_column));
                 }
             }
-        }
-
-        void query_from_one_flush_file(const Path& flush_file_path, Row &latest_row) {
-            std::string buf;
-            io::stream_read_string_from_file(flush_file_path, buf);
 
-            if (buf.empty()) {
-                return;
-            }
-
-            const char* start = buf.c_str();
-            const char* end = start + buf.size();
+            return found;
+        }
 
-            while (start < end) {
-                Row row;
-                io::deserialize_row(_schema, start, false, row);
-                if (row.timestamp > latest_row.timestamp) {
-                    latest_row = row;
-                }
+        // latest row of the converted tsm files, file_seq is the seq of the file holding it
+        void update_latest_row(VinId vin_id, const Row& latest_row, uint32_t file_seq) {
+            LatestRecord& record = _latest_records[vin_id];
+            std::lock_guard<SpinLock> l(record._lock);
+            if (!record._exists || _is_newer(latest_row.timestamp, file_seq, record._row.timestamp, record._file_seq)) {
+                record._row = latest_row;
+                record._file_seq = file_seq;
+                record._exists = true;
             }
         }
 
-        void set_latest_row(uint16_t vin_num, const Row& latest_row) {
-            _latest_records[vin_num] = latest_row;
+    private:
+        struct LatestRecord {
+            SpinLock _lock;
+            Row _row;
+            uint32_t _file_seq = 0;
+            bool _exists = false;
+        };
+
+        static bool _is_newer(int64_t ts, uint32_t file_seq, int64_t other_ts, uint32_t other_file_seq) {
+            return ts > other_ts || (ts == other_ts && file_seq > other_file_seq);
         }
 
-        // void load_latest_records_from_file(const Path& latest_records_path) {
-        //     if (!std::filesystem::exists(latest_records_path)) {
-        //         INFO_LOG("latest_records file doesn't exist")
-        //         return;
-        //     }
-        //     std::ifstream input_file(latest_records_path, std::ios::in | std::ios::binary);
-        //     if (!input_file.is_open()) {
-        //         INFO_LOG("latest_records file doesn't exist")
-        //         return;
-        //     }
-        //     std::string buf;
-        //     input_file.seekg(0, std::ios::end);
-        //     auto file_size = input_file.tellg();
-        //     input_file.seekg(0, std::ios::beg);
-        //     buf.resize(file_size);
-        //     input_file.read(buf.data(), file_size);
-        //     const char* p = buf.c_str();
-        //
-        //     for (uint16_t i = 0; i < VIN_NUM_RANGE; ++i) {
-        //         Row row;
-        //         io::deserialize_row(_schema, p, true, row);
-        //         uint16_t vin_num = decode_vin(row.vin);
-        //         _latest_records[vin_num] = row;
-        //     }
-        //
-        //     input_file.close();
-        // }
-
-    private:
-        Path _root_path;
         SchemaSPtr _schema;
-        Row _latest_records[VIN_NUM_RANGE];
+        GlobalMemTableManagerSPtr _mem_table_manager;
+        VinArray<LatestRecord> _latest_records;
     };
-}
\ No newline at end of file
+}
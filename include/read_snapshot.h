@@ -0,0 +1,134 @@
+/*
+ * Copyright Alibaba Group Holding Ltd.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include "common/time_range.h"
+#include "index_manager.h"
+#include "storage/mem_table.h"
+
+namespace LindormContest {
+
+    // timestamps of a source which are rewritten by a newer source, sorted
+    struct ShadowSet {
+        std::vector<int64_t> _timestamps;
+
+        bool empty() const {
+            return _timestamps.empty();
+        }
+
+        bool contains(int64_t ts) const {
+            return std::binary_search(_timestamps.begin(), _timestamps.end(), ts);
+        }
+
+        // some timestamp inside [min_ts, max_ts] is shadowed
+        bool overlap(int64_t min_ts, int64_t max_ts) const {
+            auto it = std::lower_bound(_timestamps.begin(), _timestamps.end(), min_ts);
+            return it != _timestamps.end() && *it <= max_ts;
+        }
+    };
+
+    // the mem tables and tsm files of one vin a query reads. the same timestamp may live in several
+    // of them when late rows rewrite it, the source with the largest file seq holds the last write
+    // and shadows the row of the others. shadows are only computed when the sources overlap in time,
+    // which is rare, so the usual query pays for one sort of its sources
+    struct ReadSnapshot {
+        std::vector<MemTableSPtr> _mem_tables;
+        std::vector<ShadowSet> _mem_table_shadows;
+        std::vector<FileIndexSPtr> _files;
+        std::vector<ShadowSet> _file_shadows;
+        TimeRange _ts_range; // spans the rows inside the time range when taken, empty without any
+
+        // the mem tables are taken before the files, a mem table converted in between
+        // is then found in both places and its file is skipped by file seq
+        void take(VinId vin_id, const TimeRange& tr, GlobalMemTableManager& mem_table_manager,
+                  GlobalIndexManager& index_manager) {
+            _mem_tables = mem_table_manager.get_mem_tables(vin_id);
+            _files = index_manager.get_files(vin_id, tr, GlobalMemTableManager::get_file_seqs(_mem_tables));
+            _mem_table_shadows.assign(_mem_tables.size(), {});
+            _file_shadows.assign(_files.size(), {});
+
+            std::vector<Source> sources;
+            for (size_t i = 0; i < _mem_tables.size(); ++i) {
+                Source source {_mem_tables[i]->file_seq(), 0, 0, i, false};
+                if (_mem_tables[i]->get_ts_range(source._min_ts, source._max_ts) && tr.overlap(source._min_ts, source._max_ts)) {
+                    sources.emplace_back(source);
+                }
+            }
+            for (size_t i = 0; i < _files.size(); ++i) {
+                sources.push_back({_files[i]->_file_seq, _files[i]->min_ts(), _files[i]->max_ts(), i, true});
+            }
+            _ts_range = {tr._start_time, tr._start_time};
+            for (auto &source: sources) {
+                source._min_ts = std::max(source._min_ts, tr._start_time);
+                source._max_ts = std::min(source._max_ts, tr._end_time - 1);
+                if (_ts_range.empty()) {
+                    _ts_range = {source._min_ts, source._max_ts + 1};
+                } else {
+                    _ts_range = {std::min(_ts_range._start_time, source._min_ts), std::max(_ts_range._end_time, source._max_ts + 1)};
+                }
+            }
+
+            std::sort(sources.begin(), sources.end(), [](const Source& lhs, const Source& rhs) {
+                return lhs._min_ts < rhs._min_ts;
+            });
+            bool overlapped = false;
+            for (size_t i = 1; i < sources.size() && !overlapped; ++i) {
+                overlapped = sources[i]._min_ts <= sources[i - 1]._max_ts;
+            }
+            if (likely(!overlapped)) {
+                return;
+            }
+
+            for (const auto &source: sources) {
+                ShadowSet& shadow = source._is_file ? _file_shadows[source._idx] : _mem_table_shadows[source._idx];
+                for (const auto &newer: sources) {
+                    if (newer._file_seq <= source._file_seq || newer._min_ts > source._max_ts || source._min_ts > newer._max_ts) {
+                        continue;
+                    }
+                    TimeRange overlap_tr(std::max(source._min_ts, newer._min_ts), std::min(source._max_ts, newer._max_ts) + 1);
+                    _get_timestamps(newer, overlap_tr, shadow._timestamps);
+                }
+                std::sort(shadow._timestamps.begin(), shadow._timestamps.end());
+                shadow._timestamps.erase(std::unique(shadow._timestamps.begin(), shadow._timestamps.end()), shadow._timestamps.end());
+            }
+        }
+
+    private:
+        struct Source {
+            uint32_t _file_seq;
+            int64_t _min_ts; // clamped to the time range of the query
+            int64_t _max_ts;
+            size_t _idx;
+            bool _is_file;
+        };
+
+        void _get_timestamps(const Source& source, const TimeRange& tr, std::vector<int64_t>& timestamps) const {
+            if (!source._is_file) {
+                _mem_tables[source._idx]->get_timestamps(tr, timestamps);
+                return;
+            }
+            const FileIndex& file = *_files[source._idx];
+            std::vector<BlockRange> block_ranges;
+            file.get_block_ranges(tr, true, block_ranges);
+            for (const auto &block_range: block_ranges) {
+                for (uint16_t i = block_range._range._start_index; i <= block_range._range._end_index; ++i) {
+                    timestamps.emplace_back(block_range._timestamps->_timestamps[i]);
+                }
+            }
+        }
+    };
+
+}
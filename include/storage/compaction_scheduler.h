@@ -0,0 +1,237 @@
+/*
+ * Copyright Alibaba Group Holding Ltd.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <queue>
+#include <thread>
+
+#include "base.h"
+
+namespace LindormContest {
+
+    struct CompactionSchedulerOptions {
+        uint16_t _thread_num = POOL_THREAD_NUM;
+        double _write_bytes_per_sec = BACKGROUND_WRITE_BYTES_PER_SEC; // 0 leaves background writes unlimited
+    };
+
+    struct CompactionSchedulerMetrics {
+        size_t _queued_tasks;
+        size_t _max_queued_tasks;
+        uint64_t _finished_tasks;
+        uint64_t _written_bytes;   // tsm files written by conversions and compactions
+        uint64_t _throttled_us;    // writers slept by the bandwidth limit
+        double _write_bytes_per_sec; // since the first background write
+    };
+
+    // tasks of partitions being queried go first, then conversions before block encodes before compactions,
+    // then the conversions holding the most bytes of wal
+    struct TaskPriority {
+        enum Kind : uint8_t {
+            COMPACT = 0,
+            ENCODE = 1,
+            CONVERT = 2,
+        };
+
+        bool _queried = false;
+        Kind _kind = COMPACT;
+        uint64_t _bytes = 0;
+
+        auto operator<=>(const TaskPriority&) const = default;
+    };
+
+    class CompactionScheduler;
+
+    using CompactionSchedulerUPtr = std::unique_ptr<CompactionScheduler>;
+
+    // runs the background tasks of the converters by priority instead of submission order, tasks of the
+    // same priority run first come first served. the tsm files they write share a token bucket of bytes,
+    // so a burst of conversions can't take the whole disk bandwidth from the queries.
+    // multi thread safe
+    class CompactionScheduler {
+    public:
+        explicit CompactionScheduler(const CompactionSchedulerOptions& options = CompactionSchedulerOptions())
+                : _options(options), _write_bytes_per_sec(options._write_bytes_per_sec),
+                  _last_refill(std::chrono::steady_clock::now()) {
+            assert(_options._write_bytes_per_sec >= 0);
+            for (uint16_t i = 0; i < _options._thread_num; ++i) {
+                _threads.emplace_back(&CompactionScheduler::_work_loop, this);
+            }
+        }
+
+        ~CompactionScheduler() {
+            shutdown();
+        }
+
+        CompactionScheduler(const CompactionScheduler&) = delete;
+        CompactionScheduler& operator=(const CompactionScheduler&) = delete;
+
+        void submit(TaskPriority priority, std::function<void()>&& task) {
+            {
+                std::lock_guard<std::mutex> l(_mutex);
+                _tasks.push({priority, _next_task_seq++, std::move(task)});
+                _max_queued_tasks = std::max(_max_queued_tasks, _tasks.size());
+            }
+            _cv.notify_one();
+        }
+
+        // run the queued tasks to the end and stop the workers
+        void shutdown() {
+            {
+                std::lock_guard<std::mutex> l(_mutex);
+                if (_shutdown) {
+                    return;
+                }
+                _shutdown = true;
+            }
+            _cv.notify_all();
+            for (auto &thread: _threads) {
+                thread.join();
+            }
+        }
+
+        bool empty() {
+            std::lock_guard<std::mutex> l(_mutex);
+            return _tasks.empty();
+        }
+
+        // change the bandwidth limit of the background writes, 0 leaves them unlimited. the writes
+        // sleeping already finish at the old rate
+        void set_write_bytes_per_sec(double write_bytes_per_sec) {
+            assert(write_bytes_per_sec >= 0);
+            std::lock_guard<std::mutex> l(_bucket_mutex);
+            _write_bytes_per_sec.store(write_bytes_per_sec, std::memory_order_relaxed);
+            _tokens = 0;
+        }
+
+        // called by a task before it writes bytes, sleeps while the task is over the bandwidth limit
+        void throttle_write(size_t bytes) {
+            _written_bytes.fetch_add(bytes, std::memory_order_relaxed);
+            auto now = std::chrono::steady_clock::now();
+            int64_t now_us = std::chrono::duration_cast<std::chrono::microseconds>(now.time_since_epoch()).count();
+            int64_t expected = 0;
+            _first_write_us.compare_exchange_strong(expected, now_us, std::memory_order_relaxed);
+            if (_write_bytes_per_sec.load(std::memory_order_relaxed) == 0) {
+                return;
+            }
+            std::chrono::microseconds wait_time = _acquire_tokens(bytes, now);
+            if (wait_time.count() > 0) {
+                std::this_thread::sleep_for(wait_time);
+                _throttled_us.fetch_add(wait_time.count(), std::memory_order_relaxed);
+            }
+        }
+
+        CompactionSchedulerMetrics get_metrics() {
+            CompactionSchedulerMetrics metrics;
+            {
+                std::lock_guard<std::mutex> l(_mutex);
+                metrics._queued_tasks = _tasks.size();
+                metrics._max_queued_tasks = _max_queued_tasks;
+            }
+            metrics._finished_tasks = _finished_tasks.load(std::memory_order_relaxed);
+            metrics._written_bytes = _written_bytes.load(std::memory_order_relaxed);
+            metrics._throttled_us = _throttled_us.load(std::memory_order_relaxed);
+            int64_t first_write_us = _first_write_us.load(std::memory_order_relaxed);
+            int64_t now_us = std::chrono::duration_cast<std::chrono::microseconds>(
+                    std::chrono::steady_clock::now().time_since_epoch()).count();
+            metrics._write_bytes_per_sec = first_write_us > 0 && now_us > first_write_us
+                                           ? metrics._written_bytes * 1e6 / (now_us - first_write_us) : 0;
+            return metrics;
+        }
+
+    private:
+        struct Task {
+            TaskPriority _priority;
+            uint64_t _seq;
+            std::function<void()> _func;
+
+            // the top of the queue is the greatest task
+            bool operator<(const Task& other) const {
+                if (_priority != other._priority) {
+                    return _priority < other._priority;
+                }
+                return _seq > other._seq;
+            }
+        };
+
+        void _work_loop() {
+            while (true) {
+                std::function<void()> func;
+                {
+                    std::unique_lock<std::mutex> l(_mutex);
+                    _cv.wait(l, [this] { return _shutdown || !_tasks.empty(); });
+                    if (_tasks.empty()) {
+                        return;
+                    }
+                    // the queue only hands out const references, the task is popped right after the move
+                    func = std::move(const_cast<Task&>(_tasks.top())._func);
+                    _tasks.pop();
+                }
+                // tasks handle their own errors, this only keeps a worker from taking the process down
+                try {
+                    func();
+                } catch (const std::exception& e) {
+                    ERR_LOG("background task failed: %s", e.what())
+                } catch (...) {
+                    ERR_LOG("background task failed")
+                }
+                _finished_tasks.fetch_add(1, std::memory_order_relaxed);
+            }
+        }
+
+        // take bytes tokens, the bucket may go into debt and the caller sleeps it off.
+        // the bucket holds at most 100ms of tokens so that an idle period doesn't allow a burst
+        std::chrono::microseconds _acquire_tokens(size_t bytes, std::chrono::steady_clock::time_point now) {
+            std::lock_guard<std::mutex> l(_bucket_mutex);
+            double write_bytes_per_sec = _write_bytes_per_sec.load(std::memory_order_relaxed);
+            double elapsed_sec = std::chrono::duration<double>(now - _last_refill).count();
+            _last_refill = now;
+            if (write_bytes_per_sec == 0) {
+                return std::chrono::microseconds(0);
+            }
+            _tokens = std::min(_tokens + elapsed_sec * write_bytes_per_sec, write_bytes_per_sec / 10);
+            _tokens -= static_cast<double>(bytes);
+            if (_tokens >= 0) {
+                return std::chrono::microseconds(0);
+            }
+            return std::chrono::microseconds(static_cast<int64_t>(-_tokens / write_bytes_per_sec * 1e6));
+        }
+
+        CompactionSchedulerOptions _options;
+        std::mutex _mutex;
+        std::condition_variable _cv;
+        std::priority_queue<Task> _tasks;
+        uint64_t _next_task_seq = 0;
+        size_t _max_queued_tasks = 0;
+        bool _shutdown = false;
+        std::vector<std::thread> _threads;
+
+        std::mutex _bucket_mutex;
+        std::atomic<double> _write_bytes_per_sec; // changed under the bucket mutex, 0 is unlimited
+        double _tokens = 0;
+        std::chrono::steady_clock::time_point _last_refill;
+
+        std::atomic<uint64_t> _finished_tasks {0};
+        std::atomic<uint64_t> _written_bytes {0};
+        std::atomic<uint64_t> _throttled_us {0};
+        std::atomic<int64_t> _first_write_us {0};
+    };
+
+}
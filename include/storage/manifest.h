@@ -0,0 +1,156 @@
+/*
+ * Copyright Alibaba Group Holding Ltd.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <map>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "base.h"
+#include "common/coding.h"
+#include "common/crc32c.h"
+#include "io/io_utils.h"
+
+namespace LindormContest {
+
+    // one tsm file of one vin packed into a segment
+    struct SegmentEntry {
+        VinId _vin_id;
+        uint32_t _file_seq;
+        uint64_t _offset; // of the tsm file inside the segment
+        uint32_t _size;
+        uint32_t _index_offset; // inside the tsm file, so the index is read without its trailer
+
+        void encode_to(std::string* buf) const {
+            put_fixed(buf, _vin_id);
+            put_fixed(buf, _file_seq);
+            put_fixed(buf, _offset);
+            put_fixed(buf, _size);
+            put_fixed(buf, _index_offset);
+        }
+
+        void decode_from(const uint8_t*& p) {
+            _vin_id = decode_fixed<VinId>(p);
+            _file_seq = decode_fixed<uint32_t>(p);
+            _offset = decode_fixed<uint64_t>(p);
+            _size = decode_fixed<uint32_t>(p);
+            _index_offset = decode_fixed<uint32_t>(p);
+        }
+
+        static constexpr size_t ENCODED_SIZE = sizeof(VinId) + 3 * sizeof(uint32_t) + sizeof(uint64_t);
+    };
+
+    // the durable state of the tsm files at a checkpoint: the files synced to their segments and the first
+    // wal segment holding rows which aren't in one of them. a checkpoint writes MANIFEST.tmp, syncs it and
+    // renames it over MANIFEST, so a crash leaves either the old or the new manifest behind. recovery takes
+    // the files listed and replays the wal from the checkpoint on, files written after it are dropped since
+    // their rows are replayed.
+    // layout: [magic][version][wal checkpoint][segment count][segment seq][entry count][entries]...[crc32c]
+    struct Manifest {
+        uint32_t _wal_checkpoint = 0;
+        std::map<uint32_t, std::vector<SegmentEntry>> _segments; // live tsm files by segment seq
+
+        void encode_to(std::string* buf) const {
+            put_fixed(buf, MAGIC);
+            put_fixed(buf, VERSION);
+            put_fixed(buf, _wal_checkpoint);
+            put_fixed(buf, static_cast<uint32_t>(_segments.size()));
+            for (const auto &[segment_seq, entries]: _segments) {
+                put_fixed(buf, segment_seq);
+                put_fixed(buf, static_cast<uint32_t>(entries.size()));
+                for (const auto &entry: entries) {
+                    entry.encode_to(buf);
+                }
+            }
+            put_fixed(buf, crc32c::value(buf->data(), buf->size()));
+        }
+
+        // return false if buf isn't a complete manifest of this version
+        bool decode_from(const std::string& buf) {
+            if (buf.size() < 5 * sizeof(uint32_t)) {
+                return false;
+            }
+            const uint8_t* p = reinterpret_cast<const uint8_t*>(buf.data());
+            const uint8_t* end = p + buf.size() - sizeof(uint32_t);
+            const uint8_t* crc_ptr = end;
+            if (decode_fixed<uint32_t>(crc_ptr) != crc32c::value(buf.data(), buf.size() - sizeof(uint32_t))
+                || decode_fixed<uint32_t>(p) != MAGIC || decode_fixed<uint32_t>(p) != VERSION) {
+                return false;
+            }
+            _wal_checkpoint = decode_fixed<uint32_t>(p);
+            uint32_t segment_count = decode_fixed<uint32_t>(p);
+            _segments.clear();
+            for (uint32_t i = 0; i < segment_count; ++i) {
+                if (p + 2 * sizeof(uint32_t) > end) {
+                    return false;
+                }
+                uint32_t segment_seq = decode_fixed<uint32_t>(p);
+                uint32_t entry_count = decode_fixed<uint32_t>(p);
+                if (static_cast<size_t>(end - p) < entry_count * SegmentEntry::ENCODED_SIZE) {
+                    return false;
+                }
+                std::vector<SegmentEntry>& entries = _segments[segment_seq];
+                entries.resize(entry_count);
+                for (auto &entry: entries) {
+                    entry.decode_from(p);
+                }
+            }
+            return p == end;
+        }
+
+        void save(const Path& manifest_path) const {
+            std::string buf;
+            encode_to(&buf);
+            Path tmp_path = manifest_path;
+            tmp_path += ".tmp";
+            int fd = ::open(tmp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+            if (fd < 0) {
+                throw std::runtime_error("open manifest failed");
+            }
+            bool ok = ::write(fd, buf.data(), buf.size()) == static_cast<ssize_t>(buf.size()) && ::fdatasync(fd) == 0;
+            ::close(fd);
+            if (!ok) {
+                throw std::runtime_error("write manifest failed");
+            }
+            std::filesystem::rename(tmp_path, manifest_path);
+            // the rename is durable once the directory is synced
+            int dir_fd = ::open(manifest_path.parent_path().c_str(), O_RDONLY | O_DIRECTORY);
+            if (dir_fd >= 0) {
+                ::fsync(dir_fd);
+                ::close(dir_fd);
+            }
+        }
+
+        // return false if there is no valid manifest
+        bool load(const Path& manifest_path) {
+            if (!std::filesystem::exists(manifest_path)) {
+                return false;
+            }
+            std::string buf;
+            io::stream_read_string_from_file(manifest_path, buf);
+            if (!decode_from(buf)) {
+                ERR_LOG("manifest %s is corrupted", manifest_path.c_str())
+                return false;
+            }
+            return true;
+        }
+
+    private:
+        static constexpr uint32_t MAGIC = 0x544e464d; // "MFNT"
+        static constexpr uint32_t VERSION = 1;
+    };
+
+}
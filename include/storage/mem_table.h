@@ -0,0 +1,808 @@
+/*
+ * Copyright Alibaba Group Holding Ltd.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <bitset>
+#include <mutex>
+#include <shared_mutex>
+#include <numeric>
+#include <chrono>
+
+#include "struct/Row.h"
+#include "struct/Schema.h"
+#include "common/spinlock.h"
+#include "common/segmented_array.h"
+#include "common/time_range.h"
+#include "storage/tsm_file.h"
+#include "storage/wal.h"
+#include "io/row_codec.h"
+
+namespace LindormContest {
+
+    class MemTable;
+
+    using MemTableSPtr = std::shared_ptr<MemTable>;
+
+    enum class AppendStatus {
+        OK,
+        FULL,  // appended, and the row filled the mem table up
+        SEALED // rejected, the mem table was sealed before
+    };
+
+    // columnar in-memory buffer of one tsm file. rows are appended in arrival order into typed
+    // data blocks, which become the tsm file blocks as they are if the timestamps arrived in order,
+    // otherwise the rows are sorted and deduplicated (the last write wins) when the mem table is sealed.
+    // a delta mem table takes the late rows of a partition the vin has already moved past.
+    // a block filled up while the rows are in order doesn't change anymore, it is encoded ahead of the
+    // conversion and queries take the stats of the filled blocks they cover instead of their values.
+    // the mem tables of compaction may span partition_count partitions and take up to max_row_count rows,
+    // they have no wal_refs. the others reference the wal segments holding their rows until they are dropped.
+    // multi thread safe
+    class MemTable {
+    public:
+        MemTable(uint32_t file_seq, int64_t partition, RowCodecSPtr row_codec, WalSegmentRefsSPtr wal_refs, bool delta = false,
+                 int64_t partition_count = 1, uint32_t max_row_count = FILE_CONVERT_SIZE)
+                : _file_seq(file_seq), _partition(partition), _partition_count(partition_count), _delta(delta),
+                  _create_time(std::chrono::steady_clock::now()), _row_codec(row_codec), _wal_refs(std::move(wal_refs)),
+                  _max_row_count(max_row_count), _max_block_count(max_row_count / DATA_BLOCK_ITEM_NUMS) {
+            assert(max_row_count % DATA_BLOCK_ITEM_NUMS == 0);
+            _timestamp_blocks.resize(_max_block_count);
+            _column_blocks.resize(_row_codec->column_count() * _max_block_count);
+            _encoded_blocks.resize(_max_block_count);
+        }
+
+        ~MemTable() {
+            for (uint32_t wal_seq: _wal_seqs) {
+                _wal_refs->unref(wal_seq);
+            }
+        }
+
+        // append the leading rows of row_indices inside the partitions of the mem table under one lock,
+        // appended is set to the number of rows taken. the blocks filled up by the rows are added to
+        // filled_blocks if given, except when the mem table is full and about to be converted.
+        // wal_seq is the seq of the wal segment holding the rows, Batch is RowBatch or ColumnarBatch
+        template <typename Batch>
+        AppendStatus append_batch(const Batch& batch, const uint32_t* row_indices, size_t count, uint32_t wal_seq, size_t& appended,
+                                  std::vector<uint16_t>* filled_blocks = nullptr) {
+            std::lock_guard<std::shared_mutex> l(_mutex);
+            appended = 0;
+
+            if (unlikely(_sealed)) {
+                return AppendStatus::SEALED;
+            }
+
+            uint16_t filled_block_count = _filled_block_count;
+            AppendStatus status = AppendStatus::OK;
+            while (appended < count && _contains_partition(get_time_partition(batch.timestamp(row_indices[appended])))) {
+                if (unlikely(_append_row(batch, row_indices[appended++]) == AppendStatus::FULL)) {
+                    status = AppendStatus::FULL;
+                    break;
+                }
+            }
+            if (appended > 0) {
+                _ref_wal_seq(wal_seq);
+            }
+            if (unlikely(status == AppendStatus::FULL)) {
+                return status;
+            }
+
+            if (filled_blocks != nullptr) {
+                for (uint16_t block_idx = filled_block_count; block_idx < _filled_block_count; ++block_idx) {
+                    filled_blocks->emplace_back(block_idx);
+                }
+            }
+            return AppendStatus::OK;
+        }
+
+        // encode a filled block with encoder, which is called with the timestamp block and the blocks of
+        // every column by column id and returns the EncodedBlock. skipped if the block has been rewritten
+        // by sorting the rows or the encoded blocks have been taken by the conversion
+        template <typename F>
+        void encode_filled_block(uint16_t block_idx, F&& encoder) {
+            std::shared_lock<std::shared_mutex> l(_mutex);
+            if (block_idx >= _filled_block_count || _encoded_blocks.empty()) {
+                return;
+            }
+            std::vector<const DataBlock*> column_blocks;
+            for (uint16_t column_idx = 0; column_idx < _row_codec->column_count(); ++column_idx) {
+                column_blocks.emplace_back(_column_blocks[column_idx * _max_block_count + block_idx].get());
+            }
+            // encoders of other blocks run concurrently, each one only writes its own entry
+            _encoded_blocks[block_idx] = encoder(*_timestamp_blocks[block_idx], column_blocks);
+        }
+
+        // the blocks encoded so far by block index, waits for the encoders still running.
+        // called once by the conversion after the mem table is sealed
+        void take_encoded_blocks(std::vector<EncodedBlock>& encoded_blocks) {
+            std::lock_guard<std::shared_mutex> l(_mutex);
+            assert(_sealed);
+            encoded_blocks = std::move(_encoded_blocks);
+            _encoded_blocks.clear();
+        }
+
+        // all blocks of one column are adjacent, which is exactly the tsm file layout.
+        // only valid after the mem table is sealed, the blocks won't be modified anymore.
+        void get_sealed_blocks(std::vector<TimestampDataBlock*>& timestamp_blocks, std::vector<DataBlock*>& data_blocks) {
+            std::shared_lock<std::shared_mutex> l(_mutex);
+            assert(_sealed);
+            uint16_t block_count = _block_count();
+
+            for (uint16_t i = 0; i < block_count; ++i) {
+                timestamp_blocks.emplace_back(_timestamp_blocks[i].get());
+            }
+
+            for (uint16_t column_idx = 0; column_idx < _row_codec->column_count(); ++column_idx) {
+                for (uint16_t i = 0; i < block_count; ++i) {
+                    data_blocks.emplace_back(_column_blocks[column_idx * _max_block_count + i].get());
+                }
+            }
+        }
+
+        // seal the mem table before it is full, return false if it has been sealed or has no rows
+        bool seal() {
+            std::lock_guard<std::shared_mutex> l(_mutex);
+            if (_sealed || _row_count == 0) {
+                _sealed = true;
+                return false;
+            }
+            _seal();
+            return true;
+        }
+
+        bool empty() {
+            std::shared_lock<std::shared_mutex> l(_mutex);
+            return _row_count == 0;
+        }
+
+        uint32_t file_seq() const {
+            return _file_seq;
+        }
+
+        int64_t partition() const {
+            return _partition;
+        }
+
+        bool delta() const {
+            return _delta;
+        }
+
+        // ms of wall clock since the mem table was created
+        int64_t age() const {
+            return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - _create_time).count();
+        }
+
+        bool overlap(const TimeRange& tr) {
+            std::shared_lock<std::shared_mutex> l(_mutex);
+            return _row_count > 0 && tr.overlap(_min_ts, _max_ts);
+        }
+
+        // return false if the mem table has no rows
+        bool get_ts_range(int64_t& min_ts, int64_t& max_ts) {
+            std::shared_lock<std::shared_mutex> l(_mutex);
+            min_ts = _min_ts;
+            max_ts = _max_ts;
+            return _row_count > 0;
+        }
+
+        // timestamps of the rows inside tr in ts order
+        void get_timestamps(const TimeRange& tr, std::vector<int64_t>& timestamps) {
+            std::shared_lock<std::shared_mutex> l(_mutex);
+            _visit_rows(tr, [&](uint32_t slot) {
+                timestamps.emplace_back(_get_ts(slot));
+            });
+        }
+
+        // estimated bytes of the buffered values
+        size_t memory_usage() {
+            std::shared_lock<std::shared_mutex> l(_mutex);
+            return _row_count * _row_codec->row_width() + _string_bytes;
+        }
+
+        bool get_latest_row(const std::set<std::string>& requested_columns, Row& latest_row) {
+            std::shared_lock<std::shared_mutex> l(_mutex);
+            if (_row_count == 0) {
+                return false;
+            }
+            uint32_t latest_slot = _row_count - 1;
+            if (!_in_order) {
+                // the last written row of the max timestamp
+                for (uint32_t slot = 0; slot < _row_count; ++slot) {
+                    if (_get_ts(slot) >= _get_ts(latest_slot)) {
+                        latest_slot = slot;
+                    }
+                }
+            }
+            latest_row.timestamp = _get_ts(latest_slot);
+            _fill_row(latest_slot, _row_codec->column_ids(requested_columns), latest_row);
+            return true;
+        }
+
+        void query_time_range(const Vin& vin, const TimeRange& tr,
+                              const std::set<std::string>& requested_columns, std::vector<Row>& trReadRes) {
+            std::shared_lock<std::shared_mutex> l(_mutex);
+            std::vector<uint16_t> column_ids = _row_codec->column_ids(requested_columns);
+
+            _visit_rows(tr, [&](uint32_t slot) {
+                Row result_row;
+                result_row.vin = vin;
+                result_row.timestamp = _get_ts(slot);
+                _fill_row(slot, column_ids, result_row);
+                trReadRes.emplace_back(std::move(result_row));
+            });
+        }
+
+        // visit every value of the column inside tr in ts order with its timestamp,
+        // T must be int32_t for integer columns and double_t for double columns
+        template <typename T, typename F>
+        void scan_column(const std::string& column_name, const TimeRange& tr, F&& visitor) {
+            std::shared_lock<std::shared_mutex> l(_mutex);
+            uint16_t column_idx = _row_codec->column_id(column_name);
+
+            _visit_rows(tr, [&](uint32_t slot) {
+                _visit_value<T>(column_idx, slot, visitor);
+            });
+        }
+
+        // like scan_column, but a filled block lying inside tr is passed to block_visitor as a whole,
+        // an IntDataBlock or DoubleDataBlock with the stats of its rows, instead of value by value
+        template <typename T, typename B, typename F>
+        void scan_column_blocks(const std::string& column_name, const TimeRange& tr, B&& block_visitor, F&& visitor) {
+            std::shared_lock<std::shared_mutex> l(_mutex);
+            uint16_t column_idx = _row_codec->column_id(column_name);
+            if (unlikely(!_in_order)) {
+                _visit_rows(tr, [&](uint32_t slot) {
+                    _visit_value<T>(column_idx, slot, visitor);
+                });
+                return;
+            }
+
+            uint32_t lower, upper;
+            _get_slot_range(tr, lower, upper);
+            for (uint32_t slot = lower; slot < upper;) {
+                if (slot % DATA_BLOCK_ITEM_NUMS == 0 && slot + DATA_BLOCK_ITEM_NUMS <= upper) {
+                    const DataBlock *data_block = _column_blocks[column_idx * _max_block_count + slot / DATA_BLOCK_ITEM_NUMS].get();
+                    if constexpr (std::is_same_v<T, int32_t>) {
+                        block_visitor(*static_cast<const IntDataBlock *>(data_block));
+                    } else if constexpr (std::is_same_v<T, double_t>) {
+                        block_visitor(*static_cast<const DoubleDataBlock *>(data_block));
+                    }
+                    slot += DATA_BLOCK_ITEM_NUMS;
+                    continue;
+                }
+                _visit_value<T>(column_idx, slot++, visitor);
+            }
+        }
+
+    private:
+        // the rows of a mem table come from a few wal segments, usually in order. the lock must be held
+        void _ref_wal_seq(uint32_t wal_seq) {
+            if (_wal_refs == nullptr || (!_wal_seqs.empty() && _wal_seqs.back() == wal_seq)
+                || std::find(_wal_seqs.begin(), _wal_seqs.end(), wal_seq) != _wal_seqs.end()) {
+                return;
+            }
+            _wal_refs->ref(wal_seq);
+            _wal_seqs.emplace_back(wal_seq);
+        }
+
+        template <typename Batch>
+        AppendStatus _append_row(const Batch& batch, size_t row_idx) {
+            int64_t timestamp = batch.timestamp(row_idx);
+            if (unlikely(_row_count > 0 && timestamp <= _max_ts)) {
+                _in_order = false;
+            }
+
+            uint32_t slot = _row_count;
+            std::unique_ptr<TimestampDataBlock> &timestamp_block = _timestamp_blocks[slot / DATA_BLOCK_ITEM_NUMS];
+            if (unlikely(timestamp_block == nullptr)) {
+                timestamp_block = std::make_unique<TimestampDataBlock>();
+            }
+            timestamp_block->_timestamps[slot % DATA_BLOCK_ITEM_NUMS] = timestamp;
+            timestamp_block->_count++;
+
+            batch.visit(row_idx, [&](uint16_t column_idx, const char* value, int32_t str_length) {
+                _put_value(_column_blocks, column_idx, slot, value, str_length);
+                _string_bytes += str_length;
+            });
+
+            _min_ts = _row_count == 0 ? timestamp : std::min(_min_ts, timestamp);
+            _max_ts = _row_count == 0 ? timestamp : std::max(_max_ts, timestamp);
+
+            if (unlikely(++_row_count == _max_row_count)) {
+                _seal();
+                return AppendStatus::FULL;
+            }
+
+            if (unlikely(_row_count % DATA_BLOCK_ITEM_NUMS == 0) && _in_order) {
+                _filled_block_count = _row_count / DATA_BLOCK_ITEM_NUMS;
+            }
+
+            return AppendStatus::OK;
+        }
+
+        int64_t _get_ts(uint32_t slot) const {
+            return _timestamp_blocks[slot / DATA_BLOCK_ITEM_NUMS]->_timestamps[slot % DATA_BLOCK_ITEM_NUMS];
+        }
+
+        bool _contains_partition(int64_t partition) const {
+            return partition >= _partition && partition - _partition < _partition_count;
+        }
+
+        uint16_t _block_count() const {
+            return (_row_count + DATA_BLOCK_ITEM_NUMS - 1) / DATA_BLOCK_ITEM_NUMS;
+        }
+
+        // visit the slots of the rows inside tr in ts order
+        template <typename F>
+        void _visit_rows(const TimeRange& tr, F&& visitor) const {
+            if (_row_count == 0 || !tr.overlap(_min_ts, _max_ts)) {
+                return;
+            }
+
+            if (likely(_in_order)) {
+                uint32_t lower, upper;
+                _get_slot_range(tr, lower, upper);
+                for (uint32_t slot = lower; slot < upper; ++slot) {
+                    visitor(slot);
+                }
+                return;
+            }
+
+            std::vector<uint32_t> slots;
+            for (uint32_t slot = 0; slot < _row_count; ++slot) {
+                if (tr.contains(_get_ts(slot))) {
+                    slots.emplace_back(slot);
+                }
+            }
+            _sort_and_dedup(slots);
+            for (uint32_t slot: slots) {
+                visitor(slot);
+            }
+        }
+
+        // the slots [lower, upper) of the rows inside tr, the rows must be in order
+        void _get_slot_range(const TimeRange& tr, uint32_t& lower, uint32_t& upper) const {
+            auto ts_lower_bound = [this](int64_t ts) {
+                uint32_t first = 0, last = _row_count;
+                while (first < last) {
+                    uint32_t mid = (first + last) / 2;
+                    if (_get_ts(mid) < ts) {
+                        first = mid + 1;
+                    } else {
+                        last = mid;
+                    }
+                }
+                return first;
+            };
+            lower = ts_lower_bound(tr._start_time);
+            upper = ts_lower_bound(tr._end_time);
+        }
+
+        template <typename T, typename F>
+        void _visit_value(uint16_t column_idx, uint32_t slot, F&& visitor) const {
+            const DataBlock *data_block = _column_blocks[column_idx * _max_block_count + slot / DATA_BLOCK_ITEM_NUMS].get();
+            if constexpr (std::is_same_v<T, int32_t>) {
+                visitor(_get_ts(slot), static_cast<const IntDataBlock *>(data_block)->_column_values[slot % DATA_BLOCK_ITEM_NUMS]);
+            } else if constexpr (std::is_same_v<T, double_t>) {
+                visitor(_get_ts(slot), static_cast<const DoubleDataBlock *>(data_block)->_column_values[slot % DATA_BLOCK_ITEM_NUMS]);
+            }
+        }
+
+        // sort the slots by ts, only the last written slot of the same ts is kept
+        void _sort_and_dedup(std::vector<uint32_t>& slots) const {
+            std::stable_sort(slots.begin(), slots.end(), [this](uint32_t lhs, uint32_t rhs) {
+                return _get_ts(lhs) < _get_ts(rhs);
+            });
+            size_t count = 0;
+            for (size_t i = 0; i < slots.size(); ++i) {
+                if (i + 1 < slots.size() && _get_ts(slots[i + 1]) == _get_ts(slots[i])) {
+                    continue;
+                }
+                slots[count++] = slots[i];
+            }
+            slots.resize(count);
+        }
+
+        void _seal() {
+            _sealed = true;
+            if (unlikely(!_in_order)) {
+                _rebuild_in_order();
+            }
+
+            // pad the last block with its last value, so that the encoders always see full blocks
+            uint32_t last_slot = _row_count - 1;
+            for (uint32_t slot = _row_count; slot % DATA_BLOCK_ITEM_NUMS != 0; ++slot) {
+                _timestamp_blocks[slot / DATA_BLOCK_ITEM_NUMS]->_timestamps[slot % DATA_BLOCK_ITEM_NUMS] = _get_ts(last_slot);
+                for (uint16_t column_idx = 0; column_idx < _row_codec->column_count(); ++column_idx) {
+                    _copy_value(_column_blocks, column_idx, last_slot, _column_blocks, slot, false);
+                }
+            }
+        }
+
+        void _rebuild_in_order() {
+            std::vector<uint32_t> slots(_row_count);
+            std::iota(slots.begin(), slots.end(), 0);
+            _sort_and_dedup(slots);
+            std::vector<std::unique_ptr<TimestampDataBlock>> timestamp_blocks(_max_block_count);
+            std::vector<std::unique_ptr<DataBlock>> column_blocks(_column_blocks.size());
+
+            for (uint32_t new_slot = 0; new_slot < slots.size(); ++new_slot) {
+                std::unique_ptr<TimestampDataBlock> &timestamp_block = timestamp_blocks[new_slot / DATA_BLOCK_ITEM_NUMS];
+                if (timestamp_block == nullptr) {
+                    timestamp_block = std::make_unique<TimestampDataBlock>();
+                }
+                timestamp_block->_timestamps[new_slot % DATA_BLOCK_ITEM_NUMS] = _get_ts(slots[new_slot]);
+                timestamp_block->_count++;
+                for (uint16_t column_idx = 0; column_idx < _row_codec->column_count(); ++column_idx) {
+                    _copy_value(_column_blocks, column_idx, slots[new_slot], column_blocks, new_slot, true);
+                }
+            }
+
+            _timestamp_blocks = std::move(timestamp_blocks);
+            _column_blocks = std::move(column_blocks);
+            _row_count = slots.size();
+            _in_order = true;
+            // the rows have moved, no encoder is running under the exclusive lock
+            _filled_block_count = 0;
+            _encoded_blocks.assign(_encoded_blocks.size(), {});
+        }
+
+        // value points to the string bytes for strings
+        void _put_value(std::vector<std::unique_ptr<DataBlock>>& blocks, uint16_t column_idx, uint32_t slot,
+                        const char* value, int32_t str_length) {
+            std::unique_ptr<DataBlock> &data_block = blocks[column_idx * _max_block_count + slot / DATA_BLOCK_ITEM_NUMS];
+            uint16_t block_offset = slot % DATA_BLOCK_ITEM_NUMS;
+            switch (_row_codec->column_type(column_idx)) {
+                case COLUMN_TYPE_INTEGER: {
+                    if (unlikely(data_block == nullptr)) {
+                        data_block = std::make_unique<IntDataBlock>();
+                    }
+                    IntDataBlock &int_data_block = static_cast<IntDataBlock &>(*data_block);
+                    int32_t int_value = *reinterpret_cast<const int32_t *>(value);
+                    int_data_block._column_values[block_offset] = int_value;
+                    int_data_block._sum += int_value;
+                    int_data_block._min = std::min(int_data_block._min, int_value);
+                    int_data_block._max = std::max(int_data_block._max, int_value);
+                    break;
+                }
+                case COLUMN_TYPE_DOUBLE_FLOAT: {
+                    if (unlikely(data_block == nullptr)) {
+                        data_block = std::make_unique<DoubleDataBlock>();
+                    }
+                    DoubleDataBlock &double_data_block = static_cast<DoubleDataBlock &>(*data_block);
+                    double_t double_value = *reinterpret_cast<const double_t *>(value);
+                    double_data_block._column_values[block_offset] = double_value;
+                    double_data_block._sum += double_value;
+                    double_data_block._min = std::min(double_data_block._min, double_value);
+                    double_data_block._max = std::max(double_data_block._max, double_value);
+                    break;
+                }
+                case COLUMN_TYPE_STRING: {
+                    if (unlikely(data_block == nullptr)) {
+                        data_block = std::make_unique<StringDataBlock>();
+                    }
+                    StringDataBlock &string_data_block = static_cast<StringDataBlock &>(*data_block);
+                    string_data_block._column_values[block_offset] = ColumnValue(value, str_length);
+                    string_data_block._min_length = std::min(string_data_block._min_length, str_length);
+                    string_data_block._max_length = std::max(string_data_block._max_length, str_length);
+                    break;
+                }
+                default:
+                    break;
+            }
+        }
+
+        // with update_stats false the value is only stored, which is used for padding
+        void _copy_value(const std::vector<std::unique_ptr<DataBlock>>& src_blocks, uint16_t column_idx, uint32_t src_slot,
+                         std::vector<std::unique_ptr<DataBlock>>& dst_blocks, uint32_t dst_slot, bool update_stats) {
+            const DataBlock *src_block = src_blocks[column_idx * _max_block_count + src_slot / DATA_BLOCK_ITEM_NUMS].get();
+            uint16_t src_offset = src_slot % DATA_BLOCK_ITEM_NUMS;
+            const char* column_data = nullptr;
+            int32_t str_length = 0;
+            switch (_row_codec->column_type(column_idx)) {
+                case COLUMN_TYPE_INTEGER:
+                    column_data = reinterpret_cast<const char*>(&static_cast<const IntDataBlock *>(src_block)->_column_values[src_offset]);
+                    break;
+                case COLUMN_TYPE_DOUBLE_FLOAT:
+                    column_data = reinterpret_cast<const char*>(&static_cast<const DoubleDataBlock *>(src_block)->_column_values[src_offset]);
+                    break;
+                case COLUMN_TYPE_STRING:
+                    column_data = static_cast<const StringDataBlock *>(src_block)->_column_values[src_offset].columnData;
+                    str_length = *reinterpret_cast<const int32_t *>(column_data);
+                    column_data += sizeof(int32_t);
+                    break;
+                default:
+                    return;
+            }
+            if (update_stats) {
+                _put_value(dst_blocks, column_idx, dst_slot, column_data, str_length);
+                return;
+            }
+            DataBlock *dst_block = dst_blocks[column_idx * _max_block_count + dst_slot / DATA_BLOCK_ITEM_NUMS].get();
+            uint16_t dst_offset = dst_slot % DATA_BLOCK_ITEM_NUMS;
+            switch (_row_codec->column_type(column_idx)) {
+                case COLUMN_TYPE_INTEGER:
+                    static_cast<IntDataBlock *>(dst_block)->_column_values[dst_offset] = *reinterpret_cast<const int32_t *>(column_data);
+                    break;
+                case COLUMN_TYPE_DOUBLE_FLOAT:
+                    static_cast<DoubleDataBlock *>(dst_block)->_column_values[dst_offset] = *reinterpret_cast<const double_t *>(column_data);
+                    break;
+                case COLUMN_TYPE_STRING:
+                    static_cast<StringDataBlock *>(dst_block)->_column_values[dst_offset] = static_cast<const StringDataBlock *>(src_block)->_column_values[src_offset];
+                    break;
+                default:
+                    break;
+            }
+        }
+
+        // column_ids must be ascending, so every column is appended at the end of the row
+        void _fill_row(uint32_t slot, const std::vector<uint16_t>& column_ids, Row& row) const {
+            uint16_t block_index = slot / DATA_BLOCK_ITEM_NUMS;
+            uint16_t block_offset = slot % DATA_BLOCK_ITEM_NUMS;
+
+            for (uint16_t column_idx: column_ids) {
+                const std::string& column_name = _row_codec->column_name(column_idx);
+                const DataBlock *data_block = _column_blocks[column_idx * _max_block_count + block_index].get();
+                switch (_row_codec->column_type(column_idx)) {
+                    case COLUMN_TYPE_INTEGER:
+                        row.columns.emplace_hint(row.columns.end(), column_name, static_cast<const IntDataBlock *>(data_block)->_column_values[block_offset]);
+                        break;
+                    case COLUMN_TYPE_DOUBLE_FLOAT:
+                        row.columns.emplace_hint(row.columns.end(), column_name, static_cast<const DoubleDataBlock *>(data_block)->_column_values[block_offset]);
+                        break;
+                    case COLUMN_TYPE_STRING:
+                        row.columns.emplace_hint(row.columns.end(), column_name, static_cast<const StringDataBlock *>(data_block)->_column_values[block_offset]);
+                        break;
+                    default:
+                        break;
+                }
+            }
+        }
+
+        uint32_t _file_seq;
+        int64_t _partition; // the first one
+        int64_t _partition_count;
+        bool _delta;
+        std::chrono::steady_clock::time_point _create_time;
+        RowCodecSPtr _row_codec;
+        WalSegmentRefsSPtr _wal_refs;
+        std::vector<uint32_t> _wal_seqs; // referenced by the mem table
+        uint32_t _max_row_count;
+        uint16_t _max_block_count;
+        std::vector<std::unique_ptr<TimestampDataBlock>> _timestamp_blocks;
+        std::vector<std::unique_ptr<DataBlock>> _column_blocks; // [column_idx * _max_block_count + block_index]
+        uint32_t _row_count = 0;
+        size_t _string_bytes = 0;
+        int64_t _min_ts = 0;
+        int64_t _max_ts = 0;
+        bool _in_order = true; // timestamps are strictly increasing in slot order
+        uint16_t _filled_block_count = 0; // leading blocks filled up in order, they don't change anymore
+        std::vector<EncodedBlock> _encoded_blocks; // by block index, empty once taken by the conversion
+        bool _sealed = false;
+        std::shared_mutex _mutex;
+    };
+
+    // a block filled up by a write, encoded ahead of the conversion of its mem table
+    struct FilledBlock {
+        MemTableSPtr _mem_table;
+        uint16_t _block_idx;
+    };
+
+    class GlobalMemTableManager;
+
+    using GlobalMemTableManagerSPtr = std::shared_ptr<GlobalMemTableManager>;
+
+    // owns the mem tables which haven't been converted to tsm files yet. every vin has one active
+    // mem table per open time partition, plus the sealed ones under conversion. a mem table is sealed
+    // when it is full, when the vin has moved TIME_PARTITION_SEAL_LAG partitions past it, or when it
+    // is older than MEM_TABLE_MAX_AGE. late rows for a partition already left behind go to a delta
+    // mem table, which only seals when it is full or old so that a slow upload doesn't produce a
+    // tiny tsm file per batch
+    class GlobalMemTableManager {
+    public:
+        GlobalMemTableManager(WalSegmentRefsSPtr wal_refs) : _schema(nullptr), _wal_refs(std::move(wal_refs)) {}
+
+        ~GlobalMemTableManager() = default;
+
+        void init(SchemaSPtr schema, RowCodecSPtr row_codec) {
+            _schema = schema;
+            _row_codec = row_codec;
+        }
+
+        // called once per vin before its id is visible
+        void add_vin(VinId vin_id, uint32_t next_file_seq) {
+            _slots[vin_id]._next_file_seq = next_file_seq;
+        }
+
+        // the mem tables sealed by this row are appended to sealed_mem_tables, which should be converted,
+        // and the blocks it filled up to filled_blocks, which may be encoded ahead
+        void append(VinId vin_id, const Row& row, uint32_t wal_seq, std::vector<MemTableSPtr>& sealed_mem_tables,
+                    std::vector<FilledBlock>& filled_blocks) {
+            const uint32_t row_indices[] = {0};
+            append_batch(vin_id, RowBatch {&row}, row_indices, 1, wal_seq, sealed_mem_tables, filled_blocks);
+        }
+
+        // rows of row_indices belong to the vin and are appended in order,
+        // each run of rows inside one time partition takes the slot lock and the mem table lock once
+        template <typename Batch>
+        void append_batch(VinId vin_id, const Batch& batch, const uint32_t* row_indices, size_t count, uint32_t wal_seq,
+                          std::vector<MemTableSPtr>& sealed_mem_tables, std::vector<FilledBlock>& filled_blocks) {
+            MemTableSlot& slot = _slots[vin_id];
+            std::vector<MemTableSPtr> expired_mem_tables;
+
+            while (count > 0) {
+                int64_t partition = get_time_partition(batch.timestamp(row_indices[0]));
+                MemTableSPtr mem_table;
+                {
+                    std::lock_guard<SpinLock> l(slot._lock);
+                    _expire(slot, partition, expired_mem_tables);
+                    for (const auto &active: slot._actives) {
+                        if (active->partition() == partition) {
+                            mem_table = active;
+                            break;
+                        }
+                    }
+                    if (unlikely(mem_table == nullptr)) {
+                        bool delta = partition + TIME_PARTITION_SEAL_LAG < slot._max_partition;
+                        mem_table = std::make_shared<MemTable>(slot._next_file_seq++, partition, _row_codec, _wal_refs, delta);
+                        slot._actives.emplace_back(mem_table);
+                    }
+                    slot._max_partition = std::max(slot._max_partition, partition);
+                }
+
+                size_t appended;
+                thread_local std::vector<uint16_t> block_indices;
+                block_indices.clear();
+                AppendStatus status = mem_table->append_batch(batch, row_indices, count, wal_seq, appended, &block_indices);
+                for (uint16_t block_idx: block_indices) {
+                    filled_blocks.push_back({mem_table, block_idx});
+                }
+                row_indices += appended;
+                count -= appended;
+                if (likely(status == AppendStatus::OK)) {
+                    continue;
+                }
+
+                {
+                    std::lock_guard<SpinLock> l(slot._lock);
+                    _deactivate(slot, mem_table);
+                }
+
+                if (status == AppendStatus::FULL) {
+                    sealed_mem_tables.emplace_back(std::move(mem_table));
+                }
+            }
+
+            for (auto &expired_mem_table: expired_mem_tables) {
+                if (expired_mem_table->seal()) {
+                    sealed_mem_tables.emplace_back(std::move(expired_mem_table));
+                } else if (expired_mem_table->empty()) {
+                    release(vin_id, expired_mem_table);
+                }
+            }
+        }
+
+        // the sealed mem tables first, then the active one.
+        // take this snapshot before looking up the tsm files, a mem table converted in between
+        // is then found in both places and its file must be skipped by file seq
+        std::vector<MemTableSPtr> get_mem_tables(VinId vin_id) {
+            MemTableSlot& slot = _slots[vin_id];
+            std::lock_guard<SpinLock> l(slot._lock);
+            std::vector<MemTableSPtr> mem_tables = slot._immutables;
+            mem_tables.insert(mem_tables.end(), slot._actives.begin(), slot._actives.end());
+            return mem_tables;
+        }
+
+        static std::vector<uint32_t> get_file_seqs(const std::vector<MemTableSPtr>& mem_tables) {
+            std::vector<uint32_t> file_seqs;
+            for (const auto &mem_table: mem_tables) {
+                file_seqs.emplace_back(mem_table->file_seq());
+            }
+            return file_seqs;
+        }
+
+        // deactivate every active mem table of the vin, the ones with rows are sealed for conversion
+        void seal_all(VinId vin_id, std::vector<MemTableSPtr>& sealed_mem_tables) {
+            MemTableSlot& slot = _slots[vin_id];
+            std::vector<MemTableSPtr> actives;
+            {
+                std::lock_guard<SpinLock> l(slot._lock);
+                actives = slot._actives;
+                for (const auto &mem_table: actives) {
+                    _deactivate(slot, mem_table);
+                }
+            }
+
+            for (auto &mem_table: actives) {
+                if (mem_table->seal()) {
+                    sealed_mem_tables.emplace_back(std::move(mem_table));
+                } else if (mem_table->empty()) {
+                    release(vin_id, mem_table);
+                }
+            }
+        }
+
+        // reserve count file seqs for files rewriting partition_count partitions from partition, return false if one
+        // of them still has mem tables. mem tables created later get larger seqs, so their rows win over the rewritten ones
+        bool reserve_file_seqs(VinId vin_id, int64_t partition, int64_t partition_count, uint32_t count, uint32_t& first_file_seq) {
+            MemTableSlot& slot = _slots[vin_id];
+            std::lock_guard<SpinLock> l(slot._lock);
+            for (const auto &mem_tables: {std::cref(slot._actives), std::cref(slot._immutables)}) {
+                for (const auto &mem_table: mem_tables.get()) {
+                    if (mem_table->partition() >= partition && mem_table->partition() - partition < partition_count) {
+                        return false;
+                    }
+                }
+            }
+            first_file_seq = slot._next_file_seq;
+            slot._next_file_seq += count;
+            return true;
+        }
+
+        // the newest partition the vin has appended rows to in this run, lowest if none
+        int64_t max_partition(VinId vin_id) {
+            MemTableSlot& slot = _slots[vin_id];
+            std::lock_guard<SpinLock> l(slot._lock);
+            return slot._max_partition;
+        }
+
+        // called after the tsm file and its indexes are visible to queries
+        void release(VinId vin_id, const MemTableSPtr& mem_table) {
+            MemTableSlot& slot = _slots[vin_id];
+            std::lock_guard<SpinLock> l(slot._lock);
+            slot._immutables.erase(std::find(slot._immutables.begin(), slot._immutables.end(), mem_table));
+        }
+
+    private:
+        struct MemTableSlot {
+            SpinLock _lock;
+            std::vector<MemTableSPtr> _actives; // at most one per time partition
+            std::vector<MemTableSPtr> _immutables;
+            uint32_t _next_file_seq = 0;
+            int64_t _max_partition = std::numeric_limits<int64_t>::lowest(); // newest partition appended
+        };
+
+        // move the active mem table to the immutables, no more rows can be appended to it.
+        // the slot lock must be held
+        static void _deactivate(MemTableSlot& slot, const MemTableSPtr& mem_table) {
+            auto it = std::find(slot._actives.begin(), slot._actives.end(), mem_table);
+            if (it != slot._actives.end()) {
+                slot._actives.erase(it);
+                slot._immutables.emplace_back(mem_table);
+            }
+        }
+
+        // deactivate the mem tables lagging behind partition, except the delta ones, or too old. they are sealed
+        // by the caller outside the slot lock. the slot lock must be held
+        static void _expire(MemTableSlot& slot, int64_t partition, std::vector<MemTableSPtr>& expired_mem_tables) {
+            for (size_t i = 0; i < slot._actives.size();) {
+                MemTableSPtr mem_table = slot._actives[i];
+                if ((!mem_table->delta() && mem_table->partition() + TIME_PARTITION_SEAL_LAG < partition)
+                    || mem_table->age() > MEM_TABLE_MAX_AGE) {
+                    expired_mem_tables.emplace_back(mem_table);
+                    _deactivate(slot, mem_table);
+                } else {
+                    ++i;
+                }
+            }
+        }
+
+        SchemaSPtr _schema;
+        WalSegmentRefsSPtr _wal_refs;
+        RowCodecSPtr _row_codec;
+        VinArray<MemTableSlot> _slots;
+    };
+
+}
@@ -0,0 +1,518 @@
+/*
+ * Copyright Alibaba Group Holding Ltd.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <atomic>
+#include <map>
+#include <mutex>
+#include <sys/mman.h>
+#include <sys/uio.h>
+
+#include "base.h"
+#include "common/coding.h"
+#include "common/crc32c.h"
+#include "io/file_handle_cache.h"
+#include "io/io_utils.h"
+#include "storage/manifest.h"
+
+namespace LindormContest {
+
+    class Segment;
+
+    using SegmentSPtr = std::shared_ptr<Segment>;
+
+    // tsm files of many vins packed into one large file, so the file count doesn't grow with the vins.
+    // layout: [chunk]...[directory][footer], chunk: [magic][vin id][file seq][size][index offset][crc32c][tsm file],
+    // directory: [entry count][entries], footer: [directory offset][directory size][magic].
+    // chunks are appended concurrently at reserved offsets, a full segment writes its directory once
+    // the last append is done. a segment left without directory by a crash is recovered from the chunk
+    // headers up to the first chunk failing its crc. chunks dropped by compaction are left out of the next directory written and the file is
+    // removed by the first checkpoint after no chunk lives in it.
+    // queries read the tsm files from a shared read only mapping of the segment, so a block is decoded
+    // straight from the page cache. a segment still growing is mapped again with more room once a read
+    // passes the end of its mapping, earlier mappings stay valid until the segment is closed. writes and
+    // the reads of recovery go through a file handle from the cache, the mappings need none.
+    // multi thread safe
+    class Segment {
+    public:
+        Segment(uint32_t segment_seq, const Path& segment_path, FileHandleCacheSPtr file_cache)
+                : _segment_seq(segment_seq), _segment_path(segment_path), _file_cache(std::move(file_cache)) {
+            _file_cache->get(_segment_seq, _segment_path, O_RDWR | O_CREAT);
+        }
+
+        ~Segment() {
+            for (const auto &mapping: _mappings) {
+                ::munmap(mapping->_data, mapping->_size);
+            }
+        }
+
+        Segment(const Segment&) = delete;
+        Segment& operator=(const Segment&) = delete;
+
+        uint32_t segment_seq() const {
+            return _segment_seq;
+        }
+
+        // reserve room for a tsm file, return false once the segment is full
+        bool reserve(uint32_t size, uint64_t& offset) {
+            std::lock_guard<std::mutex> l(_mutex);
+            if (_full) {
+                return false;
+            }
+            offset = _end + CHUNK_HEADER_SIZE;
+            _end = offset + size;
+            _full = _end >= SEGMENT_FILE_SIZE;
+            ++_appending;
+            return true;
+        }
+
+        // write a tsm file at the offset reserved for it. the reservation is given up even if the write throws,
+        // the chunk is left out of the directory then and the segment can still be sealed and removed
+        void append(const SegmentEntry& entry, const std::string& buf) {
+            assert(entry._size == buf.size());
+            AppendingGuard appending_guard(*this);
+            std::string header;
+            put_fixed(&header, CHUNK_MAGIC);
+            put_fixed(&header, entry._vin_id);
+            put_fixed(&header, entry._file_seq);
+            put_fixed(&header, entry._size);
+            put_fixed(&header, entry._index_offset);
+            put_fixed(&header, crc32c::value(buf.data(), buf.size()));
+            assert(header.size() == CHUNK_HEADER_SIZE);
+            struct iovec iov[2] = {{header.data(), header.size()}, {const_cast<char*>(buf.data()), buf.size()}};
+            _pwritev(iov, 2, entry._offset - CHUNK_HEADER_SIZE);
+
+            std::lock_guard<std::mutex> l(_mutex);
+            _entries.emplace(entry._offset, entry);
+            _dirty = true;
+            appending_guard._released = true;
+            if (--_appending == 0 && _full) {
+                _write_directory();
+            }
+        }
+
+        void read(uint64_t offset, uint32_t size, std::string& buf) const {
+            _file()->read(offset, size, buf);
+        }
+
+        // size bytes written at offset, valid as long as the segment is alive. a range read from front
+        // to back, like a column of many blocks, is read ahead, other reads only fault in their pages
+        const char* data(uint64_t offset, uint32_t size, bool sequential = false) {
+            Mapping* mapping = _mapping.load(std::memory_order_acquire);
+            if (unlikely(mapping == nullptr || offset + size > mapping->_size)) {
+                mapping = _map(offset + size);
+            }
+            char* p = mapping->_data + offset;
+            if (sequential && size >= READ_AHEAD_MIN_SIZE) {
+                uintptr_t page_mask = static_cast<uintptr_t>(::getpagesize()) - 1;
+                char* begin = reinterpret_cast<char*>(reinterpret_cast<uintptr_t>(p) & ~page_mask);
+                ::madvise(begin, p + size - begin, MADV_WILLNEED);
+            }
+            return p;
+        }
+
+        // called once the last reader of a compacted tsm file is done
+        void remove_entry(uint64_t offset) {
+            std::lock_guard<std::mutex> l(_mutex);
+            _entries.erase(offset);
+            _dirty = true;
+        }
+
+        // no more appends, write the directory if it is out of date
+        void seal() {
+            std::lock_guard<std::mutex> l(_mutex);
+            _full = true;
+            if (_appending > 0) {
+                return;
+            }
+            if (!_entries.empty() && _dirty) {
+                _write_directory();
+            }
+        }
+
+        bool removed() const {
+            std::lock_guard<std::mutex> l(_mutex);
+            return _removed;
+        }
+
+        // make the chunks appended so far durable
+        void sync() const {
+            if (::fdatasync(_file()->fd()) != 0) {
+                throw std::runtime_error("sync segment failed");
+            }
+        }
+
+        // only called by a checkpoint whose manifest no longer lists the segment
+        void remove() {
+            std::lock_guard<std::mutex> l(_mutex);
+            _remove();
+        }
+
+        // recover the live tsm files of a segment written by the last run, which takes no more appends
+        void recover(std::vector<SegmentEntry>& entries) {
+            std::lock_guard<std::mutex> l(_mutex);
+            _full = true;
+            _end = std::filesystem::file_size(_segment_path);
+            if (!_read_directory(entries)) {
+                ERR_LOG("segment %u has no directory, scanning its chunks", _segment_seq)
+                _scan_chunks(entries);
+                _dirty = true;
+            }
+            for (const auto &entry: entries) {
+                _entries.emplace(entry._offset, entry);
+            }
+        }
+
+        // recover the tsm files listed by the manifest, chunks appended after its checkpoint are dropped
+        void recover_from_manifest(const std::vector<SegmentEntry>& entries) {
+            std::lock_guard<std::mutex> l(_mutex);
+            _full = true;
+            _end = std::filesystem::file_size(_segment_path);
+            _dirty = true;
+            for (const auto &entry: entries) {
+                _entries.emplace(entry._offset, entry);
+            }
+        }
+
+    private:
+        friend class GlobalSegmentManager;
+
+        static constexpr uint32_t CHUNK_MAGIC = 0x324b4843; // "CHK2"
+        static constexpr uint32_t V1_CHUNK_MAGIC = 0x4b4e4843; // "CHNK", written by older versions without a crc
+        static constexpr uint32_t FOOTER_MAGIC = 0x47455344; // "DSEG"
+        static constexpr size_t CHUNK_HEADER_SIZE = 5 * sizeof(uint32_t) + sizeof(VinId);
+        static constexpr size_t V1_CHUNK_HEADER_SIZE = 4 * sizeof(uint32_t) + sizeof(VinId);
+        static constexpr size_t FOOTER_SIZE = sizeof(uint64_t) + 2 * sizeof(uint32_t);
+        static constexpr uint32_t READ_AHEAD_MIN_SIZE = 64 * 1024;
+
+        struct Mapping {
+            char* _data;
+            uint64_t _size;
+        };
+
+        // gives up the reservation of an append which didn't get to write its chunk
+        struct AppendingGuard {
+            Segment& _segment;
+            bool _released = false;
+
+            explicit AppendingGuard(Segment& segment) : _segment(segment) {}
+
+            ~AppendingGuard() {
+                if (unlikely(!_released)) {
+                    std::lock_guard<std::mutex> l(_segment._mutex);
+                    --_segment._appending;
+                }
+            }
+        };
+
+        // map at least end bytes. the mapping may reach past the end of the file, only the bytes
+        // written are ever read. the pages are read on demand, readahead is left to sequential reads
+        Mapping* _map(uint64_t end) {
+            std::lock_guard<std::mutex> l(_mutex);
+            Mapping* mapping = _mapping.load(std::memory_order_relaxed);
+            if (mapping != nullptr && end <= mapping->_size) {
+                return mapping;
+            }
+            uint64_t size = std::max<uint64_t>(end, mapping == nullptr ? SEGMENT_FILE_SIZE : 2 * mapping->_size);
+            void* data = ::mmap(nullptr, size, PROT_READ, MAP_SHARED, _file()->fd(), 0);
+            if (data == MAP_FAILED) {
+                throw std::runtime_error("mmap segment failed");
+            }
+            ::madvise(data, size, MADV_RANDOM);
+            _mappings.emplace_back(std::make_unique<Mapping>(Mapping {static_cast<char*>(data), size}));
+            _mapping.store(_mappings.back().get(), std::memory_order_release);
+            return _mappings.back().get();
+        }
+
+        void _pwritev(struct iovec* iov, int iov_count, uint64_t offset) {
+            size_t size = 0;
+            for (int i = 0; i < iov_count; ++i) {
+                size += iov[i].iov_len;
+            }
+            ssize_t written = ::pwritev(_file()->fd(), iov, iov_count, static_cast<off_t>(offset));
+            if (written != static_cast<ssize_t>(size)) {
+                throw std::runtime_error("write segment failed");
+            }
+        }
+
+        // appended after the chunks, a later directory replaces the earlier ones
+        void _write_directory() {
+            std::string buf;
+            put_fixed(&buf, static_cast<uint32_t>(_entries.size()));
+            for (const auto &[offset, entry]: _entries) {
+                entry.encode_to(&buf);
+            }
+            uint32_t directory_size = buf.size();
+            put_fixed(&buf, _end);
+            put_fixed(&buf, directory_size);
+            put_fixed(&buf, FOOTER_MAGIC);
+            struct iovec iov[1] = {{buf.data(), buf.size()}};
+            _pwritev(iov, 1, _end);
+            _end += buf.size();
+            _dirty = false;
+        }
+
+        bool _read_directory(std::vector<SegmentEntry>& entries) const {
+            if (_end < FOOTER_SIZE) {
+                return false;
+            }
+            std::string footer;
+            read(_end - FOOTER_SIZE, FOOTER_SIZE, footer);
+            const uint8_t* p = reinterpret_cast<const uint8_t*>(footer.c_str());
+            uint64_t directory_offset = decode_fixed<uint64_t>(p);
+            uint32_t directory_size = decode_fixed<uint32_t>(p);
+            if (decode_fixed<uint32_t>(p) != FOOTER_MAGIC || directory_offset + directory_size + FOOTER_SIZE != _end) {
+                return false;
+            }
+            std::string directory;
+            read(directory_offset, directory_size, directory);
+            p = reinterpret_cast<const uint8_t*>(directory.c_str());
+            entries.resize(decode_fixed<uint32_t>(p));
+            for (auto &entry: entries) {
+                entry.decode_from(p);
+            }
+            return true;
+        }
+
+        // chunks up to the first torn or corrupted one. the rows of the chunks behind it are replayed from
+        // the wal, which only a checkpoint saving the manifest cuts
+        void _scan_chunks(std::vector<SegmentEntry>& entries) const {
+            std::string header;
+            std::string chunk;
+            uint64_t offset = 0;
+            while (offset + V1_CHUNK_HEADER_SIZE <= _end) {
+                read(offset, std::min<uint64_t>(CHUNK_HEADER_SIZE, _end - offset), header);
+                const uint8_t* p = reinterpret_cast<const uint8_t*>(header.c_str());
+                uint32_t magic = decode_fixed<uint32_t>(p);
+                size_t header_size = magic == CHUNK_MAGIC ? CHUNK_HEADER_SIZE : V1_CHUNK_HEADER_SIZE;
+                if ((magic != CHUNK_MAGIC && magic != V1_CHUNK_MAGIC) || offset + header_size > _end) {
+                    break;
+                }
+                SegmentEntry entry;
+                entry._vin_id = decode_fixed<VinId>(p);
+                entry._file_seq = decode_fixed<uint32_t>(p);
+                entry._size = decode_fixed<uint32_t>(p);
+                entry._index_offset = decode_fixed<uint32_t>(p);
+                entry._offset = offset + header_size;
+                if (entry._offset + entry._size > _end) {
+                    break;
+                }
+                if (magic == CHUNK_MAGIC) {
+                    uint32_t crc = decode_fixed<uint32_t>(p);
+                    read(entry._offset, entry._size, chunk);
+                    if (crc32c::value(chunk.data(), chunk.size()) != crc) {
+                        ERR_LOG("chunk at %lu of segment %u is corrupted, the chunks behind it are dropped", offset, _segment_seq)
+                        break;
+                    }
+                }
+                entries.emplace_back(entry);
+                offset = entry._offset + entry._size;
+            }
+        }
+
+        // reopened without O_CREAT, a removed segment is never created again
+        FileHandleSPtr _file() const {
+            return _file_cache->get(_segment_seq, _segment_path, O_RDWR);
+        }
+
+        void _remove() {
+            _removed = true;
+            _file_cache->erase(_segment_seq);
+            std::error_code ec;
+            std::filesystem::remove(_segment_path, ec);
+        }
+
+        uint32_t _segment_seq;
+        Path _segment_path;
+        FileHandleCacheSPtr _file_cache;
+        bool _removed = false;
+        mutable std::mutex _mutex;
+        uint64_t _end = 0;       // where the next chunk or directory is written
+        uint32_t _appending = 0; // reserved chunks not written yet
+        bool _full = false;
+        bool _dirty = false;     // the last directory written misses a change
+        std::map<uint64_t, SegmentEntry> _entries; // live tsm files by offset
+        std::vector<std::unique_ptr<Mapping>> _mappings;
+        std::atomic<Mapping*> _mapping {nullptr}; // the largest one
+    };
+
+    class GlobalSegmentManager;
+
+    using GlobalSegmentManagerSPtr = std::shared_ptr<GlobalSegmentManager>;
+
+    // the tsm files of all vins go to one active segment at a time, which is replaced once it is full.
+    // a checkpoint syncs the segments and saves the live tsm files to the manifest, recovery then
+    // takes exactly these files. segments of a run without a checkpoint are recovered from their
+    // directories and chunk headers.
+    // multi thread safe
+    class GlobalSegmentManager {
+    public:
+        GlobalSegmentManager(const Path& root_path, size_t fd_budget = FILE_HANDLE_BUDGET)
+                : _segment_dir_path(root_path / "segments"), _manifest_path(root_path / "MANIFEST"),
+                  _file_cache(std::make_shared<FileHandleCache>(fd_budget)) {
+            std::filesystem::create_directories(_segment_dir_path);
+        }
+
+        ~GlobalSegmentManager() = default;
+
+        // feed every live tsm file of the segments left by the last run to the visitor,
+        // return the wal checkpoint of the manifest or 0 without one
+        template <typename F>
+        uint32_t recover(F&& visitor) {
+            std::lock_guard<std::mutex> l(_mutex);
+            Manifest manifest;
+            bool has_manifest = manifest.load(_manifest_path);
+            for (const auto& entry: std::filesystem::directory_iterator(_segment_dir_path)) {
+                uint32_t segment_seq;
+                if (!io::parse_seq_file_name(entry, segment_seq)) {
+                    ERR_LOG("%s is not a segment, skipped", entry.path().c_str())
+                    continue;
+                }
+                _next_segment_seq = std::max(_next_segment_seq, segment_seq + 1);
+                auto it = manifest._segments.find(segment_seq);
+                if (has_manifest && it == manifest._segments.end()) {
+                    // created after the checkpoint, its rows are replayed from the wal
+                    std::filesystem::remove(entry.path());
+                    continue;
+                }
+                auto segment = std::make_shared<Segment>(segment_seq, entry.path(), _file_cache);
+                std::vector<SegmentEntry> segment_entries;
+                if (has_manifest) {
+                    segment_entries = it->second;
+                    segment->recover_from_manifest(segment_entries);
+                    manifest._segments.erase(it);
+                } else {
+                    segment->recover(segment_entries);
+                }
+                for (const auto &segment_entry: segment_entries) {
+                    visitor(segment, segment_entry);
+                }
+                _segments.emplace_back(std::move(segment));
+            }
+            for (const auto &[segment_seq, entries]: manifest._segments) {
+                ERR_LOG("segment %u of the manifest is missing, %zu files are lost", segment_seq, entries.size())
+            }
+            if (has_manifest) {
+                INFO_LOG("recovered the segments of the manifest, the wal is replayed from segment %u", manifest._wal_checkpoint)
+            }
+            _wal_checkpoint = manifest._wal_checkpoint;
+            return _wal_checkpoint;
+        }
+
+        // the wal segments before wal_checkpoint only hold rows of live tsm files. sync these files and the
+        // directory entries of new segments, run sync_dependencies for the other files the manifest relies on,
+        // e.g. the vin dictionary, then save the files to the manifest and remove the segments left without a live file
+        template <typename F>
+        void checkpoint(uint32_t wal_checkpoint, F&& sync_dependencies) {
+            std::lock_guard<std::mutex> checkpoint_lock(_checkpoint_mutex);
+            if (wal_checkpoint < _wal_checkpoint) {
+                return;
+            }
+            Manifest manifest;
+            manifest._wal_checkpoint = wal_checkpoint;
+            std::vector<SegmentSPtr> segments;
+            std::vector<SegmentSPtr> removable_segments;
+            bool segment_created;
+            {
+                std::lock_guard<std::mutex> l(_mutex);
+                segments = _segments;
+                segment_created = _segment_created;
+                _segment_created = false;
+                // compaction appends its outputs before it drops its inputs, possibly in another segment.
+                // all segments are locked at once, so the manifest never misses both
+                std::vector<std::unique_lock<std::mutex>> segment_locks;
+                for (const auto &segment: segments) {
+                    segment_locks.emplace_back(segment->_mutex);
+                }
+                for (const auto &segment: segments) {
+                    if (!segment->_entries.empty()) {
+                        std::vector<SegmentEntry>& entries = manifest._segments[segment->_segment_seq];
+                        for (const auto &[offset, entry]: segment->_entries) {
+                            entries.emplace_back(entry);
+                        }
+                    } else if (segment->_full && segment->_appending == 0 && !segment->_removed) {
+                        removable_segments.emplace_back(segment);
+                    }
+                }
+            }
+            for (const auto &segment: segments) {
+                if (manifest._segments.contains(segment->segment_seq())) {
+                    segment->sync();
+                }
+            }
+            try {
+                if (segment_created) {
+                    io::sync_dir(_segment_dir_path);
+                }
+                sync_dependencies();
+            } catch (...) {
+                std::lock_guard<std::mutex> l(_mutex);
+                _segment_created |= segment_created;
+                throw;
+            }
+            manifest.save(_manifest_path);
+            _wal_checkpoint = wal_checkpoint;
+
+            for (const auto &segment: removable_segments) {
+                segment->remove();
+            }
+            std::lock_guard<std::mutex> l(_mutex);
+            _segments.erase(std::remove_if(_segments.begin(), _segments.end(), [](const SegmentSPtr& segment) {
+                return segment->removed();
+            }), _segments.end());
+        }
+
+        // write the encoded tsm file of a vin, return the segment holding it and its offset inside
+        SegmentSPtr append(VinId vin_id, uint32_t file_seq, const std::string& buf, uint32_t index_offset, uint64_t& offset) {
+            SegmentSPtr segment;
+            {
+                std::lock_guard<std::mutex> l(_mutex);
+                while (_active_segment == nullptr || !_active_segment->reserve(buf.size(), offset)) {
+                    _active_segment = std::make_shared<Segment>(_next_segment_seq, _segment_dir_path / std::to_string(_next_segment_seq),
+                                                               _file_cache);
+                    ++_next_segment_seq;
+                    _segments.emplace_back(_active_segment);
+                    _segment_created = true;
+                }
+                segment = _active_segment;
+            }
+            segment->append({vin_id, file_seq, offset, static_cast<uint32_t>(buf.size()), index_offset}, buf);
+            return segment;
+        }
+
+        // after the last append, every segment gets an up to date directory
+        void seal_all() {
+            std::lock_guard<std::mutex> l(_mutex);
+            for (const auto &segment: _segments) {
+                segment->seal();
+            }
+            _active_segment = nullptr;
+        }
+
+    private:
+        Path _segment_dir_path;
+        Path _manifest_path;
+        FileHandleCacheSPtr _file_cache; // open segments, shared with them
+        std::mutex _mutex;
+        std::mutex _checkpoint_mutex;
+        uint32_t _wal_checkpoint = 0; // of the last manifest saved
+        SegmentSPtr _active_segment;
+        std::vector<SegmentSPtr> _segments;
+        uint32_t _next_segment_seq = 0;
+        bool _segment_created = false; // since the last checkpoint, the segment dir must be synced
+    };
+
+}
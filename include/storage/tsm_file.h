@@ -20,20 +20,37 @@ extern "C" {
 }
 
 #include "struct/Schema.h"
+#include "common/arena.h"
 #include "common/coding.h"
+#include "common/crc32c.h"
 #include "common/thread_pool.h"
 #include "common/time_range.h"
+#include "compression/compression_profile.h"
 #include "compression/compressor.h"
 #include "io/io_utils.h"
 #include "../source/pfor/deltautil.h"
 
 namespace LindormContest {
 
+    // tsm files written before the footer end with the index offset alone, with 32 bit offsets and no checksums.
+    // v3 adds the block stats past sum and max to the index entries
+    static constexpr uint32_t TSM_VERSION_1 = 1;
+    static constexpr uint32_t TSM_VERSION_2 = 2;
+    static constexpr uint32_t TSM_VERSION_3 = 3;
+
+    // the stats of a block are of the rows of the block, the padding of a partial block is left out.
+    // the first and last values are at the min and max ts of the block in the time index
     struct IndexEntry {
         char _sum[8];        // int64_t or double_t
         char _max[8];        // int32_t or double_t
-        uint32_t _offset;
+        char _min[8];        // int32_t or double_t, only in v3 files
+        char _first[8];      // value of the first row, only in v3 files
+        char _last[8];       // value of the last row, only in v3 files
+        uint16_t _count = 0;     // values which aren't NaN, only in v3 files
+        uint16_t _nan_count = 0; // NaN values of a double column, only in v3 files
+        uint64_t _offset;
         uint32_t _size;
+        uint32_t _crc = 0;   // crc32c of the block, 0 in v1 files
 
         template <typename T>
         T get_sum() const {
@@ -55,58 +72,186 @@ namespace LindormContest {
             *reinterpret_cast<T*>(_max) = max;
         }
 
+        template <typename T>
+        T get_min() const {
+            return *reinterpret_cast<const T*>(_min);
+        }
+
+        template <typename T>
+        void set_min(T min) {
+            *reinterpret_cast<T*>(_min) = min;
+        }
+
+        template <typename T>
+        T get_first() const {
+            return *reinterpret_cast<const T*>(_first);
+        }
+
+        template <typename T>
+        void set_first(T first) {
+            *reinterpret_cast<T*>(_first) = first;
+        }
+
+        template <typename T>
+        T get_last() const {
+            return *reinterpret_cast<const T*>(_last);
+        }
+
+        template <typename T>
+        void set_last(T last) {
+            *reinterpret_cast<T*>(_last) = last;
+        }
+
         void encode_to(std::string *buf) const {
             buf->append(_sum, 8);
             buf->append(_max, 8);
+            buf->append(_min, 8);
+            buf->append(_first, 8);
+            buf->append(_last, 8);
+            put_fixed(buf, _count);
+            put_fixed(buf, _nan_count);
             put_fixed(buf, _offset);
             put_fixed(buf, _size);
+            put_fixed(buf, _crc);
         }
 
-        void decode_from(const uint8_t *&buf) {
+        void decode_from(const uint8_t *&buf, uint32_t version) {
             std::memcpy(_sum, buf, 8);
             buf += 8;
             std::memcpy(_max, buf, 8);
             buf += 8;
-            _offset = decode_fixed<uint32_t>(buf);
+            if (version >= TSM_VERSION_3) {
+                std::memcpy(_min, buf, 8);
+                buf += 8;
+                std::memcpy(_first, buf, 8);
+                buf += 8;
+                std::memcpy(_last, buf, 8);
+                buf += 8;
+                _count = decode_fixed<uint16_t>(buf);
+                _nan_count = decode_fixed<uint16_t>(buf);
+            }
+            if (version == TSM_VERSION_1) {
+                _offset = decode_fixed<uint32_t>(buf);
+                _size = decode_fixed<uint32_t>(buf);
+                return;
+            }
+            _offset = decode_fixed<uint64_t>(buf);
+            _size = decode_fixed<uint32_t>(buf);
+            _crc = decode_fixed<uint32_t>(buf);
+        }
+
+        static constexpr size_t encoded_size(uint32_t version) {
+            return version == TSM_VERSION_1 ? 16 + 2 * sizeof(uint32_t)
+                 : version == TSM_VERSION_2 ? 16 + sizeof(uint64_t) + 2 * sizeof(uint32_t)
+                 : 40 + 2 * sizeof(uint16_t) + sizeof(uint64_t) + 2 * sizeof(uint32_t);
+        }
+    };
+
+    // time index entry of one block, shared by all columns since their blocks hold the same rows
+    struct TimeIndexEntry {
+        int64_t _min_ts;
+        int64_t _max_ts;
+        uint16_t _count;     // rows of the block, the last block of a file may be partial
+        uint64_t _offset;    // of the timestamp block
+        uint32_t _size;
+        uint32_t _crc = 0;
+
+        void encode_to(std::string *buf) const {
+            put_fixed(buf, _min_ts);
+            put_fixed(buf, _max_ts);
+            put_fixed(buf, _count);
+            put_fixed(buf, _offset);
+            put_fixed(buf, _size);
+            put_fixed(buf, _crc);
+        }
+
+        void decode_from(const uint8_t *&buf, uint32_t version) {
+            _min_ts = decode_fixed<int64_t>(buf);
+            _max_ts = decode_fixed<int64_t>(buf);
+            _count = decode_fixed<uint16_t>(buf);
+            if (version == TSM_VERSION_1) {
+                _offset = decode_fixed<uint32_t>(buf);
+                _size = decode_fixed<uint32_t>(buf);
+                return;
+            }
+            _offset = decode_fixed<uint64_t>(buf);
             _size = decode_fixed<uint32_t>(buf);
+            _crc = decode_fixed<uint32_t>(buf);
         }
+
+        static constexpr size_t encoded_size(uint32_t version) {
+            return 2 * sizeof(int64_t) + sizeof(uint16_t)
+                   + (version == TSM_VERSION_1 ? 2 * sizeof(uint32_t) : sizeof(uint64_t) + 2 * sizeof(uint32_t));
+        }
+    };
+
+    // the last bytes of a v2 tsm file, read first to find the index
+    struct TsmFooter {
+        uint64_t _index_offset;
+        uint32_t _index_size;
+        uint32_t _index_crc;
+        uint32_t _version;
+        uint32_t _magic;
+
+        void encode_to(std::string *buf) const {
+            put_fixed(buf, _index_offset);
+            put_fixed(buf, _index_size);
+            put_fixed(buf, _index_crc);
+            put_fixed(buf, _version);
+            put_fixed(buf, _magic);
+        }
+
+        void decode_from(const uint8_t *buf) {
+            _index_offset = decode_fixed<uint64_t>(buf);
+            _index_size = decode_fixed<uint32_t>(buf);
+            _index_crc = decode_fixed<uint32_t>(buf);
+            _version = decode_fixed<uint32_t>(buf);
+            _magic = decode_fixed<uint32_t>(buf);
+        }
+
+        // a v1 file ends with its index offset, which is never both the magic and consistent with the file size
+        bool valid(uint64_t file_size) const {
+            return _magic == MAGIC && _index_offset + _index_size + ENCODED_SIZE == file_size;
+        }
+
+        static constexpr uint32_t MAGIC = 0x324d5354; // "TSM2"
+        static constexpr size_t ENCODED_SIZE = sizeof(uint64_t) + 4 * sizeof(uint32_t);
     };
 
-    // one entry corresponds to one column
+    // one entry corresponds to one data block of the column
     struct IndexBlock {
-        std::array<IndexEntry, DATA_BLOCK_COUNT> _index_entries;
+        std::vector<IndexEntry> _index_entries;
 
         IndexBlock() = default;
 
+        IndexBlock(size_t block_count) : _index_entries(block_count) {}
+
         IndexBlock(const IndexBlock& other) = default;
 
         IndexBlock& operator=(const IndexBlock& other) = default;
 
-        IndexBlock(IndexBlock &&other) noexcept : _index_entries(other._index_entries) {}
+        IndexBlock(IndexBlock &&other) noexcept = default;
 
         ~IndexBlock() = default;
 
-        void get_index_entries_and_ranges(const TimeRange& file_tr, std::vector<IndexEntry>& index_entries, std::vector<IndexRange>& ranges) {
-            for (uint16_t i = file_tr._start_idx / DATA_BLOCK_ITEM_NUMS; i <= file_tr._end_idx / DATA_BLOCK_ITEM_NUMS; ++i) {
-                index_entries.emplace_back(_index_entries[i]);
-                ranges.emplace_back(std::max(file_tr._start_idx, (uint16_t) (i * DATA_BLOCK_ITEM_NUMS)) % DATA_BLOCK_ITEM_NUMS,
-                                    std::min(file_tr._end_idx, (uint16_t) ((i + 1) * DATA_BLOCK_ITEM_NUMS - 1)) % DATA_BLOCK_ITEM_NUMS);
-            }
-        }
-
         void encode_to(std::string *buf) const {
-            for (uint16_t i = 0; i < DATA_BLOCK_COUNT; ++i) {
-                _index_entries[i].encode_to(buf);
+            for (const auto &index_entry: _index_entries) {
+                index_entry.encode_to(buf);
             }
         }
 
-        void decode_from(const uint8_t *&buf) {
-            for (uint16_t i = 0; i < DATA_BLOCK_COUNT; ++i) {
-                _index_entries[i].decode_from(buf);
+        void decode_from(const uint8_t *&buf, size_t block_count, uint32_t version) {
+            _index_entries.resize(block_count);
+            for (auto &index_entry: _index_entries) {
+                index_entry.decode_from(buf, version);
             }
         }
     };
 
+    enum class TimestampCompressType : uint8_t {
+        DELTA_OF_DELTA
+    };
+
     enum class IntCompressType : uint8_t {
         SAME,
         BITPACK,
@@ -118,7 +263,12 @@ namespace LindormContest {
         FASTPFOR_ZSTD,
         FASTPFOR_BROTLI,
         ZSTD,
-        PLAIN
+        PLAIN,
+        SIMPLE8B_BROTLI,
+        BITPACK_LZ4,
+        SIMPLE8B_LZ4,
+        FASTPFOR_LZ4,
+        LZ4
     };
 
     enum class DoubleCompressType : uint8_t {
@@ -128,7 +278,10 @@ namespace LindormContest {
         CHIMP,
         CHIMP_ZSTD,
         CHIMP_BROTLI,
-        PLAIN
+        PLAIN,
+        GORILLA_BROTLI,
+        GORILLA_LZ4,
+        CHIMP_LZ4
     };
 
     enum class StringCompressType : uint8_t {
@@ -136,7 +289,9 @@ namespace LindormContest {
         ZSTD_SAME_LENGTH,
         BROTLI,
         BROTLI_SAME_LENGTH,
-        PLAIN
+        PLAIN,
+        LZ4,
+        LZ4_SAME_LENGTH
     };
 
     struct DataBlock {
@@ -149,8 +304,107 @@ namespace LindormContest {
         virtual void decode_from_decompress(const char* buf) = 0;
     };
 
+    // timestamps of one block in ascending order, encoded as bitpacked delta of deltas
+    struct TimestampDataBlock : public DataBlock {
+        std::array<int64_t, DATA_BLOCK_ITEM_NUMS> _timestamps;
+        uint16_t _count = 0;
+
+        TimestampDataBlock() = default;
+
+        ~TimestampDataBlock() override = default;
+
+        void encode_to_compress(std::string *buf) const override {
+            std::array<uint64_t, DATA_BLOCK_ITEM_NUMS> delta_of_deltas;
+            delta_of_delta_encode(_timestamps.data(), delta_of_deltas.data(), _count);
+            uint64_t max_value = 0;
+
+            for (uint16_t i = 2; i < _count; ++i) {
+                max_value = std::max(max_value, delta_of_deltas[i]);
+            }
+
+            uint8_t required_bits = get_required_bits64(max_value);
+            put_fixed(buf, static_cast<uint8_t>(TimestampCompressType::DELTA_OF_DELTA));
+            put_fixed(buf, _count);
+            put_fixed(buf, delta_of_deltas[0]);
+            put_fixed(buf, _count > 1 ? delta_of_deltas[1] : 0);
+            put_fixed(buf, required_bits);
+            if (_count > 2) {
+                bit_packing_encoding64(required_bits, delta_of_deltas.data() + 2, _count - 2, buf);
+            }
+        }
+
+        void decode_from_decompress(const char* buf) override {
+            assert(static_cast<TimestampCompressType>(*buf) == TimestampCompressType::DELTA_OF_DELTA);
+            const uint8_t* p = reinterpret_cast<const uint8_t*>(buf + sizeof(uint8_t));
+            _count = decode_fixed<uint16_t>(p);
+            std::array<uint64_t, DATA_BLOCK_ITEM_NUMS> delta_of_deltas;
+            delta_of_deltas[0] = decode_fixed<uint64_t>(p);
+            delta_of_deltas[1] = decode_fixed<uint64_t>(p);
+            uint8_t required_bits = decode_fixed<uint8_t>(p);
+            if (_count > 2) {
+                if (required_bits == 0) {
+                    std::fill(delta_of_deltas.begin() + 2, delta_of_deltas.begin() + _count, 0);
+                } else {
+                    bit_packing_decoding64(required_bits, reinterpret_cast<const char*>(p), delta_of_deltas.data() + 2, _count - 2);
+                }
+            }
+            delta_of_delta_decode(delta_of_deltas.data(), _timestamps.data(), _count);
+        }
+
+        // rows of the block inside tr, return false if there is none
+        bool get_range(const TimeRange& tr, IndexRange& range) const {
+            auto begin = _timestamps.begin();
+            auto end = _timestamps.begin() + _count;
+            auto lower = std::lower_bound(begin, end, tr._start_time);
+            auto upper = std::lower_bound(lower, end, tr._end_time);
+            if (lower == upper) {
+                return false;
+            }
+            range._start_index = lower - begin;
+            range._end_index = upper - begin - 1;
+            return true;
+        }
+    };
+
+    // a first stage output compressed again by a second stage is written as
+    // [uncompress size][compress size][header of the codec][data]
+    struct StagedBlock {
+        // return the first stage output decompressed into scratch memory, aligned for simd loads
+        static const char* read(SecondStage second_stage, const char* buf, size_t header_size, ScratchScope& scratch,
+                                uint32_t& size) {
+            uint32_t uncompress_size = *reinterpret_cast<const uint32_t*>(buf);
+            uint32_t compress_size = *reinterpret_cast<const uint32_t*>(buf + sizeof(uint32_t));
+            char* uncompress_data = scratch.allocate(uncompress_size);
+            compression::decompress_second_stage(second_stage, buf + 2 * sizeof(uint32_t) + header_size, compress_size,
+                                                 uncompress_data, uncompress_size);
+            size = uncompress_size;
+            return uncompress_data;
+        }
+
+        // the block type which records the second stage of the profile
+        template <typename Type>
+        static Type staged_type(const CompressionProfile& profile, Type lz4_type, Type zstd_type, Type brotli_type) {
+            switch (profile._second_stage) {
+                case SecondStage::LZ4:
+                    return lz4_type;
+                case SecondStage::ZSTD:
+                    return zstd_type;
+                default:
+                    return brotli_type;
+            }
+        }
+
+        // the second stage of the profile over data into scratch memory, return the compressed size
+        // or 0 if the profile has no second stage or it doesn't pay off
+        static uint32_t compress(const CompressionProfile& profile, const char* data, uint32_t size, ScratchScope& scratch,
+                                 char*& compress_data) {
+            compress_data = scratch.allocate(compression::second_stage_bound(size));
+            return compression::compress_second_stage(profile, data, size, compress_data);
+        }
+    };
+
     struct IntDataBlock : public DataBlock {
-        std::array<int32_t, DATA_BLOCK_ITEM_NUMS> _column_values;
+        alignas(16) std::array<int32_t, DATA_BLOCK_ITEM_NUMS> _column_values; // simd codecs decode straight into it
         IntCompressType _type = IntCompressType::FASTPFOR;
         int64_t _sum = 0;
         int32_t _min = std::numeric_limits<int32_t>::max();
@@ -162,22 +416,37 @@ namespace LindormContest {
         ~IntDataBlock() override = default;
 
         void encode_to_compress(std::string *buf) const override {
-            if (_type == IntCompressType::SAME) {
-                encode_to_same(buf);
-            } else if (_type == IntCompressType::BITPACK) {
-                encode_to_bitpack(buf);
-            } else if (_type == IntCompressType::SIMPLE8B) {
-                if (!encode_to_simple8b(buf)) {
-                    if (!encode_to_zstd(buf)) {
-                        encode_to_plain(buf);
-                    }
-                }
-            } else if (_type == IntCompressType::FASTPFOR) {
-                if (!encode_to_fastpfor(buf)) {
-                    if (!encode_to_zstd(buf)) {
-                        encode_to_plain(buf);
-                    }
-                }
+            encode_with(_type, CompressionProfile::balanced(), buf);
+        }
+
+        // type is the first stage codec and the profile adds the second stage. the written type may
+        // differ, e.g. if the second stage doesn't pay off or the codec falls back to plain
+        void encode_with(IntCompressType type, const CompressionProfile& profile, std::string *buf) const {
+            bool encoded = false;
+            switch (type) {
+                case IntCompressType::SAME:
+                    encode_to_same(buf);
+                    return;
+                case IntCompressType::BITPACK:
+                    encoded = encode_to_bitpack(profile, buf);
+                    break;
+                case IntCompressType::SIMPLE8B:
+                    encoded = encode_to_simple8b(profile, buf);
+                    break;
+                case IntCompressType::FASTPFOR:
+                    encoded = encode_to_fastpfor(profile, buf);
+                    break;
+                case IntCompressType::ZSTD:
+                    encoded = encode_to_zstd(profile, buf);
+                    break;
+                case IntCompressType::LZ4:
+                    encoded = encode_to_lz4(profile, buf);
+                    break;
+                default:
+                    break;
+            }
+            if (!encoded) {
+                encode_to_plain(buf);
             }
         }
 
@@ -193,28 +462,43 @@ namespace LindormContest {
                     decode_from_simple8b(buf);
                     break;
                 case IntCompressType::SIMPLE8B_ZSTD:
-                    decode_from_simple8b_zstd(buf);
+                    decode_from_simple8b_staged(buf, SecondStage::ZSTD);
+                    break;
+                case IntCompressType::SIMPLE8B_BROTLI:
+                    decode_from_simple8b_staged(buf, SecondStage::BROTLI);
+                    break;
+                case IntCompressType::SIMPLE8B_LZ4:
+                    decode_from_simple8b_staged(buf, SecondStage::LZ4);
                     break;
                 case IntCompressType::FASTPFOR:
                     decode_from_fastpfor(buf);
                     break;
                 case IntCompressType::FASTPFOR_ZSTD:
-                    decode_from_fastpfor_zstd(buf);
+                    decode_from_fastpfor_staged(buf, SecondStage::ZSTD);
                     break;
                 case IntCompressType::FASTPFOR_BROTLI:
-                    decode_from_fastpfor_brotli(buf);
+                    decode_from_fastpfor_staged(buf, SecondStage::BROTLI);
+                    break;
+                case IntCompressType::FASTPFOR_LZ4:
+                    decode_from_fastpfor_staged(buf, SecondStage::LZ4);
                     break;
                 case IntCompressType::ZSTD:
                     decode_from_zstd(buf);
                     break;
+                case IntCompressType::LZ4:
+                    decode_from_lz4(buf);
+                    break;
                 case IntCompressType::BITPACK:
                     decode_from_bitpack(buf);
                     break;
                 case IntCompressType::BITPACK_ZSTD:
-                    decode_from_bitpack_zstd(buf);
+                    decode_from_bitpack_staged(buf, SecondStage::ZSTD);
                     break;
                 case IntCompressType::BITPACK_BROTLI:
-                    decode_from_bitpack_brotli(buf);
+                    decode_from_bitpack_staged(buf, SecondStage::BROTLI);
+                    break;
+                case IntCompressType::BITPACK_LZ4:
+                    decode_from_bitpack_staged(buf, SecondStage::LZ4);
                     break;
                 case IntCompressType::PLAIN:
                     decode_from_plain(buf);
@@ -232,29 +516,30 @@ namespace LindormContest {
             std::fill(_column_values.begin(), _column_values.end(), same_value);
         }
 
-        bool encode_to_simple8b(std::string* buf) const {
+        // simple8b: [uncompress size][compress size][data]
+        // staged: [second stage sizes][uncompress size][data]
+        bool encode_to_simple8b(const CompressionProfile& profile, std::string* buf) const {
             const char* stage_one_uncompress_data = reinterpret_cast<const char*>(_column_values.data());
             uint32_t stage_one_uncompress_size = DATA_BLOCK_ITEM_NUMS * sizeof(int32_t);
-            std::unique_ptr<char[]> stage_one_compress_data = std::make_unique<char[]>(stage_one_uncompress_size * 2);
-            uint32_t stage_one_compress_size = compression::compress_int32_simple8b(stage_one_uncompress_data, stage_one_uncompress_size, stage_one_compress_data.get());
+            ScratchScope scratch;
+            char* stage_one_compress_data = scratch.allocate(stage_one_uncompress_size * 2);
+            uint32_t stage_one_compress_size = compression::compress_int32_simple8b(stage_one_uncompress_data, stage_one_uncompress_size, stage_one_compress_data);
             if (stage_one_compress_size >= stage_one_uncompress_size) {
                 return false;
             }
-            const char* stage_two_uncompress_data = stage_one_compress_data.get();
-            uint32_t stage_two_uncompress_size = stage_one_compress_size;
-            std::unique_ptr<char[]> stage_two_compress_data = std::make_unique<char[]>(stage_two_uncompress_size * 2);
-            uint32_t stage_two_compress_size = compression::compress_string_zstd(stage_two_uncompress_data, stage_two_uncompress_size, stage_two_compress_data.get());
-            if (stage_two_compress_size >= stage_two_uncompress_size) {
+            char* stage_two_compress_data;
+            uint32_t stage_two_compress_size = StagedBlock::compress(profile, stage_one_compress_data, stage_one_compress_size, scratch, stage_two_compress_data);
+            if (stage_two_compress_size == 0) {
                 put_fixed(buf, static_cast<uint8_t>(IntCompressType::SIMPLE8B));
                 buf->append((const char*) &stage_one_uncompress_size, sizeof(uint32_t));
                 buf->append((const char*) &stage_one_compress_size, sizeof(uint32_t));
-                buf->append(stage_one_compress_data.get(), stage_one_compress_size);
+                buf->append(stage_one_compress_data, stage_one_compress_size);
             } else {
-                put_fixed(buf, static_cast<uint8_t>(IntCompressType::SIMPLE8B_ZSTD));
-                buf->append((const char*) &stage_two_uncompress_size, sizeof(uint32_t));
+                put_fixed(buf, static_cast<uint8_t>(StagedBlock::staged_type(profile, IntCompressType::SIMPLE8B_LZ4, IntCompressType::SIMPLE8B_ZSTD, IntCompressType::SIMPLE8B_BROTLI)));
+                buf->append((const char*) &stage_one_compress_size, sizeof(uint32_t));
                 buf->append((const char*) &stage_two_compress_size, sizeof(uint32_t));
                 buf->append((const char*) &stage_one_uncompress_size, sizeof(uint32_t));
-                buf->append(stage_two_compress_data.get(), stage_two_compress_size);
+                buf->append(stage_two_compress_data, stage_two_compress_size);
             }
             return true;
         }
@@ -262,31 +547,22 @@ namespace LindormContest {
         void decode_from_simple8b(const char* buf) {
             uint32_t uncompress_size = *reinterpret_cast<const uint32_t*>(buf);
             uint32_t compress_size = *reinterpret_cast<const uint32_t*>(buf + sizeof(uint32_t));
-            std::unique_ptr<char[]> compress_data = std::make_unique<char[]>(compress_size);
-            std::unique_ptr<char[]> uncompress_data = std::make_unique<char[]>(uncompress_size);
-            std::memcpy(compress_data.get(), buf + 2 * sizeof(uint32_t), compress_size);
             assert(uncompress_size / sizeof(int32_t) == DATA_BLOCK_ITEM_NUMS);
-            char* src = compression::decompress_int32_simple8b(compress_data.get(), compress_size, uncompress_data.get(), uncompress_size);
-            std::memcpy(_column_values.data(), src, uncompress_size);
+            _decode_simple8b(buf + 2 * sizeof(uint32_t), compress_size, uncompress_size);
         }
 
-        void decode_from_simple8b_zstd(const char* buf) {
-            uint32_t stage_two_uncompress_size = *reinterpret_cast<const uint32_t*>(buf);
-            uint32_t stage_two_compress_size = *reinterpret_cast<const uint32_t*>(buf + sizeof(uint32_t));
+        void decode_from_simple8b_staged(const char* buf, SecondStage second_stage) {
+            ScratchScope scratch;
+            uint32_t stage_one_compress_size;
+            const char* stage_one_compress_data = StagedBlock::read(second_stage, buf, sizeof(uint32_t), scratch, stage_one_compress_size);
             uint32_t stage_one_uncompress_size = *reinterpret_cast<const uint32_t*>(buf + 2 * sizeof(uint32_t));
-            std::unique_ptr<char[]> stage_two_compress_data = std::make_unique<char[]>(stage_two_compress_size);
-            std::unique_ptr<char[]> stage_two_uncompress_data = std::make_unique<char[]>(stage_two_uncompress_size);
-            std::memcpy(stage_two_compress_data.get(), buf + 3 * sizeof(uint32_t), stage_two_compress_size);
-            compression::decompress_string_zstd(stage_two_compress_data.get(), stage_two_compress_size, stage_two_uncompress_data.get(), stage_two_uncompress_size);
-            std::unique_ptr<char[]> stage_one_uncompress_data = std::make_unique<char[]>(stage_one_uncompress_size);
             assert(stage_one_uncompress_size / sizeof(int32_t) == DATA_BLOCK_ITEM_NUMS);
-            const char* stage_one_compress_data = stage_two_uncompress_data.get();
-            uint32_t stage_one_compress_size = stage_two_uncompress_size;
-            char* src = compression::decompress_int32_simple8b(stage_one_compress_data, stage_one_compress_size, stage_one_uncompress_data.get(), stage_one_uncompress_size);
-            std::memcpy(_column_values.data(), src, DATA_BLOCK_ITEM_NUMS * sizeof(int32_t));
+            _decode_simple8b(stage_one_compress_data, stage_one_compress_size, stage_one_uncompress_size);
         }
 
-        bool encode_to_fastpfor(std::string* buf) const {
+        // fastpfor over the zigzag encoded deltas: [compress size in words][data]
+        // staged: [second stage sizes][data]
+        bool encode_to_fastpfor(const CompressionProfile& profile, std::string* buf) const {
             std::array<uint32_t, DATA_BLOCK_ITEM_NUMS> column_values;
             delta_and_zigzag_encode(_column_values.data(), column_values.data(), DATA_BLOCK_ITEM_NUMS);
             const uint32_t * stage_one_uncompress_data = column_values.data();
@@ -298,66 +574,41 @@ namespace LindormContest {
                 return false;
             }
 
-            // INFO_LOG("encode_to_fastpfor, range: %d, uncompress_size: %lu, compress_size: %lu", _max - _min, DATA_BLOCK_ITEM_NUMS * sizeof(uint32_t), stage_one_compress_size * sizeof(uint32_t))
             const char* stage_two_uncompress_data = reinterpret_cast<const char *>(stage_one_compress_data.data());
             uint32_t stage_two_uncompress_size = stage_one_compress_size * sizeof(uint32_t);
-            std::unique_ptr<char[]> stage_two_compress_data = std::make_unique<char[]>(stage_two_uncompress_size * 2);
-            uint32_t stage_two_compress_size = compression::compress_string_brotli(stage_two_uncompress_data, stage_two_uncompress_size, stage_two_compress_data.get());
-            if (stage_two_compress_size >= stage_two_uncompress_size) {
+            ScratchScope scratch;
+            char* stage_two_compress_data;
+            uint32_t stage_two_compress_size = StagedBlock::compress(profile, stage_two_uncompress_data, stage_two_uncompress_size, scratch, stage_two_compress_data);
+            if (stage_two_compress_size == 0) {
                 put_fixed(buf, static_cast<uint8_t>(IntCompressType::FASTPFOR));
                 buf->append((const char*) &stage_one_compress_size, sizeof(uint32_t));
                 buf->append(stage_two_uncompress_data, stage_two_uncompress_size);
             } else {
-                // INFO_LOG("encode_to_fastpfor_brotli, stage_one_uncompress_size: %u, stage_two_uncompress_size: %u, stage_two_compress_size: %u", stage_one_uncompress_size * 4, stage_two_uncompress_size, stage_two_compress_size)
-                put_fixed(buf, static_cast<uint8_t>(IntCompressType::FASTPFOR_BROTLI));
+                put_fixed(buf, static_cast<uint8_t>(StagedBlock::staged_type(profile, IntCompressType::FASTPFOR_LZ4, IntCompressType::FASTPFOR_ZSTD, IntCompressType::FASTPFOR_BROTLI)));
                 buf->append((const char*) &stage_two_uncompress_size, sizeof(uint32_t));
                 buf->append((const char*) &stage_two_compress_size, sizeof(uint32_t));
-                buf->append(stage_two_compress_data.get(), stage_two_compress_size);
+                buf->append(stage_two_compress_data, stage_two_compress_size);
             }
             return true;
         }
 
         void decode_from_fastpfor(const char* buf) {
             uint32_t compress_size = *reinterpret_cast<const uint32_t*>(buf);
-            std::vector<uint32_t> compress_data(compress_size);
-            std::array<uint32_t, DATA_BLOCK_ITEM_NUMS> uncompress_data;
-            std::memcpy(compress_data.data(), buf + sizeof(uint32_t), compress_size * sizeof(uint32_t));
-            uint32_t decompress_size = compression::decompress_int32_fastpfor(compress_data.data(), compress_size, uncompress_data.data());
-            assert(decompress_size == DATA_BLOCK_ITEM_NUMS);
-            delta_and_zigzag_decode(uncompress_data.data(), _column_values.data(), DATA_BLOCK_ITEM_NUMS);
-        }
-
-        void decode_from_fastpfor_zstd(const char* buf) {
-            uint32_t stage_two_uncompress_size = *reinterpret_cast<const uint32_t*>(buf);
-            uint32_t stage_two_compress_size = *reinterpret_cast<const uint32_t*>(buf + sizeof(uint32_t));
-            std::unique_ptr<char[]> stage_two_compress_data = std::make_unique<char[]>(stage_two_compress_size);
-            std::unique_ptr<char[]> stage_two_uncompress_data = std::make_unique<char[]>(stage_two_uncompress_size);
-            std::memcpy(stage_two_compress_data.get(), buf + 2 * sizeof(uint32_t), stage_two_compress_size);
-            compression::decompress_string_zstd(stage_two_compress_data.get(), stage_two_compress_size, stage_two_uncompress_data.get(), stage_two_uncompress_size);
-            std::array<uint32_t, DATA_BLOCK_ITEM_NUMS> stage_one_uncompress_data;
-            const uint32_t * stage_one_compress_data = reinterpret_cast<const uint32_t *>(stage_two_uncompress_data.get());
-            uint32_t stage_one_compress_size = stage_two_uncompress_size / sizeof(uint32_t);
-            uint32_t decompress_size = compression::decompress_int32_fastpfor(stage_one_compress_data, stage_one_compress_size, stage_one_uncompress_data.data());
-            assert(decompress_size == DATA_BLOCK_ITEM_NUMS);
-            delta_and_zigzag_decode(stage_one_uncompress_data.data(), _column_values.data(), DATA_BLOCK_ITEM_NUMS);
+            ScratchScope scratch;
+            const char* compress_data = scratch.align(buf + sizeof(uint32_t), compress_size * sizeof(uint32_t));
+            _decode_fastpfor(reinterpret_cast<const uint32_t*>(compress_data), compress_size);
         }
 
-        void decode_from_fastpfor_brotli(const char* buf) {
-            uint32_t stage_two_uncompress_size = *reinterpret_cast<const uint32_t*>(buf);
-            uint32_t stage_two_compress_size = *reinterpret_cast<const uint32_t*>(buf + sizeof(uint32_t));
-            std::unique_ptr<char[]> stage_two_compress_data = std::make_unique<char[]>(stage_two_compress_size);
-            std::unique_ptr<char[]> stage_two_uncompress_data = std::make_unique<char[]>(stage_two_uncompress_size);
-            std::memcpy(stage_two_compress_data.get(), buf + 2 * sizeof(uint32_t), stage_two_compress_size);
-            compression::decompress_string_brotli(stage_two_compress_data.get(), stage_two_compress_size, stage_two_uncompress_data.get(), stage_two_uncompress_size);
-            std::array<uint32_t, DATA_BLOCK_ITEM_NUMS> stage_one_uncompress_data;
-            const uint32_t * stage_one_compress_data = reinterpret_cast<const uint32_t *>(stage_two_uncompress_data.get());
-            uint32_t stage_one_compress_size = stage_two_uncompress_size / sizeof(uint32_t);
-            uint32_t decompress_size = compression::decompress_int32_fastpfor(stage_one_compress_data, stage_one_compress_size, stage_one_uncompress_data.data());
-            assert(decompress_size == DATA_BLOCK_ITEM_NUMS);
-            delta_and_zigzag_decode(stage_one_uncompress_data.data(), _column_values.data(), DATA_BLOCK_ITEM_NUMS);
+        void decode_from_fastpfor_staged(const char* buf, SecondStage second_stage) {
+            ScratchScope scratch;
+            uint32_t stage_two_uncompress_size;
+            const char* stage_one_compress_data = StagedBlock::read(second_stage, buf, 0, scratch, stage_two_uncompress_size);
+            _decode_fastpfor(reinterpret_cast<const uint32_t*>(stage_one_compress_data), stage_two_uncompress_size / sizeof(uint32_t));
         }
 
-        void encode_to_bitpack(std::string* buf) const {
+        // the values minus the block min, bitpacked: [required bits][min][compress size][data]
+        // staged: [required bits][min][second stage sizes][data]
+        bool encode_to_bitpack(const CompressionProfile& profile, std::string* buf) const {
             _required_bits = get_next_power_of_two(_max - _min + 1);
             std::array<uint32_t, DATA_BLOCK_ITEM_NUMS> stage_one_uncompress_data;
 
@@ -366,105 +617,96 @@ namespace LindormContest {
             }
 
             uint32_t stage_one_uncompress_size = DATA_BLOCK_ITEM_NUMS * sizeof(uint32_t);
-            std::unique_ptr<char[]> stage_one_compress_data = std::make_unique<char[]>(stage_one_uncompress_size);
-            __m128i* end_buf = simdpack_length(stage_one_uncompress_data.data(), DATA_BLOCK_ITEM_NUMS, (__m128i*) stage_one_compress_data.get(), _required_bits);
-            uint32_t stage_one_compress_size = (end_buf - (__m128i *) stage_one_compress_data.get()) * sizeof(__m128i);
-            const char* stage_two_uncompress_data = stage_one_compress_data.get();
-            uint32_t stage_two_uncompress_size = stage_one_compress_size;
-            std::unique_ptr<char[]> stage_two_compress_data = std::make_unique<char[]>(stage_two_uncompress_size * 2);
-            uint32_t stage_two_compress_size = compression::compress_string_brotli(stage_two_uncompress_data, stage_two_uncompress_size, stage_two_compress_data.get());
-
-            if (stage_two_compress_size >= stage_two_uncompress_size) {
+            ScratchScope scratch;
+            char* stage_one_compress_data = scratch.allocate(stage_one_uncompress_size);
+            __m128i* end_buf = simdpack_length(stage_one_uncompress_data.data(), DATA_BLOCK_ITEM_NUMS, (__m128i*) stage_one_compress_data, _required_bits);
+            uint32_t stage_one_compress_size = (end_buf - (__m128i *) stage_one_compress_data) * sizeof(__m128i);
+
+            char* stage_two_compress_data;
+            uint32_t stage_two_compress_size = StagedBlock::compress(profile, stage_one_compress_data, stage_one_compress_size, scratch, stage_two_compress_data);
+            if (stage_two_compress_size == 0) {
                 put_fixed(buf, static_cast<uint8_t>(IntCompressType::BITPACK));
                 put_fixed(buf, _required_bits);
                 put_fixed(buf, _min);
                 buf->append((const char*) &stage_one_compress_size, sizeof(uint32_t));
-                buf->append(stage_one_compress_data.get(), stage_one_compress_size);
+                buf->append(stage_one_compress_data, stage_one_compress_size);
             } else {
-                // INFO_LOG("encode_to_bitpack_brotli, range: %d, stage_one_uncompress_size: %u, stage_two_uncompress_size: %u, stage_two_compress_size: %u", _max - _min + 1, stage_one_uncompress_size, stage_two_uncompress_size, stage_two_compress_size)
-                put_fixed(buf, static_cast<uint8_t>(IntCompressType::BITPACK_BROTLI));
+                put_fixed(buf, static_cast<uint8_t>(StagedBlock::staged_type(profile, IntCompressType::BITPACK_LZ4, IntCompressType::BITPACK_ZSTD, IntCompressType::BITPACK_BROTLI)));
                 put_fixed(buf, _required_bits);
                 put_fixed(buf, _min);
-                buf->append((const char*) &stage_two_uncompress_size, sizeof(uint32_t));
+                buf->append((const char*) &stage_one_compress_size, sizeof(uint32_t));
                 buf->append((const char*) &stage_two_compress_size, sizeof(uint32_t));
-                buf->append(stage_two_compress_data.get(), stage_two_compress_size);
+                buf->append(stage_two_compress_data, stage_two_compress_size);
             }
+            return true;
         }
 
         void decode_from_bitpack(const char* buf) {
             _required_bits = *reinterpret_cast<const uint8_t*>(buf);
             _min = *reinterpret_cast<const int32_t*>(buf + sizeof(uint8_t));
             uint32_t compress_size = *reinterpret_cast<const uint32_t*>(buf + sizeof(uint8_t) + sizeof(int32_t));
-            std::unique_ptr<char[]> compress_data = std::make_unique<char[]>(compress_size);
-            std::memcpy(compress_data.get(), buf + sizeof(uint8_t) + sizeof(int32_t) + sizeof(uint32_t), compress_size);
-            std::array<uint32_t, DATA_BLOCK_ITEM_NUMS> uncompress_data;
-            simdunpack_length((const __m128i*) compress_data.get(), DATA_BLOCK_ITEM_NUMS, uncompress_data.data(), _required_bits);
-
-            for (uint16_t i = 0; i < DATA_BLOCK_ITEM_NUMS; ++i) {
-                _column_values[i] = uncompress_data[i] + _min;
-            }
+            ScratchScope scratch;
+            _decode_bitpack(scratch.align(buf + sizeof(uint8_t) + sizeof(int32_t) + sizeof(uint32_t), compress_size));
         }
 
-        void decode_from_bitpack_zstd(const char* buf) {
+        void decode_from_bitpack_staged(const char* buf, SecondStage second_stage) {
             _required_bits = *reinterpret_cast<const uint8_t*>(buf);
             _min = *reinterpret_cast<const int32_t*>(buf + sizeof(uint8_t));
-            uint32_t stage_two_uncompress_size = *reinterpret_cast<const uint32_t*>(buf + sizeof(uint8_t) + sizeof(int32_t));
-            uint32_t stage_two_compress_size = *reinterpret_cast<const uint32_t*>(buf + sizeof(uint8_t) + 2 * sizeof(uint32_t));
-            std::unique_ptr<char[]> stage_two_compress_data = std::make_unique<char[]>(stage_two_compress_size);
-            std::unique_ptr<char[]> stage_two_uncompress_data = std::make_unique<char[]>(stage_two_uncompress_size);
-            std::memcpy(stage_two_compress_data.get(), buf + sizeof(uint8_t) + 3 * sizeof(uint32_t), stage_two_compress_size);
-            compression::decompress_string_zstd(stage_two_compress_data.get(), stage_two_compress_size, stage_two_uncompress_data.get(), stage_two_uncompress_size);
-            const char* stage_one_compress_data = stage_two_uncompress_data.get();
-            std::array<uint32_t, DATA_BLOCK_ITEM_NUMS> stage_one_uncompress_data;
-            simdunpack_length((const __m128i*) stage_one_compress_data, DATA_BLOCK_ITEM_NUMS, stage_one_uncompress_data.data(), _required_bits);
+            ScratchScope scratch;
+            uint32_t stage_one_compress_size;
+            const char* stage_one_compress_data = StagedBlock::read(second_stage, buf + sizeof(uint8_t) + sizeof(int32_t), 0,
+                                                                    scratch, stage_one_compress_size);
+            _decode_bitpack(stage_one_compress_data);
+        }
 
-            for (uint16_t i = 0; i < DATA_BLOCK_ITEM_NUMS; ++i) {
-                _column_values[i] = stage_one_uncompress_data[i] + _min;
+        // the values compressed by zstd alone: [uncompress size][compress size][data]
+        bool encode_to_zstd(const CompressionProfile& profile, std::string* buf) const {
+            const char* uncompress_data = reinterpret_cast<const char *>(_column_values.data());
+            uint32_t uncompress_size = static_cast<uint32_t>(DATA_BLOCK_ITEM_NUMS * sizeof(int32_t));
+            ScratchScope scratch;
+            char* compress_data = scratch.allocate(compression::second_stage_bound(uncompress_size));
+            int level = profile._second_stage == SecondStage::ZSTD ? profile._level : CompressionProfile::balanced()._level;
+            uint32_t compress_size = compression::compress_string_zstd(uncompress_data, uncompress_size, compress_data, level);
+            if (compress_size >= uncompress_size) {
+                return false;
             }
+            put_fixed(buf, static_cast<uint8_t>(IntCompressType::ZSTD));
+            buf->append((const char*) &uncompress_size, sizeof(uint32_t));
+            buf->append((const char*) &compress_size, sizeof(uint32_t));
+            buf->append(compress_data, compress_size);
+            return true;
         }
 
-        void decode_from_bitpack_brotli(const char* buf) {
-            _required_bits = *reinterpret_cast<const uint8_t*>(buf);
-            _min = *reinterpret_cast<const int32_t*>(buf + sizeof(uint8_t));
-            uint32_t stage_two_uncompress_size = *reinterpret_cast<const uint32_t*>(buf + sizeof(uint8_t) + sizeof(int32_t));
-            uint32_t stage_two_compress_size = *reinterpret_cast<const uint32_t*>(buf + sizeof(uint8_t) + 2 * sizeof(uint32_t));
-            std::unique_ptr<char[]> stage_two_compress_data = std::make_unique<char[]>(stage_two_compress_size);
-            std::unique_ptr<char[]> stage_two_uncompress_data = std::make_unique<char[]>(stage_two_uncompress_size);
-            std::memcpy(stage_two_compress_data.get(), buf + sizeof(uint8_t) + 3 * sizeof(uint32_t), stage_two_compress_size);
-            compression::decompress_string_brotli(stage_two_compress_data.get(), stage_two_compress_size, stage_two_uncompress_data.get(), stage_two_uncompress_size);
-            const char* stage_one_compress_data = stage_two_uncompress_data.get();
-            std::array<uint32_t, DATA_BLOCK_ITEM_NUMS> stage_one_uncompress_data;
-            simdunpack_length((const __m128i*) stage_one_compress_data, DATA_BLOCK_ITEM_NUMS, stage_one_uncompress_data.data(), _required_bits);
-
-            for (uint16_t i = 0; i < DATA_BLOCK_ITEM_NUMS; ++i) {
-                _column_values[i] = stage_one_uncompress_data[i] + _min;
-            }
+        void decode_from_zstd(const char* buf) {
+            uint32_t uncompress_size = *reinterpret_cast<const uint32_t*>(buf);
+            uint32_t compress_size = *reinterpret_cast<const uint32_t*>(buf + sizeof(uint32_t));
+            assert(uncompress_size == DATA_BLOCK_ITEM_NUMS * sizeof(int32_t));
+            compression::decompress_string_zstd(buf + 2 * sizeof(uint32_t), compress_size, reinterpret_cast<char*>(_column_values.data()), uncompress_size);
         }
 
-        bool encode_to_zstd(std::string* buf) const {
+        // the values compressed by lz4 alone, laid out like zstd and decoded straight into the values
+        bool encode_to_lz4(const CompressionProfile& profile, std::string* buf) const {
             const char* uncompress_data = reinterpret_cast<const char *>(_column_values.data());
             uint32_t uncompress_size = static_cast<uint32_t>(DATA_BLOCK_ITEM_NUMS * sizeof(int32_t));
-            std::unique_ptr<char[]> compress_data = std::make_unique<char[]>(uncompress_size * 1.2);
-            uint32_t compress_size = compression::compress_string_zstd(uncompress_data, uncompress_size, compress_data.get());
+            ScratchScope scratch;
+            char* compress_data = scratch.allocate(compression::second_stage_bound(uncompress_size));
+            int acceleration = profile._second_stage == SecondStage::LZ4 ? profile._level : CompressionProfile::fast()._level;
+            uint32_t compress_size = compression::compress_string_lz4(uncompress_data, uncompress_size, compress_data, acceleration);
             if (compress_size >= uncompress_size) {
                 return false;
             }
-            put_fixed(buf, static_cast<uint8_t>(IntCompressType::ZSTD));
+            put_fixed(buf, static_cast<uint8_t>(IntCompressType::LZ4));
             buf->append((const char*) &uncompress_size, sizeof(uint32_t));
             buf->append((const char*) &compress_size, sizeof(uint32_t));
-            buf->append(compress_data.get(), compress_size);
+            buf->append(compress_data, compress_size);
             return true;
         }
 
-        void decode_from_zstd(const char* buf) {
+        void decode_from_lz4(const char* buf) {
             uint32_t uncompress_size = *reinterpret_cast<const uint32_t*>(buf);
             uint32_t compress_size = *reinterpret_cast<const uint32_t*>(buf + sizeof(uint32_t));
-            std::unique_ptr<char[]> compress_data = std::make_unique<char[]>(compress_size);
-            std::unique_ptr<char[]> uncompress_data = std::make_unique<char[]>(uncompress_size);
-            std::memcpy(compress_data.get(), buf + 2 * sizeof(uint32_t), compress_size);
-            compression::decompress_string_zstd(compress_data.get(), compress_size, uncompress_data.get(), uncompress_size);
             assert(uncompress_size == DATA_BLOCK_ITEM_NUMS * sizeof(int32_t));
-            std::memcpy(_column_values.data(), uncompress_data.get(), uncompress_size);
+            compression::decompress_string_lz4(buf + 2 * sizeof(uint32_t), compress_size, reinterpret_cast<char*>(_column_values.data()), uncompress_size);
         }
 
         void encode_to_plain(std::string* buf) const {
@@ -475,6 +717,33 @@ namespace LindormContest {
         void decode_from_plain(const char* buf) {
             std::memcpy(_column_values.data(), buf, DATA_BLOCK_ITEM_NUMS * sizeof(int32_t));
         }
+
+    private:
+        void _decode_simple8b(const char* compress_data, uint32_t compress_size, uint32_t uncompress_size) {
+            ScratchScope scratch;
+            const char* aligned_compress_data = scratch.align(compress_data, compress_size);
+            char* uncompress_data = scratch.allocate(uncompress_size);
+            char* src = compression::decompress_int32_simple8b(aligned_compress_data, compress_size, uncompress_data, uncompress_size);
+            std::memcpy(_column_values.data(), src, DATA_BLOCK_ITEM_NUMS * sizeof(int32_t));
+        }
+
+        // unpacked into the values and decoded in place
+        void _decode_fastpfor(const uint32_t* compress_data, uint32_t compress_size) {
+            uint32_t* uncompress_data = reinterpret_cast<uint32_t*>(_column_values.data());
+            uint32_t decompress_size = compression::decompress_int32_fastpfor(compress_data, compress_size, uncompress_data, DATA_BLOCK_ITEM_NUMS);
+            assert(decompress_size == DATA_BLOCK_ITEM_NUMS);
+            delta_and_zigzag_decode(uncompress_data, _column_values.data(), DATA_BLOCK_ITEM_NUMS);
+        }
+
+        // compress_data must be aligned to 16 bytes, unpacked into the values and rebased in place
+        void _decode_bitpack(const char* compress_data) {
+            uint32_t* uncompress_data = reinterpret_cast<uint32_t*>(_column_values.data());
+            simdunpack_length((const __m128i*) compress_data, DATA_BLOCK_ITEM_NUMS, uncompress_data, _required_bits);
+
+            for (uint16_t i = 0; i < DATA_BLOCK_ITEM_NUMS; ++i) {
+                _column_values[i] = uncompress_data[i] + _min;
+            }
+        }
     };
 
     struct DoubleDataBlock : public DataBlock {
@@ -489,16 +758,31 @@ namespace LindormContest {
         ~DoubleDataBlock() override = default;
 
         void encode_to_compress(std::string *buf) const override {
-            if (_type == DoubleCompressType::SAME) {
-                encode_to_same(buf);
-            } else if (_type == DoubleCompressType::GORILLA) {
-                if (!encode_to_gorilla(buf)) {
-                    encode_to_plain(buf);
-                }
-            } else if (_type == DoubleCompressType::CHIMP) {
-                if (!encode_to_chimp(buf)) {
-                    encode_to_plain(buf);
-                }
+            encode_with(_type, CompressionProfile::balanced(), buf);
+        }
+
+        // type is the first stage codec and the profile adds the second stage
+        void encode_with(DoubleCompressType type, const CompressionProfile& profile, std::string *buf) const {
+            bool encoded = false;
+            switch (type) {
+                case DoubleCompressType::SAME:
+                    encode_to_same(buf);
+                    return;
+                case DoubleCompressType::GORILLA:
+                    encoded = _encode_to_float_codec(profile, compression::compress_double_gorilla, DoubleCompressType::GORILLA,
+                                                     DoubleCompressType::GORILLA_LZ4, DoubleCompressType::GORILLA_ZSTD,
+                                                     DoubleCompressType::GORILLA_BROTLI, buf);
+                    break;
+                case DoubleCompressType::CHIMP:
+                    encoded = _encode_to_float_codec(profile, compression::compress_double_chimp, DoubleCompressType::CHIMP,
+                                                     DoubleCompressType::CHIMP_LZ4, DoubleCompressType::CHIMP_ZSTD,
+                                                     DoubleCompressType::CHIMP_BROTLI, buf);
+                    break;
+                default:
+                    break;
+            }
+            if (!encoded) {
+                encode_to_plain(buf);
             }
         }
 
@@ -511,19 +795,28 @@ namespace LindormContest {
                     decode_from_same(buf);
                     break;
                 case DoubleCompressType::GORILLA:
-                    decode_from_gorilla(buf);
+                    _decode_from_float_codec(buf, compression::decompress_double_gorilla);
                     break;
                 case DoubleCompressType::GORILLA_ZSTD:
-                    decode_from_gorilla_zstd(buf);
+                    _decode_from_float_codec_staged(buf, SecondStage::ZSTD, compression::decompress_double_gorilla);
+                    break;
+                case DoubleCompressType::GORILLA_BROTLI:
+                    _decode_from_float_codec_staged(buf, SecondStage::BROTLI, compression::decompress_double_gorilla);
+                    break;
+                case DoubleCompressType::GORILLA_LZ4:
+                    _decode_from_float_codec_staged(buf, SecondStage::LZ4, compression::decompress_double_gorilla);
                     break;
                 case DoubleCompressType::CHIMP:
-                    decode_from_chimp(buf);
+                    _decode_from_float_codec(buf, compression::decompress_double_chimp);
                     break;
                 case DoubleCompressType::CHIMP_ZSTD:
-                    decode_from_chimp_zstd(buf);
+                    _decode_from_float_codec_staged(buf, SecondStage::ZSTD, compression::decompress_double_chimp);
                     break;
                 case DoubleCompressType::CHIMP_BROTLI:
-                    decode_from_chimp_brotli(buf);
+                    _decode_from_float_codec_staged(buf, SecondStage::BROTLI, compression::decompress_double_chimp);
+                    break;
+                case DoubleCompressType::CHIMP_LZ4:
+                    _decode_from_float_codec_staged(buf, SecondStage::LZ4, compression::decompress_double_chimp);
                     break;
                 case DoubleCompressType::PLAIN:
                     decode_from_plain(buf);
@@ -541,144 +834,75 @@ namespace LindormContest {
             std::fill(_column_values.begin(), _column_values.end(), same_value);
         }
 
-        bool encode_to_gorilla(std::string* buf) const {
-            const char* stage_one_uncompress_data = reinterpret_cast<const char*>(_column_values.data());
-            uint32_t stage_one_uncompress_size = DATA_BLOCK_ITEM_NUMS * sizeof(double_t);
-            std::unique_ptr<char[]> stage_one_compress_data = std::make_unique<char[]>(stage_one_uncompress_size * 2);
-            uint32_t stage_one_compress_size = compression::compress_double_gorilla(stage_one_uncompress_data, stage_one_uncompress_size, stage_one_compress_data.get());
-
-            if (stage_one_compress_size >= stage_one_uncompress_size) {
-                return false;
-            }
-
-            const char* stage_two_uncompress_data = stage_one_compress_data.get();
-            uint32_t stage_two_uncompress_size = stage_one_compress_size;
-            std::unique_ptr<char[]> stage_two_compress_data = std::make_unique<char[]>(stage_two_uncompress_size * 2);
-            uint32_t stage_two_compress_size = compression::compress_string_zstd(stage_two_uncompress_data, stage_two_uncompress_size, stage_two_compress_data.get());
-            if (stage_two_compress_size >= stage_two_uncompress_size) {
-                put_fixed(buf, static_cast<uint8_t>(DoubleCompressType::GORILLA));
-                buf->append((const char*) &stage_one_uncompress_size, sizeof(uint32_t));
-                buf->append((const char*) &stage_one_compress_size, sizeof(uint32_t));
-                buf->append(stage_one_compress_data.get(), stage_one_compress_size);
-            } else {
-                // INFO_LOG("encode_to_gorilla_zstd, stage_one_uncompress_size: %u, stage_two_uncompress_size: %u, stage_two_compress_size: %u", stage_one_uncompress_size, stage_two_uncompress_size, stage_two_compress_size)
-                put_fixed(buf, static_cast<uint8_t>(DoubleCompressType::GORILLA_ZSTD));
-                buf->append((const char*) &stage_two_uncompress_size, sizeof(uint32_t));
-                buf->append((const char*) &stage_two_compress_size, sizeof(uint32_t));
-                buf->append((const char*) &stage_one_uncompress_size, sizeof(uint32_t));
-                buf->append(stage_two_compress_data.get(), stage_two_compress_size);
-            }
-            return true;
+        void encode_to_plain(std::string* buf) const {
+            put_fixed(buf, static_cast<uint8_t>(DoubleCompressType::PLAIN));
+            buf->append(reinterpret_cast<const char*>(_column_values.data()), DATA_BLOCK_ITEM_NUMS * sizeof(double_t));
         }
 
-        void decode_from_gorilla(const char* buf) {
-            uint32_t uncompress_size = *reinterpret_cast<const uint32_t*>(buf);
-            uint32_t compress_size = *reinterpret_cast<const uint32_t*>(buf + sizeof(uint32_t));
-            std::unique_ptr<char[]> compress_data = std::make_unique<char[]>(compress_size);
-            std::unique_ptr<char[]> uncompress_data = std::make_unique<char[]>(uncompress_size);
-            std::memcpy(compress_data.get(), buf + 2 * sizeof(uint32_t), compress_size);
-            assert(uncompress_size / sizeof(double_t) == DATA_BLOCK_ITEM_NUMS);
-            char* src = compression::decompress_double_gorilla(compress_data.get(), compress_size, uncompress_data.get(), uncompress_size);
-            std::memcpy(_column_values.data(), src, uncompress_size);
+        void decode_from_plain(const char* buf) {
+            std::memcpy(_column_values.data(), buf, DATA_BLOCK_ITEM_NUMS * sizeof(double_t));
         }
 
-        void decode_from_gorilla_zstd(const char* buf) {
-            uint32_t stage_two_uncompress_size = *reinterpret_cast<const uint32_t*>(buf);
-            uint32_t stage_two_compress_size = *reinterpret_cast<const uint32_t*>(buf + sizeof(uint32_t));
-            uint32_t stage_one_uncompress_size = *reinterpret_cast<const uint32_t*>(buf + 2 * sizeof(uint32_t));
-            std::unique_ptr<char[]> stage_two_compress_data = std::make_unique<char[]>(stage_two_compress_size);
-            std::unique_ptr<char[]> stage_two_uncompress_data = std::make_unique<char[]>(stage_two_uncompress_size);
-            std::memcpy(stage_two_compress_data.get(), buf + 3 * sizeof(uint32_t), stage_two_compress_size);
-            compression::decompress_string_zstd(stage_two_compress_data.get(), stage_two_compress_size, stage_two_uncompress_data.get(), stage_two_uncompress_size);
-            std::unique_ptr<char[]> stage_one_uncompress_data = std::make_unique<char[]>(stage_one_uncompress_size);
-            assert(stage_one_uncompress_size / sizeof(double_t) == DATA_BLOCK_ITEM_NUMS);
-            const char* stage_one_compress_data = stage_two_uncompress_data.get();
-            uint32_t stage_one_compress_size = stage_two_uncompress_size;
-            char* src = compression::decompress_double_gorilla(stage_one_compress_data, stage_one_compress_size, stage_one_uncompress_data.get(), stage_one_uncompress_size);
-            std::memcpy(_column_values.data(), src, DATA_BLOCK_ITEM_NUMS * sizeof(double_t));
-        }
+    private:
+        using Compress = uint32_t (*)(const char*, uint32_t, char*);
+        using Decompress = char* (*)(const char*, uint32_t, char*, uint32_t);
 
-        bool encode_to_chimp(std::string* buf) const {
+        // gorilla and chimp: [uncompress size][compress size][data]
+        // staged: [second stage sizes][uncompress size][data]
+        bool _encode_to_float_codec(const CompressionProfile& profile, Compress compress, DoubleCompressType type,
+                                    DoubleCompressType lz4_type, DoubleCompressType zstd_type, DoubleCompressType brotli_type,
+                                    std::string* buf) const {
             const char* stage_one_uncompress_data = reinterpret_cast<const char*>(_column_values.data());
             uint32_t stage_one_uncompress_size = DATA_BLOCK_ITEM_NUMS * sizeof(double_t);
-            std::unique_ptr<char[]> stage_one_compress_data = std::make_unique<char[]>(stage_one_uncompress_size * 2);
-            uint32_t stage_one_compress_size = compression::compress_double_chimp(stage_one_uncompress_data, stage_one_uncompress_size, stage_one_compress_data.get());
+            ScratchScope scratch;
+            char* stage_one_compress_data = scratch.allocate(stage_one_uncompress_size * 2);
+            uint32_t stage_one_compress_size = compress(stage_one_uncompress_data, stage_one_uncompress_size, stage_one_compress_data);
 
             if (stage_one_compress_size >= stage_one_uncompress_size) {
                 return false;
             }
 
-            const char* stage_two_uncompress_data = stage_one_compress_data.get();
-            uint32_t stage_two_uncompress_size = stage_one_compress_size;
-            std::unique_ptr<char[]> stage_two_compress_data = std::make_unique<char[]>(stage_two_uncompress_size * 2);
-            uint32_t stage_two_compress_size = compression::compress_string_brotli(stage_two_uncompress_data, stage_two_uncompress_size, stage_two_compress_data.get());
-            if (stage_two_compress_size >= stage_two_uncompress_size) {
-                put_fixed(buf, static_cast<uint8_t>(DoubleCompressType::CHIMP));
+            char* stage_two_compress_data;
+            uint32_t stage_two_compress_size = StagedBlock::compress(profile, stage_one_compress_data, stage_one_compress_size, scratch, stage_two_compress_data);
+            if (stage_two_compress_size == 0) {
+                put_fixed(buf, static_cast<uint8_t>(type));
                 buf->append((const char*) &stage_one_uncompress_size, sizeof(uint32_t));
                 buf->append((const char*) &stage_one_compress_size, sizeof(uint32_t));
-                buf->append(stage_one_compress_data.get(), stage_one_compress_size);
+                buf->append(stage_one_compress_data, stage_one_compress_size);
             } else {
-                // INFO_LOG("encode_to_chimp_brotli, stage_one_uncompress_size: %u, stage_two_uncompress_size: %u, stage_two_compress_size: %u", stage_one_uncompress_size, stage_two_uncompress_size, stage_two_compress_size)
-                put_fixed(buf, static_cast<uint8_t>(DoubleCompressType::CHIMP_BROTLI));
-                buf->append((const char*) &stage_two_uncompress_size, sizeof(uint32_t));
+                put_fixed(buf, static_cast<uint8_t>(StagedBlock::staged_type(profile, lz4_type, zstd_type, brotli_type)));
+                buf->append((const char*) &stage_one_compress_size, sizeof(uint32_t));
                 buf->append((const char*) &stage_two_compress_size, sizeof(uint32_t));
                 buf->append((const char*) &stage_one_uncompress_size, sizeof(uint32_t));
-                buf->append(stage_two_compress_data.get(), stage_two_compress_size);
+                buf->append(stage_two_compress_data, stage_two_compress_size);
             }
             return true;
         }
 
-        void decode_from_chimp(const char* buf) {
+        void _decode_from_float_codec(const char* buf, Decompress decompress) {
             uint32_t uncompress_size = *reinterpret_cast<const uint32_t*>(buf);
             uint32_t compress_size = *reinterpret_cast<const uint32_t*>(buf + sizeof(uint32_t));
-            std::unique_ptr<char[]> compress_data = std::make_unique<char[]>(compress_size);
-            std::unique_ptr<char[]> uncompress_data = std::make_unique<char[]>(uncompress_size);
-            std::memcpy(compress_data.get(), buf + 2 * sizeof(uint32_t), compress_size);
             assert(uncompress_size / sizeof(double_t) == DATA_BLOCK_ITEM_NUMS);
-            char* src = compression::decompress_double_chimp(compress_data.get(), compress_size, uncompress_data.get(), uncompress_size);
-            std::memcpy(_column_values.data(), src, uncompress_size);
+            ScratchScope scratch;
+            const char* compress_data = scratch.align(buf + 2 * sizeof(uint32_t), compress_size);
+            _decode_float_codec(compress_data, compress_size, uncompress_size, decompress, scratch);
         }
 
-        void decode_from_chimp_zstd(const char* buf) {
-            uint32_t stage_two_uncompress_size = *reinterpret_cast<const uint32_t*>(buf);
-            uint32_t stage_two_compress_size = *reinterpret_cast<const uint32_t*>(buf + sizeof(uint32_t));
+        void _decode_from_float_codec_staged(const char* buf, SecondStage second_stage, Decompress decompress) {
+            ScratchScope scratch;
+            uint32_t stage_one_compress_size;
+            const char* stage_one_compress_data = StagedBlock::read(second_stage, buf, sizeof(uint32_t), scratch, stage_one_compress_size);
             uint32_t stage_one_uncompress_size = *reinterpret_cast<const uint32_t*>(buf + 2 * sizeof(uint32_t));
-            std::unique_ptr<char[]> stage_two_compress_data = std::make_unique<char[]>(stage_two_compress_size);
-            std::unique_ptr<char[]> stage_two_uncompress_data = std::make_unique<char[]>(stage_two_uncompress_size);
-            std::memcpy(stage_two_compress_data.get(), buf + 3 * sizeof(uint32_t), stage_two_compress_size);
-            compression::decompress_string_zstd(stage_two_compress_data.get(), stage_two_compress_size, stage_two_uncompress_data.get(), stage_two_uncompress_size);
-            std::unique_ptr<char[]> stage_one_uncompress_data = std::make_unique<char[]>(stage_one_uncompress_size);
             assert(stage_one_uncompress_size / sizeof(double_t) == DATA_BLOCK_ITEM_NUMS);
-            const char* stage_one_compress_data = stage_two_uncompress_data.get();
-            uint32_t stage_one_compress_size = stage_two_uncompress_size;
-            char* src = compression::decompress_double_chimp(stage_one_compress_data, stage_one_compress_size, stage_one_uncompress_data.get(), stage_one_uncompress_size);
-            std::memcpy(_column_values.data(), src, DATA_BLOCK_ITEM_NUMS * sizeof(double_t));
+            _decode_float_codec(stage_one_compress_data, stage_one_compress_size, stage_one_uncompress_size, decompress, scratch);
         }
 
-        void decode_from_chimp_brotli(const char* buf) {
-            uint32_t stage_two_uncompress_size = *reinterpret_cast<const uint32_t*>(buf);
-            uint32_t stage_two_compress_size = *reinterpret_cast<const uint32_t*>(buf + sizeof(uint32_t));
-            uint32_t stage_one_uncompress_size = *reinterpret_cast<const uint32_t*>(buf + 2 * sizeof(uint32_t));
-            std::unique_ptr<char[]> stage_two_compress_data = std::make_unique<char[]>(stage_two_compress_size);
-            std::unique_ptr<char[]> stage_two_uncompress_data = std::make_unique<char[]>(stage_two_uncompress_size);
-            std::memcpy(stage_two_compress_data.get(), buf + 3 * sizeof(uint32_t), stage_two_compress_size);
-            compression::decompress_string_brotli(stage_two_compress_data.get(), stage_two_compress_size, stage_two_uncompress_data.get(), stage_two_uncompress_size);
-            std::unique_ptr<char[]> stage_one_uncompress_data = std::make_unique<char[]>(stage_one_uncompress_size);
-            assert(stage_one_uncompress_size / sizeof(double_t) == DATA_BLOCK_ITEM_NUMS);
-            const char* stage_one_compress_data = stage_two_uncompress_data.get();
-            uint32_t stage_one_compress_size = stage_two_uncompress_size;
-            char* src = compression::decompress_double_chimp(stage_one_compress_data, stage_one_compress_size, stage_one_uncompress_data.get(), stage_one_uncompress_size);
+        void _decode_float_codec(const char* compress_data, uint32_t compress_size, uint32_t uncompress_size,
+                                 Decompress decompress, ScratchScope& scratch) {
+            char* uncompress_data = scratch.allocate(uncompress_size);
+            char* src = decompress(compress_data, compress_size, uncompress_data, uncompress_size);
             std::memcpy(_column_values.data(), src, DATA_BLOCK_ITEM_NUMS * sizeof(double_t));
         }
-
-        void encode_to_plain(std::string* buf) const {
-            put_fixed(buf, static_cast<uint8_t>(DoubleCompressType::PLAIN));
-            buf->append(reinterpret_cast<const char*>(_column_values.data()), DATA_BLOCK_ITEM_NUMS * sizeof(double_t));
-        }
-
-        void decode_from_plain(const char* buf) {
-            std::memcpy(_column_values.data(), buf, DATA_BLOCK_ITEM_NUMS * sizeof(double_t));
-        }
     };
 
     struct StringDataBlock : public DataBlock {
@@ -692,23 +916,52 @@ namespace LindormContest {
         ~StringDataBlock() override = default;
 
         void encode_to_compress(std::string *buf) const override {
+            encode_with(_type, CompressionProfile::balanced(), buf);
+        }
+
+        // strings have no first stage codec, type picks the layout and the compression.
+        // the level comes from the profile if its second stage is the same compression
+        void encode_with(StringCompressType type, const CompressionProfile& profile, std::string *buf) const {
+            bool same_length = _min_length == _max_length;
+            if (same_length && _min_length == 0) {
+                encode_to_empty(buf);
+                return;
+            }
             std::string uncompress_buf;
-            if (_type == StringCompressType::ZSTD) {
-                if (!encode_to_zstd(buf, uncompress_buf)) {
-                    encode_to_plain(uncompress_buf, buf);
-                }
-            } else if (_type == StringCompressType::ZSTD_SAME_LENGTH) {
-                if (!encode_to_zstd_same_length(buf, uncompress_buf)) {
-                    encode_to_plain(uncompress_buf, buf);
-                }
-            } else if (_type == StringCompressType::BROTLI) {
-                if (!encode_to_brotli(buf, uncompress_buf)) {
-                    encode_to_plain(uncompress_buf, buf);
-                }
-            } else if (_type == StringCompressType::BROTLI_SAME_LENGTH) {
-                if (!encode_to_brotli_same_length(buf, uncompress_buf)) {
-                    encode_to_plain(uncompress_buf, buf);
-                }
+            bool encoded = false;
+            switch (type) {
+                case StringCompressType::ZSTD:
+                    _serialize_lengths_first(uncompress_buf);
+                    encoded = _encode_to(type, SecondStage::ZSTD, profile, uncompress_buf, buf);
+                    break;
+                case StringCompressType::LZ4:
+                    _serialize_lengths_first(uncompress_buf);
+                    encoded = _encode_to(type, SecondStage::LZ4, profile, uncompress_buf, buf);
+                    break;
+                case StringCompressType::ZSTD_SAME_LENGTH:
+                    assert(same_length);
+                    _serialize_same_length(uncompress_buf);
+                    encoded = _encode_to(type, SecondStage::ZSTD, profile, uncompress_buf, buf);
+                    break;
+                case StringCompressType::LZ4_SAME_LENGTH:
+                    assert(same_length);
+                    _serialize_same_length(uncompress_buf);
+                    encoded = _encode_to(type, SecondStage::LZ4, profile, uncompress_buf, buf);
+                    break;
+                case StringCompressType::BROTLI:
+                    _serialize_interleaved(uncompress_buf);
+                    encoded = _encode_to(type, SecondStage::BROTLI, profile, uncompress_buf, buf);
+                    break;
+                case StringCompressType::BROTLI_SAME_LENGTH:
+                    assert(same_length);
+                    _serialize_same_length(uncompress_buf);
+                    encoded = _encode_to(type, SecondStage::BROTLI, profile, uncompress_buf, buf);
+                    break;
+                default:
+                    break;
+            }
+            if (!encoded) {
+                encode_to_plain(buf);
             }
         }
 
@@ -718,16 +971,22 @@ namespace LindormContest {
 
             switch (type) {
                 case StringCompressType::ZSTD:
-                    decode_from_zstd(buf);
+                    decode_from_lengths_first(buf, SecondStage::ZSTD);
                     break;
                 case StringCompressType::ZSTD_SAME_LENGTH:
-                    decode_from_zstd_same_length(buf);
+                    decode_from_same_length(buf, SecondStage::ZSTD);
+                    break;
+                case StringCompressType::LZ4:
+                    decode_from_lengths_first(buf, SecondStage::LZ4);
+                    break;
+                case StringCompressType::LZ4_SAME_LENGTH:
+                    decode_from_same_length(buf, SecondStage::LZ4);
                     break;
                 case StringCompressType::BROTLI:
                     decode_from_brotli(buf);
                     break;
                 case StringCompressType::BROTLI_SAME_LENGTH:
-                    decode_from_brotli_same_length(buf);
+                    decode_from_same_length(buf, SecondStage::BROTLI);
                     break;
                 case StringCompressType::PLAIN:
                     decode_from_plain(buf);
@@ -735,146 +994,147 @@ namespace LindormContest {
             }
         }
 
-        bool encode_to_zstd(std::string *buf, std::string& uncompress_buf) const {
-            uncompress_buf.resize(DATA_BLOCK_ITEM_NUMS);
+        // every string is empty: [ZSTD_SAME_LENGTH][0]
+        void encode_to_empty(std::string *buf) const {
+            put_fixed(buf, static_cast<uint8_t>(StringCompressType::ZSTD_SAME_LENGTH));
+            put_fixed(buf, static_cast<uint8_t>(0));
+        }
+
+        // zstd and lz4: [uncompress size][compress size][data], data is the lengths of all strings followed by their bytes
+        void decode_from_lengths_first(const char* buf, SecondStage second_stage) {
+            ScratchScope scratch;
+            uint32_t uncompress_size;
+            const char* uncompress_data = StagedBlock::read(second_stage, buf, 0, scratch, uncompress_size);
+            const uint8_t* str_lengths = reinterpret_cast<const uint8_t*>(uncompress_data);
+            const char* str_offset = uncompress_data + DATA_BLOCK_ITEM_NUMS;
 
             for (uint16_t i = 0; i < DATA_BLOCK_ITEM_NUMS; ++i) {
-                uint8_t str_length = static_cast<uint8_t>(*reinterpret_cast<int32_t*>(_column_values[i].columnData));
-                *reinterpret_cast<uint8_t*>(uncompress_buf.data() + i) = str_length;
-                uncompress_buf.append(_column_values[i].columnData + sizeof(int32_t), str_length);
+                _column_values[i] = ColumnValue(str_offset, str_lengths[i]);
+                str_offset += str_lengths[i];
             }
 
-            const char* uncompress_data = uncompress_buf.c_str();
-            uint32_t uncompress_size = static_cast<uint32_t>(uncompress_buf.size());
-            std::unique_ptr<char[]> compress_data = std::make_unique<char[]>(uncompress_size * 1.2);
-            uint32_t compress_size = compression::compress_string_zstd(uncompress_data, uncompress_size, compress_data.get());
+            assert(str_offset == uncompress_data + uncompress_size);
+        }
 
-            if (compress_size >= uncompress_size) {
-                return false;
+        // [str length], and unless it is 0 [uncompress size][compress size][data] of the concatenated strings
+        void decode_from_same_length(const char* buf, SecondStage second_stage) {
+            uint8_t str_length = *reinterpret_cast<const uint8_t*>(buf);
+
+            if (unlikely(str_length == 0)) {
+                for (uint16_t i = 0; i < DATA_BLOCK_ITEM_NUMS; ++i) {
+                    _column_values[i] = ColumnValue(buf, 0);
+                }
+                return;
             }
 
-            // INFO_LOG("string encode_to_zstd, uncompress_size: %u, compress_size: %u", uncompress_size, compress_size)
+            ScratchScope scratch;
+            uint32_t uncompress_size;
+            const char* uncompress_data = StagedBlock::read(second_stage, buf + sizeof(uint8_t), 0, scratch, uncompress_size);
+            assert(uncompress_size == DATA_BLOCK_ITEM_NUMS * str_length);
 
-            put_fixed(buf, static_cast<uint8_t>(StringCompressType::ZSTD));
-            buf->append((const char*) &uncompress_size, sizeof(uint32_t));
-            buf->append((const char*) &compress_size, sizeof(uint32_t));
-            buf->append(compress_data.get(), compress_size);
-            return true;
+            for (uint16_t i = 0; i < DATA_BLOCK_ITEM_NUMS; ++i) {
+                _column_values[i] = ColumnValue(uncompress_data + i * str_length, str_length);
+            }
         }
 
-        void decode_from_zstd(const char* buf) {
-            uint32_t uncompress_size = *reinterpret_cast<const uint32_t*>(buf);
-            uint32_t compress_size = *reinterpret_cast<const uint32_t*>(buf + sizeof(uint32_t));
-            std::unique_ptr<char[]> compress_data = std::make_unique<char[]>(compress_size);
-            std::unique_ptr<char[]> uncompress_data = std::make_unique<char[]>(uncompress_size);
-            std::memcpy(compress_data.get(), buf + 2 * sizeof(uint32_t), compress_size);
-            compression::decompress_string_zstd(compress_data.get(), compress_size, uncompress_data.get(), uncompress_size);
-
-            std::array<uint8_t, DATA_BLOCK_ITEM_NUMS> str_lengths;
-            std::memcpy(str_lengths.data(), uncompress_data.get(), DATA_BLOCK_ITEM_NUMS);
-            const char* str_offset = uncompress_data.get() + DATA_BLOCK_ITEM_NUMS;
+        // [uncompress size][compress size][data], data holds the length of each string before its bytes
+        void decode_from_brotli(const char* buf) {
+            ScratchScope scratch;
+            uint32_t uncompress_size;
+            const char* uncompress_data = StagedBlock::read(SecondStage::BROTLI, buf, 0, scratch, uncompress_size);
+            _deserialize_interleaved(uncompress_data, uncompress_size);
+        }
 
-            for (uint16_t i = 0; i < DATA_BLOCK_ITEM_NUMS; ++i) {
-                _column_values[i] = ColumnValue(str_offset, str_lengths[i]);
-                str_offset += str_lengths[i];
-            }
+        // [uncompress size][data] laid out like brotli
+        void encode_to_plain(std::string* buf) const {
+            std::string uncompress_buf;
+            _serialize_interleaved(uncompress_buf);
+            put_fixed(buf, static_cast<uint8_t>(StringCompressType::PLAIN));
+            uint32_t uncompress_size = static_cast<uint32_t>(uncompress_buf.size());
+            buf->append((const char*) &uncompress_size, sizeof(uint32_t));
+            buf->append(uncompress_buf.c_str(), uncompress_size);
+        }
 
-            assert(str_offset == uncompress_data.get() + uncompress_size);
+        void decode_from_plain(const char* buf) {
+            uint32_t uncompress_size = *reinterpret_cast<const uint32_t*>(buf);
+            _deserialize_interleaved(buf + sizeof(uint32_t), uncompress_size);
         }
 
-        bool encode_to_zstd_same_length(std::string *buf, std::string& uncompress_buf) const {
-            if (unlikely(_min_length == 0)) {
-                put_fixed(buf, static_cast<uint8_t>(StringCompressType::ZSTD_SAME_LENGTH));
-                uint8_t str_length = static_cast<uint8_t>(_min_length);
-                buf->append((const char*) &str_length, sizeof(uint8_t));
-                return true;
+    private:
+        // the profile of the preset using second_stage if the profile itself doesn't
+        static CompressionProfile _stage_profile(const CompressionProfile& profile, SecondStage second_stage) {
+            if (profile._second_stage == second_stage) {
+                return profile;
             }
-
-            for (const auto &column_value: _column_values) {
-                uncompress_buf.append(column_value.columnData + sizeof(int32_t), _min_length);
+            switch (second_stage) {
+                case SecondStage::LZ4:
+                    return CompressionProfile::fast();
+                case SecondStage::ZSTD:
+                    return CompressionProfile::balanced();
+                default:
+                    return CompressionProfile::max_ratio();
             }
+        }
 
+        // return false if the compression doesn't pay off
+        static bool _encode_to(StringCompressType type, SecondStage second_stage, const CompressionProfile& profile,
+                               const std::string& uncompress_buf, std::string* buf) {
             const char* uncompress_data = uncompress_buf.c_str();
             uint32_t uncompress_size = static_cast<uint32_t>(uncompress_buf.size());
-            std::unique_ptr<char[]> compress_data = std::make_unique<char[]>(uncompress_size * 1.2);
-            uint32_t compress_size = compression::compress_string_zstd(uncompress_data, uncompress_size, compress_data.get());
-
-            if (compress_size >= uncompress_size) {
+            ScratchScope scratch;
+            char* compress_data = scratch.allocate(compression::second_stage_bound(uncompress_size));
+            uint32_t compress_size = compression::compress_second_stage(_stage_profile(profile, second_stage), uncompress_data,
+                                                                        uncompress_size, compress_data);
+            if (compress_size == 0) {
                 return false;
             }
 
-            // INFO_LOG("string encode_to_zstd_same_length, uncompress_size: %u, compress_size: %u", uncompress_size, compress_size)
-
-            put_fixed(buf, static_cast<uint8_t>(StringCompressType::ZSTD_SAME_LENGTH));
-            uint8_t str_length = static_cast<uint8_t>(_min_length);
-            buf->append((const char*) &str_length, sizeof(uint8_t));
+            put_fixed(buf, static_cast<uint8_t>(type));
+            if (type == StringCompressType::ZSTD_SAME_LENGTH || type == StringCompressType::BROTLI_SAME_LENGTH
+                || type == StringCompressType::LZ4_SAME_LENGTH) {
+                put_fixed(buf, static_cast<uint8_t>(uncompress_size / DATA_BLOCK_ITEM_NUMS));
+            }
             buf->append((const char*) &uncompress_size, sizeof(uint32_t));
             buf->append((const char*) &compress_size, sizeof(uint32_t));
-            buf->append(compress_data.get(), compress_size);
+            buf->append(compress_data, compress_size);
             return true;
         }
 
-        void decode_from_zstd_same_length(const char* buf) {
-            uint8_t str_length = *reinterpret_cast<const uint8_t*>(buf);
-
-            if (unlikely(str_length == 0)) {
-                for (uint16_t i = 0; i < DATA_BLOCK_ITEM_NUMS; ++i) {
-                    _column_values[i] = ColumnValue(buf, 0);
-                }
-                return;
-            }
-
-            uint32_t uncompress_size = *reinterpret_cast<const uint32_t*>(buf + sizeof(uint8_t));
-            uint32_t compress_size = *reinterpret_cast<const uint32_t*>(buf + sizeof(uint8_t) + sizeof(uint32_t));
-            std::unique_ptr<char[]> compress_data = std::make_unique<char[]>(compress_size);
-            std::unique_ptr<char[]> uncompress_data = std::make_unique<char[]>(uncompress_size);
-            std::memcpy(compress_data.get(), buf + sizeof(uint8_t) + 2 * sizeof(uint32_t), compress_size);
-            compression::decompress_string_zstd(compress_data.get(), compress_size, uncompress_data.get(), uncompress_size);
+        static uint8_t _str_length(const ColumnValue& column_value) {
+            return static_cast<uint8_t>(*reinterpret_cast<const int32_t*>(column_value.columnData));
+        }
 
+        void _serialize_lengths_first(std::string& uncompress_buf) const {
+            uncompress_buf.resize(DATA_BLOCK_ITEM_NUMS);
             for (uint16_t i = 0; i < DATA_BLOCK_ITEM_NUMS; ++i) {
-                _column_values[i] = ColumnValue(uncompress_data.get() + i * str_length, str_length);
+                uint8_t str_length = _str_length(_column_values[i]);
+                uncompress_buf[i] = static_cast<char>(str_length);
+                uncompress_buf.append(_column_values[i].columnData + sizeof(int32_t), str_length);
             }
         }
 
-        bool encode_to_brotli(std::string *buf, std::string& uncompress_buf) const {
+        void _serialize_same_length(std::string& uncompress_buf) const {
             for (const auto &column_value: _column_values) {
-                uint8_t str_length = static_cast<uint8_t>(*reinterpret_cast<int32_t*>(column_value.columnData));
-                uncompress_buf.append((const char*) &str_length, sizeof(uint8_t));
-                uncompress_buf.append(column_value.columnData + sizeof(int32_t), str_length);
+                uncompress_buf.append(column_value.columnData + sizeof(int32_t), _min_length);
             }
+        }
 
-            const char* uncompress_data = uncompress_buf.c_str();
-            uint32_t uncompress_size = static_cast<uint32_t>(uncompress_buf.size());
-            std::unique_ptr<char[]> compress_data = std::make_unique<char[]>(uncompress_size * 1.2);
-            uint32_t compress_size = compression::compress_string_brotli(uncompress_data, uncompress_size, compress_data.get());
-
-            if (compress_size >= uncompress_size) {
-                return false;
+        void _serialize_interleaved(std::string& uncompress_buf) const {
+            for (const auto &column_value: _column_values) {
+                uint8_t str_length = _str_length(column_value);
+                uncompress_buf.push_back(static_cast<char>(str_length));
+                uncompress_buf.append(column_value.columnData + sizeof(int32_t), str_length);
             }
-
-            // INFO_LOG("string encode_to_brotli, uncompress_size: %u, compress_size: %u", uncompress_size, compress_size)
-
-            put_fixed(buf, static_cast<uint8_t>(StringCompressType::BROTLI));
-            buf->append((const char*) &uncompress_size, sizeof(uint32_t));
-            buf->append((const char*) &compress_size, sizeof(uint32_t));
-            buf->append(compress_data.get(), compress_size);
-            return true;
         }
 
-        void decode_from_brotli(const char* buf) {
-            uint32_t uncompress_size = *reinterpret_cast<const uint32_t*>(buf);
-            uint32_t compress_size = *reinterpret_cast<const uint32_t*>(buf + sizeof(uint32_t));
-            std::unique_ptr<char[]> compress_data = std::make_unique<char[]>(compress_size);
-            std::unique_ptr<char[]> uncompress_data = std::make_unique<char[]>(uncompress_size);
-            std::memcpy(compress_data.get(), buf + 2 * sizeof(uint32_t), compress_size);
-            compression::decompress_string_brotli(compress_data.get(), compress_size, uncompress_data.get(), uncompress_size);
+        void _deserialize_interleaved(const char* uncompress_data, uint32_t uncompress_size) {
             size_t str_offset = 0;
             uint16_t str_count = 0;
 
             while (str_offset != uncompress_size) {
-                uint8_t str_length = *reinterpret_cast<uint8_t*>(uncompress_data.get() + str_offset);
+                uint8_t str_length = *reinterpret_cast<const uint8_t*>(uncompress_data + str_offset);
                 str_offset += sizeof(uint8_t);
-                _column_values[str_count] = ColumnValue(uncompress_data.get() + str_offset, str_length);
+                _column_values[str_count] = ColumnValue(uncompress_data + str_offset, str_length);
                 str_offset += str_length;
                 str_count++;
             }
@@ -882,121 +1142,305 @@ namespace LindormContest {
             assert(str_offset == uncompress_size);
             assert(str_count == DATA_BLOCK_ITEM_NUMS);
         }
+    };
 
-        bool encode_to_brotli_same_length(std::string *buf, std::string& uncompress_buf) const {
-            for (const auto &column_value: _column_values) {
-                uncompress_buf.append(column_value.columnData + sizeof(int32_t), _min_length);
+    // picks the codec of the blocks of one column by encoding a block with every candidate and keeping
+    // the cheapest, where cost is the encoded size weighted by how slow the written codec decodes.
+    // the winner is reused for the next blocks of the column and trialled again every trial_interval
+    // blocks, so the choice follows the data instead of fixed range thresholds. the profile of the
+    // column sets the second stage of the candidates and how much decode speed weighs.
+    // multi thread safe, conversions of one vin may race on the winner, which only costs a trial
+    class CodecSelector {
+    public:
+        explicit CodecSelector(ColumnType column_type = COLUMN_TYPE_UNINITIALIZED,
+                               const CompressionProfile& profile = CompressionProfile::balanced(),
+                               uint32_t trial_interval = CODEC_TRIAL_INTERVAL)
+                : _column_type(column_type), _profile(profile), _trial_interval(trial_interval) {}
+
+        CodecSelector(const CodecSelector& other)
+                : CodecSelector(other._column_type, other._profile, other._trial_interval) {}
+
+        ~CodecSelector() = default;
+
+        void encode(const DataBlock& block, std::string* buf) {
+            switch (_column_type) {
+                case COLUMN_TYPE_INTEGER:
+                    _encode(static_cast<const IntDataBlock&>(block), buf);
+                    break;
+                case COLUMN_TYPE_DOUBLE_FLOAT:
+                    _encode(static_cast<const DoubleDataBlock&>(block), buf);
+                    break;
+                case COLUMN_TYPE_STRING:
+                    _encode(static_cast<const StringDataBlock&>(block), buf);
+                    break;
+                default:
+                    block.encode_to_compress(buf);
+                    break;
             }
+        }
 
-            const char* uncompress_data = uncompress_buf.c_str();
-            uint32_t uncompress_size = static_cast<uint32_t>(uncompress_buf.size());
-            std::unique_ptr<char[]> compress_data = std::make_unique<char[]>(uncompress_size * 1.2);
-            uint32_t compress_size = compression::compress_string_brotli(uncompress_data, uncompress_size, compress_data.get());
+        // relative decode cost of a written codec, plain is free
+        static double decode_cost(ColumnType column_type, uint8_t written_type) {
+            static constexpr double INT_COSTS[] = {0, 0.25, 1.25, 2.5, 1, 2, 0.5, 1.5, 2.75, 1, 0, 3, 0.5, 1.25, 0.75, 0.25};
+            static constexpr double DOUBLE_COSTS[] = {0, 1, 2, 1, 2, 3, 0, 3, 1.25, 1.25};
+            static constexpr double STRING_COSTS[] = {1, 1, 2, 2, 0, 0.25, 0.25};
+            static_assert(std::size(INT_COSTS) == static_cast<size_t>(IntCompressType::LZ4) + 1);
+            static_assert(std::size(DOUBLE_COSTS) == static_cast<size_t>(DoubleCompressType::CHIMP_LZ4) + 1);
+            static_assert(std::size(STRING_COSTS) == static_cast<size_t>(StringCompressType::LZ4_SAME_LENGTH) + 1);
+            switch (column_type) {
+                case COLUMN_TYPE_INTEGER:
+                    return INT_COSTS[written_type];
+                case COLUMN_TYPE_DOUBLE_FLOAT:
+                    return DOUBLE_COSTS[written_type];
+                case COLUMN_TYPE_STRING:
+                    return STRING_COSTS[written_type];
+                default:
+                    return 0;
+            }
+        }
 
-            if (compress_size >= uncompress_size) {
-                return false;
+    private:
+        static constexpr uint8_t NO_WINNER = std::numeric_limits<uint8_t>::max();
+        static constexpr size_t MAX_CANDIDATES = 4;
+
+        template <typename Type>
+        struct Candidates {
+            std::array<Type, MAX_CANDIDATES> _types;
+            size_t _count = 0;
+
+            void add(Type type) {
+                _types[_count++] = type;
             }
 
-            // INFO_LOG("string encode_to_brotli, uncompress_size: %u, compress_size: %u", uncompress_size, compress_size)
+            bool contains(uint8_t type) const {
+                return std::any_of(_types.begin(), _types.begin() + _count,
+                                   [&](Type candidate) { return static_cast<uint8_t>(candidate) == type; });
+            }
+        };
 
-            put_fixed(buf, static_cast<uint8_t>(StringCompressType::BROTLI_SAME_LENGTH));
-            uint8_t str_length = static_cast<uint8_t>(_min_length);
-            buf->append((const char*) &str_length, sizeof(uint8_t));
-            buf->append((const char*) &uncompress_size, sizeof(uint32_t));
-            buf->append((const char*) &compress_size, sizeof(uint32_t));
-            buf->append(compress_data.get(), compress_size);
-            return true;
+        Candidates<IntCompressType> _get_candidates(const IntDataBlock& block) const {
+            Candidates<IntCompressType> candidates;
+            if (block._min == block._max) {
+                candidates.add(IntCompressType::SAME);
+                return candidates;
+            }
+            // the bit width of bitpacking is computed from the range in 32 bits
+            if (static_cast<int64_t>(block._max) - block._min < std::numeric_limits<int32_t>::max()) {
+                candidates.add(IntCompressType::BITPACK);
+            }
+            candidates.add(IntCompressType::FASTPFOR);
+            candidates.add(IntCompressType::SIMPLE8B);
+            // plain zstd or lz4 stands in for a missing first stage, if the profile compresses with it
+            if (_profile._second_stage == SecondStage::ZSTD) {
+                candidates.add(IntCompressType::ZSTD);
+            } else if (_profile._second_stage == SecondStage::LZ4) {
+                candidates.add(IntCompressType::LZ4);
+            }
+            return candidates;
         }
 
-        void decode_from_brotli_same_length(const char* buf) {
-            uint32_t str_length = *reinterpret_cast<const uint8_t*>(buf);
-            uint32_t uncompress_size = *reinterpret_cast<const uint32_t*>(buf + sizeof(uint8_t));
-            uint32_t compress_size = *reinterpret_cast<const uint32_t*>(buf + sizeof(uint8_t) + sizeof(uint32_t));
-            std::unique_ptr<char[]> compress_data = std::make_unique<char[]>(compress_size);
-            std::unique_ptr<char[]> uncompress_data = std::make_unique<char[]>(uncompress_size);
-            std::memcpy(compress_data.get(), buf + sizeof(uint8_t) + 2 * sizeof(uint32_t), compress_size);
-            compression::decompress_string_brotli(compress_data.get(), compress_size, uncompress_data.get(), uncompress_size);
-
-            for (uint16_t i = 0; i < DATA_BLOCK_ITEM_NUMS; ++i) {
-                _column_values[i] = ColumnValue(uncompress_data.get() + i * str_length, str_length);
+        Candidates<DoubleCompressType> _get_candidates(const DoubleDataBlock& block) const {
+            Candidates<DoubleCompressType> candidates;
+            // compared by bits, -0.0 and 0.0 or two nans are different values
+            auto first = block._column_values.begin();
+            if (std::all_of(first, block._column_values.end(), [&](double_t value) {
+                return std::memcmp(&value, &*first, sizeof(double_t)) == 0;
+            })) {
+                candidates.add(DoubleCompressType::SAME);
+                return candidates;
             }
+            candidates.add(DoubleCompressType::CHIMP);
+            candidates.add(DoubleCompressType::GORILLA);
+            return candidates;
         }
 
-        void encode_to_plain(const std::string& uncompress_buf, std::string* buf) const {
-            put_fixed(buf, static_cast<uint8_t>(StringCompressType::PLAIN));
-            uint32_t uncompress_size = static_cast<uint32_t>(uncompress_buf.size());
-            buf->append((const char*) &uncompress_size, sizeof(uint32_t));
-            buf->append(uncompress_buf.c_str(), uncompress_size);
+        // strings have no first stage to choose, the second stage of the profile decides
+        Candidates<StringCompressType> _get_candidates(const StringDataBlock& block) const {
+            Candidates<StringCompressType> candidates;
+            bool same_length = block._min_length == block._max_length;
+            switch (_profile._second_stage) {
+                case SecondStage::LZ4:
+                    candidates.add(same_length ? StringCompressType::LZ4_SAME_LENGTH : StringCompressType::LZ4);
+                    break;
+                case SecondStage::ZSTD:
+                    candidates.add(same_length ? StringCompressType::ZSTD_SAME_LENGTH : StringCompressType::ZSTD);
+                    break;
+                case SecondStage::BROTLI:
+                    candidates.add(same_length ? StringCompressType::BROTLI_SAME_LENGTH : StringCompressType::BROTLI);
+                    break;
+                default:
+                    candidates.add(StringCompressType::PLAIN);
+                    break;
+            }
+            return candidates;
         }
 
-        void decode_from_plain(const char* buf) {
-            uint32_t uncompress_size = *reinterpret_cast<const uint32_t*>(buf);
-            std::string uncompress_buf;
-            uncompress_buf.resize(uncompress_size);
-            std::memcpy(uncompress_buf.data(), buf + sizeof(uint32_t), uncompress_size);
-            size_t str_offset = 0;
-            uint16_t str_count = 0;
+        template <typename Block>
+        void _encode(const Block& block, std::string* buf) {
+            auto candidates = _get_candidates(block);
+            if (candidates._count == 1) {
+                block.encode_with(candidates._types[0], _profile, buf);
+                return;
+            }
+            uint8_t winner = _winner.load(std::memory_order_relaxed);
+            if (winner != NO_WINNER && candidates.contains(winner)
+                && _blocks_since_trial.fetch_add(1, std::memory_order_relaxed) < _trial_interval) {
+                block.encode_with(static_cast<decltype(block._type)>(winner), _profile, buf);
+                return;
+            }
 
-            while (str_offset != uncompress_size) {
-                uint8_t str_length = *reinterpret_cast<uint8_t*>(uncompress_buf.data() + str_offset);
-                str_offset += sizeof(uint8_t);
-                _column_values[str_count] = ColumnValue(uncompress_buf.data() + str_offset, str_length);
-                str_offset += str_length;
-                str_count++;
+            thread_local std::string trial_buf;
+            thread_local std::string best_buf;
+            double best_cost = std::numeric_limits<double>::max();
+            for (size_t i = 0; i < candidates._count; ++i) {
+                trial_buf.clear();
+                block.encode_with(candidates._types[i], _profile, &trial_buf);
+                uint8_t written_type = static_cast<uint8_t>(trial_buf[0]);
+                double cost = trial_buf.size() * (1 + _profile._decode_cost_weight * decode_cost(_column_type, written_type));
+                if (cost < best_cost) {
+                    best_cost = cost;
+                    winner = static_cast<uint8_t>(candidates._types[i]);
+                    std::swap(trial_buf, best_buf);
+                }
             }
+            buf->append(best_buf);
+            _winner.store(winner, std::memory_order_relaxed);
+            _blocks_since_trial.store(0, std::memory_order_relaxed);
+        }
 
-            assert(str_offset == uncompress_size);
-            assert(str_count == DATA_BLOCK_ITEM_NUMS);
+        ColumnType _column_type;
+        CompressionProfile _profile;
+        uint32_t _trial_interval;
+        std::atomic<uint8_t> _winner {NO_WINNER};
+        std::atomic<uint32_t> _blocks_since_trial {0};
+    };
+
+    // one block of the timestamps and of every column, encoded by the mem table as soon as it filled up
+    struct EncodedBlock {
+        std::string _timestamps;
+        std::vector<std::string> _columns; // by column id, empty if the block hasn't been encoded
+
+        bool encoded() const {
+            return !_columns.empty();
         }
     };
 
-    // tsm file representation in memory
+    // tsm file representation in memory, the data blocks are owned by the sealed mem table.
+    // layout: [timestamp blocks][data blocks of every column][block count][time index][column directory][index blocks][footer]
+    // the column directory holds the column count and the offset and size of the data blocks of each column,
+    // the footer the offset, size and crc32c of the index. every block carries its crc32c in its index entry
     struct TsmFile {
-        std::vector<std::unique_ptr<DataBlock>> _data_blocks;
+        std::vector<TimestampDataBlock*> _timestamp_blocks;
+        std::vector<DataBlock*> _data_blocks; // column major
+        std::vector<TimeIndexEntry> _time_index;
         std::vector<IndexBlock> _index_blocks;
+        std::vector<EncodedBlock> _encoded_blocks; // by block, copied as they are instead of encoding the blocks again
+        CodecSelector* _codec_selectors = nullptr; // by column, the types set on the blocks are used if null
         uint32_t _index_offset;
 
         TsmFile() = default;
 
         ~TsmFile() = default;
 
-        void encode_to(std::string *buf) {
-            size_t index_entry_count = 0;
+        // the timestamps and each column are encoded by one task into a buffer of their own, on the
+        // encode pool if given, then the buffers are stitched together and the offsets fixed up
+        void encode_to(std::string *buf, ThreadPool* encode_pool = nullptr) {
+            size_t block_count = _timestamp_blocks.size();
+            size_t task_count = _index_blocks.size() + 1;
+            // reused by the files the thread encodes next, tasks on other threads reach them by reference
+            thread_local std::vector<std::string> local_task_bufs;
+            local_task_bufs.resize(std::max(local_task_bufs.size(), task_count));
+            std::vector<std::string>& task_bufs = local_task_bufs;
+
+            auto encode_task = [&](size_t task_idx) {
+                std::string& task_buf = task_bufs[task_idx];
+                task_buf.clear();
+                if (task_idx == 0) {
+                    for (size_t i = 0; i < block_count; ++i) {
+                        TimeIndexEntry& time_index_entry = _time_index[i];
+                        time_index_entry._offset = task_buf.size();
+                        if (_encoded(i)) {
+                            task_buf.append(_encoded_blocks[i]._timestamps);
+                        } else {
+                            _timestamp_blocks[i]->encode_to_compress(&task_buf);
+                        }
+                        time_index_entry._size = task_buf.size() - time_index_entry._offset;
+                        time_index_entry._crc = crc32c::value(task_buf.data() + time_index_entry._offset, time_index_entry._size);
+                    }
+                    return;
+                }
+                IndexBlock& index_block = _index_blocks[task_idx - 1];
+                DataBlock** data_blocks = _data_blocks.data() + (task_idx - 1) * block_count;
+                for (size_t i = 0; i < block_count; ++i) {
+                    IndexEntry& index_entry = index_block._index_entries[i];
+                    index_entry._offset = task_buf.size();
+                    if (_encoded(i)) {
+                        task_buf.append(_encoded_blocks[i]._columns[task_idx - 1]);
+                    } else if (_codec_selectors != nullptr) {
+                        _codec_selectors[task_idx - 1].encode(*data_blocks[i], &task_buf);
+                    } else {
+                        data_blocks[i]->encode_to_compress(&task_buf);
+                    }
+                    index_entry._size = task_buf.size() - index_entry._offset;
+                    index_entry._crc = crc32c::value(task_buf.data() + index_entry._offset, index_entry._size);
+                }
+            };
+            if (encode_pool != nullptr) {
+                encode_pool->parallel_for(task_count, encode_task);
+            } else {
+                for (size_t task_idx = 0; task_idx < task_count; ++task_idx) {
+                    encode_task(task_idx);
+                }
+            }
 
-            for (auto &index_block: _index_blocks) {
-                for (auto &index_entry: index_block._index_entries) {
-                    index_entry._offset = buf->size();
-                    _data_blocks[index_entry_count++]->encode_to_compress(buf);
-                    index_entry._size = buf->size() - index_entry._offset;
+            size_t index_entry_count = 0;
+            std::vector<uint64_t> task_offsets(task_count);
+            for (size_t task_idx = 0; task_idx < task_count; ++task_idx) {
+                uint64_t base_offset = buf->size();
+                task_offsets[task_idx] = base_offset;
+                buf->append(task_bufs[task_idx]);
+                if (task_idx == 0) {
+                    for (auto &time_index_entry: _time_index) {
+                        time_index_entry._offset += base_offset;
+                    }
+                    continue;
+                }
+                for (auto &index_entry: _index_blocks[task_idx - 1]._index_entries) {
+                    index_entry._offset += base_offset;
+                    ++index_entry_count;
                 }
             }
 
             assert(index_entry_count == _data_blocks.size());
             _index_offset = buf->size();
+            put_fixed(buf, static_cast<uint32_t>(_time_index.size()));
+
+            for (const auto &time_index_entry: _time_index) {
+                time_index_entry.encode_to(buf);
+            }
+
+            put_fixed(buf, static_cast<uint16_t>(_index_blocks.size()));
+            for (size_t task_idx = 1; task_idx < task_count; ++task_idx) {
+                put_fixed(buf, task_offsets[task_idx]);
+                put_fixed(buf, static_cast<uint64_t>(task_bufs[task_idx].size()));
+            }
 
             for (const auto &block: _index_blocks) {
                 block.encode_to(buf);
             }
 
-            buf->append(reinterpret_cast<const char*>(&_index_offset), sizeof(uint32_t));
+            TsmFooter footer;
+            footer._index_offset = _index_offset;
+            footer._index_size = buf->size() - _index_offset;
+            footer._index_crc = crc32c::value(buf->data() + _index_offset, footer._index_size);
+            footer._version = TSM_VERSION_3;
+            footer._magic = TsmFooter::MAGIC;
+            footer.encode_to(buf);
         }
 
-        void write_to_file(const Path &tsm_file_path) {
-            std::string buf;
-            buf.reserve(10 * 1024 * 1024);
-            encode_to(&buf);
-            io::stream_write_string_to_file(tsm_file_path, buf);
-        }
-
-        static void get_size_and_offset(const Path& tsm_file_path, uint32_t* file_size, uint32_t* index_offset) {
-            std::ifstream input_file(tsm_file_path, std::ios::binary | std::ios::ate);
-            if (!input_file.is_open() || !input_file.good()) {
-                throw std::runtime_error("failed to open the file");
-            }
-            *file_size = input_file.tellg();
-            input_file.seekg(-sizeof(uint32_t), std::ios::end);
-            input_file.read(reinterpret_cast<char*>(index_offset), sizeof(uint32_t));
-            input_file.close();
+    private:
+        bool _encoded(size_t block_idx) const {
+            return block_idx < _encoded_blocks.size() && _encoded_blocks[block_idx].encoded();
         }
     };
 }
\ No newline at end of file
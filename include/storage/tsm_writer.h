@@ -16,6 +16,8 @@
 #pragma once
 
 #include <atomic>
+#include <array>
+#include <numeric>
 
 #include "index_manager.h"
 #include "convert_manager.h"
@@ -24,71 +26,48 @@
 #include "common/thread_pool.h"
 #include "common/spinlock.h"
 #include "storage/tsm_file.h"
+#include "storage/mem_table.h"
 #include "compression/compressor.h"
 
 namespace LindormContest {
 
     class TsmWriter {
     public:
-        TsmWriter(uint16_t vin_num, const Path& flush_dir_path, GlobalConvertManagerSPtr convert_manager)
-                : _vin_num(vin_num), _convert_manager(convert_manager),
-                  _flush_dir_path(flush_dir_path), _schema(nullptr) {}
+        TsmWriter(VinId vin_id, GlobalMemTableManagerSPtr mem_table_manager, GlobalConvertManagerSPtr convert_manager)
+                : _vin_id(vin_id), _mem_table_manager(mem_table_manager), _convert_manager(convert_manager) {}
 
         ~TsmWriter() = default;
 
-        void init(SchemaSPtr schema) {
-            _schema = schema;
-            for (uint16_t file_idx = 0; file_idx < TSM_FILE_COUNT; ++file_idx) {
-                Path flush_file_path = _flush_dir_path / std::to_string(file_idx);
-                _streams[file_idx].open(flush_file_path, std::ios::out | std::ios::binary);
-                assert(_streams[file_idx].is_open() && _streams[file_idx].good());
-                _cache[file_idx].reserve(ROW_CACHE_SIZE + 1600);
-                _write_nums[file_idx] = 0;
-            }
+        void append(const Row& row, uint32_t wal_seq) {
+            const uint32_t row_indices[] = {0};
+            append_batch(RowBatch {&row}, row_indices, 1, wal_seq);
         }
 
-        void append(const Row& row) {
-            uint16_t file_idx = decode_ts(row.timestamp) / FILE_CONVERT_SIZE;
-            {
-                std::lock_guard<std::mutex> l(_mutexes[file_idx]);
-                io::serialize_row(row, false, _cache[file_idx]);
-                if (unlikely(_cache[file_idx].size() >= ROW_CACHE_SIZE)) {
-                    _streams[file_idx].write(_cache[file_idx].data(), _cache[file_idx].size());
-                    _cache[file_idx].clear();
-                    _cache[file_idx].reserve(ROW_CACHE_SIZE + 1600);
-                }
-                if (unlikely(++_write_nums[file_idx] == FILE_CONVERT_SIZE)) {
-                    if (!_cache[file_idx].empty()) {
-                        _streams[file_idx].write(_cache[file_idx].data(), _cache[file_idx].size());
-                        _cache[file_idx].clear();
-                        _cache[file_idx].shrink_to_fit();
-                    }
-                    _streams[file_idx].close();
-                    _convert_manager->convert_async(_vin_num, file_idx);
-                }
+        // rows of row_indices must all belong to this vin and are appended in order
+        template <typename Batch>
+        void append_batch(const Batch& batch, const uint32_t* row_indices, size_t count, uint32_t wal_seq) {
+            std::vector<MemTableSPtr> sealed_mem_tables;
+            std::vector<FilledBlock> filled_blocks;
+            _mem_table_manager->append_batch(_vin_id, batch, row_indices, count, wal_seq, sealed_mem_tables, filled_blocks);
+            for (auto &filled_block: filled_blocks) {
+                _convert_manager->encode_block_async(_vin_id, std::move(filled_block));
+            }
+            for (auto &sealed_mem_table: sealed_mem_tables) {
+                _convert_manager->convert_async(_vin_id, std::move(sealed_mem_table));
             }
         }
 
         void flush() {
-            for (uint16_t file_idx = 0; file_idx < TSM_FILE_COUNT; ++file_idx) {
-                std::lock_guard<std::mutex> l(_mutexes[file_idx]);
-                if (!_cache[file_idx].empty()) {
-                    _streams[file_idx].write(_cache[file_idx].data(), _cache[file_idx].size());
-                    _cache[file_idx].clear();
-                    _cache[file_idx].reserve(ROW_CACHE_SIZE + 1600);
-                }
-                _streams[file_idx].flush();
+            std::vector<MemTableSPtr> sealed_mem_tables;
+            _mem_table_manager->seal_all(_vin_id, sealed_mem_tables);
+            for (auto &sealed_mem_table: sealed_mem_tables) {
+                _convert_manager->convert_async(_vin_id, std::move(sealed_mem_table));
             }
         }
 
     private:
-        uint16_t _vin_num;
-        Path _flush_dir_path;
-        SchemaSPtr _schema;
-        std::string _cache[TSM_FILE_COUNT];
-        uint16_t _write_nums[TSM_FILE_COUNT];
-        std::mutex _mutexes[TSM_FILE_COUNT];
-        std::ofstream _streams[TSM_FILE_COUNT];
+        VinId _vin_id;
+        GlobalMemTableManagerSPtr _mem_table_manager;
         GlobalConvertManagerSPtr _convert_manager;
     };
 
@@ -98,32 +77,66 @@ namespace LindormContest {
 
     class TsmWriterManager {
     public:
-        TsmWriterManager(const Path& root_path, GlobalConvertManagerSPtr convert_manager) {
-            for (uint16_t vin_num = 0; vin_num < VIN_NUM_RANGE; ++vin_num) {
-                Path flush_dir_path = root_path / "no-compaction" / std::to_string(vin_num);
-                std::filesystem::create_directories(flush_dir_path);
-                _tsm_writers[vin_num] = std::make_unique<TsmWriter>(vin_num, flush_dir_path, convert_manager);
-            }
-        }
+        TsmWriterManager(GlobalMemTableManagerSPtr mem_table_manager, GlobalConvertManagerSPtr convert_manager)
+                : _mem_table_manager(mem_table_manager), _convert_manager(convert_manager) {}
 
         ~TsmWriterManager() = default;
 
-        void init(SchemaSPtr schema) {
-            for (auto &tsm_writer: _tsm_writers) {
-                tsm_writer->init(schema);
-            }
+        // called once per vin before its id is visible
+        void add_vin(VinId vin_id) {
+            _tsm_writers[vin_id] = std::make_unique<TsmWriter>(vin_id, _mem_table_manager, _convert_manager);
+        }
+
+        void append(VinId vin_id, const Row& row, uint32_t wal_seq) {
+            _tsm_writers[vin_id]->append(row, wal_seq);
         }
 
-        void append(const Row& row) {
-            _tsm_writers[decode_vin(row.vin)]->append(row);
+        // vin_ids[i] is the id of row i of the batch. rows are radix partitioned by vin id, keeping the
+        // order of the rows of one vin, so every vin's slice is appended with one dispatch
+        template <typename Batch>
+        void append_batch(const Batch& batch, const std::vector<VinId>& vin_ids, uint32_t wal_seq) {
+            thread_local std::vector<uint32_t> order;
+            _radix_sort(vin_ids, order);
+
+            for (size_t begin = 0, end; begin < order.size(); begin = end) {
+                VinId vin_id = vin_ids[order[begin]];
+                for (end = begin + 1; end < order.size() && vin_ids[order[end]] == vin_id; ++end);
+                _tsm_writers[vin_id]->append_batch(batch, order.data() + begin, end - begin, wal_seq);
+            }
         }
 
-        void flush(uint16_t vin_num) {
-            _tsm_writers[vin_num]->flush();
+        // convert the mem tables of every vin, no write may come in concurrently
+        void flush(VinId vin_count) {
+            for (VinId vin_id = 0; vin_id < vin_count; ++vin_id) {
+                _tsm_writers[vin_id]->flush();
+            }
         }
 
     private:
-        std::unique_ptr<TsmWriter> _tsm_writers[VIN_NUM_RANGE];
+        // stable lsd radix sort of the row indices by vin id, only the digits below the max id are sorted
+        static void _radix_sort(const std::vector<VinId>& vin_ids, std::vector<uint32_t>& order) {
+            thread_local std::vector<uint32_t> buf;
+            order.resize(vin_ids.size());
+            buf.resize(vin_ids.size());
+            std::iota(order.begin(), order.end(), 0);
+            VinId max_vin_id = vin_ids.empty() ? 0 : *std::max_element(vin_ids.begin(), vin_ids.end());
+
+            for (uint32_t shift = 0; shift < sizeof(VinId) * 8 && (max_vin_id >> shift) > 0; shift += WRITE_RADIX_BITS) {
+                std::array<uint32_t, (1 << WRITE_RADIX_BITS) + 1> offsets {};
+                for (uint32_t row_idx: order) {
+                    offsets[((vin_ids[row_idx] >> shift) & ((1 << WRITE_RADIX_BITS) - 1)) + 1]++;
+                }
+                std::partial_sum(offsets.begin(), offsets.end(), offsets.begin());
+                for (uint32_t row_idx: order) {
+                    buf[offsets[(vin_ids[row_idx] >> shift) & ((1 << WRITE_RADIX_BITS) - 1)]++] = row_idx;
+                }
+                order.swap(buf);
+            }
+        }
+
+        GlobalMemTableManagerSPtr _mem_table_manager;
+        GlobalConvertManagerSPtr _convert_manager;
+        VinArray<std::unique_ptr<TsmWriter>> _tsm_writers;
     };
 
 }
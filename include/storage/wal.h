@@ -0,0 +1,577 @@
+/*
+ * Copyright Alibaba Group Holding Ltd.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <map>
+#include <mutex>
+#include <queue>
+#include <thread>
+#include <atomic>
+#include <condition_variable>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <climits>
+
+#include "base.h"
+#include "struct/Row.h"
+#include "common/crc32c.h"
+#include "io/io_utils.h"
+#include "io/row_codec.h"
+
+namespace LindormContest {
+
+    // record layout: [uint32_t record size][uint32_t crc32c][uint64_t lsn][uint32_t row count][rows].
+    // the lsn orders the records of all streams, the same row written twice is replayed in write order.
+    // the crc32c covers the row count and the rows and is then extended by the lsn, which is only
+    // taken once the stream has a place for the record
+    static constexpr size_t WAL_RECORD_HEADER_SIZE = 3 * sizeof(uint32_t) + sizeof(uint64_t);
+    static constexpr size_t WAL_RECORD_CRC_OFFSET = sizeof(uint32_t);
+    static constexpr size_t WAL_RECORD_LSN_OFFSET = 2 * sizeof(uint32_t);
+    static constexpr size_t WAL_RECORD_ROWS_CRC_OFFSET = WAL_RECORD_LSN_OFFSET + sizeof(uint64_t); // of the row count
+
+    class WalSegmentRefs;
+
+    using WalSegmentRefsSPtr = std::shared_ptr<WalSegmentRefs>;
+
+    // live references to the wal segments, a segment can't be removed while it is referenced. a writer holds
+    // one on the segment of its record until the rows are in the mem tables, a mem table one on every
+    // segment holding its rows until it is dropped after the conversion.
+    // multi thread safe
+    class WalSegmentRefs {
+    public:
+        void ref(uint32_t seq) {
+            std::lock_guard<std::mutex> l(_mutex);
+            ++_refs[seq];
+        }
+
+        void unref(uint32_t seq) {
+            std::lock_guard<std::mutex> l(_mutex);
+            auto it = _refs.find(seq);
+            assert(it != _refs.end());
+            if (--it->second == 0) {
+                _refs.erase(it);
+            }
+        }
+
+        // the smallest segment seq referenced, UINT32_MAX if none
+        uint32_t min_seq() {
+            std::lock_guard<std::mutex> l(_mutex);
+            return _refs.empty() ? std::numeric_limits<uint32_t>::max() : _refs.begin()->first;
+        }
+
+    private:
+        std::mutex _mutex;
+        std::map<uint32_t, uint64_t> _refs; // ref count by segment seq
+    };
+
+    // one wal stream owns one segment file at a time, writer threads append records
+    // and wait, the commit thread writes all pending records with one pwritev call.
+    // the lsn of a record is taken in append order, so every segment holds its records by lsn.
+    // multi thread safe
+    class WalStream {
+    public:
+        WalStream(const Path& wal_dir_path, std::atomic<uint32_t>& segment_seq, std::atomic<uint64_t>& next_lsn,
+                  WalSegmentRefsSPtr refs)
+                : _wal_dir_path(wal_dir_path), _segment_seq(segment_seq), _next_lsn(next_lsn), _refs(std::move(refs)) {
+            _current_seq = _segment_seq++;
+            _commit_thread = std::thread(&WalStream::_commit_loop, this);
+        }
+
+        ~WalStream() {
+            shutdown();
+        }
+
+        // block until the record is written, return the seq of the segment holding the record, which
+        // is referenced for the caller. it is taken before the stream can move past the segment.
+        // rows_crc is the crc32c of the record from its row count on. throw if the stream failed to
+        // write, every record appended since is failed as well
+        uint32_t append(std::string&& record, uint32_t rows_crc) {
+            std::unique_lock<std::mutex> l(_mutex);
+            if (unlikely(_failed)) {
+                throw std::runtime_error("wal stream failed");
+            }
+            if (unlikely(_current_size >= WAL_SEGMENT_SIZE)) {
+                _current_seq = _segment_seq++;
+                _current_size = 0;
+            }
+            uint32_t seq = _current_seq;
+            _refs->ref(seq);
+            uint64_t record_lsn = _next_lsn++;
+            std::memcpy(record.data() + WAL_RECORD_LSN_OFFSET, &record_lsn, sizeof(uint64_t));
+            uint32_t crc = crc32c::extend(rows_crc, record.data() + WAL_RECORD_LSN_OFFSET, sizeof(uint64_t));
+            std::memcpy(record.data() + WAL_RECORD_CRC_OFFSET, &crc, sizeof(uint32_t));
+            _current_size += record.size();
+            _pending.push_back({seq, std::move(record)});
+            uint64_t lsn = ++_append_lsn;
+            _commit_cv.notify_one();
+            _writer_cv.wait(l, [&] { return _commit_lsn >= lsn || _failed; });
+            if (unlikely(_commit_lsn < lsn)) {
+                _refs->unref(seq);
+                throw std::runtime_error("wal stream failed");
+            }
+            return seq;
+        }
+
+        // segments with seq >= active seq may still be written
+        uint32_t active_seq() {
+            std::lock_guard<std::mutex> l(_mutex);
+            return std::min(_current_seq, _fd_seq);
+        }
+
+        void shutdown() {
+            {
+                std::lock_guard<std::mutex> l(_mutex);
+                if (_shutdown) {
+                    return;
+                }
+                _shutdown = true;
+            }
+            _commit_cv.notify_one();
+            if (_commit_thread.joinable()) {
+                _commit_thread.join();
+            }
+            if (_fd >= 0) {
+                ::close(_fd);
+                _fd = -1;
+            }
+        }
+
+    private:
+        struct PendingRecord {
+            uint32_t _seq;
+            std::string _data;
+        };
+
+        // the first io error fails the stream for good, the writers waiting are woken up to report it
+        void _commit_loop() {
+            try {
+                _commit_batches();
+            } catch (const std::exception& e) {
+                ERR_LOG("wal stream failed at segment %u: %s", _fd_seq, e.what())
+                {
+                    std::lock_guard<std::mutex> l(_mutex);
+                    _failed = true;
+                    _pending.clear();
+                }
+                _writer_cv.notify_all();
+            }
+        }
+
+        void _commit_batches() {
+            while (true) {
+                std::vector<PendingRecord> batch;
+                uint64_t lsn;
+                {
+                    std::unique_lock<std::mutex> l(_mutex);
+                    _commit_cv.wait(l, [&] { return _shutdown || !_pending.empty(); });
+                    if (_pending.empty()) {
+                        return;
+                    }
+                    batch.swap(_pending);
+                    lsn = _append_lsn;
+                }
+
+                size_t start = 0;
+
+                while (start < batch.size()) {
+                    if (batch[start]._seq != _fd_seq) {
+                        _open_segment(batch[start]._seq);
+                    }
+                    std::vector<iovec> iovs;
+                    size_t end = start;
+                    while (end < batch.size() && batch[end]._seq == _fd_seq && iovs.size() < IOV_MAX) {
+                        iovs.push_back({batch[end]._data.data(), batch[end]._data.size()});
+                        end++;
+                    }
+                    _write_fully(iovs);
+                    start = end;
+                }
+
+                if (WAL_SYNC && ::fdatasync(_fd) != 0) {
+                    throw std::runtime_error("fdatasync wal segment failed");
+                }
+
+                {
+                    std::lock_guard<std::mutex> l(_mutex);
+                    _commit_lsn = lsn;
+                }
+                _writer_cv.notify_all();
+            }
+        }
+
+        // the records written to the previous segment are synced before it is closed,
+        // the batch crossing into the new segment is committed as a whole
+        void _open_segment(uint32_t seq) {
+            if (_fd >= 0) {
+                if (WAL_SYNC && ::fdatasync(_fd) != 0) {
+                    throw std::runtime_error("fdatasync wal segment failed");
+                }
+                ::close(_fd);
+            }
+            Path segment_path = _wal_dir_path / std::to_string(seq);
+            _fd = ::open(segment_path.c_str(), O_WRONLY | O_CREAT, 0644);
+            if (_fd < 0) {
+                throw std::runtime_error("open wal segment failed");
+            }
+            _file_offset = ::lseek(_fd, 0, SEEK_END);
+            std::lock_guard<std::mutex> l(_mutex);
+            _fd_seq = seq;
+        }
+
+        void _write_fully(std::vector<iovec>& iovs) {
+            iovec* iov = iovs.data();
+            int iov_count = static_cast<int>(iovs.size());
+
+            while (iov_count > 0) {
+                ssize_t written = ::pwritev(_fd, iov, iov_count, _file_offset);
+                if (written < 0) {
+                    if (errno == EINTR) {
+                        continue;
+                    }
+                    throw std::runtime_error("write wal segment failed");
+                }
+                _file_offset += written;
+                while (iov_count > 0 && static_cast<size_t>(written) >= iov->iov_len) {
+                    written -= iov->iov_len;
+                    iov++;
+                    iov_count--;
+                }
+                if (iov_count > 0) {
+                    iov->iov_base = static_cast<char*>(iov->iov_base) + written;
+                    iov->iov_len -= written;
+                }
+            }
+        }
+
+        Path _wal_dir_path;
+        std::atomic<uint32_t>& _segment_seq;
+        std::atomic<uint64_t>& _next_lsn;
+        WalSegmentRefsSPtr _refs;
+        std::mutex _mutex;
+        std::condition_variable _writer_cv;
+        std::condition_variable _commit_cv;
+        std::vector<PendingRecord> _pending;
+        uint64_t _append_lsn = 0;
+        uint64_t _commit_lsn = 0;
+        uint32_t _current_seq;
+        size_t _current_size = 0;
+        int _fd = -1;
+        off_t _file_offset = 0;
+        uint32_t _fd_seq = std::numeric_limits<uint32_t>::max();
+        bool _shutdown = false;
+        bool _failed = false;
+        std::thread _commit_thread;
+    };
+
+    // reads the records of a wal segment left by the last run from front to back. the segment is mapped,
+    // its pages are only resident while they are read
+    class WalReader {
+    public:
+        WalReader(const Path& segment_path, uint32_t seq) : _seq(seq) {
+            int fd = ::open(segment_path.c_str(), O_RDONLY);
+            if (fd < 0) {
+                throw std::runtime_error("open wal segment failed");
+            }
+            _size = ::lseek(fd, 0, SEEK_END);
+            void* data = _size > 0 ? ::mmap(nullptr, _size, PROT_READ, MAP_PRIVATE, fd, 0) : nullptr;
+            ::close(fd);
+            if (data == MAP_FAILED) {
+                throw std::runtime_error("mmap wal segment failed");
+            }
+            if (data != nullptr) {
+                ::madvise(data, _size, MADV_SEQUENTIAL);
+            }
+            _data = static_cast<const char*>(data);
+        }
+
+        ~WalReader() {
+            if (_data != nullptr) {
+                ::munmap(const_cast<char*>(_data), _size);
+            }
+        }
+
+        WalReader(const WalReader&) = delete;
+        WalReader& operator=(const WalReader&) = delete;
+
+        // move to the next record, false at the end of the segment or at a torn or corrupted record,
+        // the records behind which are lost
+        bool next() {
+            _offset += _record_size;
+            _record_size = 0;
+            // the pages read so far are dropped from the mapping
+            size_t read_end = _offset & ~(static_cast<size_t>(::getpagesize()) - 1);
+            if (read_end - _released >= RELEASE_SIZE) {
+                ::madvise(const_cast<char*>(_data) + _released, read_end - _released, MADV_DONTNEED);
+                _released = read_end;
+            }
+            if (_offset == _size) {
+                return false;
+            }
+            uint32_t record_size = 0;
+            if (_size - _offset >= WAL_RECORD_HEADER_SIZE) {
+                std::memcpy(&record_size, _data + _offset, sizeof(uint32_t));
+            }
+            if (unlikely(record_size < WAL_RECORD_HEADER_SIZE || record_size > _size - _offset)) {
+                // torn tail of the last write
+                ERR_LOG("wal segment %u is truncated at %zu", _seq, _offset)
+                return false;
+            }
+            uint32_t crc;
+            std::memcpy(&crc, _data + _offset + WAL_RECORD_CRC_OFFSET, sizeof(uint32_t));
+            uint32_t actual_crc = crc32c::value(_data + _offset + WAL_RECORD_ROWS_CRC_OFFSET, record_size - WAL_RECORD_ROWS_CRC_OFFSET);
+            actual_crc = crc32c::extend(actual_crc, _data + _offset + WAL_RECORD_LSN_OFFSET, sizeof(uint64_t));
+            if (unlikely(actual_crc != crc)) {
+                ERR_LOG("record at %zu of wal segment %u is corrupted, the records behind it are dropped", _offset, _seq)
+                return false;
+            }
+            _record_size = record_size;
+            return true;
+        }
+
+        uint32_t seq() const {
+            return _seq;
+        }
+
+        uint32_t record_size() const {
+            return _record_size;
+        }
+
+        uint64_t lsn() const {
+            uint64_t lsn;
+            std::memcpy(&lsn, _data + _offset + WAL_RECORD_LSN_OFFSET, sizeof(uint64_t));
+            return lsn;
+        }
+
+        uint32_t row_count() const {
+            uint32_t row_count;
+            std::memcpy(&row_count, _data + _offset + WAL_RECORD_ROWS_CRC_OFFSET, sizeof(uint32_t));
+            return row_count;
+        }
+
+        const char* rows() const {
+            return _data + _offset + WAL_RECORD_HEADER_SIZE;
+        }
+
+    private:
+        static constexpr size_t RELEASE_SIZE = 4 * 1024 * 1024;
+
+        uint32_t _seq;
+        const char* _data = nullptr;
+        size_t _size = 0;
+        size_t _offset = 0;
+        size_t _released = 0; // bytes dropped from the mapping
+        uint32_t _record_size = 0; // of the current record
+    };
+
+    class GlobalWalManager;
+
+    using GlobalWalManagerSPtr = std::shared_ptr<GlobalWalManager>;
+
+    // a small fixed set of wal streams shared by all vins, so the number of open files
+    // and write syscalls doesn't depend on the vin count.
+    // multi thread safe
+    class GlobalWalManager {
+    public:
+        GlobalWalManager(const Path& root_path)
+                : _wal_dir_path(root_path / "wal"), _schema(nullptr), _refs(std::make_shared<WalSegmentRefs>()) {
+            std::filesystem::create_directories(_wal_dir_path);
+            uint32_t next_seq = 0;
+
+            for (const auto& entry: std::filesystem::directory_iterator(_wal_dir_path)) {
+                uint32_t seq;
+                if (!io::parse_seq_file_name(entry, seq)) {
+                    ERR_LOG("%s is not a wal segment, skipped", entry.path().c_str())
+                    continue;
+                }
+                _replay_seqs.emplace_back(seq);
+                next_seq = std::max(next_seq, seq + 1);
+            }
+
+            std::sort(_replay_seqs.begin(), _replay_seqs.end());
+            _segment_seq = next_seq;
+        }
+
+        ~GlobalWalManager() {
+            shutdown();
+        }
+
+        void init(SchemaSPtr schema, RowCodecSPtr row_codec) {
+            _schema = schema;
+            _row_codec = row_codec;
+            for (uint16_t i = 0; i < WAL_STREAM_NUM; ++i) {
+                if (_streams[i] == nullptr) {
+                    _streams[i] = std::make_unique<WalStream>(_wal_dir_path, _segment_seq, _next_lsn, _refs);
+                }
+            }
+        }
+
+        // encoded size of one row without its string bytes
+        size_t row_width() const {
+            return _row_codec->row_width();
+        }
+
+        template <typename Batch>
+        void encode_row(const Batch& batch, size_t row_idx, std::string& record) const {
+            _row_codec->encode(batch, row_idx, record);
+        }
+
+        // shared with the mem tables, which reference the segments holding their rows
+        WalSegmentRefsSPtr refs() const {
+            return _refs;
+        }
+
+        // rows must have been encoded after a WAL_RECORD_HEADER_SIZE placeholder. the segment seq returned
+        // is referenced until release is called, once the rows are in the mem tables
+        uint32_t append(std::string&& record, uint32_t row_count) {
+            uint32_t record_size = static_cast<uint32_t>(record.size());
+            std::memcpy(record.data(), &record_size, sizeof(uint32_t));
+            std::memcpy(record.data() + WAL_RECORD_ROWS_CRC_OFFSET, &row_count, sizeof(uint32_t));
+            // the bulk of the crc is computed outside the lock of the stream
+            uint32_t rows_crc = crc32c::value(record.data() + WAL_RECORD_ROWS_CRC_OFFSET, record.size() - WAL_RECORD_ROWS_CRC_OFFSET);
+            static std::atomic<uint32_t> next_stream {0};
+            thread_local uint32_t stream_idx = next_stream++ % WAL_STREAM_NUM;
+            return _streams[stream_idx]->append(std::move(record), rows_crc);
+        }
+
+        // the segments before the checkpoint of the manifest are obsolete, new segments are numbered after it
+        void set_checkpoint(uint32_t wal_checkpoint) {
+            auto it = std::lower_bound(_replay_seqs.begin(), _replay_seqs.end(), wal_checkpoint);
+            for (auto obsolete = _replay_seqs.begin(); obsolete != it; ++obsolete) {
+                std::filesystem::remove(_wal_dir_path / std::to_string(*obsolete));
+            }
+            _replay_seqs.erase(_replay_seqs.begin(), it);
+            _segment_seq = std::max(_segment_seq.load(), wal_checkpoint);
+            _min_live_seq = wal_checkpoint;
+        }
+
+        // feed the rows of the segments left by the last run to the visitor in write order, a batch of
+        // about one segment at a time. the visitor gets the rows and the seqs of the segments holding them.
+        // the records of every segment are in lsn order, the segments are merged by lsn while they are
+        // read, so only the batch is held in memory
+        template <typename F>
+        void replay(F&& visitor) {
+            // no segment is removed by the conversions of the replayed rows before its last row is in a mem table
+            for (uint32_t seq: _replay_seqs) {
+                _refs->ref(seq);
+            }
+            std::vector<std::unique_ptr<WalReader>> readers;
+            auto lsn_greater = [](const WalReader* lhs, const WalReader* rhs) {
+                return lhs->lsn() > rhs->lsn();
+            };
+            // the segments by the lsn of their next record
+            std::priority_queue<WalReader*, std::vector<WalReader*>, decltype(lsn_greater)> heap(lsn_greater);
+            for (uint32_t seq: _replay_seqs) {
+                readers.emplace_back(std::make_unique<WalReader>(_wal_dir_path / std::to_string(seq), seq));
+                if (readers.back()->next()) {
+                    heap.push(readers.back().get());
+                }
+            }
+
+            std::vector<Row> rows;
+            std::vector<uint32_t> seqs;
+            size_t batch_size = 0;
+            while (!heap.empty()) {
+                WalReader* reader = heap.top();
+                heap.pop();
+                _next_lsn = std::max(_next_lsn.load(), reader->lsn() + 1);
+                const char* row_ptr = reader->rows();
+                for (uint32_t j = 0; j < reader->row_count(); ++j) {
+                    _row_codec->decode(row_ptr, rows.emplace_back());
+                    seqs.emplace_back(reader->seq());
+                }
+                batch_size += reader->record_size();
+                if (reader->next()) {
+                    heap.push(reader);
+                }
+                if (batch_size >= WAL_SEGMENT_SIZE || heap.empty()) {
+                    visitor(rows, seqs);
+                    rows.clear();
+                    seqs.clear();
+                    batch_size = 0;
+                }
+            }
+            for (uint32_t seq: _replay_seqs) {
+                _refs->unref(seq);
+            }
+        }
+
+        void release(uint32_t seq) {
+            _refs->unref(seq);
+        }
+
+        // the smallest segment seq which may hold rows not converted yet. the streams are asked first,
+        // a segment referenced after that is never before the active segment of its stream.
+        // after shutdown only the segments referenced by mem tables are live, next_seq() if none
+        uint32_t min_live_seq() {
+            if (_shutdown.load(std::memory_order_acquire)) {
+                return std::min(_refs->min_seq(), next_seq());
+            }
+            uint32_t min_live_seq = std::numeric_limits<uint32_t>::max();
+            for (const auto& stream: _streams) {
+                if (stream != nullptr) {
+                    min_live_seq = std::min(min_live_seq, stream->active_seq());
+                }
+            }
+            return std::min(min_live_seq, _refs->min_seq());
+        }
+
+        // seq of the next segment opened, every segment written so far is before it
+        uint32_t next_seq() const {
+            return _segment_seq;
+        }
+
+        // remove the segments before the checkpoint, whose rows all live in tsm files of the manifest
+        void remove_obsolete(uint32_t wal_checkpoint) {
+            std::lock_guard<std::mutex> l(_remove_mutex);
+            if (wal_checkpoint <= _min_live_seq) {
+                return;
+            }
+            _min_live_seq = wal_checkpoint;
+
+            for (const auto& entry: std::filesystem::directory_iterator(_wal_dir_path)) {
+                uint32_t seq;
+                if (io::parse_seq_file_name(entry, seq) && seq < wal_checkpoint) {
+                    std::filesystem::remove(entry.path());
+                }
+            }
+        }
+
+        void shutdown() {
+            for (auto& stream: _streams) {
+                if (stream != nullptr) {
+                    stream->shutdown();
+                }
+            }
+            _shutdown.store(true, std::memory_order_release);
+        }
+
+    private:
+        Path _wal_dir_path;
+        SchemaSPtr _schema;
+        RowCodecSPtr _row_codec;
+        std::atomic<uint32_t> _segment_seq;
+        std::atomic<uint64_t> _next_lsn {0};
+        std::vector<uint32_t> _replay_seqs;
+        std::unique_ptr<WalStream> _streams[WAL_STREAM_NUM];
+        WalSegmentRefsSPtr _refs;
+        std::mutex _remove_mutex;
+        uint32_t _min_live_seq = 0;
+        std::atomic<bool> _shutdown {false}; // every stream is shut down
+    };
+
+}
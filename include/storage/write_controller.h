@@ -0,0 +1,153 @@
+/*
+ * Copyright Alibaba Group Holding Ltd.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+
+#include "base.h"
+
+namespace LindormContest {
+
+    struct WriteControllerOptions {
+        size_t _soft_pending_converts = WRITE_SOFT_PENDING_CONVERTS;
+        size_t _hard_pending_converts = WRITE_HARD_PENDING_CONVERTS;
+        size_t _soft_pending_bytes = WRITE_SOFT_PENDING_BYTES;
+        size_t _hard_pending_bytes = WRITE_HARD_PENDING_BYTES;
+        double _delayed_rows_per_sec = WRITE_DELAYED_ROWS_PER_SEC;
+    };
+
+    struct WriteStallMetrics {
+        size_t _pending_converts;
+        size_t _pending_bytes;
+        uint64_t _delayed_writes;  // writes throttled past the soft thresholds
+        uint64_t _delayed_us;
+        uint64_t _stopped_writes;  // writes blocked past the hard thresholds
+        uint64_t _stopped_us;
+    };
+
+    class WriteController;
+
+    using WriteControllerSPtr = std::shared_ptr<WriteController>;
+
+    // keeps writers from outrunning the converters. sealed mem tables waiting for conversion are
+    // counted with their bytes; past a soft threshold writes are paced by a token bucket of rows,
+    // past a hard threshold writes block until conversions catch up.
+    // multi thread safe
+    class WriteController {
+    public:
+        explicit WriteController(const WriteControllerOptions& options = WriteControllerOptions())
+                : _options(options), _tokens(0), _last_refill(std::chrono::steady_clock::now()) {
+            assert(_options._soft_pending_converts <= _options._hard_pending_converts);
+            assert(_options._soft_pending_bytes <= _options._hard_pending_bytes);
+            assert(_options._delayed_rows_per_sec > 0);
+        }
+
+        ~WriteController() = default;
+
+        // called by a writer before it buffers row_count rows
+        void delay_write(size_t row_count) {
+            if (likely(!_over_soft())) {
+                return;
+            }
+            auto start = std::chrono::steady_clock::now();
+
+            if (unlikely(_over_hard())) {
+                std::unique_lock<std::mutex> l(_mutex);
+                _stop_cv.wait(l, [this] { return !_over_hard(); });
+                _stopped_writes.fetch_add(1, std::memory_order_relaxed);
+                _stopped_us.fetch_add(_elapsed_us(start), std::memory_order_relaxed);
+                return;
+            }
+
+            std::chrono::microseconds wait_time = _acquire_tokens(row_count);
+            if (wait_time.count() > 0) {
+                std::this_thread::sleep_for(wait_time);
+            }
+            _delayed_writes.fetch_add(1, std::memory_order_relaxed);
+            _delayed_us.fetch_add(_elapsed_us(start), std::memory_order_relaxed);
+        }
+
+        // a sealed mem table is queued for conversion
+        void add_pending(size_t bytes) {
+            _pending_converts.fetch_add(1, std::memory_order_relaxed);
+            _pending_bytes.fetch_add(bytes, std::memory_order_relaxed);
+        }
+
+        // a queued mem table has been converted
+        void remove_pending(size_t bytes) {
+            _pending_converts.fetch_sub(1, std::memory_order_relaxed);
+            _pending_bytes.fetch_sub(bytes, std::memory_order_relaxed);
+            if (!_over_hard()) {
+                // take the lock so that a writer can't miss the wakeup between its check and its wait
+                std::lock_guard<std::mutex> l(_mutex);
+                _stop_cv.notify_all();
+            }
+        }
+
+        WriteStallMetrics get_metrics() const {
+            return {_pending_converts.load(std::memory_order_relaxed), _pending_bytes.load(std::memory_order_relaxed),
+                    _delayed_writes.load(std::memory_order_relaxed), _delayed_us.load(std::memory_order_relaxed),
+                    _stopped_writes.load(std::memory_order_relaxed), _stopped_us.load(std::memory_order_relaxed)};
+        }
+
+    private:
+        bool _over_soft() const {
+            return _pending_converts.load(std::memory_order_relaxed) >= _options._soft_pending_converts
+                   || _pending_bytes.load(std::memory_order_relaxed) >= _options._soft_pending_bytes;
+        }
+
+        bool _over_hard() const {
+            return _pending_converts.load(std::memory_order_relaxed) >= _options._hard_pending_converts
+                   || _pending_bytes.load(std::memory_order_relaxed) >= _options._hard_pending_bytes;
+        }
+
+        // take row_count tokens, the bucket may go into debt and the caller sleeps it off.
+        // the bucket holds at most 100ms of tokens so that an idle period doesn't allow a burst
+        std::chrono::microseconds _acquire_tokens(size_t row_count) {
+            std::lock_guard<std::mutex> l(_mutex);
+            auto now = std::chrono::steady_clock::now();
+            double elapsed_sec = std::chrono::duration<double>(now - _last_refill).count();
+            _last_refill = now;
+            _tokens = std::min(_tokens + elapsed_sec * _options._delayed_rows_per_sec, _options._delayed_rows_per_sec / 10);
+            _tokens -= static_cast<double>(row_count);
+            if (_tokens >= 0) {
+                return std::chrono::microseconds(0);
+            }
+            return std::chrono::microseconds(static_cast<int64_t>(-_tokens / _options._delayed_rows_per_sec * 1e6));
+        }
+
+        static uint64_t _elapsed_us(std::chrono::steady_clock::time_point start) {
+            return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count();
+        }
+
+        WriteControllerOptions _options;
+        std::atomic<size_t> _pending_converts {0};
+        std::atomic<size_t> _pending_bytes {0};
+        std::atomic<uint64_t> _delayed_writes {0};
+        std::atomic<uint64_t> _delayed_us {0};
+        std::atomic<uint64_t> _stopped_writes {0};
+        std::atomic<uint64_t> _stopped_us {0};
+        double _tokens;
+        std::chrono::steady_clock::time_point _last_refill;
+        std::mutex _mutex;
+        std::condition_variable _stop_cv;
+    };
+
+}
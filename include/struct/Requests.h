@@ -53,6 +53,34 @@ namespace LindormContest {
         std::vector<Row> rows;
     }WriteRequest;
 
+    /**
+     * One column of a ColumnarWriteRequest, the buffers are owned by the caller. <br>
+     * - integer: intValues[rowCount] <br>
+     * - double float: doubleValues[rowCount] <br>
+     * - string: the i-th string is stringData[stringOffsets[i], stringOffsets[i + 1]), stringOffsets has rowCount + 1 entries <br>
+     */
+    typedef struct ColumnarColumn {
+        std::string columnName;
+        ColumnType columnType;
+        const int32_t *intValues = nullptr;
+        const double_t *doubleValues = nullptr;
+        const int32_t *stringOffsets = nullptr;
+        const char *stringData = nullptr;
+    }ColumnarColumn;
+
+    /**
+     * Write several rows for this table in column major layout, the engine reads the buffers
+     * directly without building a Row for every record. The buffers are only read during the call.
+     * All columns defined in schema must be present.
+     */
+    typedef struct ColumnarWriteRequest {
+        std::string tableName;
+        size_t rowCount = 0;
+        const Vin *vins = nullptr;
+        const int64_t *timestamps = nullptr;
+        std::vector<ColumnarColumn> columns;
+    }ColumnarWriteRequest;
+
     /**
      * Request several target columns of this vin.
      * If requestedColumnFieldNames is empty, return all columns.
@@ -22,6 +22,8 @@
 #include "struct/Row.h"
 #include "io/io_utils.h"
 #include "index_manager.h"
+#include "storage/mem_table.h"
+#include "read_snapshot.h"
 #include "common/spinlock.h"
 
 namespace LindormContest {
@@ -30,130 +32,121 @@ namespace LindormContest {
     public:
         TimeRangeManager() = default;
 
-        TimeRangeManager(uint16_t vin_num, const Path& vin_dir_path, GlobalIndexManagerSPtr index_manager)
-        : _vin_num(vin_num), _vin_dir_path(vin_dir_path), _schema(nullptr), _index_manager(index_manager) {}
+        TimeRangeManager(VinId vin_id, GlobalMemTableManagerSPtr mem_table_manager, GlobalIndexManagerSPtr index_manager)
+        : _vin_id(vin_id), _schema(nullptr), _row_codec(nullptr),
+          _mem_table_manager(mem_table_manager), _index_manager(index_manager) {}
 
         TimeRangeManager(TimeRangeManager&& other) = default;
 
         ~TimeRangeManager() = default;
 
-        void init(SchemaSPtr schema) {
+        void init(SchemaSPtr schema, RowCodecSPtr row_codec) {
             _schema = schema;
+            _row_codec = row_codec;
         }
 
-        template <bool finish_compaction>
         void query_time_range(const Vin& vin, const TimeRange& tr, const std::set<std::string>& requested_columns,
                               std::vector<Row> &trReadRes) {
-            if constexpr (finish_compaction) {
-                trReadRes.resize(tr.range_width());
-                for (size_t i = 0; i < trReadRes.size(); ++i) {
-                    trReadRes[i].vin = vin;
-                    trReadRes[i].timestamp = encode_ts(i + tr._start_idx);
-                }
+            size_t row_idx = trReadRes.size();
+            ReadSnapshot snapshot;
+            snapshot.take(_vin_id, tr, *_mem_table_manager, *_index_manager);
+
+            for (size_t i = 0; i < snapshot._files.size(); ++i) {
+                size_t source_row_idx = trReadRes.size();
+                _query_from_one_tsm_file(vin, *snapshot._files[i], tr, requested_columns, trReadRes);
+                _remove_shadowed_rows(snapshot._file_shadows[i], source_row_idx, trReadRes);
             }
-            uint16_t row_idx = 0;
-
-            for (uint16_t file_idx = tr._start_idx / FILE_CONVERT_SIZE; file_idx <= tr._end_idx / FILE_CONVERT_SIZE; ++file_idx) {
-                TimeRange file_tr (
-                        std::max(tr._start_idx, (uint16_t) (file_idx * FILE_CONVERT_SIZE)) % FILE_CONVERT_SIZE,
-                        std::min(tr._end_idx, (uint16_t) ((file_idx + 1) * FILE_CONVERT_SIZE - 1)) % FILE_CONVERT_SIZE
-                        );
-
-                if constexpr (finish_compaction) {
-                    _query_from_one_tsm_file(vin, file_idx, file_tr, requested_columns, row_idx, trReadRes);
-                    row_idx += file_tr.range_width();
-                } else {
-                    _query_from_one_flush_file(vin, file_idx, file_tr, requested_columns, trReadRes);
-                }
+
+            for (size_t i = 0; i < snapshot._mem_tables.size(); ++i) {
+                size_t source_row_idx = trReadRes.size();
+                snapshot._mem_tables[i]->query_time_range(vin, tr, requested_columns, trReadRes);
+                _remove_shadowed_rows(snapshot._mem_table_shadows[i], source_row_idx, trReadRes);
             }
+
+            std::stable_sort(trReadRes.begin() + row_idx, trReadRes.end(), [](const Row& lhs, const Row& rhs) {
+                return lhs.timestamp < rhs.timestamp;
+            });
         }
 
     private:
-        void _query_from_one_tsm_file(const Vin& vin, uint16_t file_idx, const TimeRange& file_tr,
-                                      const std::set<std::string>& requested_columns,
-                                      uint16_t row_idx, std::vector<Row> &trReadRes) {
-            for (const auto &column_name: requested_columns) {
-                std::vector<IndexEntry> index_entries;
-                std::vector<IndexRange> ranges;
-                _index_manager->query_indexes(_vin_num, file_idx, column_name, file_tr, index_entries, ranges);
-                _get_column_values(file_idx, column_name, _schema->columnTypeMap[column_name],
-                                   index_entries, ranges, row_idx, trReadRes);
+        static void _remove_shadowed_rows(const ShadowSet& shadow, size_t row_idx, std::vector<Row> &trReadRes) {
+            if (likely(shadow.empty())) {
+                return;
             }
+            trReadRes.erase(std::remove_if(trReadRes.begin() + row_idx, trReadRes.end(), [&](const Row& row) {
+                return shadow.contains(row.timestamp);
+            }), trReadRes.end());
         }
 
-        void _query_from_one_flush_file(const Vin& vin, uint16_t file_idx, const TimeRange& file_tr,
-                                        const std::set<std::string>& requested_columns, std::vector<Row> &trReadRes) {
-            Path flush_file_path = _vin_dir_path / std::to_string(file_idx);
-            std::string buf;
-            io::stream_read_string_from_file(flush_file_path, buf);
-
-            if (buf.empty()) {
+        void _query_from_one_tsm_file(const Vin& vin, const FileIndex& file, const TimeRange& tr,
+                                      const std::set<std::string>& requested_columns, std::vector<Row> &trReadRes) {
+            std::vector<BlockRange> block_ranges;
+            file.get_block_ranges(tr, true, block_ranges);
+            if (block_ranges.empty()) {
                 return;
             }
 
-            const char* start = buf.c_str();
-            const char* end = start + buf.size();
+            size_t row_idx = trReadRes.size();
 
-            while (start < end) {
-                Row row;
-                io::deserialize_row(_schema, start, false, row);
-                uint16_t ts_num = decode_ts(row.timestamp) % FILE_CONVERT_SIZE;
-                if (ts_num >= file_tr._start_idx && ts_num <= file_tr._end_idx) {
+            for (const auto &block_range: block_ranges) {
+                for (uint16_t i = block_range._range._start_index; i <= block_range._range._end_index; ++i) {
                     Row result_row;
                     result_row.vin = vin;
-                    result_row.timestamp = row.timestamp;
-                    for (const auto &requested_column: requested_columns) {
-                        result_row.columns.emplace(requested_column, row.columns.at(requested_column));
-                    }
+                    result_row.timestamp = block_range._timestamps->_timestamps[i];
                     trReadRes.emplace_back(std::move(result_row));
                 }
             }
+
+            for (const auto &column_name: requested_columns) {
+                _get_column_values(file, _row_codec->column_id(column_name), column_name,
+                                   _schema->columnTypeMap[column_name], block_ranges, row_idx, trReadRes);
+            }
         }
 
-        void _get_column_values(uint16_t file_idx, const std::string& column_name,
-                                ColumnType column_type, const std::vector<IndexEntry>& index_entries,
-                                const std::vector<IndexRange>& ranges, uint16_t start_idx, std::vector<Row> &trReadRes) {
-            Path tsm_file_path = _vin_dir_path / std::to_string(file_idx);
-            uint32_t global_offset = index_entries.front()._offset;
-            uint32_t global_size = index_entries.back()._offset + index_entries.back()._size - global_offset;
-            std::string buf;
-            io::stream_read_string_from_file(tsm_file_path, global_offset, global_size, buf);
-
-            for (size_t i = 0; i < index_entries.size(); ++i) {
-                uint32_t local_offset = index_entries[i]._offset - global_offset;
+        void _get_column_values(const FileIndex& file, uint16_t column_id, const std::string& column_name,
+                                ColumnType column_type, const std::vector<BlockRange>& block_ranges,
+                                size_t start_idx, std::vector<Row> &trReadRes) {
+            const IndexBlock& index_block = file.get_index_block(column_id);
+            const IndexEntry& first_entry = index_block._index_entries[block_ranges.front()._block_idx];
+            const IndexEntry& last_entry = index_block._index_entries[block_ranges.back()._block_idx];
+            uint64_t global_offset = first_entry._offset;
+            uint32_t global_size = last_entry._offset + last_entry._size - global_offset;
+            const char* buf = file.data(global_offset, global_size, true);
+
+            for (const auto &block_range: block_ranges) {
+                const char* block_buf = file.column_block(buf, global_offset, column_id, block_range._block_idx);
+                uint16_t start = block_range._range._start_index;
+                uint16_t end = block_range._range._end_index;
                 switch (column_type) {
                     case COLUMN_TYPE_INTEGER: {
                         IntDataBlock int_data_block;
-                        int_data_block.decode_from_decompress(buf.c_str() + local_offset);
-                        uint16_t start = ranges[i]._start_index;
-                        uint16_t end = ranges[i]._end_index;
+                        int_data_block.decode_from_decompress(block_buf);
 
                         for (; start <= end; ++start) {
-                            trReadRes[start_idx++].columns.emplace(column_name, int_data_block._column_values[start]);
+                            Row& result_row = trReadRes[start_idx++];
+                            result_row.columns.emplace_hint(result_row.columns.end(), column_name, int_data_block._column_values[start]);
                         }
 
                         break;
                     }
                     case COLUMN_TYPE_DOUBLE_FLOAT: {
                         DoubleDataBlock double_data_block;
-                        double_data_block.decode_from_decompress(buf.c_str() + local_offset);
-                        uint16_t start = ranges[i]._start_index;
-                        uint16_t end = ranges[i]._end_index;
+                        double_data_block.decode_from_decompress(block_buf);
 
                         for (; start <= end; ++start) {
-                            trReadRes[start_idx++].columns.emplace(column_name, double_data_block._column_values[start]);
+                            Row& result_row = trReadRes[start_idx++];
+                            result_row.columns.emplace_hint(result_row.columns.end(), column_name, double_data_block._column_values[start]);
                         }
 
                         break;
                     }
                     case COLUMN_TYPE_STRING: {
                         StringDataBlock str_data_block;
-                        str_data_block.decode_from_decompress(buf.c_str() + local_offset);
-                        uint16_t start = ranges[i]._start_index;
-                        uint16_t end = ranges[i]._end_index;
+                        str_data_block.decode_from_decompress(block_buf);
 
                         for (; start <= end; ++start) {
-                            trReadRes[start_idx++].columns.emplace(column_name, str_data_block._column_values[start]);
+                            Row& result_row = trReadRes[start_idx++];
+                            result_row.columns.emplace_hint(result_row.columns.end(), column_name, str_data_block._column_values[start]);
                         }
 
                         break;
@@ -164,9 +157,10 @@ namespace LindormContest {
             }
         }
 
-        uint16_t _vin_num;
-        Path _vin_dir_path;
+        VinId _vin_id;
         SchemaSPtr _schema;
+        RowCodecSPtr _row_codec;
+        GlobalMemTableManagerSPtr _mem_table_manager;
         GlobalIndexManagerSPtr _index_manager;
     };
 
@@ -176,36 +170,45 @@ namespace LindormContest {
 
     class GlobalTimeRangeManager {
     public:
-        GlobalTimeRangeManager(const Path& root_path, bool finish_compaction, GlobalIndexManagerSPtr index_manager) {
-            for (uint16_t vin_num = 0; vin_num < VIN_NUM_RANGE; ++vin_num) {
-                Path vin_dir_path = finish_compaction ?
-                        root_path / "compaction" / std::to_string(vin_num)
-                        : root_path / "no-compaction" / std::to_string(vin_num);
-                _tr_managers[vin_num] = std::make_unique<TimeRangeManager>(vin_num, vin_dir_path, index_manager);
-            }
-        }
+        GlobalTimeRangeManager(const Path& root_path, GlobalMemTableManagerSPtr mem_table_manager,
+                               GlobalIndexManagerSPtr index_manager)
+        : _root_path(root_path), _schema(nullptr), _row_codec(nullptr), _mem_table_manager(mem_table_manager), _index_manager(index_manager) {}
 
         ~GlobalTimeRangeManager() = default;
 
-        void init(SchemaSPtr schema) {
-            for (auto &tr_manager: _tr_managers) {
-                tr_manager->init(schema);
-            }
+        void init(SchemaSPtr schema, RowCodecSPtr row_codec) {
+            _schema = schema;
+            _row_codec = row_codec;
+            _tr_managers.for_each([&](size_t /*vin_id*/, std::unique_ptr<TimeRangeManager>& tr_manager) {
+                if (tr_manager != nullptr) {
+                    tr_manager->init(_schema, _row_codec);
+                }
+            });
+        }
+
+        // called once per vin before its id is visible
+        void add_vin(VinId vin_id) {
+            auto tr_manager = std::make_unique<TimeRangeManager>(vin_id, _mem_table_manager, _index_manager);
+            tr_manager->init(_schema, _row_codec);
+            _tr_managers[vin_id] = std::move(tr_manager);
         }
 
-        template <bool finish_compaction>
-        void query_time_range(uint16_t vin_num, const Vin& vin, int64_t time_lower_inclusive, int64_t time_upper_exclusive,
+        void query_time_range(VinId vin_id, const Vin& vin, int64_t time_lower_inclusive, int64_t time_upper_exclusive,
                               const std::set<std::string>& requested_columns, std::vector<Row> &trReadRes) {
-            TimeRange tr;
-            tr.init(time_lower_inclusive, time_upper_exclusive);
-            if (unlikely(tr._end_idx >= TS_NUM_RANGE)) {
+            TimeRange tr(time_lower_inclusive, time_upper_exclusive);
+            if (unlikely(tr.empty())) {
                 return;
             }
-            _tr_managers[vin_num]->query_time_range<finish_compaction>(vin, tr, requested_columns, trReadRes);
+            _tr_managers[vin_id]->query_time_range(vin, tr, requested_columns, trReadRes);
         }
 
     private:
-        std::unique_ptr<TimeRangeManager> _tr_managers[VIN_NUM_RANGE];
+        Path _root_path;
+        SchemaSPtr _schema;
+        RowCodecSPtr _row_codec;
+        GlobalMemTableManagerSPtr _mem_table_manager;
+        GlobalIndexManagerSPtr _index_manager;
+        VinArray<std::unique_ptr<TimeRangeManager>> _tr_managers;
     };
 
 }
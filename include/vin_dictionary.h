@@ -0,0 +1,173 @@
+/*
+ * Copyright Alibaba Group Holding Ltd.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <mutex>
+#include <atomic>
+#include <string_view>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "base.h"
+#include "struct/Vin.h"
+#include "common/segmented_array.h"
+#include "io/io_utils.h"
+
+namespace LindormContest {
+
+    class VinDictionary;
+
+    using VinDictionarySPtr = std::shared_ptr<VinDictionary>;
+
+    // maps arbitrary vins to dense ids in insertion order, the mapping is appended to
+    // root/vins so ids are stable across restarts.
+    // lookups are lock free, inserts are serialized by a mutex.
+    // multi thread safe
+    class VinDictionary {
+    public:
+        VinDictionary(const Path& root_path) : _dict_path(root_path / "vins") {
+            std::filesystem::create_directories(root_path);
+            _buckets = std::make_unique<std::atomic<Node*>[]>(VIN_DICT_BUCKET_NUM);
+            for (size_t i = 0; i < VIN_DICT_BUCKET_NUM; ++i) {
+                _buckets[i].store(nullptr, std::memory_order_relaxed);
+            }
+            _load_from_file();
+            _fd = ::open(_dict_path.c_str(), O_WRONLY | O_CREAT | O_APPEND, 0644);
+            if (_fd < 0) {
+                throw std::runtime_error("open vin dictionary failed");
+            }
+            // the dictionary may have just been created
+            io::sync_dir(root_path);
+        }
+
+        ~VinDictionary() {
+            if (_fd >= 0) {
+                ::close(_fd);
+            }
+        }
+
+        // return INVALID_VIN_ID if the vin has never been written
+        VinId get(const Vin& vin) const {
+            const Node* node = _buckets[_hash(vin)].load(std::memory_order_acquire);
+            while (node != nullptr) {
+                if (std::memcmp(node->_vin.vin, vin.vin, VIN_LENGTH) == 0) {
+                    return node->_id;
+                }
+                node = node->_next;
+            }
+            return INVALID_VIN_ID;
+        }
+
+        // on_insert(vin_id, vin) runs before the new id becomes visible to lookups,
+        // so the per vin state can be set up without racing with readers
+        template <typename F>
+        VinId get_or_insert(const Vin& vin, F&& on_insert) {
+            VinId vin_id = get(vin);
+            if (likely(vin_id != INVALID_VIN_ID)) {
+                return vin_id;
+            }
+            std::lock_guard<std::mutex> l(_mutex);
+            vin_id = get(vin);
+            if (vin_id != INVALID_VIN_ID) {
+                return vin_id;
+            }
+            vin_id = _size.load(std::memory_order_relaxed);
+            if (unlikely(vin_id >= VinArray<Node>::CAPACITY)) {
+                throw std::runtime_error("too many vins");
+            }
+            if (unlikely(_torn)) {
+                throw std::runtime_error("vin dictionary has a torn record");
+            }
+            ssize_t written = ::write(_fd, vin.vin, VIN_LENGTH);
+            if (unlikely(written != VIN_LENGTH)) {
+                // cut the partial record, the records appended after it would be misaligned
+                if (written > 0 && ::ftruncate(_fd, static_cast<off_t>(vin_id) * VIN_LENGTH) != 0) {
+                    _torn = true;
+                }
+                throw std::runtime_error("write vin dictionary failed");
+            }
+            on_insert(vin_id, vin);
+            _publish(vin_id, vin);
+            return vin_id;
+        }
+
+        // vin_id must be smaller than size()
+        const Vin& get_vin(VinId vin_id) const {
+            return _nodes.get(vin_id)->_vin;
+        }
+
+        // ids are dense, every id below size() is valid
+        VinId size() const {
+            return _size.load(std::memory_order_acquire);
+        }
+
+        // make the vins inserted so far durable, the manifest must not list files of vins a crash would forget
+        void sync() const {
+            if (::fdatasync(_fd) != 0) {
+                throw std::runtime_error("sync vin dictionary failed");
+            }
+        }
+
+    private:
+        struct Node {
+            Vin _vin;
+            VinId _id = INVALID_VIN_ID;
+            Node* _next = nullptr;
+        };
+
+        static size_t _hash(const Vin& vin) {
+            return std::hash<std::string_view>()(std::string_view(vin.vin, VIN_LENGTH)) & (VIN_DICT_BUCKET_NUM - 1);
+        }
+
+        void _publish(VinId vin_id, const Vin& vin) {
+            Node& node = _nodes[vin_id];
+            node._vin = vin;
+            node._id = vin_id;
+            std::atomic<Node*>& bucket = _buckets[_hash(vin)];
+            node._next = bucket.load(std::memory_order_relaxed);
+            bucket.store(&node, std::memory_order_release);
+            _size.store(vin_id + 1, std::memory_order_release);
+        }
+
+        void _load_from_file() {
+            if (!std::filesystem::exists(_dict_path)) {
+                return;
+            }
+            std::string buf;
+            io::stream_read_string_from_file(_dict_path, buf);
+            // a torn tail of the last insert is dropped
+            size_t vin_count = buf.size() / VIN_LENGTH;
+            if (unlikely(vin_count * VIN_LENGTH != buf.size())) {
+                std::filesystem::resize_file(_dict_path, vin_count * VIN_LENGTH);
+            }
+
+            for (size_t i = 0; i < vin_count; ++i) {
+                Vin vin;
+                std::memcpy(vin.vin, buf.data() + i * VIN_LENGTH, VIN_LENGTH);
+                _publish(i, vin);
+            }
+        }
+
+        Path _dict_path;
+        int _fd = -1;
+        std::unique_ptr<std::atomic<Node*>[]> _buckets;
+        VinArray<Node> _nodes;
+        std::atomic<VinId> _size {0};
+        std::mutex _mutex;
+        bool _torn = false; // a partial record couldn't be cut, no more inserts are taken
+    };
+
+}
@@ -5,8 +5,6 @@
 // the interface semantics correctly.
 //
 
-#include <omp.h>
-
 #include "TSDBEngineImpl.h"
 #include <fstream>
 
@@ -18,18 +16,24 @@ namespace LindormContest {
      * The function's body can be modified.
      */
     TSDBEngineImpl::TSDBEngineImpl(const std::string &dataDirPath)
+            : TSDBEngineImpl(dataDirPath, EngineOptions()) {}
+
+    TSDBEngineImpl::TSDBEngineImpl(const std::string &dataDirPath, const EngineOptions &options)
             : TSDBEngine(dataDirPath) {
-        Path compaction_data_path = _get_root_path() / "compaction";
-        _finish_compaction = std::filesystem::exists(compaction_data_path);
-        _convert_manager = std::make_shared<GlobalConvertManager>(_get_root_path());
-        if (!_finish_compaction) {
-            _writer_manager = std::make_unique<TsmWriterManager>(_get_root_path(), _convert_manager);
-        }
+        _vin_dictionary = std::make_shared<VinDictionary>(_get_root_path());
+        _wal_manager = std::make_shared<GlobalWalManager>(_get_root_path());
+        _mem_table_manager = std::make_shared<GlobalMemTableManager>(_wal_manager->refs());
         _index_manager = std::make_shared<GlobalIndexManager>();
-        _latest_manager = std::make_unique<GlobalLatestManager>(_get_root_path(), _finish_compaction);
-        _tr_manager = std::make_unique<GlobalTimeRangeManager>(_get_root_path(), _finish_compaction, _index_manager);
-        _agg_manager = std::make_unique<GlobalAggregateManager>(_get_root_path(), _finish_compaction, _index_manager);
-        _ds_manager = std::make_unique<GlobalDownSampleManager>(_get_root_path(), _finish_compaction, _index_manager);
+        _latest_manager = std::make_shared<GlobalLatestManager>(_mem_table_manager);
+        _segment_manager = std::make_shared<GlobalSegmentManager>(_get_root_path(), options._fd_budget);
+        _write_controller = std::make_shared<WriteController>(options._write_controller_options);
+        _convert_manager = std::make_shared<GlobalConvertManager>(_mem_table_manager, _index_manager, _latest_manager,
+                                                                  _segment_manager, _wal_manager, _write_controller,
+                                                                  _vin_dictionary);
+        _writer_manager = std::make_unique<TsmWriterManager>(_mem_table_manager, _convert_manager);
+        _tr_manager = std::make_unique<GlobalTimeRangeManager>(_get_root_path(), _mem_table_manager, _index_manager);
+        _agg_manager = std::make_unique<GlobalAggregateManager>(_get_root_path(), _mem_table_manager, _index_manager);
+        _ds_manager = std::make_unique<GlobalDownSampleManager>(_get_root_path(), _mem_table_manager, _index_manager);
     }
 
     TSDBEngineImpl::~TSDBEngineImpl() = default;
@@ -39,111 +43,215 @@ namespace LindormContest {
         if (_schema == nullptr) {
             return 0;
         }
-        assert(_finish_compaction);
-        _index_manager->decode_from_file(_get_root_path(), _schema);
+        // recovery work is spread over a pool which lives until the wal is replayed
+        ThreadPool recovery_pool(POOL_THREAD_NUM);
+        uint32_t wal_checkpoint;
+        try {
+            wal_checkpoint = _index_manager->decode_from_segments(*_segment_manager, _schema, _vin_dictionary->size(),
+                                                                  recovery_pool);
+        } catch (const std::exception& e) {
+            ERR_LOG("open of %s failed: %s", dataDirPath.c_str(), e.what())
+            _open_failed = true;
+            return -1;
+        }
+        _wal_manager->set_checkpoint(wal_checkpoint);
+        _row_codec = std::make_shared<RowCodec>(_schema);
+        _mem_table_manager->init(_schema, _row_codec);
         _latest_manager->init(_schema);
-        _tr_manager->init(_schema);
-        _agg_manager->init(_schema);
-        _ds_manager->init(_schema);
-        _convert_manager->init(_schema);
-        _get_latest_records();
+        _tr_manager->init(_schema, _row_codec);
+        _agg_manager->init(_schema, _row_codec);
+        _ds_manager->init(_schema, _row_codec);
+        _convert_manager->init(_schema, _row_codec);
+        _wal_manager->init(_schema, _row_codec);
+
+        for (VinId vin_id = 0; vin_id < _vin_dictionary->size(); ++vin_id) {
+            _add_vin(vin_id, _vin_dictionary->get_vin(vin_id));
+        }
+
+        _get_latest_records(recovery_pool);
+        _replay_wal(recovery_pool);
+        _convert_manager->compact_overlapping_partitions(_vin_dictionary->size());
         return 0;
     }
 
-    int TSDBEngineImpl::createTable(const std::string &tableName, const Schema &schema) {
+    int TSDBEngineImpl::createTable(const std::string &/*tableName*/, const Schema &schema) {
         _schema = std::make_shared<Schema>(schema);
-        _writer_manager->init(_schema);
+        _row_codec = std::make_shared<RowCodec>(_schema);
+        _mem_table_manager->init(_schema, _row_codec);
         _latest_manager->init(_schema);
-        _tr_manager->init(_schema);
-        _agg_manager->init(_schema);
-        _ds_manager->init(_schema);
-        _convert_manager->init(_schema);
+        _tr_manager->init(_schema, _row_codec);
+        _agg_manager->init(_schema, _row_codec);
+        _ds_manager->init(_schema, _row_codec);
+        _convert_manager->init(_schema, _row_codec);
+        _wal_manager->init(_schema, _row_codec);
         return 0;
     }
 
     int TSDBEngineImpl::shutdown() {
+        if (unlikely(_open_failed)) {
+            // nothing has been loaded or replayed, a checkpoint would drop the wal
+            return -1;
+        }
         _save_schema_to_file();
+        // convert every mem table, so that the wal is only replayed after a crash
+        _writer_manager->flush(_vin_dictionary->size());
         _convert_manager->finalize_convert();
-        if (std::filesystem::exists(_get_root_path() / "no-compaction")) {
-            std::filesystem::remove_all(_get_root_path() / "no-compaction");
+        _wal_manager->shutdown();
+        // the segments of mem tables failing to convert are kept, the next connect replays them
+        int ret = 0;
+        uint32_t wal_checkpoint = _wal_manager->min_live_seq();
+        if (unlikely(wal_checkpoint < _wal_manager->next_seq())) {
+            ERR_LOG("mem tables are left unconverted, the wal is kept from segment %u", wal_checkpoint)
+            ret = -1;
         }
-        return 0;
+        try {
+            _convert_manager->checkpoint(wal_checkpoint);
+        } catch (const std::exception& e) {
+            ERR_LOG("checkpoint at shutdown failed: %s", e.what())
+            ret = -1;
+        }
+        WriteStallMetrics metrics = _write_controller->get_metrics();
+        INFO_LOG("write stalls: %lu delayed for %lu ms, %lu stopped for %lu ms", metrics._delayed_writes,
+                 metrics._delayed_us / 1000, metrics._stopped_writes, metrics._stopped_us / 1000)
+        CompactionSchedulerMetrics scheduler_metrics = _convert_manager->get_scheduler_metrics();
+        INFO_LOG("background tasks: %lu finished, max queue depth %zu, %lu MB written at %.1f MB/s, throttled for %lu ms",
+                 scheduler_metrics._finished_tasks, scheduler_metrics._max_queued_tasks, scheduler_metrics._written_bytes >> 20,
+                 scheduler_metrics._write_bytes_per_sec / (1 << 20), scheduler_metrics._throttled_us / 1000)
+        return ret;
     }
 
     int TSDBEngineImpl::write(const WriteRequest &writeRequest) {
-        for (const auto &row: writeRequest.rows) {
-            _writer_manager->append(row);
+        if (unlikely(writeRequest.rows.empty())) {
+            return 0;
+        }
+        return _write_batch(RowBatch {writeRequest.rows.data()}, writeRequest.rows.size());
+    }
+
+    int TSDBEngineImpl::writeColumnar(const ColumnarWriteRequest &writeRequest) {
+        if (unlikely(writeRequest.rowCount == 0)) {
+            return 0;
+        }
+        ColumnarBatch batch {writeRequest, {}};
+        if (unlikely(!batch.init(*_row_codec))) {
+            ERR_LOG("columnar write request doesn't match the schema of %s", writeRequest.tableName.c_str())
+            return -1;
+        }
+        return _write_batch(batch, writeRequest.rowCount);
+    }
+
+    template <typename Batch>
+    int TSDBEngineImpl::_write_batch(const Batch &batch, size_t row_count) {
+        _write_controller->delay_write(row_count);
+        std::string record;
+        record.reserve(WAL_RECORD_HEADER_SIZE + row_count * _wal_manager->row_width());
+        record.resize(WAL_RECORD_HEADER_SIZE);
+        thread_local std::vector<VinId> vin_ids;
+        vin_ids.clear();
+
+        for (size_t i = 0; i < row_count; ++i) {
+            _wal_manager->encode_row(batch, i, record);
+            // rows of one vin usually come in runs
+            vin_ids.emplace_back(i > 0 && batch.vin(i) == batch.vin(i - 1) ? vin_ids.back() : _get_or_insert_vin(batch.vin(i)));
+        }
+
+        uint32_t wal_seq;
+        try {
+            wal_seq = _wal_manager->append(std::move(record), row_count);
+        } catch (const std::exception& e) {
+            ERR_LOG("write of %zu rows failed: %s", row_count, e.what())
+            return -1;
+        }
+        _writer_manager->append_batch(batch, vin_ids, wal_seq);
+        // the mem tables reference the segment now
+        _wal_manager->release(wal_seq);
+        return 0;
+    }
+
+    void TSDBEngineImpl::setCompressionOptions(const CompressionOptions &compressionOptions) {
+        _convert_manager->set_compression_options(compressionOptions);
+    }
+
+    int TSDBEngineImpl::setBackgroundWriteBandwidth(double bytesPerSec) {
+        if (unlikely(!(bytesPerSec >= 0))) {
+            ERR_LOG("background write bandwidth %f is not a valid limit", bytesPerSec)
+            return -1;
         }
+        _convert_manager->set_background_write_bandwidth(bytesPerSec);
         return 0;
     }
 
+    WriteStallMetrics TSDBEngineImpl::getWriteStallMetrics() const {
+        return _write_controller->get_metrics();
+    }
+
+    CompactionSchedulerMetrics TSDBEngineImpl::getCompactionSchedulerMetrics() const {
+        return _convert_manager->get_scheduler_metrics();
+    }
+
     int TSDBEngineImpl::executeLatestQuery(const LatestQueryRequest &pReadReq, std::vector<Row> &pReadRes) {
         for (const auto &vin: pReadReq.vins) {
-            uint16_t vin_num = decode_vin(vin);
-            if (unlikely(vin_num == INVALID_VIN_NUM)) {
+            VinId vin_id = _vin_dictionary->get(vin);
+            if (unlikely(vin_id == INVALID_VIN_ID)) {
                 continue;
             }
             Row result_row;
             result_row.vin = vin;
-            if (_finish_compaction) {
-                _latest_manager->query_latest<true>(vin_num, pReadReq.requestedColumns, result_row);
-            } else {
-                _writer_manager->flush(vin_num);
-                _latest_manager->query_latest<false>(vin_num, pReadReq.requestedColumns, result_row);
+            if (_latest_manager->query_latest(vin_id, pReadReq.requestedColumns, result_row)) {
+                pReadRes.emplace_back(std::move(result_row));
             }
-            pReadRes.emplace_back(std::move(result_row));
         }
         return 0;
     }
 
     int TSDBEngineImpl::executeTimeRangeQuery(const TimeRangeQueryRequest &trReadReq, std::vector<Row> &trReadRes) {
-        uint16_t vin_num = decode_vin(trReadReq.vin);
-        if (unlikely(vin_num == INVALID_VIN_NUM)) {
+        VinId vin_id = _vin_dictionary->get(trReadReq.vin);
+        if (unlikely(vin_id == INVALID_VIN_ID)) {
             return 0;
         }
-        if (_finish_compaction) {
-            _tr_manager->query_time_range<true>(vin_num, trReadReq.vin, trReadReq.timeLowerBound, trReadReq.timeUpperBound,
+        size_t res_size = trReadRes.size();
+        try {
+            _tr_manager->query_time_range(vin_id, trReadReq.vin, trReadReq.timeLowerBound, trReadReq.timeUpperBound,
                                           trReadReq.requestedColumns, trReadRes);
-        } else {
-            _writer_manager->flush(vin_num);
-            _tr_manager->query_time_range<false>(vin_num, trReadReq.vin, trReadReq.timeLowerBound, trReadReq.timeUpperBound,
-                                                          trReadReq.requestedColumns, trReadRes);
+        } catch (const std::exception& e) {
+            ERR_LOG("time range query of vin %u failed: %s", vin_id, e.what())
+            trReadRes.erase(trReadRes.begin() + res_size, trReadRes.end());
+            return -1;
         }
         return 0;
     }
 
     int TSDBEngineImpl::executeAggregateQuery(const TimeRangeAggregationRequest &aggregationReq, std::vector<Row> &aggregationRes) {
-        uint16_t vin_num = decode_vin(aggregationReq.vin);
-        if (unlikely(vin_num == INVALID_VIN_NUM)) {
+        VinId vin_id = _vin_dictionary->get(aggregationReq.vin);
+        if (unlikely(vin_id == INVALID_VIN_ID)) {
             return 0;
         }
-        if (_finish_compaction) {
-            _agg_manager->query_aggregate<true>(vin_num, aggregationReq.vin, aggregationReq.timeLowerBound, aggregationReq.timeUpperBound,
+        size_t res_size = aggregationRes.size();
+        try {
+            _agg_manager->query_aggregate(vin_id, aggregationReq.vin, aggregationReq.timeLowerBound, aggregationReq.timeUpperBound,
                                           aggregationReq.columnName, aggregationReq.aggregator, aggregationRes);
-        } else {
-            _writer_manager->flush(vin_num);
-            _agg_manager->query_aggregate<false>(vin_num, aggregationReq.vin, aggregationReq.timeLowerBound, aggregationReq.timeUpperBound,
-                                                                          aggregationReq.columnName, aggregationReq.aggregator, aggregationRes);
+        } catch (const std::exception& e) {
+            ERR_LOG("aggregate query of vin %u failed: %s", vin_id, e.what())
+            aggregationRes.erase(aggregationRes.begin() + res_size, aggregationRes.end());
+            return -1;
         }
         return 0;
     }
 
     int TSDBEngineImpl::executeDownsampleQuery(const TimeRangeDownsampleRequest &downsampleReq, std::vector<Row> &downsampleRes) {
-        uint16_t vin_num = decode_vin(downsampleReq.vin);
-        if (unlikely(vin_num == INVALID_VIN_NUM)) {
+        VinId vin_id = _vin_dictionary->get(downsampleReq.vin);
+        if (unlikely(vin_id == INVALID_VIN_ID)) {
             return 0;
         }
-        if (_finish_compaction) {
-            _ds_manager->query_down_sample<true>(vin_num, downsampleReq.vin, downsampleReq.timeLowerBound, downsampleReq.timeUpperBound,
+        size_t res_size = downsampleRes.size();
+        try {
+            _ds_manager->query_down_sample(vin_id, downsampleReq.vin, downsampleReq.timeLowerBound, downsampleReq.timeUpperBound,
                                            downsampleReq.interval, downsampleReq.columnName, downsampleReq.aggregator,
                                            downsampleReq.columnFilter, downsampleRes);
-        } else {
-            _writer_manager->flush(vin_num);
-            _ds_manager->query_down_sample<false>(vin_num, downsampleReq.vin, downsampleReq.timeLowerBound, downsampleReq.timeUpperBound,
-                                                 downsampleReq.interval, downsampleReq.columnName, downsampleReq.aggregator,
-                                                 downsampleReq.columnFilter, downsampleRes);
+        } catch (const std::exception& e) {
+            ERR_LOG("downsample query of vin %u failed: %s", vin_id, e.what())
+            downsampleRes.erase(downsampleRes.begin() + res_size, downsampleRes.end());
+            return -1;
         }
-
         return 0;
     }
 
@@ -182,20 +290,70 @@ namespace LindormContest {
         _schema = std::make_shared<Schema>(std::move(column_type_map));
     }
 
-    void TSDBEngineImpl::_get_latest_records() {
+    VinId TSDBEngineImpl::_get_or_insert_vin(const Vin &vin) {
+        return _vin_dictionary->get_or_insert(vin, [this](VinId vin_id, const Vin &new_vin) {
+            _add_vin(vin_id, new_vin);
+        });
+    }
+
+    void TSDBEngineImpl::_add_vin(VinId vin_id, const Vin &vin) {
+        _mem_table_manager->add_vin(vin_id, _index_manager->next_file_seq(vin_id));
+        _writer_manager->add_vin(vin_id);
+        _tr_manager->add_vin(vin_id);
+        _agg_manager->add_vin(vin_id);
+        _ds_manager->add_vin(vin_id);
+        _convert_manager->add_vin(vin_id, vin);
+    }
+
+    void TSDBEngineImpl::_get_latest_records(ThreadPool& pool) {
         std::set<std::string> column_names;
 
         for (const auto &item: _schema->columnTypeMap) {
             column_names.insert(item.first);
         }
 
-#pragma omp parallel for num_threads(8)
-        for (uint16_t i = 0; i < VIN_NUM_RANGE; ++i) {
+        VinId vin_count = _vin_dictionary->size();
+
+        pool.parallel_for(vin_count, [&](size_t i) {
+            int64_t max_ts;
+            if (!_index_manager->get_max_ts(i, max_ts)) {
+                return;
+            }
             std::vector<Row> latest_row;
-            _tr_manager->query_time_range<true>(i, encode_vin(i), MAX_TS, MAX_TS + 1, column_names, latest_row);
-            assert(latest_row.size() == 1);
-            _latest_manager->set_latest_row(i, latest_row[0]);
-        }
+            try {
+                _tr_manager->query_time_range(i, _vin_dictionary->get_vin(i), max_ts, max_ts + 1, column_names, latest_row);
+            } catch (const std::exception& e) {
+                // the latest row comes from the mem tables then, queries of the file report the corruption
+                ERR_LOG("latest row of vin %zu can't be read: %s", i, e.what())
+                return;
+            }
+            if (!latest_row.empty()) {
+                // the files found on start are older than any mem table
+                _latest_manager->update_latest_row(i, latest_row.back(), 0);
+            }
+        });
+    }
+
+    void TSDBEngineImpl::_replay_wal(ThreadPool& pool) {
+        std::vector<std::vector<uint32_t>> row_indices(POOL_THREAD_NUM);
+        _wal_manager->replay([&](const std::vector<Row>& rows, const std::vector<uint32_t>& wal_seqs) {
+            // the rows of a vin all go to the same task, so they are appended in wal order
+            for (auto &indices: row_indices) {
+                indices.clear();
+            }
+            for (uint32_t i = 0; i < rows.size(); ++i) {
+                size_t hash = std::hash<std::string_view>()(std::string_view(rows[i].vin.vin, VIN_LENGTH));
+                row_indices[hash % POOL_THREAD_NUM].emplace_back(i);
+            }
+            pool.parallel_for(POOL_THREAD_NUM, [&](size_t task_idx) {
+                for (uint32_t i: row_indices[task_idx]) {
+                    VinId vin_id = _get_or_insert_vin(rows[i].vin);
+                    // rows converted before the crash come back in mem tables newer than every file,
+                    // they shadow the same rows on disk and are merged away by compaction
+                    _writer_manager->append(vin_id, rows[i], wal_seqs[i]);
+                }
+            });
+        });
     }
 
     void TSDBEngineImpl::_print_schema() {
@@ -16,8 +16,8 @@ namespace LindormContest::compression {
         return compress_size;
     }
 
-    size_t CompressionFastPFor::decompress(const uint32_t *source, size_t source_size, uint32_t *dest) const {
-        size_t uncompress_size = source_size * 2;
+    size_t CompressionFastPFor::decompress(const uint32_t *source, size_t source_size, uint32_t *dest, size_t dest_size) const {
+        size_t uncompress_size = dest_size;
         _codec->decodeArray(source, source_size, dest, uncompress_size);
         return uncompress_size;
     }
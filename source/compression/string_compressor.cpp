@@ -2,12 +2,12 @@
 
 namespace LindormContest::compression {
 
-    uint32_t CompressionCodecZSTD::compress(const char *source, uint32_t source_size, char *dest) const {
-        ZSTD_CCtx *cctx = ZSTD_createCCtx();
-        ZSTD_CCtx_setParameter(cctx, ZSTD_c_compressionLevel, 1);
-        ZSTD_CCtx_setParameter(cctx, ZSTD_c_strategy, ZSTD_fast);
-        size_t compressed_size = ZSTD_compress2(cctx, dest, ZSTD_compressBound(source_size), source, source_size);
-        ZSTD_freeCCtx(cctx);
+    uint32_t CompressionCodecZSTD::compress(const char *source, uint32_t source_size, char *dest, int level) const {
+        // one context per thread, its tables are reused by the blocks the thread compresses next
+        thread_local std::unique_ptr<ZSTD_CCtx, size_t (*)(ZSTD_CCtx*)> cctx(ZSTD_createCCtx(), ZSTD_freeCCtx);
+        ZSTD_CCtx_reset(cctx.get(), ZSTD_reset_session_and_parameters);
+        ZSTD_CCtx_setParameter(cctx.get(), ZSTD_c_compressionLevel, level);
+        size_t compressed_size = ZSTD_compress2(cctx.get(), dest, ZSTD_compressBound(source_size), source, source_size);
 
         if (ZSTD_isError(compressed_size)) {
             throw "Error on compressing";
@@ -25,9 +25,29 @@ namespace LindormContest::compression {
         }
     }
 
-    uint32_t CompressionCodecBrotli::compress(const char *source, uint32_t source_size, char *dest) const {
-        size_t encode_size;
-        bool encode_res = BrotliEncoderCompress(5, BROTLI_DEFAULT_WINDOW, BROTLI_DEFAULT_MODE,
+    uint32_t CompressionCodecLZ4::compress(const char *source, uint32_t source_size, char *dest, int acceleration) const {
+        int compressed_size = LZ4_compress_fast(source, dest, static_cast<int>(source_size),
+                                                LZ4_compressBound(static_cast<int>(source_size)), acceleration);
+
+        if (compressed_size <= 0) {
+            throw "Error on compressing";
+        }
+        return static_cast<uint32_t>(compressed_size);
+    }
+
+    void CompressionCodecLZ4::decompress(const char *source, uint32_t source_size, char *dest,
+                                         uint32_t uncompressed_size) const {
+        int res = LZ4_decompress_safe(source, dest, static_cast<int>(source_size), static_cast<int>(uncompressed_size));
+
+        if (res != static_cast<int>(uncompressed_size)) {
+            throw "Error on decompressing";
+        }
+    }
+
+    uint32_t CompressionCodecBrotli::compress(const char *source, uint32_t source_size, char *dest, int quality) const {
+        // in: capacity of dest, out: compressed size
+        size_t encode_size = BrotliEncoderMaxCompressedSize(source_size);
+        bool encode_res = BrotliEncoderCompress(quality, BROTLI_DEFAULT_WINDOW, BROTLI_DEFAULT_MODE,
                                                 source_size, reinterpret_cast<const uint8_t *>(source), &encode_size,
                                                 reinterpret_cast<uint8_t *>(dest));
         assert(encode_res);
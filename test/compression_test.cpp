@@ -1,6 +1,7 @@
 #include <gtest/gtest.h>
 #include "compression/compressor.h"
 #include "compression/integer_compression.h"
+#include "storage/tsm_file.h"
 #include <random>
 #include "../source/chimp/include/chimp_compress.hpp"
 #include "../source/chimp/include/chimp_scan.hpp"
@@ -55,13 +56,13 @@ namespace LindormContest::test {
         std::string decode_data;
         decode_data.resize(N);
         std::unique_ptr<char[]> compress_data = std::make_unique<char[]>(N * 2);
-        size_t encode_size;
+        size_t encode_size = N * 2;
         bool encode_res = BrotliEncoderCompress(BROTLI_DEFAULT_QUALITY, BROTLI_DEFAULT_WINDOW, BROTLI_DEFAULT_MODE,
                               N, reinterpret_cast<const uint8_t *>(encode_data.c_str()), &encode_size,
                               reinterpret_cast<uint8_t *>(compress_data.get()));
         ASSERT_TRUE(encode_res);
 
-        size_t decode_size;
+        size_t decode_size = N;
         auto decode_res = BrotliDecoderDecompress(encode_size, reinterpret_cast<const uint8_t *>(compress_data.get()), &decode_size,
                                                   reinterpret_cast<uint8_t *>(decode_data.data()));
         ASSERT_EQ(decode_res, BROTLI_DECODER_RESULT_SUCCESS);
@@ -157,4 +158,96 @@ namespace LindormContest::test {
         GTEST_LOG_(INFO) << "gorilla compress ratio: " << compressGorilla * 1.0 / uncompressSize;
     }
 
+    TEST(Compression, delta_of_delta_timestamp_test) {
+        std::mt19937 gen(42);
+        LindormContest::TimestampDataBlock input;
+        int64_t ts = 1694043124000;
+
+        for (size_t i = 0; i < LindormContest::DATA_BLOCK_ITEM_NUMS - 7; ++i) {
+            // mostly regular seconds with irregular millisecond gaps
+            ts += i % 10 == 0 ? 1 + gen() % 5000 : 1000;
+            input._timestamps[input._count++] = ts;
+        }
+
+        std::string buf;
+        input.encode_to_compress(&buf);
+        LindormContest::TimestampDataBlock output;
+        output.decode_from_decompress(buf.c_str());
+        ASSERT_EQ(input._count, output._count);
+
+        for (uint16_t i = 0; i < input._count; ++i) {
+            ASSERT_EQ(input._timestamps[i], output._timestamps[i]);
+        }
+
+        GTEST_LOG_(INFO) << "original size: " << input._count * sizeof(int64_t) << "; compress size: " << buf.size();
+    }
+
+    TEST(Compression, codec_selector_int_test) {
+        std::mt19937 gen(42);
+        LindormContest::CodecSelector selector(LindormContest::COLUMN_TYPE_INTEGER);
+        std::vector<LindormContest::IntDataBlock> inputs(3);
+
+        for (size_t i = 0; i < LindormContest::DATA_BLOCK_ITEM_NUMS; ++i) {
+            inputs[0]._column_values[i] = 7;
+            inputs[1]._column_values[i] = 1000 + gen() % 100;          // narrow range
+            inputs[2]._column_values[i] = static_cast<int32_t>(gen()); // full range
+        }
+
+        for (auto &input: inputs) {
+            input._min = *std::min_element(input._column_values.begin(), input._column_values.end());
+            input._max = *std::max_element(input._column_values.begin(), input._column_values.end());
+            std::string buf;
+            selector.encode(input, &buf);
+            LindormContest::IntDataBlock output;
+            output.decode_from_decompress(buf.c_str());
+
+            for (size_t i = 0; i < LindormContest::DATA_BLOCK_ITEM_NUMS; ++i) {
+                ASSERT_EQ(input._column_values[i], output._column_values[i]);
+            }
+
+            GTEST_LOG_(INFO) << "codec: " << static_cast<int>(buf[0]) << "; compress size: " << buf.size();
+        }
+    }
+
+    TEST(Compression, compression_profile_test) {
+        std::mt19937 gen(42);
+        LindormContest::IntDataBlock int_input;
+        LindormContest::DoubleDataBlock double_input;
+        LindormContest::StringDataBlock string_input;
+
+        for (size_t i = 0; i < LindormContest::DATA_BLOCK_ITEM_NUMS; ++i) {
+            int_input._column_values[i] = 1000 + gen() % 100;
+            double_input._column_values[i] = 20.0 + (gen() % 1000) / 100.0;
+            string_input._column_values[i] = LindormContest::ColumnValue(std::string(gen() % 8 + 1, 'a' + gen() % 4));
+        }
+        int_input._min = *std::min_element(int_input._column_values.begin(), int_input._column_values.end());
+        int_input._max = *std::max_element(int_input._column_values.begin(), int_input._column_values.end());
+        string_input._min_length = 1;
+        string_input._max_length = 8;
+
+        LindormContest::CompressionProfile uncompressed {LindormContest::SecondStage::NONE, 0, 0};
+        for (const auto &profile: {uncompressed, LindormContest::CompressionProfile::fast(), LindormContest::CompressionProfile::balanced(),
+                                   LindormContest::CompressionProfile::max_ratio()}) {
+            std::string int_buf, double_buf, string_buf;
+            LindormContest::CodecSelector(LindormContest::COLUMN_TYPE_INTEGER, profile).encode(int_input, &int_buf);
+            LindormContest::CodecSelector(LindormContest::COLUMN_TYPE_DOUBLE_FLOAT, profile).encode(double_input, &double_buf);
+            LindormContest::CodecSelector(LindormContest::COLUMN_TYPE_STRING, profile).encode(string_input, &string_buf);
+            LindormContest::IntDataBlock int_output;
+            LindormContest::DoubleDataBlock double_output;
+            LindormContest::StringDataBlock string_output;
+            int_output.decode_from_decompress(int_buf.c_str());
+            double_output.decode_from_decompress(double_buf.c_str());
+            string_output.decode_from_decompress(string_buf.c_str());
+
+            for (size_t i = 0; i < LindormContest::DATA_BLOCK_ITEM_NUMS; ++i) {
+                ASSERT_EQ(int_input._column_values[i], int_output._column_values[i]);
+                ASSERT_EQ(double_input._column_values[i], double_output._column_values[i]);
+                ASSERT_EQ(string_input._column_values[i], string_output._column_values[i]);
+            }
+
+            GTEST_LOG_(INFO) << "second stage: " << static_cast<int>(profile._second_stage) << "; int size: " << int_buf.size()
+                             << "; double size: " << double_buf.size() << "; string size: " << string_buf.size();
+        }
+    }
+
 }
\ No newline at end of file
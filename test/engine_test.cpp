@@ -0,0 +1,840 @@
+/*
+* Copyright Alibaba Group Holding Ltd.
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+* http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*/
+
+#include <chrono>
+#include <filesystem>
+#include <fstream>
+#include <thread>
+
+#include <gtest/gtest.h>
+
+#include "TSDBEngineImpl.h"
+#include "storage/manifest.h"
+#include "struct/Requests.h"
+
+namespace LindormContest::test {
+
+    static constexpr int64_t START_TS = 1694043124000;
+    static constexpr int64_t TS_STEP = 1000;
+    static constexpr char TABLE_NAME[] = "test";
+
+    // a small engine in a directory of its own, which is reopened to check what survives a restart
+    class EngineTest : public ::testing::Test {
+    protected:
+        void SetUp() override {
+            _root_path = std::filesystem::temp_directory_path() / ("engine_test_" + std::to_string(::getpid()));
+            std::filesystem::remove_all(_root_path);
+            std::filesystem::create_directories(_root_path);
+            _vin = _generate_vin("LSVNV2182E0540001");
+        }
+
+        void TearDown() override {
+            std::filesystem::remove_all(_root_path);
+        }
+
+        std::unique_ptr<TSDBEngineImpl> open() {
+            auto db = std::make_unique<TSDBEngineImpl>(_root_path);
+            db->connect();
+            return db;
+        }
+
+        std::unique_ptr<TSDBEngineImpl> create(const EngineOptions& options = EngineOptions()) {
+            auto db = std::make_unique<TSDBEngineImpl>(_root_path, options);
+            db->connect();
+            Schema schema;
+            for (uint16_t i = 0; i < SCHEMA_COLUMN_NUMS; ++i) {
+                schema.columnTypeMap.emplace(_column_name(i), _column_type(i));
+            }
+            db->createTable(TABLE_NAME, schema);
+            return db;
+        }
+
+        // rows start_idx..start_idx + count - 1, the values of a row are derived from its index and version
+        void write(TSDBEngineImpl& db, int start_idx, int count, int32_t version) {
+            WriteRequest request;
+            request.tableName = TABLE_NAME;
+            for (int i = start_idx; i < start_idx + count; ++i) {
+                request.rows.emplace_back(_generate_row(i, version));
+            }
+            ASSERT_EQ(db.write(request), 0);
+        }
+
+        int query(TSDBEngineImpl& db, std::vector<Row>& rows) {
+            TimeRangeQueryRequest request;
+            request.tableName = TABLE_NAME;
+            request.vin = _vin;
+            request.timeLowerBound = START_TS;
+            request.timeUpperBound = START_TS + 24 * 3600 * 1000;
+            for (uint16_t i = 0; i < SCHEMA_COLUMN_NUMS; ++i) {
+                request.requestedColumns.insert(_column_name(i));
+            }
+            int ret = db.executeTimeRangeQuery(request, rows);
+            std::sort(rows.begin(), rows.end(), [](const Row& lhs, const Row& rhs) {
+                return lhs.timestamp < rhs.timestamp;
+            });
+            return ret;
+        }
+
+        // the rows of the vin are exactly the ones of versions, which holds the version of every row index
+        void expect_rows(TSDBEngineImpl& db, const std::vector<int32_t>& versions) {
+            std::vector<Row> rows;
+            ASSERT_EQ(query(db, rows), 0);
+            ASSERT_EQ(rows.size(), versions.size());
+            for (size_t i = 0; i < rows.size(); ++i) {
+                Row expected = _generate_row(static_cast<int>(i), versions[i]);
+                ASSERT_EQ(rows[i].timestamp, expected.timestamp);
+                ASSERT_EQ(rows[i].columns, expected.columns);
+            }
+        }
+
+        // rows of the downsample tests. the values come in runs longer than a block, so whole blocks hold
+        // a constant int, only NaNs or signed zeros, which the block stats decide without decoding
+        static constexpr int64_t SAMPLE_TS_STEP = 250;
+        static constexpr int SAMPLE_RUN = 5000;
+        static constexpr char SAMPLE_INT_COLUMN[] = "col1";
+        static constexpr char SAMPLE_DOUBLE_COLUMN[] = "col2";
+        // DOUBLE_NAN, the result of an empty interval, has the bits of -inf
+        static constexpr double_t SAMPLE_NAN = std::numeric_limits<double_t>::quiet_NaN();
+
+        void write_samples(TSDBEngineImpl& db, int start_idx, int count, std::vector<Row>& samples) {
+            for (int begin = start_idx; begin < start_idx + count; begin += 1000) {
+                WriteRequest request;
+                request.tableName = TABLE_NAME;
+                for (int i = begin; i < std::min(begin + 1000, start_idx + count); ++i) {
+                    request.rows.emplace_back(_generate_sample(i));
+                    samples.emplace_back(request.rows.back());
+                }
+                ASSERT_EQ(db.write(request), 0);
+            }
+        }
+
+        // every downsample and aggregate of the sample columns over a few ranges and intervals matches the
+        // rows evaluated one by one with CompareExpression::doCompare
+        void expect_samples(TSDBEngineImpl& db, const std::vector<Row>& samples) {
+            int64_t end_ts = samples.back().timestamp + 1;
+            std::vector<std::pair<int64_t, int64_t>> ranges = {
+                    {START_TS, end_ts},
+                    // both ends inside a block
+                    {START_TS + 777 * SAMPLE_TS_STEP + 3, START_TS + 15321 * SAMPLE_TS_STEP},
+            };
+            // a few rows per interval up to the whole range in one, a block spans many intervals of the short ones
+            std::vector<int64_t> intervals = {1000, 125 * 1000, 3600 * 1000, 10 * 3600 * 1000};
+            std::vector<std::pair<std::string, std::vector<CompareExpression>>> filters = {
+                    {SAMPLE_INT_COLUMN, {
+                            {ColumnValue(7), GREATER}, {ColumnValue(7), EQUAL}, {ColumnValue(1000), GREATER},
+                            {ColumnValue(1500), EQUAL}, {ColumnValue(-100), GREATER}, {ColumnValue(7.0), EQUAL},
+                    }},
+                    {SAMPLE_DOUBLE_COLUMN, {
+                            {ColumnValue(0.0), GREATER}, {ColumnValue(0.0), EQUAL}, {ColumnValue(-0.0), EQUAL},
+                            {ColumnValue(SAMPLE_NAN), EQUAL}, {ColumnValue(SAMPLE_NAN), GREATER}, {ColumnValue(-1.0), GREATER},
+                            {ColumnValue(DOUBLE_NAN), EQUAL}, {ColumnValue(DOUBLE_NAN), GREATER}, {ColumnValue(3.5), EQUAL},
+                            {ColumnValue(3), GREATER},
+                    }},
+            };
+
+            for (const auto &[lower, upper]: ranges) {
+                for (const auto &[column_name, column_filters]: filters) {
+                    for (Aggregator aggregator: {MAX, AVG}) {
+                        TimeRangeAggregationRequest aggregation_request;
+                        aggregation_request.tableName = TABLE_NAME;
+                        aggregation_request.vin = _vin;
+                        aggregation_request.columnName = column_name;
+                        aggregation_request.timeLowerBound = lower;
+                        aggregation_request.timeUpperBound = upper;
+                        aggregation_request.aggregator = aggregator;
+                        std::vector<Row> result;
+                        ASSERT_EQ(db.executeAggregateQuery(aggregation_request, result), 0);
+                        ASSERT_EQ(result.size(), 1);
+                        _expect_value(result[0].columns.at(column_name),
+                                      _aggregate(samples, lower, upper, upper - lower, column_name, aggregator, nullptr).at(lower));
+
+                        for (int64_t interval: intervals) {
+                            for (const auto &column_filter: column_filters) {
+                                TimeRangeDownsampleRequest request;
+                                static_cast<TimeRangeAggregationRequest&>(request) = aggregation_request;
+                                request.interval = interval;
+                                request.columnFilter = column_filter;
+                                std::vector<Row> rows;
+                                ASSERT_EQ(db.executeDownsampleQuery(request, rows), 0);
+                                std::map<int64_t, ColumnValue> expected = _aggregate(samples, lower, upper, interval, column_name,
+                                                                                     aggregator, &column_filter);
+                                ASSERT_EQ(rows.size(), expected.size()) << column_name << " interval " << interval;
+                                for (const auto &row: rows) {
+                                    ASSERT_TRUE(expected.contains(row.timestamp));
+                                    _expect_value(row.columns.at(column_name), expected.at(row.timestamp));
+                                }
+                            }
+                        }
+                    }
+                }
+            }
+        }
+
+        Path _root_path;
+        Vin _vin;
+
+    private:
+        static Vin _generate_vin(const std::string& s) {
+            Vin vin;
+            std::strncpy(vin.vin, s.c_str(), VIN_LENGTH);
+            return vin;
+        }
+
+        // the engine always reloads a schema of SCHEMA_COLUMN_NUMS columns, the types take turns
+        static std::string _column_name(uint16_t i) {
+            return "col" + std::to_string(i);
+        }
+
+        static ColumnType _column_type(uint16_t i) {
+            static constexpr ColumnType TYPES[] = {COLUMN_TYPE_STRING, COLUMN_TYPE_INTEGER, COLUMN_TYPE_DOUBLE_FLOAT};
+            return TYPES[i % 3];
+        }
+
+        Row _generate_row(int idx, int32_t version) const {
+            int32_t value = version * 100000 + idx;
+            Row row;
+            row.vin = _vin;
+            row.timestamp = START_TS + idx * TS_STEP;
+            for (uint16_t i = 0; i < SCHEMA_COLUMN_NUMS; ++i) {
+                switch (_column_type(i)) {
+                    case COLUMN_TYPE_STRING:
+                        row.columns.emplace(_column_name(i), ColumnValue("v" + std::to_string(value + i)));
+                        break;
+                    case COLUMN_TYPE_INTEGER:
+                        row.columns.emplace(_column_name(i), ColumnValue(value + i));
+                        break;
+                    default:
+                        row.columns.emplace(_column_name(i), ColumnValue((value + i) * 0.5));
+                        break;
+                }
+            }
+            return row;
+        }
+
+        Row _generate_sample(int idx) const {
+            int run = idx / SAMPLE_RUN;
+            int32_t int_value;
+            switch (run % 4) {
+                case 0: int_value = 7; break;
+                case 1: int_value = idx % 13; break;
+                case 2: int_value = 1000 + idx % 1000; break;
+                default: int_value = -(idx % 50); break;
+            }
+            double_t double_value;
+            switch (run % 5) {
+                case 0: double_value = idx % 7 == 0 ? SAMPLE_NAN : (idx % 100) * 0.5; break;
+                case 1: double_value = idx % 2 == 0 ? 0.0 : -0.0; break;
+                case 2: double_value = idx % 3 == 0 ? DOUBLE_NAN : SAMPLE_NAN; break;
+                case 3: double_value = 0.25 * (idx % 9) - 1.0; break;
+                default: double_value = 3.5; break;
+            }
+            Row row;
+            row.vin = _vin;
+            row.timestamp = START_TS + idx * SAMPLE_TS_STEP;
+            for (uint16_t i = 0; i < SCHEMA_COLUMN_NUMS; ++i) {
+                switch (_column_type(i)) {
+                    case COLUMN_TYPE_STRING:
+                        row.columns.emplace(_column_name(i), ColumnValue("s" + std::to_string(idx)));
+                        break;
+                    case COLUMN_TYPE_INTEGER:
+                        row.columns.emplace(_column_name(i), ColumnValue(int_value));
+                        break;
+                    default:
+                        row.columns.emplace(_column_name(i), ColumnValue(double_value));
+                        break;
+                }
+            }
+            return row;
+        }
+
+        // the max or avg of the rows inside [lower, upper) by the start of their interval, a row is
+        // aggregated if it passes column_filter. an interval without a passing row gets NaN
+        static std::map<int64_t, ColumnValue> _aggregate(const std::vector<Row>& rows, int64_t lower, int64_t upper, int64_t interval,
+                                                         const std::string& column_name, Aggregator aggregator,
+                                                         const CompareExpression* column_filter) {
+            bool is_int = rows.front().columns.at(column_name).getColumnType() == COLUMN_TYPE_INTEGER;
+            std::map<int64_t, std::vector<const ColumnValue*>> buckets;
+            for (const auto &row: rows) {
+                if (row.timestamp >= lower && row.timestamp < upper) {
+                    std::vector<const ColumnValue*>& values = buckets[lower + (row.timestamp - lower) / interval * interval];
+                    const ColumnValue& value = row.columns.at(column_name);
+                    if (column_filter == nullptr || column_filter->doCompare(value)) {
+                        values.emplace_back(&value);
+                    }
+                }
+            }
+
+            std::map<int64_t, ColumnValue> results;
+            for (const auto &[start_ts, values]: buckets) {
+                int32_t int_max = std::numeric_limits<int32_t>::lowest();
+                int64_t int_sum = 0;
+                double_t double_max = std::numeric_limits<double_t>::lowest();
+                double_t double_sum = 0;
+                for (const ColumnValue* value: values) {
+                    if (is_int) {
+                        int32_t int_value;
+                        value->getIntegerValue(int_value);
+                        int_max = std::max(int_max, int_value);
+                        int_sum += int_value;
+                    } else {
+                        double_t double_value;
+                        value->getDoubleFloatValue(double_value);
+                        double_max = std::max(double_max, double_value);
+                        double_sum += double_value;
+                    }
+                }
+                if (aggregator == AVG) {
+                    results.emplace(start_ts, ColumnValue(values.empty() ? DOUBLE_NAN : (is_int ? int_sum * 1.0 : double_sum) / values.size()));
+                } else if (is_int) {
+                    results.emplace(start_ts, ColumnValue(values.empty() ? INT_NAN : int_max));
+                } else {
+                    results.emplace(start_ts, ColumnValue(values.empty() ? DOUBLE_NAN : double_max));
+                }
+            }
+            return results;
+        }
+
+        // doubles are compared by value, the max of +0.0 and -0.0 may be either of them
+        static void _expect_value(const ColumnValue& value, const ColumnValue& expected) {
+            ASSERT_EQ(value.getColumnType(), expected.getColumnType());
+            if (expected.getColumnType() == COLUMN_TYPE_INTEGER) {
+                int32_t int_value;
+                int32_t expected_int_value;
+                value.getIntegerValue(int_value);
+                expected.getIntegerValue(expected_int_value);
+                ASSERT_EQ(int_value, expected_int_value);
+            } else {
+                double_t double_value;
+                double_t expected_double_value;
+                value.getDoubleFloatValue(double_value);
+                expected.getDoubleFloatValue(expected_double_value);
+                if (std::isnan(expected_double_value)) {
+                    ASSERT_TRUE(std::isnan(double_value));
+                } else {
+                    ASSERT_EQ(double_value, expected_double_value);
+                }
+            }
+        }
+    };
+
+    TEST(ManifestTest, RoundTrip) {
+        Path manifest_path = std::filesystem::temp_directory_path() / ("manifest_test_" + std::to_string(::getpid()));
+        Manifest manifest;
+        manifest._wal_checkpoint = 7;
+        manifest._segments[0] = {{1, 2, 3, 4, 5}, {6, 7, 8, 9, 10}};
+        manifest._segments[3] = {{11, 12, 13, 14, 15}};
+        manifest.save(manifest_path);
+
+        Manifest loaded;
+        ASSERT_TRUE(loaded.load(manifest_path));
+        ASSERT_EQ(loaded._wal_checkpoint, 7);
+        ASSERT_EQ(loaded._segments.size(), 2);
+        std::string buf;
+        std::string loaded_buf;
+        manifest.encode_to(&buf);
+        loaded.encode_to(&loaded_buf);
+        ASSERT_EQ(buf, loaded_buf);
+
+        // a torn manifest is rejected as a whole
+        std::filesystem::resize_file(manifest_path, buf.size() - 1);
+        ASSERT_FALSE(loaded.load(manifest_path));
+        std::filesystem::remove(manifest_path);
+    }
+
+    TEST_F(EngineTest, RestartAfterShutdown) {
+        {
+            auto db = create();
+            ASSERT_EQ(db->setBackgroundWriteBandwidth(-1), -1);
+            ASSERT_EQ(db->setBackgroundWriteBandwidth(64 << 20), 0);
+            write(*db, 0, 100, 1);
+            db->shutdown();
+        }
+        ASSERT_TRUE(std::filesystem::exists(_root_path / "MANIFEST"));
+        auto db = open();
+        expect_rows(*db, std::vector<int32_t>(100, 1));
+        db->shutdown();
+    }
+
+    TEST_F(EngineTest, RestartWithoutShutdown) {
+        {
+            auto db = create();
+            write(*db, 0, 100, 1);
+            db->shutdown();
+        }
+        {
+            // the engine goes away in the middle of writing, the rows only live in the wal
+            auto db = open();
+            write(*db, 100, 100, 1);
+        }
+        auto db = open();
+        expect_rows(*db, std::vector<int32_t>(200, 1));
+        db->shutdown();
+    }
+
+    TEST_F(EngineTest, CorruptedManifestFallsBackToChunkScan) {
+        {
+            auto db = create();
+            write(*db, 0, 100, 1);
+            db->shutdown();
+        }
+        Manifest manifest;
+        ASSERT_TRUE(manifest.load(_root_path / "MANIFEST"));
+        std::filesystem::resize_file(_root_path / "MANIFEST", std::filesystem::file_size(_root_path / "MANIFEST") / 2);
+        // drop the directories of the segments too, their tsm files are then found by their chunk headers
+        for (const auto& entry: std::filesystem::directory_iterator(_root_path / "segments")) {
+            uint64_t end = 0;
+            for (const auto &segment_entry: manifest._segments[std::stoul(entry.path().filename().string())]) {
+                end = std::max(end, segment_entry._offset + segment_entry._size);
+            }
+            std::filesystem::resize_file(entry.path(), end);
+        }
+        auto db = open();
+        expect_rows(*db, std::vector<int32_t>(100, 1));
+        db->shutdown();
+    }
+
+    TEST_F(EngineTest, WalReplayAfterTornWrite) {
+        {
+            auto db = create();
+            write(*db, 0, 100, 1);
+            db->shutdown();
+        }
+        {
+            auto db = open();
+            write(*db, 100, 50, 1);
+            write(*db, 150, 50, 1);
+        }
+        // the last record of the wal is torn, the one before it is replayed
+        for (const auto& entry: std::filesystem::directory_iterator(_root_path / "wal")) {
+            size_t size = std::filesystem::file_size(entry.path());
+            if (size > 0) {
+                std::filesystem::resize_file(entry.path(), size - 1);
+            }
+        }
+        auto db = open();
+        expect_rows(*db, std::vector<int32_t>(150, 1));
+        db->shutdown();
+    }
+
+    TEST_F(EngineTest, WalReplayStopsAtCorruptedRecord) {
+        {
+            auto db = create();
+            write(*db, 0, 100, 1);
+            db->shutdown();
+        }
+        {
+            auto db = open();
+            write(*db, 100, 50, 1);
+            write(*db, 150, 50, 1);
+        }
+        for (const auto& entry: std::filesystem::directory_iterator(_root_path / "wal")) {
+            size_t size = std::filesystem::file_size(entry.path());
+            if (size > 0) {
+                std::fstream file(entry.path(), std::ios::in | std::ios::out | std::ios::binary);
+                file.seekg(static_cast<std::streamoff>(size - 1));
+                char c = static_cast<char>(file.get());
+                file.seekp(static_cast<std::streamoff>(size - 1));
+                file.put(static_cast<char>(c ^ 1));
+            }
+        }
+        auto db = open();
+        expect_rows(*db, std::vector<int32_t>(150, 1));
+        db->shutdown();
+    }
+
+    TEST_F(EngineTest, FailedConversionKeepsTheWal) {
+        {
+            auto db = create();
+            write(*db, 0, 100, 1);
+            // no segment can be created, every conversion fails
+            std::filesystem::remove_all(_root_path / "segments");
+            std::ofstream(_root_path / "segments") << "not a dir";
+            std::vector<Row> rows;
+            ASSERT_EQ(query(*db, rows), 0);
+            ASSERT_EQ(rows.size(), 100);
+            ASSERT_EQ(db->shutdown(), -1);
+        }
+        std::filesystem::remove(_root_path / "segments");
+        std::filesystem::create_directories(_root_path / "segments");
+        auto db = open();
+        expect_rows(*db, std::vector<int32_t>(100, 1));
+        ASSERT_EQ(db->shutdown(), 0);
+        // converted at last, the wal is gone
+        ASSERT_TRUE(std::filesystem::is_empty(_root_path / "wal"));
+    }
+
+    TEST_F(EngineTest, StrayFilesAreSkipped) {
+        {
+            auto db = create();
+            write(*db, 0, 100, 1);
+            db->shutdown();
+        }
+        {
+            auto db = open();
+            write(*db, 100, 100, 1);
+        }
+        for (const char* dir: {"wal", "segments"}) {
+            for (const char* name: {"1~", ".nfs0001", "2.tmp"}) {
+                std::ofstream(_root_path / dir / name) << "stray";
+            }
+            std::filesystem::create_directories(_root_path / dir / "99999");
+        }
+        auto db = open();
+        expect_rows(*db, std::vector<int32_t>(200, 1));
+        db->shutdown();
+        ASSERT_TRUE(std::filesystem::exists(_root_path / "wal" / "1~"));
+        ASSERT_TRUE(std::filesystem::exists(_root_path / "segments" / "1~"));
+    }
+
+    TEST_F(EngineTest, LateOverwriteIsCompacted) {
+        {
+            auto db = create();
+            write(*db, 0, 100, 1);
+            db->shutdown();
+        }
+        {
+            // the late rows go to a second tsm file overlapping the first one
+            auto db = open();
+            write(*db, 20, 50, 2);
+            db->shutdown();
+        }
+        std::vector<int32_t> versions(100, 1);
+        std::fill(versions.begin() + 20, versions.begin() + 70, 2);
+
+        // connect queues the compaction of the overlapping files, it is dropped by a shutdown before it runs
+        size_t file_count = 0;
+        for (int i = 0; i < 50; ++i) {
+            auto db = open();
+            expect_rows(*db, versions);
+            std::this_thread::sleep_for(std::chrono::milliseconds(100));
+            db->shutdown();
+            Manifest manifest;
+            ASSERT_TRUE(manifest.load(_root_path / "MANIFEST"));
+            file_count = 0;
+            for (const auto &[segment_seq, entries]: manifest._segments) {
+                file_count += entries.size();
+            }
+            if (file_count == 1) {
+                break;
+            }
+        }
+        ASSERT_EQ(file_count, 1);
+        auto db = open();
+        expect_rows(*db, versions);
+        db->shutdown();
+    }
+
+    TEST_F(EngineTest, CorruptedBlockIsReported) {
+        {
+            auto db = create();
+            write(*db, 0, 100, 1);
+            db->shutdown();
+        }
+        Manifest manifest;
+        ASSERT_TRUE(manifest.load(_root_path / "MANIFEST"));
+        ASSERT_FALSE(manifest._segments.empty());
+        // the first block of the tsm file is its timestamp block
+        const auto &[segment_seq, entries] = *manifest._segments.begin();
+        {
+            std::fstream file(_root_path / "segments" / std::to_string(segment_seq), std::ios::in | std::ios::out | std::ios::binary);
+            file.seekg(static_cast<std::streamoff>(entries[0]._offset));
+            char c = static_cast<char>(file.get());
+            file.seekp(static_cast<std::streamoff>(entries[0]._offset));
+            file.put(static_cast<char>(c ^ 1));
+        }
+        auto db = open();
+        std::vector<Row> rows;
+        ASSERT_EQ(query(*db, rows), -1);
+        ASSERT_TRUE(rows.empty());
+        db->shutdown();
+    }
+
+    TEST_F(EngineTest, CorruptedIndexFailsTheOpen) {
+        {
+            auto db = create();
+            write(*db, 0, 100, 1);
+            db->shutdown();
+        }
+        Manifest manifest;
+        ASSERT_TRUE(manifest.load(_root_path / "MANIFEST"));
+        ASSERT_FALSE(manifest._segments.empty());
+        // the index of the tsm file lies right before its footer
+        const auto &[segment_seq, entries] = *manifest._segments.begin();
+        Path segment_path = _root_path / "segments" / std::to_string(segment_seq);
+        auto index_end = static_cast<std::streamoff>(entries[0]._offset + entries[0]._size - TsmFooter::ENCODED_SIZE);
+        char c;
+        {
+            std::fstream file(segment_path, std::ios::in | std::ios::out | std::ios::binary);
+            file.seekg(index_end - 1);
+            c = static_cast<char>(file.get());
+            file.seekp(index_end - 1);
+            file.put(static_cast<char>(c ^ 1));
+        }
+        {
+            TSDBEngineImpl db(_root_path);
+            ASSERT_EQ(db.connect(), -1);
+            ASSERT_EQ(db.shutdown(), -1);
+        }
+        // the file is kept, once repaired its rows are back
+        {
+            std::fstream file(segment_path, std::ios::in | std::ios::out | std::ios::binary);
+            file.seekp(index_end - 1);
+            file.put(c);
+        }
+        auto db = open();
+        expect_rows(*db, std::vector<int32_t>(100, 1));
+        db->shutdown();
+    }
+
+    TEST_F(EngineTest, WriteStallsAreReported) {
+        EngineOptions options;
+        // every write is paced, at a rate which doesn't slow the test down
+        options._write_controller_options._soft_pending_converts = 0;
+        options._write_controller_options._delayed_rows_per_sec = 1e9;
+        auto db = create(options);
+        ASSERT_EQ(db->getWriteStallMetrics()._delayed_writes, 0);
+        write(*db, 0, 100, 1);
+        write(*db, 100, 100, 1);
+        WriteStallMetrics metrics = db->getWriteStallMetrics();
+        ASSERT_EQ(metrics._delayed_writes, 2);
+        ASSERT_EQ(metrics._stopped_writes, 0);
+        expect_rows(*db, std::vector<int32_t>(200, 1));
+        db->shutdown();
+    }
+
+    TEST_F(EngineTest, BackgroundTasksAreReported) {
+        auto db = create();
+        CompactionSchedulerMetrics metrics = db->getCompactionSchedulerMetrics();
+        ASSERT_EQ(metrics._queued_tasks, 0);
+        ASSERT_EQ(metrics._finished_tasks, 0);
+        ASSERT_EQ(metrics._written_bytes, 0);
+        write(*db, 0, 100, 1);
+        // the mem tables are converted by shutdown
+        ASSERT_EQ(db->shutdown(), 0);
+        metrics = db->getCompactionSchedulerMetrics();
+        ASSERT_EQ(metrics._queued_tasks, 0);
+        ASSERT_GE(metrics._max_queued_tasks, 1);
+        ASSERT_GE(metrics._finished_tasks, 1);
+        ASSERT_GT(metrics._written_bytes, 0);
+        ASSERT_GT(metrics._write_bytes_per_sec, 0);
+    }
+
+    // the same rows written row by row for one vin and column by column for another read back the same,
+    // before and after a restart
+    TEST_F(EngineTest, ColumnarWriteMatchesRowWrite) {
+        Vin columnar_vin = _vin;
+        columnar_vin.vin[VIN_LENGTH - 1] = 'C';
+        auto db = create();
+        write(*db, 0, 300, 1);
+        std::vector<Row> rows;
+        ASSERT_EQ(query(*db, rows), 0);
+
+        // the strings of a column lie back to back in one buffer, of different lengths
+        ColumnarWriteRequest columnar_request;
+        columnar_request.tableName = TABLE_NAME;
+        columnar_request.rowCount = rows.size();
+        std::vector<Vin> vins(rows.size(), columnar_vin);
+        std::vector<int64_t> timestamps;
+        for (const auto &row: rows) {
+            timestamps.emplace_back(row.timestamp);
+        }
+        columnar_request.vins = vins.data();
+        columnar_request.timestamps = timestamps.data();
+        std::map<std::string, std::vector<int32_t>> int_values;
+        std::map<std::string, std::vector<double_t>> double_values;
+        std::map<std::string, std::vector<int32_t>> string_offsets;
+        std::map<std::string, std::string> string_data;
+        for (const auto &[column_name, column_value]: rows[0].columns) {
+            ColumnarColumn column;
+            column.columnName = column_name;
+            column.columnType = column_value.getColumnType();
+            for (const auto &row: rows) {
+                const ColumnValue& value = row.columns.at(column_name);
+                if (column.columnType == COLUMN_TYPE_INTEGER) {
+                    value.getIntegerValue(int_values[column_name].emplace_back());
+                } else if (column.columnType == COLUMN_TYPE_DOUBLE_FLOAT) {
+                    value.getDoubleFloatValue(double_values[column_name].emplace_back());
+                } else {
+                    std::pair<int32_t, const char*> str;
+                    value.getStringValue(str);
+                    string_offsets[column_name].emplace_back(string_data[column_name].size());
+                    string_data[column_name].append(str.second, str.first);
+                }
+            }
+            if (column.columnType == COLUMN_TYPE_STRING) {
+                string_offsets[column_name].emplace_back(string_data[column_name].size());
+                column.stringOffsets = string_offsets[column_name].data();
+                column.stringData = string_data[column_name].data();
+            } else if (column.columnType == COLUMN_TYPE_INTEGER) {
+                column.intValues = int_values[column_name].data();
+            } else {
+                column.doubleValues = double_values[column_name].data();
+            }
+            columnar_request.columns.emplace_back(std::move(column));
+        }
+
+        // a missing column or a column of another type is rejected as a whole
+        ColumnarWriteRequest missing_column_request = columnar_request;
+        missing_column_request.columns.pop_back();
+        ASSERT_EQ(db->writeColumnar(missing_column_request), -1);
+        ColumnarWriteRequest mistyped_request = columnar_request;
+        for (auto &column: mistyped_request.columns) {
+            if (column.columnType == COLUMN_TYPE_INTEGER) {
+                column.columnType = COLUMN_TYPE_DOUBLE_FLOAT;
+                break;
+            }
+        }
+        ASSERT_EQ(db->writeColumnar(mistyped_request), -1);
+        ASSERT_EQ(db->writeColumnar(columnar_request), 0);
+
+        auto expect_same_rows = [&](TSDBEngineImpl& engine) {
+            std::vector<Row> expected_rows;
+            ASSERT_EQ(query(engine, expected_rows), 0);
+            ASSERT_EQ(expected_rows.size(), rows.size());
+            TimeRangeQueryRequest columnar_query;
+            columnar_query.tableName = TABLE_NAME;
+            columnar_query.vin = columnar_vin;
+            columnar_query.timeLowerBound = START_TS;
+            columnar_query.timeUpperBound = START_TS + 24 * 3600 * 1000;
+            for (const auto &[column_name, column_value]: rows[0].columns) {
+                columnar_query.requestedColumns.insert(column_name);
+            }
+            std::vector<Row> columnar_rows;
+            ASSERT_EQ(engine.executeTimeRangeQuery(columnar_query, columnar_rows), 0);
+            std::sort(columnar_rows.begin(), columnar_rows.end(), [](const Row& lhs, const Row& rhs) {
+                return lhs.timestamp < rhs.timestamp;
+            });
+            ASSERT_EQ(columnar_rows.size(), expected_rows.size());
+            for (size_t i = 0; i < columnar_rows.size(); ++i) {
+                ASSERT_EQ(columnar_rows[i].vin, columnar_vin);
+                ASSERT_EQ(columnar_rows[i].timestamp, expected_rows[i].timestamp);
+                ASSERT_EQ(columnar_rows[i].columns, expected_rows[i].columns);
+            }
+        };
+        expect_same_rows(*db);
+        db->shutdown();
+        db = open();
+        expect_same_rows(*db);
+        db->shutdown();
+    }
+
+    TEST(CompactionSchedulerTest, WriteBandwidthIsAdjustable) {
+        CompactionScheduler scheduler(CompactionSchedulerOptions {1, 0});
+        scheduler.throttle_write(1 << 20);
+        ASSERT_EQ(scheduler.get_metrics()._throttled_us, 0);
+
+        // the bucket starts empty, 1 MB at 10 MB/s sleeps about 100 ms
+        scheduler.set_write_bytes_per_sec(10 << 20);
+        scheduler.throttle_write(1 << 20);
+        uint64_t throttled_us = scheduler.get_metrics()._throttled_us;
+        ASSERT_GT(throttled_us, 50000);
+
+        scheduler.set_write_bytes_per_sec(0);
+        scheduler.throttle_write(1 << 20);
+        ASSERT_EQ(scheduler.get_metrics()._throttled_us, throttled_us);
+    }
+
+    // open files of dir_path held by the process
+    static size_t count_open_files(const Path& dir_path) {
+        size_t count = 0;
+        for (const auto& entry: std::filesystem::directory_iterator("/proc/self/fd")) {
+            std::error_code ec;
+            Path target = std::filesystem::read_symlink(entry.path(), ec);
+            count += !ec && target.parent_path() == dir_path;
+        }
+        return count;
+    }
+
+    TEST(FileHandleCacheTest, OpenFilesStayWithinTheBudget) {
+        Path dir_path = std::filesystem::temp_directory_path() / ("file_handle_cache_test_" + std::to_string(::getpid()));
+        std::filesystem::remove_all(dir_path);
+        std::filesystem::create_directories(dir_path);
+        for (size_t fd_budget: {32, 1}) {
+            FileHandleCache cache(fd_budget);
+            for (uint32_t id = 0; id < 256; ++id) {
+                FileHandleSPtr handle = cache.get(id, dir_path / std::to_string(id), O_RDWR | O_CREAT);
+                ASSERT_GE(handle->fd(), 0);
+            }
+            // a shard keeps at least one file open
+            ASSERT_EQ(count_open_files(dir_path), std::max<size_t>(fd_budget, 16));
+            for (uint32_t id = 0; id < 256; ++id) {
+                cache.erase(id);
+            }
+            ASSERT_EQ(count_open_files(dir_path), 0);
+        }
+        std::filesystem::remove_all(dir_path);
+    }
+
+    TEST(ValueFilterTest, MatchBlock) {
+        double_t nan = std::numeric_limits<double_t>::quiet_NaN();
+        ValueFilter<int32_t> int_greater(CompareExpression {ColumnValue(5), GREATER});
+        ASSERT_EQ(int_greater.match_block(6, 9, true), BlockMatch::ALL);
+        ASSERT_EQ(int_greater.match_block(1, 5, true), BlockMatch::NONE);
+        ASSERT_EQ(int_greater.match_block(1, 9, true), BlockMatch::SOME);
+
+        ValueFilter<int32_t> int_equal(CompareExpression {ColumnValue(7), EQUAL});
+        ASSERT_EQ(int_equal.match_block(7, 7, true), BlockMatch::ALL);
+        ASSERT_EQ(int_equal.match_block(1, 9, true), BlockMatch::SOME);
+        ASSERT_EQ(int_equal.match_block(8, 9, true), BlockMatch::NONE);
+        // files without block stats have no min
+        ASSERT_EQ(int_equal.match_block(std::numeric_limits<int32_t>::lowest(), 7, true), BlockMatch::SOME);
+
+        ValueFilter<int32_t> int_untyped(CompareExpression {ColumnValue(7.0), EQUAL});
+        ASSERT_EQ(int_untyped.match_block(7, 7, true), BlockMatch::NONE);
+        ASSERT_FALSE(int_untyped.match(7));
+
+        ValueFilter<double_t> double_greater(CompareExpression {ColumnValue(1.0), GREATER});
+        ASSERT_EQ(double_greater.match_block(2.0, 3.0, true), BlockMatch::ALL);
+        // NaN values never pass
+        ASSERT_EQ(double_greater.match_block(2.0, 3.0, false), BlockMatch::SOME);
+        ASSERT_EQ(double_greater.match_block(-std::numeric_limits<double_t>::infinity(), 3.0, true), BlockMatch::SOME);
+        ASSERT_FALSE(double_greater.match(nan));
+
+        // a constant double block may still hold values of other bits
+        ValueFilter<double_t> double_zero(CompareExpression {ColumnValue(0.0), EQUAL});
+        ASSERT_EQ(double_zero.match_block(0.0, 0.0, true), BlockMatch::SOME);
+        ASSERT_EQ(double_zero.match_block(-0.0, 0.0, true), BlockMatch::SOME);
+        ASSERT_TRUE(double_zero.match(0.0));
+        ASSERT_FALSE(double_zero.match(-0.0));
+
+        ValueFilter<double_t> double_nan_equal(CompareExpression {ColumnValue(nan), EQUAL});
+        ASSERT_EQ(double_nan_equal.match_block(1.0, 2.0, true), BlockMatch::NONE);
+        ASSERT_EQ(double_nan_equal.match_block(1.0, 2.0, false), BlockMatch::SOME);
+        ASSERT_TRUE(double_nan_equal.match(nan));
+        ASSERT_FALSE(double_nan_equal.match(1.0));
+
+        ValueFilter<double_t> double_nan_greater(CompareExpression {ColumnValue(nan), GREATER});
+        ASSERT_EQ(double_nan_greater.match_block(1.0, 2.0, false), BlockMatch::NONE);
+        ASSERT_FALSE(double_nan_greater.match(2.0));
+    }
+
+    // the downsamples pruned by the block stats and the aggregates answered by them agree with the rows
+    // evaluated one by one, while the rows are in mem tables, in tsm files and in both
+    TEST_F(EngineTest, DownsampleMatchesRowByRow) {
+        std::vector<Row> samples;
+        {
+            auto db = create();
+            write_samples(*db, 0, 20000, samples);
+            expect_samples(*db, samples);
+            db->shutdown();
+        }
+        auto db = open();
+        expect_samples(*db, samples);
+        write_samples(*db, 20000, 10000, samples);
+        expect_samples(*db, samples);
+        db->shutdown();
+    }
+
+}